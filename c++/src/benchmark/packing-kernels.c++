@@ -0,0 +1,128 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Measures the throughput of each packing kernel supported by this CPU. The kernels' output is
+// checked against each other by serialize-packed-test; this only times them.
+//
+// Usage: packing-kernels [megabytes]
+
+#include <capnp/serialize-packed.h>
+#include <kj/io.h>
+#include <kj/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace capnp {
+namespace benchmark {
+namespace {
+
+using _::PackingKernel;
+
+kj::Array<word> makeMixedWords(size_t count) {
+  // Words with a mix of zero-byte densities, like serialize-packed-test uses.
+
+  auto result = kj::heapArray<word>(count);
+  byte* bytes = reinterpret_cast<byte*>(result.begin());
+
+  uint32_t state = 1234;
+  auto next = [&]() {
+    state = state * 1103515245u + 12345u;
+    return state >> 16;
+  };
+
+  for (size_t i = 0; i < count; i++) {
+    uint kind = next() % 8;
+    for (uint j = 0; j < 8; j++) {
+      uint value = next() & 0xff;
+      switch (kind) {
+        case 0: value = 0; break;
+        case 1: value |= 1; break;
+        case 2: if (j % 2 == 0) value = 0; break;
+        default: if (next() % 3 == 0) value = 0; break;
+      }
+      bytes[i * 8 + j] = value;
+    }
+  }
+
+  return result;
+}
+
+double megabytesPerSecond(size_t bytes, kj::Duration time) {
+  return bytes / 1048576.0 / (time / kj::NANOSECONDS / 1e9);
+}
+
+void run(size_t megabytes) {
+  constexpr size_t CHUNK_WORDS = 1 << 17;
+  constexpr const char* NAMES[] = { "scalar", "ssse3", "neon" };
+
+  auto words = makeMixedWords(CHUNK_WORDS);
+  kj::ArrayPtr<const byte> unpacked = words.asBytes();
+  size_t iterations = kj::max(megabytes * 1048576 / unpacked.size(), size_t(1));
+
+  // Packing can expand the input by at most one tag byte per word, plus run lengths.
+  auto packed = kj::heapArray<byte>(unpacked.size() * 2);
+  auto roundTrip = kj::heapArray<byte>(unpacked.size());
+  auto& clock = kj::systemPreciseMonotonicClock();
+
+  for (auto kernel: { PackingKernel::SCALAR, PackingKernel::SSSE3, PackingKernel::NEON }) {
+    if (!_::isPackingKernelSupported(kernel)) continue;
+
+    size_t packedSize = 0;
+    auto start = clock.now();
+    for (size_t i = 0; i < iterations; i++) {
+      kj::ArrayOutputStream out(packed);
+      {
+        _::PackedOutputStream packedOut(out, kernel);
+        packedOut.write(unpacked.begin(), unpacked.size());
+      }
+      packedSize = out.getArray().size();
+    }
+    auto packTime = clock.now() - start;
+
+    start = clock.now();
+    for (size_t i = 0; i < iterations; i++) {
+      kj::ArrayInputStream in(packed.slice(0, packedSize));
+      _::PackedInputStream packedIn(in, kernel);
+      packedIn.kj::InputStream::read(roundTrip.begin(), roundTrip.size());
+    }
+    auto unpackTime = clock.now() - start;
+
+    if (memcmp(roundTrip.begin(), unpacked.begin(), unpacked.size()) != 0) {
+      fprintf(stderr, "%s: round trip mismatch\n", NAMES[static_cast<uint>(kernel)]);
+      exit(1);
+    }
+
+    size_t total = unpacked.size() * iterations;
+    printf("%-8s pack: %8.1f MB/s   unpack: %8.1f MB/s\n", NAMES[static_cast<uint>(kernel)],
+           megabytesPerSecond(total, packTime), megabytesPerSecond(total, unpackTime));
+  }
+}
+
+}  // namespace
+}  // namespace benchmark
+}  // namespace capnp
+
+int main(int argc, char* argv[]) {
+  size_t megabytes = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1024;
+  capnp::benchmark::run(megabytes);
+  return 0;
+}
@@ -0,0 +1,127 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Measures the cost of holding many capabilities imported over one RPC connection. The client
+// passes a new capability in each of `count` calls which the server never returns, so the
+// server's import and answer tables both grow to `count` entries, then cancels them all, which
+// releases every import. rpc-test checks that this works; this only times it.
+//
+// Usage: rpc-imports [count...]
+
+#include <capnp/rpc-twoparty.h>
+#include <kj/async-io.h>
+#include <kj/time.h>
+#include <kj/vector.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace capnp {
+namespace benchmark {
+namespace {
+
+constexpr uint64_t INTERFACE_ID = 0xb1a3d7a4c20f6e59ull;
+// Made up: calls are built with typelessRequest(), so there's no schema.
+
+enum Method: uint16_t {
+  HOLD,   // Never returns, keeping the capability in its params imported until canceled.
+  PING,   // Returns right away.
+};
+
+class HolderImpl final: public Capability::Server {
+public:
+  DispatchCallResult dispatchCall(uint64_t interfaceId, uint16_t methodId,
+                                  CallContext<AnyPointer, AnyPointer> context) override {
+    if (methodId == HOLD) {
+      context.allowCancellation();
+      return { kj::NEVER_DONE, false };
+    } else {
+      return { kj::READY_NOW, false };
+    }
+  }
+};
+
+class HeldImpl final: public Capability::Server {
+  // Passed to HOLD. Reports when the server has released it.
+
+public:
+  explicit HeldImpl(kj::Own<kj::PromiseFulfiller<void>> fulfiller)
+      : fulfiller(kj::mv(fulfiller)) {}
+  ~HeldImpl() noexcept(false) { fulfiller->fulfill(); }
+
+  DispatchCallResult dispatchCall(uint64_t interfaceId, uint16_t methodId,
+                                  CallContext<AnyPointer, AnyPointer> context) override {
+    KJ_UNIMPLEMENTED("HeldImpl has no methods");
+  }
+
+private:
+  kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+};
+
+void run(kj::AsyncIoContext& io, uint count) {
+  auto pipe = io.provider->newTwoWayPipe();
+  TwoPartyClient server(*pipe.ends[0], kj::heap<HolderImpl>(), rpc::twoparty::Side::SERVER);
+  TwoPartyClient client(*pipe.ends[1]);
+  auto holder = client.bootstrap();
+  auto& clock = kj::systemPreciseMonotonicClock();
+
+  kj::Vector<kj::Promise<void>> destroyed(count);
+  kj::Vector<RemotePromise<AnyPointer>> calls(count);
+
+  auto start = clock.now();
+  for (uint i = 0; i < count; i++) {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    destroyed.add(kj::mv(paf.promise));
+    auto request = holder.typelessRequest(INTERFACE_ID, HOLD, nullptr);
+    request.setAs<Capability>(kj::heap<HeldImpl>(kj::mv(paf.fulfiller)));
+    calls.add(request.send());
+  }
+
+  // A round trip ensures that the server has received every call.
+  holder.typelessRequest(INTERFACE_ID, PING, nullptr).send().wait(io.waitScope);
+  auto importTime = clock.now() - start;
+
+  // Canceling the calls releases every capability the server imported.
+  start = clock.now();
+  calls.clear();
+  kj::joinPromises(destroyed.releaseAsArray()).wait(io.waitScope);
+  auto releaseTime = clock.now() - start;
+
+  printf("%8u capabilities   import: %8.1f ms   release: %8.1f ms\n", count,
+         importTime / kj::NANOSECONDS / 1e6, releaseTime / kj::NANOSECONDS / 1e6);
+}
+
+}  // namespace
+}  // namespace benchmark
+}  // namespace capnp
+
+int main(int argc, char* argv[]) {
+  auto io = kj::setupAsyncIo();
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++) {
+      capnp::benchmark::run(io, strtoul(argv[i], nullptr, 0));
+    }
+  } else {
+    for (uint count: {10000u, 100000u}) {
+      capnp::benchmark::run(io, count);
+    }
+  }
+  return 0;
+}
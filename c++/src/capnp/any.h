@@ -476,6 +476,9 @@ public:
   kj::Array<word> canonicalize() {
     return _reader.canonicalize();
   }
+  void writeCanonical(kj::OutputStream& output) const {
+    _reader.writeCanonical(output);
+  }
 
   Equality equals(AnyStruct::Reader right) const;
   bool operator==(AnyStruct::Reader right) const;
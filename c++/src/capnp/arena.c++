@@ -149,6 +149,17 @@ SegmentReader* ReaderArena::tryGetSegment(SegmentId id) {
   return result;
 }
 
+void ReaderArena::markValidated() {
+  segment0.markValidated();
+
+  auto lock = moreSegments.lockExclusive();
+  KJ_IF_MAYBE(s, *lock) {
+    for (auto& entry: *s) {
+      entry.value->markValidated();
+    }
+  }
+}
+
 void ReaderArena::reportReadLimitReached() {
   KJ_FAIL_REQUIRE("Exceeded message traversal limit.  See capnp::ReaderOptions.") {
     return;
@@ -182,7 +193,7 @@ BuilderArena::BuilderArena(MessageBuilder* message,
     segmentWithSpace = builders.back();
 
     this->moreSegments = kj::heap<MultiSegmentState>(
-        MultiSegmentState { kj::mv(builders), kj::mv(forOutput) });
+        MultiSegmentState { kj::mv(builders), kj::mv(forOutput), {} });
 
   } else {
     segmentWithSpace = &segment0;
@@ -266,6 +277,13 @@ SegmentBuilder* BuilderArena::addExternalSegment(kj::ArrayPtr<const word> conten
   return addSegmentInternal(content);
 }
 
+SegmentBuilder* BuilderArena::addExternalSegment(kj::ArrayPtr<const word> content,
+                                                 kj::Array<const byte>&& owner) {
+  SegmentBuilder* result = addSegmentInternal(content);
+  KJ_ASSERT_NONNULL(moreSegments)->ownedExternalData.add(kj::mv(owner));
+  return result;
+}
+
 template <typename T>
 SegmentBuilder* BuilderArena::addSegmentInternal(kj::ArrayPtr<T> content) {
   // This check should never fail in practice, since you can't get an Orphanage without allocating
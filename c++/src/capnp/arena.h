@@ -148,9 +148,15 @@ public:
   inline void unread(WordCount64 amount);
   // Add back some words to the ReadLimiter.
 
+  inline void markValidated() { validated = true; }
+  // Indicates that every object in this segment reachable from the message root has already been
+  // bounds-checked and charged to the ReadLimiter (see validateMessage() in validate.h). After
+  // this, checkObject() and amplifiedRead() always succeed.
+
 private:
   Arena* arena;
   SegmentId id;
+  bool validated = false;
   kj::ArrayPtr<const word> ptr;  // size guaranteed to fit in SEGMENT_WORD_COUNT_BITS bits
   ReadLimiter* readLimiter;
 
@@ -234,6 +240,10 @@ public:
   SegmentReader* tryGetSegment(SegmentId id) override;
   void reportReadLimitReached() override;
 
+  void markValidated();
+  // Call SegmentReader::markValidated() on every segment loaded so far. Segments which have not
+  // been loaded yet were not reachable during validation and stay checked.
+
 private:
   MessageReader* message;
   ReadLimiter readLimiter;
@@ -319,6 +329,11 @@ public:
   // from disk (until the message itself is written out).  `Orphanage` provides the public API for
   // this feature.
 
+  SegmentBuilder* addExternalSegment(kj::ArrayPtr<const word> content,
+                                     kj::Array<const byte>&& owner);
+  // Like above, but the arena also takes ownership of `owner`, the array backing `content`, and
+  // frees it when the arena is destroyed.
+
   // implements Arena ------------------------------------------------
   SegmentReader* tryGetSegment(SegmentId id) override;
   void reportReadLimitReached() override;
@@ -347,6 +362,7 @@ private:
   struct MultiSegmentState {
     kj::Vector<kj::Own<SegmentBuilder>> builders;
     kj::Vector<kj::ArrayPtr<const word>> forOutput;
+    kj::Vector<kj::Array<const byte>> ownedExternalData;  // see addExternalSegment()
   };
   kj::Maybe<kj::Own<MultiSegmentState>> moreSegments;
 
@@ -399,6 +415,7 @@ inline const word* SegmentReader::checkOffset(const word* from, ptrdiff_t offset
 }
 
 inline bool SegmentReader::checkObject(const word* start, WordCountN<31> size) {
+  if (validated) return true;
   auto startOffset = intervalLength(ptr.begin(), start, MAX_SEGMENT_WORDS);
 #ifdef KJ_DEBUG
   if (startOffset > bounded(ptr.size()) * WORDS) {
@@ -410,6 +427,7 @@ inline bool SegmentReader::checkObject(const word* start, WordCountN<31> size) {
 }
 
 inline bool SegmentReader::amplifiedRead(WordCount virtualAmount) {
+  if (validated) return true;
   return readLimiter->canRead(virtualAmount, arena);
 }
 
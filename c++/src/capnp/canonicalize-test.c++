@@ -22,6 +22,7 @@
 #include "message.h"
 #include "any.h"
 #include <kj/debug.h>
+#include <kj/io.h>
 #include <kj/test.h>
 #include "test-util.h"
 
@@ -387,6 +388,120 @@ KJ_TEST("bit list with nonzero padding") {
   ASSERT_EQ(canonicalWords.asBytes(), kj::arrayPtr(canonicalSegment.bytes, 3 * 8));
 }
 
+template <typename Reader>
+void expectWriteCanonicalMatches(Reader&& reader) {
+  auto expected = canonicalize(reader);
+  kj::VectorOutputStream output;
+  writeCanonical(output, reader);
+  KJ_ASSERT(output.getArray() == expected.asBytes());
+}
+
+KJ_TEST("writeCanonical matches canonicalize") {
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestAllTypes>();
+  expectWriteCanonicalMatches(root.asReader());
+
+  initTestMessage(root);
+  expectWriteCanonicalMatches(root.asReader());
+
+  // Struct list elements of different sizes, some of them truncated to nothing.
+  auto structList = root.initStructList(4);
+  structList[1].setUInt64Field(1);
+  structList[2].setTextField("foo");
+  structList[2].initStructField().setInt8Field(-1);
+  expectWriteCanonicalMatches(root.asReader());
+  expectWriteCanonicalMatches(structList[0].asReader());
+  expectWriteCanonicalMatches(structList[2].asReader());
+}
+
+KJ_TEST("writeCanonical on lists of every element size") {
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestLists>();
+
+  root.initList0(3);
+  auto list1 = root.initList1(11);
+  list1[0].setF(true);
+  list1[10].setF(true);
+  root.initList8(3)[1].setF(12);
+  root.initList16(2)[0].setF(1234);
+  root.initList32(1)[0].setF(123456);
+  root.initList64(0);
+  root.initListP(2)[1].setF("bar");
+  auto int32ListList = root.initInt32ListList(2);
+  int32ListList.init(0, 3).set(2, 5);
+  int32ListList.init(1, 0);
+  root.initStructListList(1).init(0, 2)[1].setBoolField(true);
+
+  expectWriteCanonicalMatches(root.asReader());
+
+  // Structs read from primitive lists.
+  expectWriteCanonicalMatches(root.asReader().getList1()[0]);
+  expectWriteCanonicalMatches(root.asReader().getList1()[1]);
+  expectWriteCanonicalMatches(root.asReader().getList8()[1]);
+}
+
+KJ_TEST("writeCanonical on non-canonical input") {
+  // Many small segments, so the input is full of far pointers.
+  MallocMessageBuilder builder(1, AllocationStrategy::FIXED_SIZE);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  KJ_ASSERT(builder.getSegmentsForOutput().size() > 1);
+
+  SegmentArrayMessageReader reader(builder.getSegmentsForOutput());
+  KJ_ASSERT(!reader.isCanonical());
+  expectWriteCanonicalMatches(reader.getRoot<TestAllTypes>());
+
+  // Non-zero padding in a bit list.
+  AlignedData<3> segment = {{
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x59, 0x00, 0x00, 0x00,
+    0xee, 0x0f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  }};
+  kj::ArrayPtr<const word> segments[1] = {kj::arrayPtr(segment.words, 3)};
+  SegmentArrayMessageReader message(kj::arrayPtr(segments, 1));
+  expectWriteCanonicalMatches(message.getRoot<test::TestAnyPointer>());
+}
+
+KJ_TEST("writeCanonical on deeply nested message") {
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestAllTypes>();
+  auto inner = root;
+  for (uint i = 0; i < 60; i++) {
+    inner.setUInt32Field(i);
+    inner = inner.initStructField();
+  }
+  inner.setTextField("bottom");
+
+  expectWriteCanonicalMatches(root.asReader());
+}
+
+class Fnv1aHasher final: public kj::OutputStream {
+public:
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  void write(const void* buffer, size_t size) override {
+    for (byte b: kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size)) {
+      hash = (hash ^ b) * 0x100000001b3ull;
+    }
+  }
+};
+
+KJ_TEST("writeCanonical can feed a hash function") {
+  MallocMessageBuilder builder1;
+  initTestMessage(builder1.initRoot<TestAllTypes>());
+
+  MallocMessageBuilder builder2(1, AllocationStrategy::FIXED_SIZE);
+  initTestMessage(builder2.initRoot<TestAllTypes>());
+
+  Fnv1aHasher hasher1, hasher2, expected;
+  writeCanonical(hasher1, builder1.getRoot<TestAllTypes>().asReader());
+  writeCanonical(hasher2, builder2.getRoot<TestAllTypes>().asReader());
+  auto words = canonicalize(builder1.getRoot<TestAllTypes>().asReader());
+  expected.write(words.begin(), words.asBytes().size());
+
+  KJ_EXPECT(hasher1.hash == expected.hash);
+  KJ_EXPECT(hasher2.hash == expected.hash);
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
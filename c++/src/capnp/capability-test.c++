@@ -215,6 +215,46 @@ KJ_TEST("use pipeline after dropping response") {
   EXPECT_EQ(1, chainedCallCount);
 }
 
+KJ_TEST("Response::sliceData() only shares bytes that are part of the response") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  int callCount = 0;
+  test::TestInterface::Client client(kj::heap<TestInterfaceImpl>(callCount));
+
+  const byte bytes[] = { 1, 2, 3 };
+  Data::Reader outside(bytes, sizeof(bytes));
+
+  auto check = [&](Response<test::TestInterface::FooResults>& response) {
+    auto x = response.getX().asBytes();
+    auto slice = response.sliceData(x);
+    KJ_EXPECT(slice.begin() == x.begin());
+
+    auto copy = response.sliceData(outside);
+    KJ_EXPECT(copy.begin() != outside.begin());
+    KJ_EXPECT(copy.asPtr() == outside);
+  };
+
+  {
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    auto response = request.send().wait(waitScope);
+    check(response);
+  }
+
+  {
+    // While a pipeline is held, the call context stands in for the response.
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    auto promise = request.send();
+    test::TestInterface::FooResults::Pipeline pipeline = kj::mv(promise);
+    auto response = promise.wait(waitScope);
+    check(response);
+  }
+}
+
 TEST(Capability, TailCall) {
   kj::EventLoop loop;
   kj::WaitScope waitScope(loop);
@@ -1363,6 +1403,95 @@ KJ_TEST("Streaming call throwing cascades to following calls") {
   KJ_EXPECT_THROW_RECOVERABLE_MESSAGE("throw requested", promise4.ignoreResult().wait(waitScope));
 }
 
+class SynchronousCallOrder final: public test::TestCallOrder::Server {
+public:
+  LocalCallOptions getLocalCallOptions() override {
+    LocalCallOptions options;
+    options.synchronous = true;
+    options.pooled = true;
+    return options;
+  }
+
+  kj::Promise<void> getCallSequence(GetCallSequenceContext context) override {
+    context.getResults().setN(count++);
+    return kj::READY_NOW;
+  }
+
+  uint count = 0;
+};
+
+KJ_TEST("Local calls can be dispatched synchronously") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto ownServer = kj::heap<SynchronousCallOrder>();
+  auto& server = *ownServer;
+  test::TestCallOrder::Client cap = kj::mv(ownServer);
+
+  // A direct call reaches the server before send() returns.
+  auto promise = cap.getCallSequenceRequest().send();
+  KJ_EXPECT(server.count == 1);
+  KJ_EXPECT(promise.wait(waitScope).getN() == 0);
+
+  // A call through a promise doesn't.
+  test::TestCallOrder::Client promiseCap = kj::Promise<test::TestCallOrder::Client>(cap);
+  auto promisedCall = promiseCap.getCallSequenceRequest().send();
+  KJ_EXPECT(server.count == 1);
+
+  // Once the promise resolves, the call made through it has been handed to the server's client,
+  // though maybe not delivered yet. A direct call made now must not overtake it.
+  auto directCall = KJ_ASSERT_NONNULL(ClientHook::from(kj::cp(promiseCap))->whenMoreResolved())
+      .then([&](kj::Own<ClientHook>&&) {
+    return cap.getCallSequenceRequest().send()
+        .then([](Response<test::TestCallOrder::GetCallSequenceResults>&& response) {
+      return response.getN();
+    });
+  });
+
+  KJ_EXPECT(promisedCall.wait(waitScope).getN() == 1);
+  KJ_EXPECT(directCall.wait(waitScope) == 2);
+}
+
+class SynchronousTailCaller final: public test::TestTailCaller::Server {
+public:
+  LocalCallOptions getLocalCallOptions() override {
+    LocalCallOptions options;
+    options.synchronous = true;
+    return options;
+  }
+
+  kj::Promise<void> foo(FooContext context) override {
+    auto params = context.getParams();
+    auto tailRequest = params.getCallee().fooRequest();
+    tailRequest.setI(params.getI());
+    tailRequest.setT("from SynchronousTailCaller");
+    return context.tailCall(kj::mv(tailRequest));
+  }
+};
+
+KJ_TEST("Calls can be pipelined through a synchronous tail call") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  int calleeCallCount = 0;
+  test::TestTailCaller::Client caller = kj::heap<SynchronousTailCaller>();
+
+  // The tail call is made before send() returns, so the caller's pipeline has to be waiting for
+  // it by then.
+  auto request = caller.fooRequest();
+  request.setI(456);
+  request.setCallee(kj::heap<TestTailCalleeImpl>(calleeCallCount));
+  auto promise = request.send();
+
+  auto dependentCall = promise.getC().getCallSequenceRequest().send();
+
+  auto response = promise.wait(waitScope);
+  KJ_EXPECT(response.getI() == 456);
+  KJ_EXPECT(response.getT() == "from SynchronousTailCaller");
+  KJ_EXPECT(dependentCall.wait(waitScope).getN() == 0);
+  KJ_EXPECT(calleeCallCount == 1);
+}
+
 }  // namespace
 }  // namespace _
 }  // namespace capnp
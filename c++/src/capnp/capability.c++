@@ -86,6 +86,10 @@ kj::Maybe<kj::Promise<Capability::Client>> Capability::Server::shortenPath() {
   return nullptr;
 }
 
+Capability::Server::LocalCallOptions Capability::Server::getLocalCallOptions() {
+  return {};
+}
+
 Capability::Server::DispatchCallResult Capability::Server::internalUnimplemented(
     const char* actualInterfaceName, uint64_t requestedTypeId) {
   return {
@@ -111,6 +115,14 @@ kj::Promise<void> Capability::Server::internalUnimplemented(
 
 ResponseHook::~ResponseHook() noexcept(false) {}
 
+kj::Maybe<kj::Array<const byte>> ResponseHook::sliceData(kj::ArrayPtr<const byte> data) {
+  return nullptr;
+}
+
+kj::Maybe<kj::Array<const byte>> CallContextHook::sliceParamData(kj::ArrayPtr<const byte> data) {
+  return nullptr;
+}
+
 kj::Promise<void> ClientHook::whenResolved() {
   KJ_IF_MAYBE(promise, whenMoreResolved()) {
     return promise->then([](kj::Own<ClientHook>&& resolution) {
@@ -135,20 +147,40 @@ static inline uint firstSegmentSize(kj::Maybe<MessageSize> sizeHint) {
   }
 }
 
+static kj::Own<MessageBuilder> newLocalMessage(kj::Maybe<MessageSize> sizeHint, bool pooled) {
+  if (pooled) {
+    return kj::heap<PooledMessageBuilder>(firstSegmentSize(sizeHint));
+  } else {
+    return kj::heap<MallocMessageBuilder>(firstSegmentSize(sizeHint));
+  }
+}
+
+template <typename Builder>
 class LocalResponse final: public ResponseHook, public kj::Refcounted {
+  // `Builder` is MallocMessageBuilder or, for servers that asked for pooled messages,
+  // PooledMessageBuilder.
+
 public:
   LocalResponse(kj::Maybe<MessageSize> sizeHint)
       : message(firstSegmentSize(sizeHint)) {}
 
-  MallocMessageBuilder message;
+  kj::Maybe<kj::Array<const byte>> sliceData(kj::ArrayPtr<const byte> data) override {
+    auto root = message.template getRoot<AnyPointer>().asReader();
+    if (!_::PointerHelpers<AnyPointer>::getInternalReader(root).containsBytes(data)) {
+      return nullptr;
+    }
+    return data.attach(kj::addRef(*this));
+  }
+
+  Builder message;
 };
 
 class LocalCallContext final: public CallContextHook, public ResponseHook, public kj::Refcounted {
 public:
-  LocalCallContext(kj::Own<MallocMessageBuilder>&& request, kj::Own<ClientHook> clientRef,
-                   kj::Own<kj::PromiseFulfiller<void>> cancelAllowedFulfiller)
+  LocalCallContext(kj::Own<MessageBuilder>&& request, kj::Own<ClientHook> clientRef,
+                   kj::Own<kj::PromiseFulfiller<void>> cancelAllowedFulfiller, bool pooled)
       : request(kj::mv(request)), clientRef(kj::mv(clientRef)),
-        cancelAllowedFulfiller(kj::mv(cancelAllowedFulfiller)) {}
+        cancelAllowedFulfiller(kj::mv(cancelAllowedFulfiller)), pooled(pooled) {}
 
   AnyPointer::Reader getParams() override {
     KJ_IF_MAYBE(r, request) {
@@ -162,9 +194,11 @@ public:
   }
   AnyPointer::Builder getResults(kj::Maybe<MessageSize> sizeHint) override {
     if (response == nullptr) {
-      auto localResponse = kj::refcounted<LocalResponse>(sizeHint);
-      responseBuilder = localResponse->message.getRoot<AnyPointer>();
-      response = Response<AnyPointer>(responseBuilder.asReader(), kj::mv(localResponse));
+      if (pooled) {
+        initResponse<PooledMessageBuilder>(sizeHint);
+      } else {
+        initResponse<MallocMessageBuilder>(sizeHint);
+      }
     }
     return responseBuilder;
   }
@@ -197,21 +231,43 @@ public:
   kj::Own<CallContextHook> addRef() override {
     return kj::addRef(*this);
   }
+  kj::Maybe<kj::Array<const byte>> sliceData(kj::ArrayPtr<const byte> data) override {
+    // Only used when a shared context stands in for the response; see LocalRequest::send(). The
+    // response itself knows whether `data` is part of it, and keeps its message alive.
+    KJ_IF_MAYBE(r, response) {
+      return r->sliceData(data);
+    } else {
+      return nullptr;
+    }
+  }
 
-  kj::Maybe<kj::Own<MallocMessageBuilder>> request;
+  kj::Maybe<kj::Own<MessageBuilder>> request;
   kj::Maybe<Response<AnyPointer>> response;
   AnyPointer::Builder responseBuilder = nullptr;  // only valid if `response` is non-null
   kj::Own<ClientHook> clientRef;
   kj::Maybe<kj::Own<kj::PromiseFulfiller<AnyPointer::Pipeline>>> tailCallPipelineFulfiller;
   kj::Own<kj::PromiseFulfiller<void>> cancelAllowedFulfiller;
+  bool pooled;
+
+private:
+  template <typename Builder>
+  void initResponse(kj::Maybe<MessageSize> sizeHint) {
+    auto localResponse = kj::refcounted<LocalResponse<Builder>>(sizeHint);
+    responseBuilder = localResponse->message.template getRoot<AnyPointer>();
+    response = Response<AnyPointer>(responseBuilder.asReader(), kj::mv(localResponse));
+  }
 };
 
 class LocalRequest final: public RequestHook {
 public:
   inline LocalRequest(uint64_t interfaceId, uint16_t methodId,
-                      kj::Maybe<MessageSize> sizeHint, kj::Own<ClientHook> client)
-      : message(kj::heap<MallocMessageBuilder>(firstSegmentSize(sizeHint))),
-        interfaceId(interfaceId), methodId(methodId), client(kj::mv(client)) {}
+                      kj::Maybe<MessageSize> sizeHint, kj::Own<ClientHook> client,
+                      bool pooled = false, kj::Maybe<LocalClient&> localClient = nullptr)
+      : message(newLocalMessage(sizeHint, pooled)),
+        interfaceId(interfaceId), methodId(methodId), pooled(pooled),
+        client(kj::mv(client)), localClient(localClient) {}
+  // `localClient` is non-null when `client` is a LocalClient on which the call is being made
+  // directly, which makes the call eligible for synchronous dispatch.
 
   RemotePromise<AnyPointer> send() override {
     KJ_REQUIRE(message.get() != nullptr, "Already called send() on this request.");
@@ -219,8 +275,8 @@ public:
     auto cancelPaf = kj::newPromiseAndFulfiller<void>();
 
     auto context = kj::refcounted<LocalCallContext>(
-        kj::mv(message), client->addRef(), kj::mv(cancelPaf.fulfiller));
-    auto promiseAndPipeline = client->call(interfaceId, methodId, kj::addRef(*context));
+        kj::mv(message), client->addRef(), kj::mv(cancelPaf.fulfiller), pooled);
+    auto promiseAndPipeline = dispatch(kj::addRef(*context));
 
     // We have to make sure the call is not canceled unless permitted.  We need to fork the promise
     // so that if the client drops their copy, the promise isn't necessarily canceled.
@@ -270,12 +326,17 @@ public:
     return nullptr;
   }
 
-  kj::Own<MallocMessageBuilder> message;
+  kj::Own<MessageBuilder> message;
 
 private:
   uint64_t interfaceId;
   uint16_t methodId;
+  bool pooled;
   kj::Own<ClientHook> client;
+  kj::Maybe<LocalClient&> localClient;
+
+  ClientHook::VoidPromiseAndPipeline dispatch(kj::Own<CallContextHook>&& context);
+  // Defined after LocalClient.
 };
 
 // =======================================================================================
@@ -538,13 +599,14 @@ private:
 class LocalClient final: public ClientHook, public kj::Refcounted {
 public:
   LocalClient(kj::Own<Capability::Server>&& serverParam)
-      : server(kj::mv(serverParam)) {
+      : server(kj::mv(serverParam)), options(server->getLocalCallOptions()) {
     server->thisHook = this;
     startResolveTask();
   }
   LocalClient(kj::Own<Capability::Server>&& serverParam,
               _::CapabilityServerSetBase& capServerSet, void* ptr)
-      : server(kj::mv(serverParam)), capServerSet(&capServerSet), ptr(ptr) {
+      : server(kj::mv(serverParam)), options(server->getLocalCallOptions()),
+        capServerSet(&capServerSet), ptr(ptr) {
     server->thisHook = this;
     startResolveTask();
   }
@@ -564,13 +626,21 @@ public:
     }
 
     auto hook = kj::heap<LocalRequest>(
-        interfaceId, methodId, sizeHint, kj::addRef(*this));
+        interfaceId, methodId, sizeHint, kj::addRef(*this), options.pooled, *this);
     auto root = hook->message->getRoot<AnyPointer>();
     return Request<AnyPointer, AnyPointer>(root, kj::mv(hook));
   }
 
   VoidPromiseAndPipeline call(uint64_t interfaceId, uint16_t methodId,
                               kj::Own<CallContextHook>&& context) override {
+    return dispatch(interfaceId, methodId, kj::mv(context), false);
+  }
+
+  VoidPromiseAndPipeline dispatch(uint64_t interfaceId, uint16_t methodId,
+                                  kj::Own<CallContextHook>&& context, bool direct) {
+    // Implements call(). `direct` is true if the call was made by a LocalRequest created by our
+    // own newCall(), as opposed to arriving through a promise, pipeline, or RPC.
+
     KJ_IF_MAYBE(r, resolved) {
       // We resolved to a shortened path. New calls MUST go directly to the replacement capability
       // so that their ordering is consistent with callers who call getResolved() to get direct
@@ -589,14 +659,34 @@ public:
     //
     // Note also that QueuedClient depends on this evalLater() to ensure that pipelined calls don't
     // complete before 'whenMoreResolved()' promises resolve.
-    auto promise = kj::evalLater([this,interfaceId,methodId,contextPtr]() {
-      if (blocked) {
-        return kj::newAdaptedPromise<kj::Promise<void>, BlockedCall>(
-            *this, interfaceId, methodId, *contextPtr);
-      } else {
+    //
+    // The exception is a server which asked for synchronous dispatch. We honor that only for
+    // direct calls, and only if no earlier call is still waiting for its evalLater() or queued
+    // behind a streaming call, since otherwise this call would overtake those.
+    //
+    // Either way, register for tail calls first: a synchronous call may make its tail call before
+    // we return, and if nothing is listening for it then, its pipeline is lost.
+    auto tailPipelinePromise = context->onTailCall().then([](AnyPointer::Pipeline&& pipeline) {
+      return kj::mv(pipeline.hook);
+    });
+
+    kj::Promise<void> promise = nullptr;
+    if (direct && options.synchronous && !blocked && queuedCalls == 0) {
+      promise = kj::evalNow([&]() {
         return callInternal(interfaceId, methodId, *contextPtr);
-      }
-    }).attach(kj::addRef(*this));
+      }).attach(kj::addRef(*this));
+    } else {
+      promise = kj::evalLater([this,interfaceId,methodId,contextPtr,
+                               queued = QueuedCall(*this)]() mutable {
+        queued.dispatched();
+        if (blocked) {
+          return kj::newAdaptedPromise<kj::Promise<void>, BlockedCall>(
+              *this, interfaceId, methodId, *contextPtr);
+        } else {
+          return callInternal(interfaceId, methodId, *contextPtr);
+        }
+      }).attach(kj::addRef(*this));
+    }
 
     // We have to fork this promise for the pipeline to receive a copy of the answer.
     auto forked = promise.fork();
@@ -607,10 +697,6 @@ public:
           return kj::refcounted<LocalPipeline>(kj::mv(context));
         }));
 
-    auto tailPipelinePromise = context->onTailCall().then([](AnyPointer::Pipeline&& pipeline) {
-      return kj::mv(pipeline.hook);
-    });
-
     pipelinePromise = pipelinePromise.exclusiveJoin(kj::mv(tailPipelinePromise));
 
     auto completionPromise = forked.addBranch().attach(kj::mv(context));
@@ -688,9 +774,33 @@ public:
 
 private:
   kj::Own<Capability::Server> server;
+  Capability::Server::LocalCallOptions options;
   _::CapabilityServerSetBase* capServerSet = nullptr;
   void* ptr = nullptr;
 
+  uint queuedCalls = 0;
+  // Number of calls passed to dispatch() whose evalLater() hasn't run yet.
+
+  class QueuedCall {
+    // Counts a call in `queuedCalls` from when it is queued until it is dispatched or canceled.
+
+  public:
+    QueuedCall(LocalClient& client): client(&client) { ++client.queuedCalls; }
+    QueuedCall(QueuedCall&& other): client(other.client) { other.client = nullptr; }
+    KJ_DISALLOW_COPY(QueuedCall);
+    ~QueuedCall() noexcept(false) { dispatched(); }
+
+    void dispatched() {
+      if (client != nullptr) {
+        --client->queuedCalls;
+        client = nullptr;
+      }
+    }
+
+  private:
+    LocalClient* client;
+  };
+
   kj::Maybe<kj::ForkedPromise<void>> resolveTask;
   kj::Maybe<kj::Own<ClientHook>> resolved;
 
@@ -827,6 +937,14 @@ private:
 
 const uint LocalClient::BRAND = 0;
 
+ClientHook::VoidPromiseAndPipeline LocalRequest::dispatch(kj::Own<CallContextHook>&& context) {
+  KJ_IF_MAYBE(c, localClient) {
+    return c->dispatch(interfaceId, methodId, kj::mv(context), true);
+  } else {
+    return client->call(interfaceId, methodId, kj::mv(context));
+  }
+}
+
 kj::Own<ClientHook> Capability::Client::makeLocalClient(kj::Own<Capability::Server>&& server) {
   return kj::refcounted<LocalClient>(kj::mv(server));
 }
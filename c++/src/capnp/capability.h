@@ -153,6 +153,12 @@ public:
   inline Response(typename Results::Reader reader, kj::Own<ResponseHook>&& hook)
       : Results::Reader(reader), hook(kj::mv(hook)) {}
 
+  kj::Array<const byte> sliceData(Data::Reader data);
+  // Given a Data field of this response, returns an array referencing the same bytes which keeps
+  // them valid even after the Response is destroyed. Where the RPC system can share the received
+  // message (as it can for responses received over the network), this doesn't copy; otherwise, it
+  // returns a copy.
+
 private:
   kj::Own<ResponseHook> hook;
 
@@ -293,6 +299,13 @@ public:
   // requests.  Long-running asynchronous methods should try to call this as early as is
   // convenient.
 
+  kj::Array<const byte> sliceParamData(Data::Reader data);
+  // Given a Data field of the params, returns an array referencing the same bytes which remains
+  // valid after releaseParams() and after the call completes, e.g. so that a server can keep a
+  // large blob it was sent without copying it. Like Response::sliceData(), this only avoids the
+  // copy where the RPC system can share the received message; the rest of the message stays in
+  // memory for as long as any slice of it does.
+
   typename Results::Builder getResults(kj::Maybe<MessageSize> sizeHint = nullptr);
   typename Results::Builder initResults(kj::Maybe<MessageSize> sizeHint = nullptr);
   void setResults(typename Results::Reader value);
@@ -361,6 +374,7 @@ public:
 
   typename Params::Reader getParams();
   void releaseParams();
+  kj::Array<const byte> sliceParamData(Data::Reader data);
 
   // Note: tailCall() is not supported because:
   // - It would significantly complicate the implementation of streaming.
@@ -422,6 +436,27 @@ public:
   //
   // The default implementation always returns nullptr.
 
+  struct LocalCallOptions {
+    bool synchronous = false;
+    // Normally a call made in-process is delivered on a later turn of the event loop, so that the
+    // callee can't have side effects before `send()` returns to the caller. If this is true, a
+    // call made directly on a client pointing at this server is instead dispatched before `send()`
+    // returns, saving an event loop turn per call. This is only done when it can't change the
+    // order in which the server sees calls: calls arriving through promises, pipelines or RPC,
+    // and calls made while earlier ones are still queued (including behind a streaming call), are
+    // still delivered later. Only enable this for servers whose methods don't mind running inside
+    // the caller's stack frame, e.g. because they don't call back into the caller.
+
+    bool pooled = false;
+    // If true, in-process calls to this server build their params and results in segments drawn
+    // from the calling thread's MessageSegmentPool (see PooledMessageBuilder) rather than freshly
+    // calloc()ed ones.
+  };
+
+  virtual LocalCallOptions getLocalCallOptions();
+  // Returns how in-process calls to this server should be delivered. Called once, when a client
+  // is created around the server. The default implementation returns the defaults above.
+
   // TODO(someday):  Method which can optionally be overridden to implement Join when the object is
   //   a proxy.
 
@@ -587,6 +622,11 @@ public:
   virtual ~ResponseHook() noexcept(false);
   // Just here to make sure the type is dynamic.
 
+  virtual kj::Maybe<kj::Array<const byte>> sliceData(kj::ArrayPtr<const byte> data);
+  // Implements Response::sliceData(). `data` points into the response. Returns null if the
+  // response can't be shared, in which case the caller copies the bytes. The default
+  // implementation returns null.
+
   template <typename T>
   inline static kj::Own<ResponseHook> from(Response<T>&& response) {
     return kj::mv(response.hook);
@@ -687,6 +727,11 @@ public:
   // promise fulfiller for onTailCall() with the returned pipeline.
 
   virtual kj::Own<CallContextHook> addRef() = 0;
+
+  virtual kj::Maybe<kj::Array<const byte>> sliceParamData(kj::ArrayPtr<const byte> data);
+  // Implements CallContext::sliceParamData(). `data` points into the params. Returns null if the
+  // params can't be shared, in which case the caller copies the bytes. The default implementation
+  // returns null.
 };
 
 kj::Own<ClientHook> newLocalPromiseClient(kj::Promise<kj::Own<ClientHook>>&& promise);
@@ -884,6 +929,15 @@ kj::Promise<void> StreamingRequest<Params>::send() {
   return promise;
 }
 
+template <typename Results>
+kj::Array<const byte> Response<Results>::sliceData(Data::Reader data) {
+  KJ_IF_MAYBE(slice, hook->sliceData(data)) {
+    return kj::mv(*slice);
+  } else {
+    return kj::heapArray<const byte>(data);
+  }
+}
+
 inline Capability::Client::Client(kj::Own<ClientHook>&& hook): hook(kj::mv(hook)) {}
 template <typename T, typename>
 inline Capability::Client::Client(kj::Own<T>&& server)
@@ -934,6 +988,22 @@ template <typename Params, typename Results>
 inline void CallContext<Params, Results>::releaseParams() {
   hook->releaseParams();
 }
+template <typename Params, typename Results>
+inline kj::Array<const byte> CallContext<Params, Results>::sliceParamData(Data::Reader data) {
+  KJ_IF_MAYBE(slice, hook->sliceParamData(data)) {
+    return kj::mv(*slice);
+  } else {
+    return kj::heapArray<const byte>(data);
+  }
+}
+template <typename Params>
+inline kj::Array<const byte> StreamingCallContext<Params>::sliceParamData(Data::Reader data) {
+  KJ_IF_MAYBE(slice, hook->sliceParamData(data)) {
+    return kj::mv(*slice);
+  } else {
+    return kj::heapArray<const byte>(data);
+  }
+}
 template <typename Params>
 inline void StreamingCallContext<Params>::releaseParams() {
   hook->releaseParams();
@@ -1170,6 +1170,7 @@ private:
     kj::StringTree builderMethodDecls;
     kj::StringTree pipelineMethodDecls;
     kj::StringTree inlineMethodDefs;
+    kj::StringTree columnDecls;  // static members of the outer struct type
   };
 
   enum class FieldKind {
@@ -1182,8 +1183,8 @@ private:
     BRAND_PARAMETER
   };
 
-  FieldText makeFieldText(kj::StringPtr scope, StructSchema::Field field,
-                          const TemplateContext& templateContext) {
+  FieldText makeFieldText(kj::StringPtr scope, kj::StringPtr structName,
+                          StructSchema::Field field, const TemplateContext& templateContext) {
     auto proto = field.getProto();
     auto typeSchema = field.getType();
     auto baseName = protoName(proto);
@@ -1255,7 +1256,9 @@ private:
                   KJ_UNREACHABLE;
                 },
                 "  return typename ", scope, titleCase, "::Builder(_builder);\n"
-                "}\n")
+                "}\n"),
+
+            kj::strTree()
           };
       }
     }
@@ -1389,6 +1392,34 @@ private:
     uint offset = slot.getOffset();
 
     if (kind == FieldKind::PRIMITIVE) {
+      // Fields that every struct in a list has -- not those of unions or groups -- can be read a
+      // column at a time; see List<T>::Reader::getDataColumn().
+      kj::StringTree columnDecl;
+      if (typeSchema.which() != schema::Type::VOID && !hasDiscriminantValue(proto) &&
+          !field.getContainingStruct().getProto().getStruct().getIsGroup()) {
+        kj::StringTree columnType;
+        if (typeSchema.which() == schema::Type::ENUM) {
+          // The enum's typedef may be nested in a struct defined later in the file, but the enum
+          // itself is always declared up front.
+          auto enumSchema = typeSchema.asEnum();
+          auto enumProto = enumSchema.getProto();
+          kj::StringPtr enumName = enumSchema.getUnqualifiedName();
+          KJ_IF_MAYBE(annotatedName, annotationValue(enumProto, NAME_ANNOTATION_ID)) {
+            enumName = annotatedName->getText();
+          }
+          columnType = kj::strTree(
+              " ::capnp::schemas::", enumName, "_", kj::hex(enumProto.getId()));
+        } else {
+          columnType = kj::strTree(type);
+        }
+        kj::StringPtr columnMask = defaultMask.size() > 0 ? kj::StringPtr(defaultMask) : "0";
+        columnDecl = kj::strTree(
+            "  static constexpr ::capnp::DataColumn<", structName, ", ", kj::mv(columnType), "> ",
+                baseName, "Column() {\n"
+            "    return { ", offset, ", ", columnMask, " };\n"
+            "  }\n");
+      }
+
       return FieldText {
         kj::strTree(
             kj::mv(unionDiscrim.readerIsDecl),
@@ -1424,7 +1455,9 @@ private:
             "  _builder.setDataField<", type, ">(\n"
             "      ::capnp::bounded<", offset, ">() * ::capnp::ELEMENTS, value", defaultMaskParam, ");\n",
             "}\n"
-            "\n")
+            "\n"),
+
+        kj::mv(columnDecl)
       };
 
     } else if (kind == FieldKind::INTERFACE) {
@@ -1514,7 +1547,9 @@ private:
             "      ::capnp::bounded<", offset, ">() * ::capnp::POINTERS));\n"
             "}\n"
             "#endif  // !CAPNP_LITE\n"
-            "\n")
+            "\n"),
+
+          kj::strTree()
       };
 
     } else if (kind == FieldKind::ANY_POINTER) {
@@ -1568,7 +1603,9 @@ private:
             "  result.clear();\n"
             "  return result;\n"
             "}\n"
-            "\n")
+            "\n"),
+
+          kj::strTree()
       };
 
     } else {
@@ -1804,7 +1841,9 @@ private:
             "}\n",
             COND(type.hasDisambiguatedTemplate(), "#endif  // !_MSC_VER || __clang__\n"),
             COND(shouldExcludeInLiteMode, "#endif  // !CAPNP_LITE\n"),
-            "\n")
+            "\n"),
+
+          kj::strTree()
       };
 
       #undef COND
@@ -2025,7 +2064,7 @@ private:
     auto fullName = kj::str(scope, name, templateContext.args());
     auto subScope = kj::str(fullName, "::");
     auto fieldTexts = KJ_MAP(f, schema.getFields()) {
-      return makeFieldText(subScope, f, templateContext);
+      return makeFieldText(subScope, name, f, templateContext);
     };
 
     auto structNode = proto.getStruct();
@@ -2070,6 +2109,8 @@ private:
     declareText = kj::strTree(kj::mv(declareText), "  };");
     defineText = kj::strTree(kj::mv(defineText), "#endif  // !CAPNP_LITE\n\n");
 
+    auto columnDecls = kj::strTree(KJ_MAP(f, fieldTexts) { return kj::mv(f.columnDecls); });
+
     // Name of the ::Which type, when applicable.
     CppTypeName whichName;
     if (structNode.getDiscriminantCount() != 0) {
@@ -2103,6 +2144,7 @@ private:
               "  };\n"),
           KJ_MAP(n, nestedTypeDecls) { return kj::mv(n); },
           "\n",
+          columnDecls.size() == 0 ? kj::strTree() : kj::strTree(kj::mv(columnDecls), "\n"),
           kj::mv(declareText), "\n",
           "};\n"
           "\n"),
@@ -55,6 +55,13 @@ struct LocatedText {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<LocatedText,  ::uint32_t> startByteColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<LocatedText,  ::uint32_t> endByteColumn() {
+    return { 1, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(e75816b56529d464, 1, 1)
     #if !CAPNP_LITE
@@ -70,6 +77,16 @@ struct LocatedInteger {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<LocatedInteger,  ::uint64_t> valueColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<LocatedInteger,  ::uint32_t> startByteColumn() {
+    return { 2, 0 };
+  }
+  static constexpr ::capnp::DataColumn<LocatedInteger,  ::uint32_t> endByteColumn() {
+    return { 3, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(991c7a3693d62cf2, 2, 0)
     #if !CAPNP_LITE
@@ -85,6 +102,16 @@ struct LocatedFloat {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<LocatedFloat, double> valueColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<LocatedFloat,  ::uint32_t> startByteColumn() {
+    return { 2, 0 };
+  }
+  static constexpr ::capnp::DataColumn<LocatedFloat,  ::uint32_t> endByteColumn() {
+    return { 3, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(90f2a60678fd2367, 2, 0)
     #if !CAPNP_LITE
@@ -119,6 +146,13 @@ struct Expression {
   struct Application;
   struct Member;
 
+  static constexpr ::capnp::DataColumn<Expression,  ::uint32_t> startByteColumn() {
+    return { 1, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Expression,  ::uint32_t> endByteColumn() {
+    return { 4, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(8e207d4dfe54d0de, 3, 2)
     #if !CAPNP_LITE
@@ -230,6 +264,13 @@ struct Declaration {
   struct Method;
   struct Annotation;
 
+  static constexpr ::capnp::DataColumn<Declaration,  ::uint32_t> startByteColumn() {
+    return { 1, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Declaration,  ::uint32_t> endByteColumn() {
+    return { 2, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(96efe787c17e83bb, 2, 8)
     #if !CAPNP_LITE
@@ -245,6 +286,13 @@ struct Declaration::BrandParameter {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<BrandParameter,  ::uint32_t> startByteColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<BrandParameter,  ::uint32_t> endByteColumn() {
+    return { 1, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(d5e71144af1ce175, 1, 1)
     #if !CAPNP_LITE
@@ -300,6 +348,13 @@ struct Declaration::ParamList {
     STREAM,
   };
 
+  static constexpr ::capnp::DataColumn<ParamList,  ::uint32_t> startByteColumn() {
+    return { 1, 0 };
+  }
+  static constexpr ::capnp::DataColumn<ParamList,  ::uint32_t> endByteColumn() {
+    return { 2, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(b3f66e7a79d81bcd, 2, 1)
     #if !CAPNP_LITE
@@ -316,6 +371,13 @@ struct Declaration::Param {
   class Pipeline;
   struct DefaultValue;
 
+  static constexpr ::capnp::DataColumn<Param,  ::uint32_t> startByteColumn() {
+    return { 1, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Param,  ::uint32_t> endByteColumn() {
+    return { 2, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(fffe08a9a697d2a5, 2, 4)
     #if !CAPNP_LITE
@@ -44,6 +44,13 @@ struct Token {
     BINARY_LITERAL,
   };
 
+  static constexpr ::capnp::DataColumn<Token,  ::uint32_t> startByteColumn() {
+    return { 1, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Token,  ::uint32_t> endByteColumn() {
+    return { 4, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(91cc55cd57de5419, 3, 1)
     #if !CAPNP_LITE
@@ -63,6 +70,13 @@ struct Statement {
     BLOCK,
   };
 
+  static constexpr ::capnp::DataColumn<Statement,  ::uint32_t> startByteColumn() {
+    return { 1, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Statement,  ::uint32_t> endByteColumn() {
+    return { 2, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(c6725e678d60fa37, 2, 3)
     #if !CAPNP_LITE
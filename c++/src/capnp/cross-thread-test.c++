@@ -0,0 +1,205 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "cross-thread.h"
+#include <kj/test.h>
+#include <kj/thread.h>
+#include "test-util.h"
+
+namespace capnp {
+namespace _ {
+namespace {
+
+void runOnOtherThread(kj::WaitScope& waitScope, kj::Function<void(kj::WaitScope&)> func) {
+  // Runs `func` on a new thread with its own event loop, while the current thread's event loop
+  // keeps running so that it can service calls.
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  const kj::Executor& executor = kj::getCurrentThreadExecutor();
+
+  kj::Thread thread([&]() {
+    KJ_DEFER(executor.executeSync([&]() { paf.fulfiller->fulfill(); }));
+    kj::EventLoop loop;
+    kj::WaitScope otherWaitScope(loop);
+    func(otherWaitScope);
+  });
+
+  paf.promise.wait(waitScope);
+}
+
+KJ_TEST("CrossThreadCapability calls") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  int callCount = 0;
+  CrossThreadCapability cap(kj::heap<TestInterfaceImpl>(callCount));
+
+  runOnOtherThread(waitScope, [&](kj::WaitScope& waitScope) {
+    auto client = cap.getClient().castAs<test::TestInterface>();
+
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    auto response = request.send().wait(waitScope);
+    KJ_ASSERT(response.getX() == "foo");
+  });
+
+  KJ_EXPECT(callCount == 1);
+}
+
+KJ_TEST("CrossThreadCapability preserves call order") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  CrossThreadCapability cap(kj::heap<TestCallOrderImpl>());
+
+  runOnOtherThread(waitScope, [&](kj::WaitScope& waitScope) {
+    auto client = cap.getClient().castAs<test::TestCallOrder>();
+
+    kj::Vector<kj::Promise<void>> promises;
+    for (uint i = 0; i < 100; i++) {
+      auto request = client.getCallSequenceRequest();
+      request.setExpected(i);
+      promises.add(request.send().then([i](auto&& response) {
+        KJ_ASSERT(response.getN() == i);
+      }));
+    }
+    kj::joinPromises(promises.releaseAsArray()).wait(waitScope);
+  });
+}
+
+KJ_TEST("CrossThreadCapability passes capabilities in params and results") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  const kj::Executor& homeExecutor = kj::getCurrentThreadExecutor();
+
+  int callCount = 0;
+  int handleCount = 0;
+  test::TestMoreStuff::Client server = kj::heap<TestMoreStuffImpl>(callCount, handleCount);
+  int heldCallCount = 0;
+  {
+    auto request = server.holdRequest();
+    request.setCap(kj::heap<TestInterfaceImpl>(heldCallCount));
+    request.send().wait(waitScope);
+  }
+
+  CrossThreadCapability cap(server);
+
+  runOnOtherThread(waitScope, [&](kj::WaitScope& waitScope) {
+    auto client = cap.getClient().castAs<test::TestMoreStuff>();
+
+    // The home thread calls back into a capability hosted on this thread.
+    int localCallCount = 0;
+    {
+      auto request = client.callFooRequest();
+      request.setCap(kj::heap<TestInterfaceImpl>(localCallCount));
+      KJ_EXPECT(request.send().wait(waitScope).getS() == "bar");
+    }
+    KJ_EXPECT(localCallCount == 1);
+
+    // A capability in the results is called on the home thread.
+    auto held = client.getHeldRequest().send().wait(waitScope).getCap();
+    {
+      auto request = held.fooRequest();
+      request.setI(123);
+      request.setJ(true);
+      KJ_EXPECT(request.send().wait(waitScope).getX() == "foo");
+    }
+
+    // Passing it back to its home thread unwraps it again.
+    {
+      auto request = client.callFooRequest();
+      request.setCap(held);
+      KJ_EXPECT(request.send().wait(waitScope).getS() == "bar");
+    }
+
+    // Dropping a capability releases it on the home thread.
+    {
+      auto handle = client.getHandleRequest().send().wait(waitScope).getHandle();
+      homeExecutor.executeSync([&]() { KJ_EXPECT(handleCount == 1); });
+    }
+    homeExecutor.executeSync([&]() { KJ_EXPECT(handleCount == 0); });
+  });
+
+  KJ_EXPECT(heldCallCount == 2);
+}
+
+KJ_TEST("CrossThreadCapability pipelining") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  int callCount = 0;
+  int handleCount = 0;
+  test::TestMoreStuff::Client server = kj::heap<TestMoreStuffImpl>(callCount, handleCount);
+  int heldCallCount = 0;
+  {
+    auto request = server.holdRequest();
+    request.setCap(kj::heap<TestInterfaceImpl>(heldCallCount));
+    request.send().wait(waitScope);
+  }
+
+  CrossThreadCapability cap(server);
+
+  runOnOtherThread(waitScope, [&](kj::WaitScope& waitScope) {
+    auto client = cap.getClient().castAs<test::TestMoreStuff>();
+
+    auto promise = client.getHeldRequest().send();
+    auto request = promise.getCap().fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    KJ_EXPECT(request.send().wait(waitScope).getX() == "foo");
+  });
+
+  KJ_EXPECT(heldCallCount == 1);
+}
+
+KJ_TEST("CrossThreadCapability disconnects when destroyed") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  const kj::Executor& homeExecutor = kj::getCurrentThreadExecutor();
+
+  int callCount = 0;
+  kj::Own<CrossThreadCapability> cap =
+      kj::heap<CrossThreadCapability>(kj::heap<TestInterfaceImpl>(callCount));
+
+  runOnOtherThread(waitScope, [&](kj::WaitScope& waitScope) {
+    auto client = cap->getClient().castAs<test::TestInterface>();
+
+    auto callFoo = [&]() {
+      auto request = client.fooRequest();
+      request.setI(123);
+      request.setJ(true);
+      return request.send().ignoreResult();
+    };
+
+    callFoo().wait(waitScope);
+
+    homeExecutor.executeSync([&]() { cap = nullptr; });
+
+    KJ_EXPECT_THROW(DISCONNECTED, callFoo().wait(waitScope));
+  });
+
+  KJ_EXPECT(callCount == 1);
+}
+
+}  // namespace
+}  // namespace _
+}  // namespace capnp
@@ -0,0 +1,399 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "cross-thread.h"
+#include "message.h"
+#include <kj/debug.h>
+
+namespace capnp {
+
+namespace {
+
+static inline uint firstSegmentSize(kj::Maybe<MessageSize> sizeHint) {
+  KJ_IF_MAYBE(s, sizeHint) {
+    return s->wordCount;
+  } else {
+    return SUGGESTED_FIRST_SEGMENT_WORDS;
+  }
+}
+
+struct TransferredMessage {
+  // A message on its way between threads, along with the capabilities it points to.
+
+  kj::Own<MallocMessageBuilder> message;
+  kj::Array<kj::Maybe<kj::Own<const _::CrossThreadHome>>> caps;
+};
+
+kj::Array<kj::Maybe<kj::Own<const _::CrossThreadHome>>> exportCaps(
+    BuilderCapabilityTable& capTable);
+// Wraps each capability in `capTable` so that it can be called from other threads. Called on the
+// thread that built the message.
+
+kj::Array<kj::Maybe<kj::Own<ClientHook>>> importCaps(
+    kj::Array<kj::Maybe<kj::Own<const _::CrossThreadHome>>> caps);
+// Turns capabilities exported by another thread into clients usable on the current thread.
+
+class CrossThreadCallContext final: public CallContextHook, public kj::Refcounted {
+  // Context for a call arriving on the home thread. The params message was built by the caller
+  // and is now owned by us; the results message is handed back to the caller when done.
+
+public:
+  CrossThreadCallContext(TransferredMessage params, kj::Own<ClientHook> clientRef,
+                         kj::Own<kj::PromiseFulfiller<void>> cancelAllowedFulfiller)
+      : params(kj::mv(params.message)),
+        paramsCapTable(kj::heap<ReaderCapabilityTable>(importCaps(kj::mv(params.caps)))),
+        clientRef(kj::mv(clientRef)), cancelAllowedFulfiller(kj::mv(cancelAllowedFulfiller)) {}
+
+  AnyPointer::Reader getParams() override {
+    KJ_IF_MAYBE(p, params) {
+      return paramsCapTable->imbue(p->get()->getRoot<AnyPointer>().asReader());
+    } else {
+      KJ_FAIL_REQUIRE("Can't call getParams() after releaseParams().");
+    }
+  }
+  void releaseParams() override {
+    params = nullptr;
+    paramsCapTable = nullptr;
+  }
+  AnyPointer::Builder getResults(kj::Maybe<MessageSize> sizeHint) override {
+    if (results.get() == nullptr) {
+      results = kj::heap<MallocMessageBuilder>(firstSegmentSize(sizeHint));
+      resultsBuilder = resultsCapTable.imbue(results->getRoot<AnyPointer>());
+    }
+    return resultsBuilder;
+  }
+  kj::Promise<void> tailCall(kj::Own<RequestHook>&& request) override {
+    auto result = directTailCall(kj::mv(request));
+    KJ_IF_MAYBE(f, tailCallPipelineFulfiller) {
+      f->get()->fulfill(AnyPointer::Pipeline(kj::mv(result.pipeline)));
+    }
+    return kj::mv(result.promise);
+  }
+  ClientHook::VoidPromiseAndPipeline directTailCall(kj::Own<RequestHook>&& request) override {
+    KJ_REQUIRE(results.get() == nullptr,
+               "Can't call tailCall() after initializing the results struct.");
+
+    // The tail call's response belongs to this thread, so it has to be copied into a message we
+    // can hand over.
+    auto promise = request->send();
+    auto voidPromise = promise.then([this](Response<AnyPointer>&& tailResponse) {
+      getResults(tailResponse.targetSize()).set(tailResponse);
+    });
+
+    return { kj::mv(voidPromise), PipelineHook::from(kj::mv(promise)) };
+  }
+  kj::Promise<AnyPointer::Pipeline> onTailCall() override {
+    auto paf = kj::newPromiseAndFulfiller<AnyPointer::Pipeline>();
+    tailCallPipelineFulfiller = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+  }
+  void allowCancellation() override {
+    cancelAllowedFulfiller->fulfill();
+  }
+  kj::Own<CallContextHook> addRef() override {
+    return kj::addRef(*this);
+  }
+
+  TransferredMessage releaseResults() {
+    getResults(MessageSize { 0, 0 });
+    return { kj::mv(results), exportCaps(resultsCapTable) };
+  }
+
+private:
+  kj::Maybe<kj::Own<MallocMessageBuilder>> params;
+  kj::Own<ReaderCapabilityTable> paramsCapTable;
+  kj::Own<MallocMessageBuilder> results;
+  BuilderCapabilityTable resultsCapTable;
+  AnyPointer::Builder resultsBuilder = nullptr;  // only valid if `results` is non-null
+  kj::Own<ClientHook> clientRef;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<AnyPointer::Pipeline>>> tailCallPipelineFulfiller;
+  kj::Own<kj::PromiseFulfiller<void>> cancelAllowedFulfiller;
+};
+
+}  // namespace
+
+namespace _ {  // private
+
+class CrossThreadHome final: public kj::AtomicRefcounted {
+  // Shared between the home thread and all calling threads.
+
+public:
+  CrossThreadHome(kj::Own<ClientHook> hook)
+      : executor(kj::getCurrentThreadExecutor().addRef()), hook(kj::mv(hook)) {}
+
+  ~CrossThreadHome() noexcept(false) {
+    KJ_IF_MAYBE(h, hook) {
+      // A capability that was passed to another thread, which has now dropped the last
+      // reference. The capability itself still has to be released on the home thread.
+      if (executor.get() != &kj::getCurrentThreadExecutor()) {
+        executor->executeAsync([hook = kj::mv(*h)]() mutable { hook = nullptr; })
+            .detach([](kj::Exception&&) {});
+      }
+    }
+  }
+
+  kj::Own<const kj::Executor> executor;
+
+  kj::Own<ClientHook> getClient() const;
+  // Get a client usable on the calling thread.
+
+  void disconnect() const {
+    // Called on the home thread.
+    hook = nullptr;
+  }
+
+  kj::Promise<TransferredMessage> call(
+      uint64_t interfaceId, uint16_t methodId, TransferredMessage params) const {
+    // Called on the home thread.
+
+    KJ_IF_MAYBE(h, hook) {
+      auto cancelPaf = kj::newPromiseAndFulfiller<void>();
+
+      auto context = kj::refcounted<CrossThreadCallContext>(
+          kj::mv(params), h->get()->addRef(), kj::mv(cancelPaf.fulfiller));
+      auto promise = h->get()->call(interfaceId, methodId, kj::addRef(*context)).promise;
+
+      // As in LocalRequest::send(), the call may only be canceled once the callee allows it, so
+      // keep a detached branch running until then.
+      auto forked = promise.fork();
+      forked.addBranch().attach(kj::addRef(*context))
+          .exclusiveJoin(kj::mv(cancelPaf.promise))
+          .detach([](kj::Exception&&) {});
+
+      return forked.addBranch().then([context = kj::mv(context)]() mutable {
+        return context->releaseResults();
+      });
+    } else {
+      return KJ_EXCEPTION(DISCONNECTED, "CrossThreadCapability was destroyed");
+    }
+  }
+
+private:
+  mutable kj::Maybe<kj::Own<ClientHook>> hook;
+  // Only touched on the home thread. Null once the CrossThreadCapability is destroyed.
+};
+
+}  // namespace _
+
+namespace {
+
+class CrossThreadResponse final: public ResponseHook, public kj::Refcounted {
+public:
+  CrossThreadResponse(TransferredMessage results)
+      : message(kj::mv(results.message)), capTable(importCaps(kj::mv(results.caps))) {}
+
+  AnyPointer::Reader getResults() {
+    return capTable.imbue(message->getRoot<AnyPointer>().asReader());
+  }
+
+  kj::Own<CrossThreadResponse> addRef() {
+    return kj::addRef(*this);
+  }
+
+private:
+  kj::Own<MallocMessageBuilder> message;
+  ReaderCapabilityTable capTable;
+};
+
+class CrossThreadPipeline final: public PipelineHook, public kj::Refcounted {
+  // Pipelined calls are queued on the calling thread until the response arrives, and then made on
+  // the capabilities in the response.
+
+public:
+  CrossThreadPipeline(kj::Own<CrossThreadResponse> response): response(kj::mv(response)) {}
+
+  kj::Own<PipelineHook> addRef() override {
+    return kj::addRef(*this);
+  }
+
+  kj::Own<ClientHook> getPipelinedCap(kj::ArrayPtr<const PipelineOp> ops) override {
+    return response->getResults().getPipelinedCap(ops);
+  }
+
+private:
+  kj::Own<CrossThreadResponse> response;
+};
+
+class CrossThreadRequest final: public RequestHook {
+  // Runs on the calling thread. The params message is built here and then moved to the home
+  // thread as-is.
+
+public:
+  CrossThreadRequest(kj::Own<const _::CrossThreadHome> home,
+                     uint64_t interfaceId, uint16_t methodId, kj::Maybe<MessageSize> sizeHint)
+      : home(kj::mv(home)), message(kj::heap<MallocMessageBuilder>(firstSegmentSize(sizeHint))),
+        interfaceId(interfaceId), methodId(methodId) {}
+
+  AnyPointer::Builder getRoot() {
+    return capTable.imbue(message->getRoot<AnyPointer>());
+  }
+
+  RemotePromise<AnyPointer> send() override {
+    KJ_REQUIRE(message.get() != nullptr, "Already called send() on this request.");
+
+    TransferredMessage params { kj::mv(message), exportCaps(capTable) };
+    auto promise = kj::evalNow([&]() {
+      return home->executor->executeAsync(
+          [home = kj::atomicAddRef(*home), params = kj::mv(params),
+           interfaceId = interfaceId, methodId = methodId]() mutable {
+        return home->call(interfaceId, methodId, kj::mv(params));
+      });
+    }).then([](TransferredMessage&& results) {
+      return kj::refcounted<CrossThreadResponse>(kj::mv(results));
+    }).fork();
+
+    auto pipelinePromise = promise.addBranch()
+        .then([](kj::Own<CrossThreadResponse>&& response) -> kj::Own<PipelineHook> {
+      return kj::refcounted<CrossThreadPipeline>(kj::mv(response));
+    });
+
+    auto responsePromise = promise.addBranch()
+        .then([](kj::Own<CrossThreadResponse>&& response) {
+      AnyPointer::Reader reader = response->getResults();
+      return Response<AnyPointer>(reader, kj::mv(response));
+    });
+
+    return RemotePromise<AnyPointer>(kj::mv(responsePromise),
+        AnyPointer::Pipeline(newLocalPromisePipeline(kj::mv(pipelinePromise))));
+  }
+
+  kj::Promise<void> sendStreaming() override {
+    return send().ignoreResult();
+  }
+
+  const void* getBrand() override {
+    return nullptr;
+  }
+
+private:
+  kj::Own<const _::CrossThreadHome> home;
+  kj::Own<MallocMessageBuilder> message;
+  BuilderCapabilityTable capTable;
+  uint64_t interfaceId;
+  uint16_t methodId;
+};
+
+class CrossThreadClient final: public ClientHook, public kj::Refcounted {
+public:
+  CrossThreadClient(kj::Own<const _::CrossThreadHome> home): home(kj::mv(home)) {}
+
+  const _::CrossThreadHome& getHome() { return *home; }
+
+  Request<AnyPointer, AnyPointer> newCall(
+      uint64_t interfaceId, uint16_t methodId, kj::Maybe<MessageSize> sizeHint) override {
+    auto hook = kj::heap<CrossThreadRequest>(
+        kj::atomicAddRef(*home), interfaceId, methodId, sizeHint);
+    auto root = hook->getRoot();
+    return Request<AnyPointer, AnyPointer>(root, kj::mv(hook));
+  }
+
+  VoidPromiseAndPipeline call(uint64_t interfaceId, uint16_t methodId,
+                              kj::Own<CallContextHook>&& context) override {
+    // The params belong to someone else's message here, so they have to be copied.
+    auto params = context->getParams();
+    auto request = newCall(interfaceId, methodId, params.targetSize());
+    request.set(params);
+    context->releaseParams();
+    return context->directTailCall(RequestHook::from(kj::mv(request)));
+  }
+
+  kj::Maybe<ClientHook&> getResolved() override {
+    return nullptr;
+  }
+  kj::Maybe<kj::Promise<kj::Own<ClientHook>>> whenMoreResolved() override {
+    return nullptr;
+  }
+  kj::Own<ClientHook> addRef() override {
+    return kj::addRef(*this);
+  }
+  const void* getBrand() override {
+    return &BRAND;
+  }
+  kj::Maybe<int> getFd() override {
+    return nullptr;
+  }
+
+  static const uint BRAND;
+
+private:
+  kj::Own<const _::CrossThreadHome> home;
+};
+
+const uint CrossThreadClient::BRAND = 0;
+
+kj::Array<kj::Maybe<kj::Own<const _::CrossThreadHome>>> exportCaps(
+    BuilderCapabilityTable& capTable) {
+  return KJ_MAP(cap, capTable.getTable()) -> kj::Maybe<kj::Own<const _::CrossThreadHome>> {
+    KJ_IF_MAYBE(c, cap) {
+      if (c->get()->getBrand() == &CrossThreadClient::BRAND) {
+        // Already hosted on some thread; pass its home along rather than wrapping it again.
+        return kj::atomicAddRef(kj::downcast<CrossThreadClient>(**c).getHome());
+      } else {
+        return kj::atomicRefcounted<_::CrossThreadHome>(c->get()->addRef());
+      }
+    } else {
+      return nullptr;
+    }
+  };
+}
+
+kj::Array<kj::Maybe<kj::Own<ClientHook>>> importCaps(
+    kj::Array<kj::Maybe<kj::Own<const _::CrossThreadHome>>> caps) {
+  return KJ_MAP(cap, caps) -> kj::Maybe<kj::Own<ClientHook>> {
+    KJ_IF_MAYBE(c, cap) {
+      return c->get()->getClient();
+    } else {
+      return nullptr;
+    }
+  };
+}
+
+}  // namespace
+
+namespace _ {  // private
+
+kj::Own<ClientHook> CrossThreadHome::getClient() const {
+  if (executor.get() == &kj::getCurrentThreadExecutor()) {
+    // Back on the home thread, so there's no need to go through the executor.
+    KJ_IF_MAYBE(h, hook) {
+      return h->get()->addRef();
+    } else {
+      return newBrokenCap(KJ_EXCEPTION(DISCONNECTED, "CrossThreadCapability was destroyed"));
+    }
+  } else {
+    return kj::refcounted<CrossThreadClient>(kj::atomicAddRef(*this));
+  }
+}
+
+}  // namespace _
+
+CrossThreadCapability::CrossThreadCapability(Capability::Client cap)
+    : home(kj::atomicRefcounted<_::CrossThreadHome>(ClientHook::from(kj::mv(cap)))) {}
+
+CrossThreadCapability::~CrossThreadCapability() noexcept(false) {
+  home->disconnect();
+}
+
+Capability::Client CrossThreadCapability::getClient() const {
+  return Capability::Client(home->getClient());
+}
+
+}  // namespace capnp
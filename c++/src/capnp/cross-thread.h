@@ -0,0 +1,71 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+// Calling a capability hosted on another thread's event loop.
+//
+// The usual way to talk to an object living on another thread is to connect the two threads with
+// a socketpair and a TwoPartyVatNetwork. That works for any capability, but every call pays to
+// serialize its params and results into the stream and parse them back out on the other side.
+// Threads in the same process already share an address space, so when both ends are in-process we
+// can instead hand the message itself across: the caller builds its params into a
+// MallocMessageBuilder, ownership of that builder moves to the home thread via
+// kj::Executor::executeAsync(), and the results builder comes back the same way. Neither message
+// is copied.
+
+#include "capability.h"
+
+namespace capnp {
+
+namespace _ {  // private
+class CrossThreadHome;
+}  // namespace _
+
+class CrossThreadCapability {
+  // Makes `cap` callable from other threads' event loops.
+  //
+  // Construct on the thread whose event loop hosts `cap` (the "home" thread); any other thread
+  // with an event loop may then call getClient() and make calls through the result. Calls are run
+  // on the home thread, in the order they were sent from each calling thread.
+  //
+  // Capabilities in params and results are passed across too: each one stays on the thread that
+  // put it in the message, and calls on it from the receiving thread are sent back there the same
+  // way. A capability is released on its own thread once the receiving thread drops it, which
+  // requires that thread's event loop to still be running. Calls on a pipelined result are queued
+  // on the calling thread until the response arrives, so pipelining saves no round trips to the
+  // home thread, but it does work.
+  //
+  // Must be destroyed on the home thread. Afterwards, calls through clients obtained from
+  // getClient() fail with DISCONNECTED, as do calls made once the home event loop has exited.
+
+public:
+  explicit CrossThreadCapability(Capability::Client cap);
+  KJ_DISALLOW_COPY(CrossThreadCapability);
+  ~CrossThreadCapability() noexcept(false);
+
+  Capability::Client getClient() const;
+  // Get a client usable on the calling thread. Thread-safe. Use castAs<T>() to get a typed client.
+
+private:
+  kj::Own<const _::CrossThreadHome> home;
+};
+
+}  // namespace capnp
@@ -492,6 +492,90 @@ TEST(DynamicApi, BuilderAssign) {
   listValue.set(0, 123);
 }
 
+TEST(DynamicApi, ReadColumns) {
+  MallocMessageBuilder builder;
+  auto orphan = builder.getOrphanage().newOrphan<List<TestDefaults>>(100);
+  auto list = orphan.get();
+  for (uint i = 1; i < list.size(); i += 2) {
+    list[i].setBoolField(false);
+    list[i].setInt32Field(i);
+    list[i].setUInt64Field(i * 3);
+    list[i].setFloat32Field(i * 0.5f);
+    list[i].setEnumField(TestEnum::FOO);
+  }
+  auto reader = list.asReader();
+
+  auto schema = Schema::from<TestDefaults>();
+  DynamicList::Reader dynamic = reader;
+  auto bools = dynamic.getColumn<bool>(schema.getFieldByName("boolField"));
+  auto int32s = dynamic.getColumn<int32_t>(schema.getFieldByName("int32Field"));
+  auto uint64s = dynamic.getColumn<uint64_t>(schema.getFieldByName("uInt64Field"));
+  auto floats = dynamic.getColumn<float>(schema.getFieldByName("float32Field"));
+  auto enums = dynamic.getColumn<uint16_t>(schema.getFieldByName("enumField"));
+
+  for (uint i = 0; i < reader.size(); i++) {
+    auto element = reader[i];
+    EXPECT_EQ(element.getBoolField(), bools[i]);
+    EXPECT_EQ(element.getInt32Field(), int32s[i]);
+    EXPECT_EQ(element.getUInt64Field(), uint64s[i]);
+    EXPECT_EQ(element.getFloat32Field(), floats[i]);
+    EXPECT_EQ(static_cast<uint16_t>(element.getEnumField()), enums[i]);
+  }
+  EXPECT_EQ(-12345678, int32s[0]);
+  EXPECT_EQ(1, int32s[1]);
+
+  EXPECT_ANY_THROW(dynamic.getColumn<int64_t>(schema.getFieldByName("int32Field")));
+  EXPECT_ANY_THROW(dynamic.getColumn<int32_t>(
+      Schema::from<TestAllTypes>().getFieldByName("int32Field")));
+}
+
+TEST(DynamicApi, ReadColumnsOfGroups) {
+  MallocMessageBuilder builder;
+  auto list = builder.initRoot<AnyPointer>().initAs<List<test::TestInterleavedGroups>>(10);
+  for (uint i = 0; i < list.size(); i++) {
+    list[i].getGroup1().setFoo(i);
+    list[i].getGroup1().setQux(i + 100);
+  }
+  DynamicList::Reader dynamic = list.asReader();
+
+  auto group1 = Schema::from<test::TestInterleavedGroups>()
+      .getFieldByName("group1").getType().asStruct();
+  auto foos = dynamic.getColumn<uint32_t>(group1.getFieldByName("foo"));
+  for (uint i = 0; i < list.size(); i++) {
+    EXPECT_EQ(i, foos[i]);
+  }
+
+  // Union members, directly or through a group, aren't set in every element.
+  EXPECT_ANY_THROW(dynamic.getColumn<uint16_t>(group1.getFieldByName("qux")));
+  auto corge = group1.getFieldByName("corge").getType().asStruct();
+  EXPECT_ANY_THROW(dynamic.getColumn<uint64_t>(corge.getFieldByName("grault")));
+
+  // A group of some other struct.
+  auto foo = Schema::from<test::TestGroups>().getFieldByName("groups").getType().asStruct()
+      .getFieldByName("foo").getType().asStruct();
+  EXPECT_ANY_THROW(dynamic.getColumn<int32_t>(foo.getFieldByName("corge")));
+}
+
+TEST(DynamicApi, ReadColumnsFromOldVersion) {
+  // Fields past the end of the elements' data section read as their defaults.
+  MallocMessageBuilder builder;
+  auto root = builder.getRoot<AnyPointer>();
+  auto list = root.initAs<List<test::TestOldVersion>>(10);
+  for (uint i = 0; i < list.size(); i++) {
+    list[i].setOld1(i);
+  }
+
+  auto newList = root.asReader().getAs<List<test::TestNewVersion>>();
+  DynamicList::Reader dynamic = newList;
+  auto schema = Schema::from<test::TestNewVersion>();
+  auto old1 = dynamic.getColumn<int64_t>(schema.getFieldByName("old1"));
+  auto new1 = dynamic.getColumn<int64_t>(schema.getFieldByName("new1"));
+  for (uint i = 0; i < list.size(); i++) {
+    EXPECT_EQ(i, old1[i]);
+    EXPECT_EQ(987, new1[i]);
+  }
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
@@ -1036,6 +1036,93 @@ void DynamicStruct::Builder::clear(kj::StringPtr name) {
 
 // =======================================================================================
 
+namespace {
+
+bool findGroup(StructSchema scope, StructSchema group, bool& inUnion) {
+  // Returns whether `group` is `scope` or one of its (possibly nested) groups. If so, sets
+  // `inUnion` if any group on the way is a union member.
+
+  if (scope == group) return true;
+
+  for (auto field: scope.getFields()) {
+    auto proto = field.getProto();
+    if (proto.isGroup() && findGroup(field.getType().asStruct(), group, inUnion)) {
+      inUnion = inUnion || hasDiscriminantValue(proto);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+}  // namespace
+
+template <typename T>
+void DynamicList::Reader::getColumn(StructSchema::Field field, kj::ArrayPtr<T> output) const {
+  KJ_REQUIRE(schema.whichElementType() == schema::Type::STRUCT,
+             "getColumn() is only valid for lists of structs.");
+  KJ_REQUIRE(output.size() == size(), "Output has the wrong size.");
+
+  auto proto = field.getProto();
+  bool inUnion = hasDiscriminantValue(proto);
+  KJ_REQUIRE(findGroup(schema.getStructElementType(), field.getContainingStruct(), inUnion),
+             "`field` is not a field of this list's element type.");
+  KJ_REQUIRE(!inUnion,
+             "Can't read a union member as a column, since it's only meaningful in elements "
+             "where it is set.");
+  KJ_REQUIRE(proto.isSlot(), "Can't read a group as a column.");
+  auto slot = proto.getSlot();
+  auto dval = slot.getDefaultValue();
+
+  auto type = field.getType();
+  auto which = type.which() == schema::Type::ENUM ? schema::Type::UINT16 : type.which();
+  KJ_REQUIRE(which == Type::from<T>().which(), "Type mismatch when reading column.");
+
+  T typedDval;
+  switch (type.which()) {
+#define HANDLE_TYPE(discrim, titleCase) \
+    case schema::Type::discrim: \
+      typedDval = static_cast<T>(dval.get##titleCase()); \
+      break;
+
+    HANDLE_TYPE(BOOL, Bool)
+    HANDLE_TYPE(INT8, Int8)
+    HANDLE_TYPE(INT16, Int16)
+    HANDLE_TYPE(INT32, Int32)
+    HANDLE_TYPE(INT64, Int64)
+    HANDLE_TYPE(UINT8, Uint8)
+    HANDLE_TYPE(UINT16, Uint16)
+    HANDLE_TYPE(UINT32, Uint32)
+    HANDLE_TYPE(UINT64, Uint64)
+    HANDLE_TYPE(FLOAT32, Float32)
+    HANDLE_TYPE(FLOAT64, Float64)
+    HANDLE_TYPE(ENUM, Enum)
+#undef HANDLE_TYPE
+
+    default:
+      KJ_UNREACHABLE;
+  }
+
+  reader.getDataFieldColumn<T>(assumeDataOffset(slot.getOffset()),
+                               _::mask<T>(typedDval, 0), output);
+}
+
+#define INSTANTIATE(type) \
+  template void DynamicList::Reader::getColumn<type>( \
+      StructSchema::Field field, kj::ArrayPtr<type> output) const
+INSTANTIATE(bool);
+INSTANTIATE(int8_t);
+INSTANTIATE(int16_t);
+INSTANTIATE(int32_t);
+INSTANTIATE(int64_t);
+INSTANTIATE(uint8_t);
+INSTANTIATE(uint16_t);
+INSTANTIATE(uint32_t);
+INSTANTIATE(uint64_t);
+INSTANTIATE(float);
+INSTANTIATE(double);
+#undef INSTANTIATE
+
 DynamicValue::Reader DynamicList::Reader::operator[](uint index) const {
   KJ_REQUIRE(index < size(), "List index out-of-bounds.");
 
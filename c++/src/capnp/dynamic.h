@@ -396,6 +396,24 @@ public:
   inline Iterator begin() const { return Iterator(this, 0); }
   inline Iterator end() const { return Iterator(this, size()); }
 
+  template <typename T>
+  void getColumn(StructSchema::Field field, kj::ArrayPtr<T> output) const;
+  template <typename T>
+  inline kj::Array<T> getColumn(StructSchema::Field field) const {
+    auto result = kj::heapArray<T>(size());
+    getColumn<T>(field, result);
+    return result;
+  }
+  // For a list of structs, reads the given field of every element, much faster than reading
+  // each element separately since the field's bounds are checked once per list rather than once
+  // per element. `field` must be a primitive or enum field of the element type (or of one of its
+  // groups), and T must be the field's C++ type, with uint16_t used for enums. Union members
+  // (and fields of groups that are union members) can't be read this way. `output` must have
+  // exactly size() elements.
+  //
+  // Typed lists have List<T>::Reader::getDataColumn(), which takes a column the generated code
+  // declares for the field and needs no reflection.
+
 private:
   ListSchema schema;
   _::ListReader reader;
@@ -1968,6 +1968,58 @@ KJ_TEST("list.setWithCaveats(i, list[i]) doesn't corrupt contents") {
   checkTestMessage(list[1]);
 }
 
+KJ_TEST("List<T>::Reader::getDataColumn() reads a field of every element") {
+  MallocMessageBuilder builder;
+  auto list = builder.initRoot<AnyPointer>().initAs<List<TestDefaults>>(100);
+  for (uint i = 1; i < list.size(); i += 2) {
+    list[i].setBoolField(false);
+    list[i].setInt32Field(i);
+    list[i].setUInt64Field(i * 3);
+    list[i].setFloat32Field(i * 0.5f);
+    list[i].setFloat64Field(i * 0.25);
+    list[i].setEnumField(TestEnum::FOO);
+  }
+  auto reader = list.asReader();
+
+  auto bools = reader.getDataColumn(TestDefaults::boolFieldColumn());
+  auto int32s = reader.getDataColumn(TestDefaults::int32FieldColumn());
+  auto uint64s = reader.getDataColumn(TestDefaults::uInt64FieldColumn());
+  auto floats = reader.getDataColumn(TestDefaults::float32FieldColumn());
+  auto doubles = reader.getDataColumn(TestDefaults::float64FieldColumn());
+  kj::Array<TestEnum> enums = reader.getDataColumn(TestDefaults::enumFieldColumn());
+
+  for (uint i = 0; i < reader.size(); i++) {
+    auto element = reader[i];
+    KJ_EXPECT(element.getBoolField() == bools[i]);
+    KJ_EXPECT(element.getInt32Field() == int32s[i]);
+    KJ_EXPECT(element.getUInt64Field() == uint64s[i]);
+    KJ_EXPECT(element.getFloat32Field() == floats[i]);
+    KJ_EXPECT(element.getFloat64Field() == doubles[i]);
+    KJ_EXPECT(element.getEnumField() == enums[i]);
+  }
+  KJ_EXPECT(int32s[0] == -12345678);
+  KJ_EXPECT(int32s[1] == 1);
+  KJ_EXPECT(enums[0] == TestEnum::CORGE);
+  KJ_EXPECT(enums[1] == TestEnum::FOO);
+}
+
+KJ_TEST("List<T>::Reader::getDataColumn() reads defaults past an old element's data section") {
+  MallocMessageBuilder builder;
+  auto root = builder.getRoot<AnyPointer>();
+  auto list = root.initAs<List<test::TestOldVersion>>(10);
+  for (uint i = 0; i < list.size(); i++) {
+    list[i].setOld1(i);
+  }
+
+  auto newList = root.asReader().getAs<List<test::TestNewVersion>>();
+  auto old1 = newList.getDataColumn(test::TestNewVersion::old1Column());
+  auto new1 = newList.getDataColumn(test::TestNewVersion::new1Column());
+  for (uint i = 0; i < list.size(); i++) {
+    KJ_EXPECT(old1[i] == i);
+    KJ_EXPECT(new1[i] == 987);
+  }
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
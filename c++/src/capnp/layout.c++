@@ -22,6 +22,9 @@
 #define CAPNP_PRIVATE
 #include "layout.h"
 #include <kj/debug.h>
+#include <kj/io.h>
+#include <kj/thread.h>
+#include <kj/mutex.h>
 #include "arena.h"
 #include <string.h>
 #include <stdlib.h>
@@ -2755,6 +2758,24 @@ kj::Maybe<Arena&> PointerReader::getArena() const {
   return segment == nullptr ? nullptr : segment->getArena();
 }
 
+bool PointerReader::containsBytes(kj::ArrayPtr<const byte> bytes) const {
+  if (segment == nullptr) return false;
+
+  Arena* arena = segment->getArena();
+  uintptr_t begin = reinterpret_cast<uintptr_t>(bytes.begin());
+  uintptr_t end = reinterpret_cast<uintptr_t>(bytes.end());
+  for (uint id = 0;; id++) {
+    SegmentReader* s = arena->tryGetSegment(SegmentId(id));
+    if (s == nullptr) return false;
+
+    auto words = s->getArray();
+    if (begin >= reinterpret_cast<uintptr_t>(words.begin()) &&
+        end <= reinterpret_cast<uintptr_t>(words.end())) {
+      return true;
+    }
+  }
+}
+
 CapTableReader* PointerReader::getCapTable() {
   return capTable;
 }
@@ -2970,6 +2991,800 @@ kj::Array<word> StructReader::canonicalize() {
   return trunc;
 }
 
+// -------------------------------------------------------------------
+
+namespace {
+
+class CanonicalWriter {
+  // Implements StructReader::writeCanonical().
+  //
+  // Canonical form lays objects out in preorder, so each pointer's offset depends on the total
+  // size of everything reachable from the pointers before it.  measure() walks the message once
+  // and records, for each non-null pointer, the canonical size of its target's subtree and the
+  // upper half of the pointer word.  The records for one object's pointers are reserved together
+  // when the object is reached, which is exactly the order in which write() consumes them on its
+  // own walk.
+
+public:
+  explicit CanonicalWriter(kj::OutputStream& output): output(output) {}
+
+  void write(const StructReader& root) {
+    Object object = measureStruct(root);
+    uint64_t words = measure(object);
+    KJ_REQUIRE(words < (1u << SEGMENT_WORD_COUNT_BITS), "Message is too large to canonicalize.");
+
+    // The root pointer, followed by everything else.
+    target = POINTER_SIZE_IN_WORDS / WORDS;
+    writePointer(PointerType::STRUCT, Record { static_cast<uint32_t>(words), object.upper });
+    writeObject(kj::mv(object));
+
+    while (!stack.empty()) {
+      Frame& frame = stack.back();
+      PointerReader pointer;
+      PointerType type = nextPointer(frame, pointer);
+      if (type == PointerType::NULL_) {
+        stack.removeLast();
+      } else {
+        writeObject(readObject(type, pointer, records[frame.nextRecord++]));
+      }
+    }
+
+    KJ_ASSERT(nextRecord == records.size());
+    output.flush();
+  }
+
+private:
+  struct Record {
+    uint32_t words;
+    // Words occupied by the pointer's target and everything reachable from it.  For the tag of
+    // an INLINE_COMPOSITE list, the element count instead.
+
+    uint32_t upper;
+    // Upper half of the pointer (or of the list tag).
+  };
+
+  struct Object {
+    // A struct or list along with its canonical shape.
+
+    StructReader structValue;
+    ListReader listValue = ListReader(ElementSize::VOID);
+    bool isList = false;
+
+    uint elementCount = 1;
+    uint dataWords = 0;           // Canonical data section size of the struct (or each element).
+    uint pointersPerElement = 0;  // Canonical pointer section size of the struct (or each element).
+
+    uint64_t ownWords = 0;  // Canonical size of this object alone, including any list tag.
+    uint32_t upper = 0;     // Upper half of the canonical pointer to this object.
+
+    PointerReader getPointer(uint index) const {
+      if (!isList) {
+        return structValue.getPointerField(assumePointerOffset(index));
+      } else if (listValue.getElementSize() == ElementSize::POINTER) {
+        return listValue.getPointerElement(bounded(index) * ELEMENTS);
+      } else {
+        return listValue.getStructElement(bounded(index / pointersPerElement) * ELEMENTS)
+            .getPointerField(assumePointerOffset(index % pointersPerElement));
+      }
+    }
+  };
+
+  struct Frame {
+    Object object;
+    uint nextPointer = 0;   // Next pointer to visit, counting across all elements.
+    size_t nextRecord = 0;  // Record describing the next non-null pointer.
+    size_t record = 0;      // measure() only: the record describing this object.
+    uint64_t words = 0;     // measure() only: words in this subtree found so far.
+  };
+
+  kj::BufferedOutputStreamWrapper output;
+  kj::Vector<Record> records;
+  kj::Vector<Frame> stack;
+  size_t nextRecord = 0;  // write() only: the next record to consume.
+  uint64_t position = 0;  // write() only: words written so far.
+  uint64_t target = 0;    // write() only: where the next non-empty pointer target goes.
+
+  // ---------------------------------------------------------------
+  // shapes
+
+  static uint canonicalDataWords(const StructReader& value) {
+    if (value.getDataSectionSize() == ONE * BITS) {
+      // A struct read from a bit list.
+      return value.getDataField<bool>(ZERO * ELEMENTS) ? 1 : 0;
+    }
+    auto data = value.getDataSectionAsBlob();
+    auto end = data.end();
+    while (end > data.begin() && end[-1] == 0) --end;
+    return (end - data.begin() + sizeof(word) - 1) / sizeof(word);
+  }
+
+  static uint canonicalPointerCount(const StructReader& value) {
+    uint count = unbound(value.getPointerSectionSize() / POINTERS);
+    while (count > 0 && value.getPointerField(assumePointerOffset(count - 1)).isNull()) --count;
+    return count;
+  }
+
+  static Object structObject(const StructReader& value, uint dataWords, uint pointerCount) {
+    Object result;
+    result.structValue = value;
+    result.dataWords = dataWords;
+    result.pointersPerElement = pointerCount;
+    result.ownWords = dataWords + pointerCount;
+    result.upper = dataWords | (pointerCount << 16);
+    return result;
+  }
+
+  static Object listObject(const ListReader& value, uint dataWords, uint pointerCount) {
+    // `dataWords` and `pointerCount` are the canonical element shape of an INLINE_COMPOSITE
+    // list, and are ignored otherwise.
+
+    Object result;
+    result.listValue = value;
+    result.isList = true;
+    result.elementCount = unbound(value.size() / ELEMENTS);
+
+    ElementSize elementSize = value.getElementSize();
+    uint64_t contentWords;
+    switch (elementSize) {
+      case ElementSize::INLINE_COMPOSITE:
+        result.dataWords = dataWords;
+        result.pointersPerElement = pointerCount;
+        contentWords = uint64_t(result.elementCount) * (dataWords + pointerCount);
+        result.ownWords = contentWords + POINTER_SIZE_IN_WORDS / WORDS;
+        result.upper = (contentWords << 3) | static_cast<uint>(elementSize);
+        return result;
+      case ElementSize::POINTER:
+        result.pointersPerElement = 1;
+        result.ownWords = result.elementCount;
+        break;
+      default:
+        result.ownWords = (value.asRawBytes().size() + sizeof(word) - 1) / sizeof(word);
+        break;
+    }
+    result.upper = (result.elementCount << 3) | static_cast<uint>(elementSize);
+    return result;
+  }
+
+  static Object measureStruct(const StructReader& value) {
+    return structObject(value, canonicalDataWords(value), canonicalPointerCount(value));
+  }
+
+  static Object measureList(const ListReader& value) {
+    uint dataWords = 0;
+    uint pointerCount = 0;
+    if (value.getElementSize() == ElementSize::INLINE_COMPOSITE) {
+      // Elements are sized to fit the largest one.
+      for (auto i: kj::zeroTo(value.size())) {
+        auto element = value.getStructElement(i);
+        dataWords = kj::max(dataWords, canonicalDataWords(element));
+        pointerCount = kj::max(pointerCount, canonicalPointerCount(element));
+      }
+    }
+    return listObject(value, dataWords, pointerCount);
+  }
+
+  Object readObject(PointerType type, const PointerReader& pointer, Record record) {
+    // Reads a pointer's target using the shape found by measure().
+
+    if (type == PointerType::STRUCT) {
+      return structObject(pointer.getStruct(nullptr), record.upper & 0xffff, record.upper >> 16);
+    }
+
+    auto list = pointer.getListAnySize(nullptr);
+    if (list.getElementSize() == ElementSize::INLINE_COMPOSITE) {
+      // The tag is the first record of the list's own block, which write() is about to reach.
+      Record tag = records[nextRecord];
+      return listObject(list, tag.upper & 0xffff, tag.upper >> 16);
+    } else {
+      return listObject(list, 0, 0);
+    }
+  }
+
+  static PointerType nextPointer(Frame& frame, PointerReader& pointer) {
+    // Advances `frame` past its next non-null pointer, returning the pointer's type, or NULL_ if
+    // there are no more.
+
+    uint pointerCount = frame.object.elementCount * frame.object.pointersPerElement;
+    while (frame.nextPointer < pointerCount) {
+      pointer = frame.object.getPointer(frame.nextPointer++);
+      PointerType type = checkedPointerType(pointer);
+      if (type != PointerType::NULL_) return type;
+    }
+    return PointerType::NULL_;
+  }
+
+  static PointerType checkedPointerType(const PointerReader& pointer) {
+    PointerType type = pointer.getPointerType();
+    if (type == PointerType::CAPABILITY) {
+      KJ_FAIL_REQUIRE("Cannot create a canonical message with a capability") {
+        return PointerType::NULL_;
+      }
+    }
+    return type;
+  }
+
+  // ---------------------------------------------------------------
+  // first pass
+
+  void beginMeasuring(Object&& object, size_t record) {
+    Frame frame;
+    frame.record = record;
+    frame.words = object.ownWords;
+
+    if (object.isList && object.listValue.getElementSize() == ElementSize::INLINE_COMPOSITE) {
+      // The list's tag.
+      records.add(Record { object.elementCount,
+                           object.dataWords | (object.pointersPerElement << 16) });
+    }
+
+    // Reserve a record for each non-null pointer.
+    frame.nextRecord = records.size();
+    uint pointerCount = object.elementCount * object.pointersPerElement;
+    for (uint i = 0; i < pointerCount; i++) {
+      if (checkedPointerType(object.getPointer(i)) != PointerType::NULL_) {
+        records.add(Record { 0, 0 });
+      }
+    }
+
+    frame.object = kj::mv(object);
+    stack.add(kj::mv(frame));
+  }
+
+  uint64_t measure(const Object& root) {
+    // Fills in `records` and returns the canonical size of everything `root` points to,
+    // including itself.
+
+    beginMeasuring(kj::cp(root), 0);
+
+    for (;;) {
+      Frame& frame = stack.back();
+      PointerReader pointer;
+      PointerType type = nextPointer(frame, pointer);
+
+      if (type == PointerType::STRUCT) {
+        beginMeasuring(measureStruct(pointer.getStruct(nullptr)), frame.nextRecord++);
+      } else if (type == PointerType::LIST) {
+        beginMeasuring(measureList(pointer.getListAnySize(nullptr)), frame.nextRecord++);
+      } else {
+        // All pointers visited.
+        uint64_t words = frame.words;
+        if (stack.size() == 1) {
+          stack.clear();
+          return words;
+        }
+        KJ_REQUIRE(words < (1u << SEGMENT_WORD_COUNT_BITS),
+                   "Message is too large to canonicalize.");
+        records[frame.record] = Record { static_cast<uint32_t>(words), frame.object.upper };
+        stack.removeLast();
+        stack.back().words += words;
+      }
+    }
+  }
+
+  // ---------------------------------------------------------------
+  // second pass
+
+  void writeZeros(size_t size) {
+    static constexpr byte ZEROS[sizeof(word)] = {};
+    while (size > 0) {
+      size_t n = kj::min(size, sizeof(ZEROS));
+      output.write(ZEROS, n);
+      size -= n;
+    }
+  }
+
+  void writeWord(uint32_t lower, uint32_t upper) {
+    WireValue<uint32_t> halves[2];
+    halves[0].set(lower);
+    halves[1].set(upper);
+    output.write(halves, sizeof(halves));
+    ++position;
+  }
+
+  void writeData(const StructReader& value, uint dataWords) {
+    size_t size = dataWords * sizeof(word);
+    if (value.getDataSectionSize() == ONE * BITS) {
+      if (dataWords > 0) {
+        byte bit = 1;
+        output.write(&bit, 1);
+        writeZeros(size - 1);
+      }
+    } else {
+      // Bytes past the canonical data section are zero anyway, so copying the whole word
+      // containing the last non-zero byte is fine.
+      auto data = value.getDataSectionAsBlob();
+      size_t copied = kj::min(data.size(), size);
+      output.write(data.begin(), copied);
+      writeZeros(size - copied);
+    }
+    position += dataWords;
+  }
+
+  void writePointer(PointerType type, Record record) {
+    if (type == PointerType::NULL_) {
+      writeWord(0, 0);
+    } else if (type == PointerType::STRUCT && record.words == 0) {
+      // Zero-sized structs point just before themselves rather than occupying space.
+      writeWord(0xfffffffcu, 0);
+    } else {
+      uint32_t offset = target - position - 1;
+      uint32_t kind = type == PointerType::STRUCT ? 0 : 1;
+      target += record.words;
+      writeWord((offset << 2) | kind, record.upper);
+    }
+  }
+
+  void writePointers(const Object& object, uint begin, uint end) {
+    for (uint i = begin; i < end; i++) {
+      PointerType type = checkedPointerType(object.getPointer(i));
+      writePointer(type, type == PointerType::NULL_ ? Record { 0, 0 } : records[nextRecord++]);
+    }
+  }
+
+  void writeObject(Object&& object) {
+    // Writes the object itself, then pushes a frame to write its children.
+
+    target = position + object.ownWords;
+    Frame frame;
+
+    if (!object.isList) {
+      frame.nextRecord = nextRecord;
+      writeData(object.structValue, object.dataWords);
+      writePointers(object, 0, object.pointersPerElement);
+    } else switch (object.listValue.getElementSize()) {
+      case ElementSize::INLINE_COMPOSITE: {
+        Record tag = records[nextRecord++];
+        writeWord(tag.words << 2, tag.upper);
+        frame.nextRecord = nextRecord;
+        for (uint i = 0; i < object.elementCount; i++) {
+          writeData(object.listValue.getStructElement(bounded(i) * ELEMENTS), object.dataWords);
+          writePointers(object, i * object.pointersPerElement,
+                        (i + 1) * object.pointersPerElement);
+        }
+        break;
+      }
+
+      case ElementSize::POINTER:
+        frame.nextRecord = nextRecord;
+        writePointers(object, 0, object.elementCount);
+        break;
+
+      default: {
+        auto bytes = object.listValue.asRawBytes();
+        uint leftoverBits = object.elementCount % 8;
+        if (object.listValue.getElementSize() == ElementSize::BIT && leftoverBits > 0) {
+          // Clear the unused bits of the last byte.
+          output.write(bytes.begin(), bytes.size() - 1);
+          byte last = bytes.back() & ((1u << leftoverBits) - 1);
+          output.write(&last, 1);
+        } else {
+          output.write(bytes.begin(), bytes.size());
+        }
+        writeZeros(object.ownWords * sizeof(word) - bytes.size());
+        position += object.ownWords;
+        break;
+      }
+    }
+
+    frame.object = kj::mv(object);
+    stack.add(kj::mv(frame));
+  }
+};
+
+}  // namespace
+
+void StructReader::writeCanonical(kj::OutputStream& output) const {
+  CanonicalWriter(output).write(*this);
+}
+
+// -------------------------------------------------------------------
+
+namespace {
+
+class ParallelCopyWorkers {
+  // Threads which copy the ranges of long lists for StructReader::copyParallel().  They're started
+  // once per copy and serve every long list, in both the measuring and the copying pass: the
+  // thread walking the message queues a list's ranges, the workers take them one at a time, and
+  // the walking thread waits for the last to finish.
+
+public:
+  explicit ParallelCopyWorkers(uint threadCount): threads(threadCount) {
+    for (uint i = 0; i < threadCount; i++) {
+      threads.add(kj::heap<kj::Thread>([this]() { work(); }));
+    }
+  }
+
+  ~ParallelCopyWorkers() noexcept(false) {
+    state.lockExclusive()->shuttingDown = true;
+    threads.clear();  // Joins the threads.
+  }
+
+  uint size() const { return threads.size(); }
+
+  void run(uint count, kj::Function<void(uint)>& task) {
+    // Calls task(0) through task(count - 1) on the workers, and waits for them all to return.
+    // If any throws, one of the exceptions is rethrown here once the rest are done.
+
+    auto lock = state.lockExclusive();
+    lock->task = task;
+    lock->next = 0;
+    lock->count = count;
+    lock->finished = 0;
+    lock.wait([](const State& state) { return state.finished == state.count; });
+
+    lock->task = nullptr;
+    lock->count = 0;
+    KJ_IF_MAYBE(e, lock->exception) {
+      auto exception = kj::mv(*e);
+      lock->exception = nullptr;
+      kj::throwFatalException(kj::mv(exception));
+    }
+  }
+
+private:
+  struct State {
+    kj::Maybe<kj::Function<void(uint)>&> task;
+    uint next = 0;      // Index of the next call for a worker to take.
+    uint count = 0;     // Number of calls in the current run().
+    uint finished = 0;  // Number of calls that have returned.
+    kj::Maybe<kj::Exception> exception;
+    bool shuttingDown = false;
+  };
+
+  kj::MutexGuarded<State> state;
+  kj::Vector<kj::Own<kj::Thread>> threads;
+
+  void work() {
+    for (;;) {
+      kj::Function<void(uint)>* task;
+      uint index;
+      {
+        auto lock = state.lockExclusive();
+        lock.wait([](const State& state) {
+          return state.shuttingDown || state.next < state.count;
+        });
+        if (lock->shuttingDown) return;
+        task = &KJ_ASSERT_NONNULL(lock->task);
+        index = lock->next++;
+      }
+
+      auto exception = kj::runCatchingExceptions([&]() { (*task)(index); });
+
+      auto lock = state.lockExclusive();
+      KJ_IF_MAYBE(e, exception) {
+        if (lock->exception == nullptr) lock->exception = kj::mv(*e);
+      }
+      ++lock->finished;
+    }
+  }
+};
+
+class ParallelCopier {
+  // Implements StructReader::copyParallel().
+  //
+  // Objects are laid out with a bump allocator over one flat buffer, so a copy is valid whatever
+  // order objects are placed in.  That lets the children of a long list be split into ranges
+  // that are copied on separate threads, each range into its own region of the buffer.  Region
+  // sizes have to be known first, so the whole walk runs twice: once to measure (with the long
+  // lists' ranges also measured in parallel), and once to copy.  Both runs visit objects in the
+  // same order, so the copy run can consume the measured range sizes as it reaches each list.
+  //
+  // Unlike WireHelpers::copyPointer(), the walk uses an explicit stack, and every word of the
+  // output is written exactly once, so the buffer needn't be zeroed first.
+
+public:
+  ParallelCopier(word* buffer, uint64_t position, ParallelCopyWorkers* workers,
+                 kj::Vector<uint64_t>* rangeWords)
+      : buffer(buffer), position(position), workers(workers), rangeWords(rangeWords) {}
+  // `buffer` is null when measuring.  `workers` copies the ranges of long lists, which aren't split
+  // at all if it's null.  `rangeWords` holds the sizes of those ranges, in the order they're
+  // reached; it's filled in when measuring and consumed when copying.  Ranges aren't split
+  // further, so within one, `workers` and `rangeWords` are null.
+
+  void copyRoot(const StructReader& root) {
+    copyStruct(root, 0);
+    finish();
+  }
+
+  void copyChildren(const ListReader& list, uint begin, uint end) {
+    // Copies everything the elements in [begin, end) point to.
+
+    uint pointerCount = elementPointerCount(list);
+    uint64_t stride = listDataWords + pointerCount;
+    for (uint i = begin; i < end; i++) {
+      for (uint j = 0; j < pointerCount; j++) {
+        PointerReader pointer = elementPointer(list, i, j);
+        if (!pointer.isNull()) {
+          stack.add(Pending { pointer, listStart + i * stride + listDataWords + j });
+        }
+      }
+    }
+    finish();
+  }
+
+  uint64_t getPosition() const { return position; }
+
+private:
+  struct Pending {
+    PointerReader pointer;
+    uint64_t slot;  // Where the pointer to the copy goes.  Meaningless when measuring.
+  };
+
+  word* buffer;
+  uint64_t position;
+  ParallelCopyWorkers* workers;
+  kj::Vector<uint64_t>* rangeWords;
+  size_t nextRange = 0;
+  kj::Vector<Pending> stack;
+
+  // For copyChildren(): where the list's content starts, and its elements' data section size.
+  uint64_t listStart = 0;
+  uint listDataWords = 0;
+
+  static constexpr uint MIN_ELEMENTS_PER_RANGE = 1024;
+  static constexpr uint BITS_PER_WORD_UINT = sizeof(word) * 8;
+
+  void finish() {
+    while (!stack.empty()) {
+      Pending pending = stack.back();
+      stack.removeLast();
+
+      switch (pending.pointer.getPointerType()) {
+        case PointerType::NULL_:
+          writeWord(pending.slot, 0, 0);
+          break;
+        case PointerType::STRUCT:
+          copyStruct(pending.pointer.getStruct(nullptr), pending.slot);
+          break;
+        case PointerType::LIST:
+          copyList(pending.pointer.getListAnySize(nullptr), pending.slot);
+          break;
+        case PointerType::CAPABILITY:
+          KJ_FAIL_REQUIRE("copyParallel() doesn't support capabilities.") {
+            writeWord(pending.slot, 0, 0);
+            break;
+          }
+      }
+    }
+  }
+
+  uint64_t allocate(uint64_t words) {
+    uint64_t result = position;
+    position += words;
+    return result;
+  }
+
+  void writeWord(uint64_t pos, uint32_t lower, uint32_t upper) {
+    if (buffer == nullptr) return;
+    auto halves = reinterpret_cast<WireValue<uint32_t>*>(buffer + pos);
+    halves[0].set(lower);
+    halves[1].set(upper);
+  }
+
+  void writePointer(uint64_t slot, uint64_t target, uint kind, uint32_t upper) {
+    uint32_t offset = target - slot - 1;
+    writeWord(slot, (offset << 2) | kind, upper);
+  }
+
+  void writeBytes(uint64_t pos, kj::ArrayPtr<const byte> bytes, uint64_t words) {
+    if (buffer == nullptr) return;
+    byte* dst = reinterpret_cast<byte*>(buffer + pos);
+    memcpy(dst, bytes.begin(), bytes.size());
+    memset(dst + bytes.size(), 0, words * sizeof(word) - bytes.size());
+  }
+
+  void writeData(uint64_t pos, const StructReader& value, uint dataWords) {
+    if (value.getDataSectionSize() == ONE * BITS) {
+      // A struct read from a bit list.
+      byte bit = value.getDataField<bool>(ZERO * ELEMENTS);
+      writeBytes(pos, kj::arrayPtr(&bit, 1), dataWords);
+    } else {
+      writeBytes(pos, value.getDataSectionAsBlob(), dataWords);
+    }
+  }
+
+  void addPointers(const StructReader& value, uint64_t pos) {
+    for (auto i: kj::zeroTo(value.getPointerSectionSize())) {
+      PointerReader pointer = value.getPointerField(i);
+      if (pointer.isNull()) {
+        writeWord(pos + unbound(i / POINTERS), 0, 0);
+      } else {
+        stack.add(Pending { pointer, pos + unbound(i / POINTERS) });
+      }
+    }
+  }
+
+  void copyStruct(const StructReader& value, uint64_t slot) {
+    uint dataWords = dataWordsFor(value.getDataSectionSize());
+    uint pointerCount = unbound(value.getPointerSectionSize() / POINTERS);
+    uint32_t upper = dataWords | (pointerCount << 16);
+
+    if (dataWords + pointerCount == 0) {
+      // Zero-sized structs point just before themselves rather than occupying space.
+      writeWord(slot, 0xfffffffcu, upper);
+      return;
+    }
+
+    uint64_t pos = allocate(dataWords + pointerCount);
+    writePointer(slot, pos, 0, upper);
+    writeData(pos, value, dataWords);
+    addPointers(value, pos + dataWords);
+  }
+
+  static uint dataWordsFor(StructDataBitCount dataSize) {
+    return (unbound(dataSize / BITS) + BITS_PER_WORD_UINT - 1) / BITS_PER_WORD_UINT;
+  }
+
+  static uint elementPointerCount(const ListReader& list) {
+    switch (list.getElementSize()) {
+      case ElementSize::POINTER:
+        return 1;
+      case ElementSize::INLINE_COMPOSITE:
+        return list.size() == ZERO * ELEMENTS ? 0 :
+            unbound(list.getStructElement(ZERO * ELEMENTS).getPointerSectionSize() / POINTERS);
+      default:
+        return 0;
+    }
+  }
+
+  static PointerReader elementPointer(const ListReader& list, uint index, uint pointer) {
+    if (list.getElementSize() == ElementSize::POINTER) {
+      return list.getPointerElement(bounded(index) * ELEMENTS);
+    } else {
+      return list.getStructElement(bounded(index) * ELEMENTS)
+          .getPointerField(assumePointerOffset(pointer));
+    }
+  }
+
+  void copyList(const ListReader& list, uint64_t slot) {
+    uint elementCount = unbound(list.size() / ELEMENTS);
+    ElementSize elementSize = list.getElementSize();
+
+    switch (elementSize) {
+      case ElementSize::INLINE_COMPOSITE: {
+        uint dataWords = 0;
+        uint pointerCount = 0;
+        if (elementCount > 0) {
+          auto first = list.getStructElement(ZERO * ELEMENTS);
+          dataWords = dataWordsFor(first.getDataSectionSize());
+          pointerCount = unbound(first.getPointerSectionSize() / POINTERS);
+        }
+        uint64_t contentWords = uint64_t(elementCount) * (dataWords + pointerCount);
+        uint64_t pos = allocate(contentWords + 1);
+        writePointer(slot, pos, 1, (contentWords << 3) | static_cast<uint>(elementSize));
+        writeWord(pos, elementCount << 2, dataWords | (pointerCount << 16));
+
+        bool split = beginSplit(elementCount, pointerCount);
+        uint64_t element = pos + 1;
+        for (uint i = 0; i < elementCount; i++) {
+          auto value = list.getStructElement(bounded(i) * ELEMENTS);
+          writeData(element, value, dataWords);
+          if (split) {
+            writeNullPointers(value, element + dataWords);
+          } else {
+            addPointers(value, element + dataWords);
+          }
+          element += dataWords + pointerCount;
+        }
+        if (split) copySplit(list, pos + 1, dataWords);
+        break;
+      }
+
+      case ElementSize::POINTER: {
+        uint64_t pos = allocate(elementCount);
+        writePointer(slot, pos, 1, (elementCount << 3) | static_cast<uint>(elementSize));
+
+        bool split = beginSplit(elementCount, 1);
+        for (uint i = 0; i < elementCount; i++) {
+          PointerReader pointer = list.getPointerElement(bounded(i) * ELEMENTS);
+          if (pointer.isNull()) {
+            writeWord(pos + i, 0, 0);
+          } else if (!split) {
+            stack.add(Pending { pointer, pos + i });
+          }
+        }
+        if (split) copySplit(list, pos, 0);
+        break;
+      }
+
+      default: {
+        auto bytes = list.asRawBytes();
+        uint64_t words = (bytes.size() + sizeof(word) - 1) / sizeof(word);
+        uint64_t pos = allocate(words);
+        writePointer(slot, pos, 1, (elementCount << 3) | static_cast<uint>(elementSize));
+
+        uint leftoverBits = elementCount % 8;
+        if (elementSize == ElementSize::BIT && leftoverBits > 0) {
+          // Don't copy whatever is in the unused bits of the last byte.
+          writeBytes(pos, bytes, words);
+          if (buffer != nullptr) {
+            reinterpret_cast<byte*>(buffer + pos)[bytes.size() - 1] &= (1u << leftoverBits) - 1;
+          }
+        } else {
+          writeBytes(pos, bytes, words);
+        }
+        break;
+      }
+    }
+  }
+
+  void writeNullPointers(const StructReader& value, uint64_t pos) {
+    for (auto i: kj::zeroTo(value.getPointerSectionSize())) {
+      if (value.getPointerField(i).isNull()) writeWord(pos + unbound(i / POINTERS), 0, 0);
+    }
+  }
+
+  uint rangeCount(uint elementCount) const {
+    if (workers == nullptr) return 1;
+    return kj::min(workers->size(), elementCount / MIN_ELEMENTS_PER_RANGE);
+  }
+
+  bool beginSplit(uint elementCount, uint pointerCount) const {
+    return rangeWords != nullptr && pointerCount > 0 && rangeCount(elementCount) > 1;
+  }
+
+  void copySplit(const ListReader& list, uint64_t start, uint dataWords) {
+    // Copies the children of `list`, whose content starts at `start`, on multiple threads.
+
+    uint elementCount = unbound(list.size() / ELEMENTS);
+    uint ranges = rangeCount(elementCount);
+
+    // When measuring, regions start at zero and we just record how far each range gets.
+    kj::Array<uint64_t> regions = kj::heapArray<uint64_t>(ranges);
+    if (buffer == nullptr) {
+      for (auto& region: regions) region = 0;
+    } else {
+      for (auto& region: regions) {
+        region = position;
+        position += (*rangeWords)[nextRange++];
+      }
+    }
+
+    kj::Array<uint64_t> ends = kj::heapArray<uint64_t>(ranges);
+    kj::Function<void(uint)> copyRange = [&](uint k) {
+      ParallelCopier copier(buffer, regions[k], nullptr, nullptr);
+      copier.listStart = start;
+      copier.listDataWords = dataWords;
+      copier.copyChildren(list, uint64_t(elementCount) * k / ranges,
+                          uint64_t(elementCount) * (k + 1) / ranges);
+      ends[k] = copier.getPosition();
+    };
+    workers->run(ranges, copyRange);
+
+    for (uint k = 0; k < ranges; k++) {
+      if (buffer == nullptr) {
+        rangeWords->add(ends[k]);
+        position += ends[k];
+      } else {
+        KJ_ASSERT(ends[k] == regions[k] + (*rangeWords)[nextRange - ranges + k],
+                  "Message changed while being copied.");
+      }
+    }
+  }
+};
+
+}  // namespace
+
+kj::Array<word> StructReader::copyParallel(uint threadCount) const {
+  KJ_REQUIRE(threadCount > 0);
+
+  // With one thread, no list is split, so there's no need for workers.
+  kj::Own<ParallelCopyWorkers> workers;
+  if (threadCount > 1) workers = kj::heap<ParallelCopyWorkers>(threadCount);
+
+  kj::Vector<uint64_t> rangeWords;
+  ParallelCopier measurer(nullptr, POINTER_SIZE_IN_WORDS / WORDS, workers.get(), &rangeWords);
+  measurer.copyRoot(*this);
+  uint64_t size = measurer.getPosition();
+  KJ_REQUIRE(size <= unbound(MAX_SEGMENT_WORDS / WORDS), "Message is too large to copy.");
+
+  auto result = kj::heapArray<word>(size);
+  ParallelCopier copier(result.begin(), POINTER_SIZE_IN_WORDS / WORDS, workers.get(), &rangeWords);
+  copier.copyRoot(*this);
+  KJ_ASSERT(copier.getPosition() == size);
+  return result;
+}
+
 CapTableReader* StructReader::getCapTable() {
   return capTable;
 }
@@ -3147,6 +3962,73 @@ StructReader ListReader::getStructElement(ElementCount index) const {
       nestingLimit - 1);
 }
 
+namespace {
+
+template <typename T>
+void readDataColumn(const byte* ptr, size_t strideBytes, size_t dataBits, size_t index,
+                    Mask<T> mask, kj::ArrayPtr<T> output) {
+  if ((index + 1) * sizeof(Mask<T>) * 8 <= dataBits) {
+    const byte* pos = ptr + index * sizeof(Mask<T>);
+    for (auto& value: output) {
+      value = unmask<T>(reinterpret_cast<const WireValue<Mask<T>>*>(pos)->get(), mask);
+      pos += strideBytes;
+    }
+  } else {
+    T defaultValue = unmask<T>(0, mask);
+    for (auto& value: output) value = defaultValue;
+  }
+}
+
+void readDataColumn(const byte* ptr, size_t strideBytes, size_t dataBits, size_t index,
+                    bool mask, kj::ArrayPtr<bool> output) {
+  if (index < dataBits) {
+    const byte* pos = ptr + index / 8;
+    uint shift = index % 8;
+    for (auto& value: output) {
+      value = (((*pos) >> shift) & 1) ^ mask;
+      pos += strideBytes;
+    }
+  } else {
+    for (auto& value: output) value = mask;
+  }
+}
+
+}  // namespace
+
+template <typename T>
+void ListReader::getDataFieldColumn(
+    StructDataOffset offset, Mask<T> mask, kj::ArrayPtr<T> output) const {
+  KJ_IREQUIRE(output.size() == unbound(elementCount / ELEMENTS));
+
+  KJ_REQUIRE(nestingLimit > 0,
+             "Message is too deeply-nested or contains cycles.  See capnp::ReaderOptions.") {
+    readDataColumn<T>(nullptr, 0, 0, 0, mask, output);
+    return;
+  }
+
+  size_t strideBits = unbound(step * (ONE * ELEMENTS) / BITS);
+  KJ_DASSERT(strideBits % 8 == 0);
+
+  readDataColumn(ptr, strideBits / 8, unbound(structDataSize / BITS),
+                 unbound(offset / ELEMENTS), mask, output);
+}
+
+#define INSTANTIATE(type) \
+  template void ListReader::getDataFieldColumn<type>( \
+      StructDataOffset offset, Mask<type> mask, kj::ArrayPtr<type> output) const
+INSTANTIATE(bool);
+INSTANTIATE(int8_t);
+INSTANTIATE(int16_t);
+INSTANTIATE(int32_t);
+INSTANTIATE(int64_t);
+INSTANTIATE(uint8_t);
+INSTANTIATE(uint16_t);
+INSTANTIATE(uint32_t);
+INSTANTIATE(uint64_t);
+INSTANTIATE(float);
+INSTANTIATE(double);
+#undef INSTANTIATE
+
 MessageSizeCounts ListReader::totalSize() const {
   // TODO(cleanup): This is kind of a lot of logic duplicated from WireHelpers::totalSize(), but
   //   it's unclear how to share it effectively.
@@ -3520,6 +4402,24 @@ OrphanBuilder OrphanBuilder::concat(
 }
 
 OrphanBuilder OrphanBuilder::referenceExternalData(BuilderArena* arena, Data::Reader data) {
+  return referenceExternalData(arena, data, nullptr);
+}
+
+OrphanBuilder OrphanBuilder::referenceExternalData(
+    BuilderArena* arena, kj::Array<const byte>&& data) {
+  if (reinterpret_cast<uintptr_t>(data.begin()) % sizeof(word) != 0 ||
+      data.size() % sizeof(word) != 0) {
+    // The bytes between the end of the array and the next word boundary would go out on the wire,
+    // but they aren't ours to read, let alone expose. Fall back to a copy.
+    return copy(arena, nullptr, data.asPtr());
+  }
+
+  Data::Reader reader = data;
+  return referenceExternalData(arena, reader, kj::mv(data));
+}
+
+OrphanBuilder OrphanBuilder::referenceExternalData(
+    BuilderArena* arena, Data::Reader data, kj::Maybe<kj::Array<const byte>> owner) {
   KJ_REQUIRE(reinterpret_cast<uintptr_t>(data.begin()) % sizeof(void*) == 0,
              "Cannot referenceExternalData() that is not aligned.");
 
@@ -3531,7 +4431,11 @@ OrphanBuilder OrphanBuilder::referenceExternalData(BuilderArena* arena, Data::Re
   OrphanBuilder result;
   result.tagAsPtr()->setKindForOrphan(WirePointer::LIST);
   result.tagAsPtr()->listRef.set(ElementSize::BYTE, checkedSize * ELEMENTS);
-  result.segment = arena->addExternalSegment(words);
+  KJ_IF_MAYBE(o, owner) {
+    result.segment = arena->addExternalSegment(words, kj::mv(*o));
+  } else {
+    result.segment = arena->addExternalSegment(words);
+  }
 
   // External data cannot possibly contain capabilities.
   result.capTable = nullptr;
@@ -56,6 +56,10 @@ CAPNP_BEGIN_HEADER
 // and blow away NaN payloads, because no one uses them anyway.
 #endif
 
+namespace kj {
+  class OutputStream;
+}
+
 namespace capnp {
 
 class ClientHook;
@@ -454,6 +458,10 @@ public:
   kj::Maybe<Arena&> getArena() const;
   // Get the arena containing this pointer.
 
+  bool containsBytes(kj::ArrayPtr<const byte> bytes) const;
+  // Returns whether `bytes` lies entirely within one segment of the message containing this
+  // pointer.
+
   CapTableReader* getCapTable();
   // Gets the capability context in which this object is operating.
 
@@ -595,6 +603,17 @@ public:
 
   kj::Array<word> canonicalize();
 
+  void writeCanonical(kj::OutputStream& output) const;
+  // Writes exactly the bytes canonicalize() would return to `output`, without building the
+  // canonical message.  Makes two passes over the message: the first records the canonical size
+  // of every object (one small record per pointer), which the second needs to compute pointer
+  // offsets while writing.  Both passes use an explicit stack, so deep nesting doesn't recurse.
+
+  kj::Array<word> copyParallel(uint threadCount) const;
+  // Returns a deep copy of this struct as a flat single-segment message (root pointer included),
+  // spreading the children of long struct and pointer lists across up to `threadCount` threads.
+  // The message must not contain capabilities.
+
   template <typename T>
   KJ_ALWAYS_INLINE(bool hasDataField(StructDataOffset offset) const);
   // Return true if the field is set to something other than its default value.
@@ -783,6 +802,13 @@ public:
 
   StructReader getStructElement(ElementCount index) const;
 
+  template <typename T>
+  void getDataFieldColumn(StructDataOffset offset, Mask<T> mask, kj::ArrayPtr<T> output) const;
+  // Equivalent to `output[i] = getStructElement(i).getDataField<T>(offset, mask)` for every
+  // element, but computes the field's bounds once for the whole list and then reads it with a
+  // fixed stride. `output` must have exactly size() elements. Instantiated for bool and the
+  // integer and floating-point types.
+
   MessageSizeCounts totalSize() const;
   // Like StructReader::totalSize(). Note that for struct lists, the size includes the list tag.
 
@@ -873,6 +899,7 @@ public:
                               kj::ArrayPtr<const ListReader> lists);
 
   static OrphanBuilder referenceExternalData(BuilderArena* arena, Data::Reader data);
+  static OrphanBuilder referenceExternalData(BuilderArena* arena, kj::Array<const byte>&& data);
 
   OrphanBuilder& operator=(const OrphanBuilder& other) = delete;
   inline OrphanBuilder& operator=(OrphanBuilder&& other);
@@ -916,6 +943,9 @@ public:
   // Versions of truncate() that know how to allocate a new list if needed.
 
 private:
+  static OrphanBuilder referenceExternalData(BuilderArena* arena, Data::Reader data,
+                                             kj::Maybe<kj::Array<const byte>> owner);
+
   static_assert(ONE * POINTERS * WORDS_PER_POINTER == ONE * WORDS,
                 "This struct assumes a pointer is one word.");
   word tag;
@@ -176,6 +176,48 @@ KJ_TEST("clone()") {
   checkTestMessage(*copy);
 }
 
+KJ_TEST("copyParallel()") {
+  MallocMessageBuilder builder;
+  initTestMessage(builder.getRoot<TestAllTypes>());
+  auto root = builder.getRoot<TestAllTypes>().asReader();
+
+  auto copy = copyParallel(root, 4);
+  KJ_EXPECT(copy.size() == root.totalSize().wordCount + 1);
+
+  kj::ArrayPtr<const word> segments[1] = {copy};
+  SegmentArrayMessageReader reader(segments);
+  checkTestMessage(reader.getRoot<TestAllTypes>());
+}
+
+KJ_TEST("copyParallel() splits long lists") {
+  // Small segments, so that the source is full of far pointers.
+  MallocMessageBuilder builder(64, AllocationStrategy::FIXED_SIZE);
+  auto root = builder.initRoot<TestAllTypes>();
+
+  auto structs = root.initStructList(5000);
+  for (uint i = 0; i < structs.size(); i += 3) {
+    structs[i].setUInt32Field(i);
+    structs[i].setTextField(kj::str("struct ", i));
+    if (i % 2 == 0) structs[i].initStructField().initInt32List(i % 7 + 1).set(0, 1);
+  }
+  auto texts = root.initTextList(3000);
+  for (uint i = 0; i < texts.size(); i += 2) {
+    texts.set(i, kj::str(i));
+  }
+
+  for (uint threadCount: {1, 3, 8}) {
+    auto copy = copyParallel(root.asReader(), threadCount);
+    KJ_EXPECT(copy.size() == root.asReader().totalSize().wordCount + 1);
+
+    kj::ArrayPtr<const word> segments[1] = {copy};
+    SegmentArrayMessageReader reader(segments);
+    auto copyRoot = reader.getRoot<TestAllTypes>();
+    KJ_EXPECT(AnyStruct::Reader(copyRoot) == AnyStruct::Reader(root.asReader()));
+    KJ_EXPECT(copyRoot.getStructList()[2997].getTextField() == "struct 2997");
+    KJ_EXPECT(copyRoot.getTextList()[2998] == "2998");
+  }
+}
+
 #if !CAPNP_ALLOW_UNALIGNED
 KJ_TEST("disallow unaligned") {
   union {
@@ -192,6 +234,106 @@ KJ_TEST("disallow unaligned") {
 }
 #endif
 
+KJ_TEST("PooledMessageBuilder reuses segments") {
+  auto pool = kj::atomicRefcounted<MessageSegmentPool>();
+
+  const word* firstSegment;
+  {
+    PooledMessageBuilder builder(1000, kj::atomicAddRef(*pool));
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    auto segments = builder.getSegmentsForOutput();
+    KJ_ASSERT(segments.size() == 1);
+    firstSegment = segments[0].begin();
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+  }
+
+  auto stats = pool->getStats();
+  KJ_EXPECT(stats.allocations == 1);
+  KJ_EXPECT(stats.mallocs == 1);
+  KJ_EXPECT(stats.frees == 0);
+  KJ_EXPECT(stats.cachedWords == 1024);  // 1000 rounded up to a size class
+
+  for (uint i = 0; i < 10; i++) {
+    PooledMessageBuilder builder(1000, kj::atomicAddRef(*pool));
+    auto root = builder.initRoot<TestAllTypes>();
+
+    // The segment must come back zeroed even though the previous message was bigger.
+    checkTestMessageAllZero(root.asReader());
+    root.setInt32Field(i);
+
+    auto segments = builder.getSegmentsForOutput();
+    KJ_ASSERT(segments.size() == 1);
+    KJ_EXPECT(segments[0].begin() == firstSegment);
+    for (auto& w: kj::arrayPtr(firstSegment, 1024).slice(segments[0].size(), 1024)) {
+      KJ_EXPECT(*reinterpret_cast<const uint64_t*>(&w) == 0);
+    }
+  }
+
+  // Steady state: no more calls to malloc() or free().
+  stats = pool->getStats();
+  KJ_EXPECT(stats.allocations == 11);
+  KJ_EXPECT(stats.poolHits == 10);
+  KJ_EXPECT(stats.mallocs == 1);
+  KJ_EXPECT(stats.frees == 0);
+}
+
+KJ_TEST("PooledMessageBuilder multi-segment") {
+  auto pool = kj::atomicRefcounted<MessageSegmentPool>();
+
+  for (uint i = 0; i < 3; i++) {
+    PooledMessageBuilder builder(16, kj::atomicAddRef(*pool));
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+
+    // Segment sizes follow GROW_HEURISTICALLY.
+    auto segments = builder.getSegmentsForOutput();
+    KJ_ASSERT(segments.size() > 1);
+  }
+
+  auto stats = pool->getStats();
+  KJ_EXPECT(stats.allocations > stats.mallocs);
+  KJ_EXPECT(stats.poolHits == stats.allocations - stats.mallocs);
+  KJ_EXPECT(stats.frees == 0);
+
+  pool->clear();
+  stats = pool->getStats();
+  KJ_EXPECT(stats.frees == stats.mallocs);
+  KJ_EXPECT(stats.cachedWords == 0);
+}
+
+KJ_TEST("MessageSegmentPool limits") {
+  auto pool = kj::atomicRefcounted<MessageSegmentPool>(64);
+
+  // Oversized segments bypass the pool.
+  auto big = pool->allocate(MessageSegmentPool::MAX_POOLED_WORDS + 1);
+  KJ_EXPECT(big.size() == MessageSegmentPool::MAX_POOLED_WORDS + 1);
+  pool->release(big, 0);
+  KJ_EXPECT(pool->getStats().frees == 1);
+
+  // Segments past the cache limit are freed.
+  auto a = pool->allocate(64);
+  auto b = pool->allocate(1);
+  KJ_EXPECT(a.size() == 64);
+  KJ_EXPECT(b.size() == MessageSegmentPool::MIN_POOLED_WORDS);
+  pool->release(a, 0);
+  pool->release(b, 0);
+
+  auto stats = pool->getStats();
+  KJ_EXPECT(stats.cachedWords == 64);
+  KJ_EXPECT(stats.frees == 2);
+}
+
+KJ_TEST("MessageSegmentPool::getForCurrentThread()") {
+  auto pool = MessageSegmentPool::getForCurrentThread();
+  KJ_EXPECT(pool.get() == MessageSegmentPool::getForCurrentThread().get());
+
+  {
+    PooledMessageBuilder builder;
+    builder.initRoot<TestAllTypes>().setInt32Field(123);
+  }
+  KJ_EXPECT(pool->getStats().cachedWords >= SUGGESTED_FIRST_SEGMENT_WORDS);
+}
+
 // TODO(test):  More tests.
 
 }  // namespace
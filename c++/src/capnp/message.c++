@@ -291,6 +291,153 @@ kj::ArrayPtr<word> MallocMessageBuilder::allocateSegment(uint minimumSize) {
 
 // -------------------------------------------------------------------
 
+constexpr uint MessageSegmentPool::MIN_POOLED_WORDS;
+constexpr uint MessageSegmentPool::MAX_POOLED_WORDS;
+
+MessageSegmentPool::MessageSegmentPool(size_t maxCachedWords): maxCachedWords(maxCachedWords) {}
+
+MessageSegmentPool::~MessageSegmentPool() noexcept(false) {
+  clear();
+}
+
+kj::Own<const MessageSegmentPool> MessageSegmentPool::getForCurrentThread() {
+  static thread_local kj::Own<const MessageSegmentPool> threadPool;
+  if (threadPool.get() == nullptr) {
+    threadPool = kj::atomicRefcounted<MessageSegmentPool>();
+  }
+  return kj::atomicAddRef(*threadPool);
+}
+
+uint MessageSegmentPool::sizeClass(uint size) {
+  // Index of the smallest class that can hold `size` words. Caller must check that
+  // size <= MAX_POOLED_WORDS.
+  uint cls = 0;
+  while ((MIN_POOLED_WORDS << cls) < size) ++cls;
+  return cls;
+}
+
+kj::ArrayPtr<word> MessageSegmentPool::allocate(uint minimumSize) const {
+  KJ_REQUIRE(bounded(minimumSize) * WORDS <= MAX_SEGMENT_WORDS,
+      "MessageSegmentPool asked to allocate segment above maximum serializable size.");
+
+  uint size = minimumSize;
+  if (size <= MAX_POOLED_WORDS) {
+    uint cls = sizeClass(size);
+    size = MIN_POOLED_WORDS << cls;
+
+    auto lock = state.lockExclusive();
+    ++lock->stats.allocations;
+    auto& freeList = lock->classes[cls];
+    if (!freeList.empty()) {
+      FreeSegment segment = freeList.back();
+      freeList.removeLast();
+      lock->stats.cachedWords -= size;
+      ++lock->stats.poolHits;
+      lock.release();
+
+      // Only the part the previous user wrote can be non-zero.
+      memset(segment.ptr, 0, segment.dirtyWords * sizeof(word));
+      return kj::arrayPtr(segment.ptr, size);
+    }
+    ++lock->stats.mallocs;
+  } else {
+    auto lock = state.lockExclusive();
+    ++lock->stats.allocations;
+    ++lock->stats.mallocs;
+  }
+
+  void* result = calloc(size, sizeof(word));
+  if (result == nullptr) {
+    KJ_FAIL_SYSCALL("calloc(size, sizeof(word))", ENOMEM, size);
+  }
+  return kj::arrayPtr(reinterpret_cast<word*>(result), size);
+}
+
+void MessageSegmentPool::release(kj::ArrayPtr<word> segment, size_t usedWords) const {
+  KJ_DASSERT(usedWords <= segment.size());
+
+  {
+    auto lock = state.lockExclusive();
+    if (segment.size() <= MAX_POOLED_WORDS &&
+        lock->stats.cachedWords + segment.size() <= maxCachedWords) {
+      uint cls = sizeClass(segment.size());
+      KJ_DASSERT(segment.size() == (MIN_POOLED_WORDS << cls),
+          "segment did not come from MessageSegmentPool::allocate()");
+      lock->classes[cls].add(FreeSegment { segment.begin(), usedWords });
+      lock->stats.cachedWords += segment.size();
+      return;
+    }
+    ++lock->stats.frees;
+  }
+
+  free(segment.begin());
+}
+
+MessageSegmentPool::Stats MessageSegmentPool::getStats() const {
+  return state.lockShared()->stats;
+}
+
+void MessageSegmentPool::clear() const {
+  auto lock = state.lockExclusive();
+  for (auto& freeList: lock->classes) {
+    for (auto& segment: freeList) {
+      free(segment.ptr);
+      ++lock->stats.frees;
+    }
+    freeList.clear();
+  }
+  lock->stats.cachedWords = 0;
+}
+
+// -------------------------------------------------------------------
+
+PooledMessageBuilder::PooledMessageBuilder(
+    uint firstSegmentWords, kj::Own<const MessageSegmentPool> pool)
+    : pool(kj::mv(pool)), nextSize(firstSegmentWords) {}
+
+PooledMessageBuilder::~PooledMessageBuilder() noexcept(false) {
+  if (firstSegment == nullptr) return;
+
+  // Tell the pool how much of each segment was actually written so that it only needs to zero
+  // that much on reuse. The arena lists segments in the order we allocated them.
+  kj::ArrayPtr<const kj::ArrayPtr<const word>> used = getSegmentsForOutput();
+  auto usedSize = [&](uint i, kj::ArrayPtr<word> segment) -> size_t {
+    if (i < used.size() && used[i].begin() == segment.begin()) {
+      return used[i].size();
+    } else {
+      return segment.size();
+    }
+  };
+
+  pool->release(firstSegment, usedSize(0, firstSegment));
+  for (auto i: kj::indices(moreSegments)) {
+    pool->release(moreSegments[i], usedSize(i + 1, moreSegments[i]));
+  }
+}
+
+kj::ArrayPtr<word> PooledMessageBuilder::allocateSegment(uint minimumSize) {
+  KJ_ASSERT(bounded(nextSize) * WORDS <= MAX_SEGMENT_WORDS,
+      "PooledMessageBuilder nextSize out of bounds.");
+
+  auto result = pool->allocate(kj::max(minimumSize, nextSize));
+  uint size = result.size();
+
+  // Same growth as GROW_HEURISTICALLY in MallocMessageBuilder: after the first segment, nextSize
+  // equals the total size allocated so far.
+  if (firstSegment == nullptr) {
+    firstSegment = result;
+    nextSize = size;
+  } else {
+    moreSegments.add(result);
+    nextSize = (size <= unbound(MAX_SEGMENT_WORDS / WORDS) - nextSize)
+        ? nextSize + size : unbound(MAX_SEGMENT_WORDS / WORDS);
+  }
+
+  return result;
+}
+
+// -------------------------------------------------------------------
+
 FlatMessageBuilder::FlatMessageBuilder(kj::ArrayPtr<word> array): array(array), allocated(false) {}
 FlatMessageBuilder::~FlatMessageBuilder() noexcept(false) {}
 
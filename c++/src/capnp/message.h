@@ -23,6 +23,7 @@
 
 #include <kj/common.h>
 #include <kj/memory.h>
+#include <kj/refcount.h>
 #include <kj/mutex.h>
 #include <kj/debug.h>
 #include <kj/vector.h>
@@ -124,6 +125,9 @@ public:
   size_t sizeInWords();
   // Add up the size of all segments.
 
+  inline bool isValidated() { return validated; }
+  // Returns whether validateMessage() (see validate.h) has succeeded on this message.
+
 private:
   ReaderOptions options;
 
@@ -139,9 +143,12 @@ private:
   // extra malloc on every message which could be expensive when processing small messages.
   alignas(8) void* arenaSpace[arenaSpacePadding + sizeof(kj::MutexGuarded<void*>) / sizeof(void*)];
   bool allocatedArena;
+  bool validated = false;
 
   _::ReaderArena* arena() { return reinterpret_cast<_::ReaderArena*>(arenaSpace); }
   AnyPointer::Reader getRootInternal();
+
+  friend void validateMessage(MessageReader& message, StructSchema schema);
 };
 
 class MessageBuilder {
@@ -330,6 +337,20 @@ template <typename Reader, typename = FromReader<Reader>>
 kj::Own<kj::Decay<Reader>> clone(Reader&& reader);
 // Make a deep copy of the given Reader on the heap, producing an owned pointer.
 
+template <typename T>
+void writeCanonical(kj::OutputStream& output, T&& reader);
+// Writes exactly the bytes that `canonicalize(reader)` would return, but without building the
+// canonical message in memory.  To compute a canonical hash (e.g. as a content-addressed key),
+// pass an OutputStream that feeds its input into the hash function.
+
+template <typename Reader>
+kj::Array<word> copyParallel(Reader&& reader, uint threadCount);
+// Makes a deep copy of the given struct as a flat, single-segment message, like setRoot() on a
+// FlatMessageBuilder would, but copies what the elements of long lists point to on up to
+// `threadCount` threads.  Each thread copies a contiguous range of at least a thousand elements,
+// so this helps for large messages dominated by a few long lists.  Read the result with
+// FlatArrayMessageReader.  The message must not contain capabilities.
+
 // =======================================================================================
 
 class SegmentArrayMessageReader: public MessageReader {
@@ -416,6 +437,106 @@ private:
   kj::Vector<void*> moreSegments;
 };
 
+class MessageSegmentPool: public kj::AtomicRefcounted {
+  // A cache of message segments which PooledMessageBuilder draws from and returns to, so that
+  // building a stream of similarly-sized messages reaches a steady state in which no calls to
+  // malloc() or free() are made at all.
+  //
+  // Segments are grouped into power-of-two size classes. Since GROW_HEURISTICALLY doubles the
+  // total message size with each new segment, a builder whose first segment is a power of two
+  // only ever asks for exact class sizes. A segment returned to the pool remembers how many of its
+  // words were written, and only that prefix is zeroed when it is handed out again, so small
+  // messages in large segments don't pay to clear the whole segment.
+  //
+  // All methods are thread-safe. Each thread has a default pool (see getForCurrentThread()), but a
+  // pool can also be shared explicitly by passing it to several builders on different threads.
+
+public:
+  static constexpr uint MIN_POOLED_WORDS = 16;
+  static constexpr uint MAX_POOLED_WORDS = 1u << 20;
+  // Segments are rounded up to a power of two no smaller than MIN_POOLED_WORDS. Segments larger
+  // than MAX_POOLED_WORDS bypass the pool entirely.
+
+  explicit MessageSegmentPool(size_t maxCachedWords = 1u << 20);
+  // `maxCachedWords` bounds the total size of the free segments held by the pool. Segments
+  // released while the pool is full are freed instead.
+
+  KJ_DISALLOW_COPY(MessageSegmentPool);
+  ~MessageSegmentPool() noexcept(false);
+
+  static kj::Own<const MessageSegmentPool> getForCurrentThread();
+  // Returns the calling thread's default pool, creating it if needed. The pool remains alive as
+  // long as the thread does or anyone holds a reference.
+
+  kj::ArrayPtr<word> allocate(uint minimumSize) const;
+  // Returns a zeroed segment of at least `minimumSize` words.
+
+  void release(kj::ArrayPtr<word> segment, size_t usedWords) const;
+  // Gives back a segment obtained from allocate(). Only the first `usedWords` words may be
+  // non-zero.
+
+  struct Stats {
+    uint64_t allocations = 0;
+    // Calls to allocate().
+
+    uint64_t poolHits = 0;
+    // Calls to allocate() satisfied from the pool.
+
+    uint64_t mallocs = 0;
+    uint64_t frees = 0;
+    // Calls to the underlying allocator.
+
+    size_t cachedWords = 0;
+    // Total size of the free segments currently held.
+  };
+
+  Stats getStats() const;
+
+  void clear() const;
+  // Frees all cached segments.
+
+private:
+  struct FreeSegment {
+    word* ptr;
+    size_t dirtyWords;
+  };
+
+  static constexpr uint CLASS_COUNT = 17;
+  // Classes for 2^4 through 2^20 words.
+
+  struct State {
+    kj::Vector<FreeSegment> classes[CLASS_COUNT];
+    Stats stats;
+  };
+
+  size_t maxCachedWords;
+  kj::MutexGuarded<State> state;
+
+  static uint sizeClass(uint size);
+};
+
+class PooledMessageBuilder: public MessageBuilder {
+  // A MessageBuilder which gets its segments from a MessageSegmentPool and gives them back when
+  // destroyed. This is a drop-in replacement for MallocMessageBuilder (with GROW_HEURISTICALLY)
+  // for code that builds many short-lived messages, such as RPC transports.
+
+public:
+  explicit PooledMessageBuilder(uint firstSegmentWords = SUGGESTED_FIRST_SEGMENT_WORDS,
+      kj::Own<const MessageSegmentPool> pool = MessageSegmentPool::getForCurrentThread());
+  // `firstSegmentWords` is rounded up to the pool's next size class.
+
+  KJ_DISALLOW_COPY(PooledMessageBuilder);
+  virtual ~PooledMessageBuilder() noexcept(false);
+
+  virtual kj::ArrayPtr<word> allocateSegment(uint minimumSize) override;
+
+private:
+  kj::Own<const MessageSegmentPool> pool;
+  uint nextSize;
+  kj::ArrayPtr<word> firstSegment;
+  kj::Vector<kj::ArrayPtr<word>> moreSegments;
+};
+
 class FlatMessageBuilder: public MessageBuilder {
   // THIS IS NOT THE CLASS YOU'RE LOOKING FOR.
   //
@@ -553,6 +674,17 @@ kj::Array<word> canonicalize(T&& reader) {
     return _::PointerHelpers<FromReader<T>>::getInternalReader(reader).canonicalize();
 }
 
+template <typename T>
+void writeCanonical(kj::OutputStream& output, T&& reader) {
+  _::PointerHelpers<FromReader<T>>::getInternalReader(reader).writeCanonical(output);
+}
+
+template <typename Reader>
+kj::Array<word> copyParallel(Reader&& reader, uint threadCount) {
+  return _::PointerHelpers<FromReader<Reader>>::getInternalReader(reader)
+      .copyParallel(threadCount);
+}
+
 }  // namespace capnp
 
 CAPNP_END_HEADER
@@ -1026,6 +1026,54 @@ TEST(Orphans, ReferenceExternalData_NoZeroImmediateAbandon) {
   }
 }
 
+TEST(Orphans, ReferenceExternalData_Owned) {
+  // The message takes ownership of the array, referencing it as a segment without copying.
+
+  bool freed = false;
+  auto bytes = kj::heapArray<byte>(64);
+  memset(bytes.begin(), 0x55, bytes.size());
+  const byte* ptr = bytes.begin();
+
+  {
+    MallocMessageBuilder builder;
+    kj::Array<const byte> owned = bytes.attach(kj::defer([&]() { freed = true; }));
+    auto root = builder.getRoot<TestAllTypes>();
+    root.adoptDataField(builder.getOrphanage().referenceExternalData(kj::mv(owned)));
+
+    auto segments = builder.getSegmentsForOutput();
+    ASSERT_EQ(2, segments.size());
+    EXPECT_EQ(ptr, segments[1].asBytes().begin());
+    EXPECT_EQ(ptr, root.asReader().getDataField().begin());
+
+    root.setDataField(Data::Builder());
+    EXPECT_FALSE(freed);
+  }
+
+  EXPECT_TRUE(freed);
+}
+
+TEST(Orphans, ReferenceExternalData_OwnedOddSize) {
+  // An owned array whose size isn't a multiple of a word is copied, since the padding after it
+  // would otherwise be written out.
+
+  auto bytes = kj::heapArray<byte>(50);
+  memset(bytes.begin(), 0x55, bytes.size());
+  const byte* ptr = bytes.begin();
+
+  MallocMessageBuilder builder;
+  auto root = builder.getRoot<TestAllTypes>();
+  root.adoptDataField(builder.getOrphanage().referenceExternalData(
+      kj::Array<const byte>(kj::mv(bytes))));
+
+  EXPECT_EQ(1, builder.getSegmentsForOutput().size());
+  auto data = root.asReader().getDataField();
+  EXPECT_NE(ptr, data.begin());
+  ASSERT_EQ(50, data.size());
+  for (byte b: data) {
+    EXPECT_EQ(0x55, b);
+  }
+}
+
 TEST(Orphans, TruncateData) {
   MallocMessageBuilder message;
   auto orphan = message.getOrphanage().newOrphan<Data>(17);
@@ -172,6 +172,17 @@ public:
   // into the message tree without copying it.  This is particularly useful when referencing very
   // large blobs, such as whole mmap'd files.
 
+  Orphan<Data> referenceExternalData(kj::Array<const byte>&& data) const;
+  Orphan<Data> referenceExternalData(kj::Array<byte>&& data) const;
+  // Like above, but the message takes ownership of `data` and frees it when the `MessageBuilder`
+  // is destroyed, so the caller doesn't have to keep it alive. When the message is written with
+  // writeMessage() (or sent over RPC with TwoPartyVatNetwork), the data goes to the stream
+  // straight out of `data` as its own segment, without ever being copied into the message.
+  //
+  // `data` must start on a word boundary and its size must be a multiple of 8 bytes for this to
+  // work; otherwise the data is copied into the message as if by newOrphanCopy(), since the bytes
+  // past the end of the array aren't ours to send.
+
 private:
   _::BuilderArena* arena;
   _::CapTableBuilder* capTable;
@@ -432,6 +443,14 @@ inline Orphan<Data> Orphanage::referenceExternalData(Data::Reader data) const {
   return Orphan<Data>(_::OrphanBuilder::referenceExternalData(arena, data));
 }
 
+inline Orphan<Data> Orphanage::referenceExternalData(kj::Array<const byte>&& data) const {
+  return Orphan<Data>(_::OrphanBuilder::referenceExternalData(arena, kj::mv(data)));
+}
+
+inline Orphan<Data> Orphanage::referenceExternalData(kj::Array<byte>&& data) const {
+  return referenceExternalData(kj::Array<const byte>(kj::mv(data)));
+}
+
 }  // namespace capnp
 
 CAPNP_END_HEADER
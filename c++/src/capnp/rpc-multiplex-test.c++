@@ -0,0 +1,203 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "rpc-multiplex.h"
+#include "test-util.h"
+#include <kj/test.h>
+
+namespace capnp {
+namespace _ {
+namespace {
+
+constexpr uint CONTROL = 0;
+constexpr uint BULK = 1;
+
+struct TestContext {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope;
+  kj::TwoWayPipe pipe;
+  MultiplexedStream clientMux;
+  MultiplexedStream serverMux;
+  MallocMessageBuilder serverVatId;
+
+  TestContext(kj::ArrayPtr<const MultiplexedStream::ChannelOptions> options)
+      : waitScope(loop),
+        pipe(kj::newTwoWayPipe()),
+        clientMux(*pipe.ends[0], rpc::twoparty::Side::CLIENT, options),
+        serverMux(*pipe.ends[1], rpc::twoparty::Side::SERVER, options) {
+    serverVatId.initRoot<rpc::twoparty::VatId>().setSide(rpc::twoparty::Side::SERVER);
+  }
+
+  rpc::twoparty::VatId::Reader getServerVatId() {
+    return serverVatId.getRoot<rpc::twoparty::VatId>();
+  }
+};
+
+kj::Array<MultiplexedStream::ChannelOptions> controlAndBulk() {
+  auto options = kj::heapArray<MultiplexedStream::ChannelOptions>(2);
+  options[CONTROL].priority = 1;
+  options[BULK].priority = 0;
+  return options;
+}
+
+KJ_TEST("MultiplexedStream runs a separate connection on each channel") {
+  auto options = controlAndBulk();
+  TestContext context(options);
+
+  int callCount = 0;
+  auto controlServer = makeRpcServer(context.serverMux.getChannel(CONTROL),
+                                     kj::heap<TestInterfaceImpl>(callCount));
+  auto bulkServer = makeRpcServer(context.serverMux.getChannel(BULK),
+                                  kj::heap<TestCallOrderImpl>());
+  auto controlClient = makeRpcClient(context.clientMux.getChannel(CONTROL));
+  auto bulkClient = makeRpcClient(context.clientMux.getChannel(BULK));
+
+  auto control = controlClient.bootstrap(context.getServerVatId()).castAs<test::TestInterface>();
+  auto bulk = bulkClient.bootstrap(context.getServerVatId()).castAs<test::TestCallOrder>();
+
+  for (uint i = 0; i < 3; i++) {
+    auto fooRequest = control.fooRequest();
+    fooRequest.setI(123);
+    fooRequest.setJ(true);
+    auto sequenceRequest = bulk.getCallSequenceRequest();
+    sequenceRequest.setExpected(i);
+
+    auto fooPromise = fooRequest.send();
+    auto sequencePromise = sequenceRequest.send();
+    KJ_EXPECT(fooPromise.wait(context.waitScope).getX() == "foo");
+    KJ_EXPECT(sequencePromise.wait(context.waitScope).getN() == i);
+  }
+
+  KJ_EXPECT(callCount == 3);
+}
+
+class BulkServer final: public test::TestPipeline::Server {
+public:
+  size_t receivedBytes = 0;
+
+  kj::Promise<void> testPointers(TestPointersContext context) override {
+    receivedBytes = context.getParams().getObj().getAs<Data>().size();
+    return kj::READY_NOW;
+  }
+};
+
+KJ_TEST("MultiplexedStream lets control calls overtake bulk data") {
+  constexpr size_t BULK_BYTES = 8 << 20;
+
+  // A window bigger than the transfer, so that only priority lets the control call through.
+  auto options = controlAndBulk();
+  options[BULK].windowBytes = 2 * BULK_BYTES;
+  TestContext context(options);
+
+  int callCount = 0;
+  auto ownBulkServer = kj::heap<BulkServer>();
+  auto& bulkServer = *ownBulkServer;
+  auto controlServer = makeRpcServer(context.serverMux.getChannel(CONTROL),
+                                     kj::heap<TestInterfaceImpl>(callCount));
+  auto bulkRpcServer = makeRpcServer(context.serverMux.getChannel(BULK), kj::mv(ownBulkServer));
+  auto controlClient = makeRpcClient(context.clientMux.getChannel(CONTROL));
+  auto bulkClient = makeRpcClient(context.clientMux.getChannel(BULK));
+
+  auto control = controlClient.bootstrap(context.getServerVatId()).castAs<test::TestInterface>();
+  auto bulk = bulkClient.bootstrap(context.getServerVatId()).castAs<test::TestPipeline>();
+
+  auto bulkRequest = bulk.testPointersRequest();
+  auto data = bulkRequest.getObj().initAs<Data>(BULK_BYTES);
+  memset(data.begin(), 'x', data.size());
+  bool bulkDone = false;
+  auto bulkPromise = bulkRequest.send().then([&](auto&&) { bulkDone = true; });
+
+  // Get the transfer going, then make a call on the control channel. It shouldn't have to wait
+  // for the rest of the bulk data.
+  context.loop.run(100);
+  KJ_EXPECT(!bulkDone);
+
+  auto fooRequest = control.fooRequest();
+  fooRequest.setI(123);
+  fooRequest.setJ(true);
+  KJ_EXPECT(fooRequest.send().wait(context.waitScope).getX() == "foo");
+  KJ_EXPECT(bulkServer.receivedBytes == 0);
+
+  bulkPromise.wait(context.waitScope);
+  KJ_EXPECT(bulkServer.receivedBytes == BULK_BYTES);
+}
+
+KJ_TEST("MultiplexedStream windows are independent") {
+  // The server doesn't read the bulk channel until the end, so its window fills up. The receiver
+  // fails the whole stream if a window is exceeded, so the control channel working at all shows
+  // that the sender respected it.
+
+  auto options = controlAndBulk();
+  options[BULK].windowBytes = 4096;
+  TestContext context(options);
+
+  auto clientControl = KJ_ASSERT_NONNULL(
+      context.clientMux.getChannel(CONTROL).connect(context.getServerVatId()));
+  auto clientBulk = KJ_ASSERT_NONNULL(
+      context.clientMux.getChannel(BULK).connect(context.getServerVatId()));
+  auto serverControl = context.serverMux.getChannel(CONTROL).accept().wait(context.waitScope);
+  auto serverBulk = context.serverMux.getChannel(BULK).accept().wait(context.waitScope);
+
+  auto sendText = [](TwoPartyVatNetworkBase::Connection& connection, kj::StringPtr text) {
+    auto message = connection.newOutgoingMessage(0);
+    message->getBody().setAs<Text>(text);
+    message->send();
+  };
+  auto receiveText = [&](TwoPartyVatNetworkBase::Connection& connection) {
+    auto message = KJ_ASSERT_NONNULL(connection.receiveIncomingMessage().wait(context.waitScope));
+    return kj::heapString(message->getBody().getAs<Text>());
+  };
+
+  auto padding = kj::heapArray<char>(1000);
+  memset(padding.begin(), 'x', padding.size());
+  for (uint i = 0; i < 64; i++) {
+    sendText(*clientBulk, kj::str(i, ' ', padding));
+  }
+  // Bigger than the whole window.
+  auto big = kj::heapArray<char>(20000);
+  memset(big.begin(), 'y', big.size());
+  sendText(*clientBulk, kj::str(big));
+
+  sendText(*clientControl, "control");
+  KJ_EXPECT(receiveText(*serverControl) == "control");
+
+  for (uint i = 0; i < 64; i++) {
+    auto text = receiveText(*serverBulk);
+    KJ_EXPECT(text.startsWith(kj::str(i, ' ')), text.slice(0, 8));
+    KJ_EXPECT(text.size() == kj::str(i, ' ').size() + padding.size());
+  }
+  KJ_EXPECT(receiveText(*serverBulk) == kj::str(big));
+
+  // Shutting down one channel leaves the other running.
+  clientBulk->shutdown().wait(context.waitScope);
+  KJ_EXPECT(serverBulk->receiveIncomingMessage().wait(context.waitScope) == nullptr);
+
+  sendText(*clientControl, "still here");
+  KJ_EXPECT(receiveText(*serverControl) == "still here");
+
+  // The end of the stream ends every channel.
+  context.pipe.ends[0]->shutdownWrite();
+  KJ_EXPECT(serverControl->receiveIncomingMessage().wait(context.waitScope) == nullptr);
+}
+
+}  // namespace
+}  // namespace _
+}  // namespace capnp
@@ -0,0 +1,507 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "rpc-multiplex.h"
+#include "serialize.h"
+#include <kj/debug.h>
+
+namespace capnp {
+
+namespace {
+
+// The stream is a sequence of frames, each a FrameHeader followed, for DATA frames, by `length`
+// bytes of message. A channel's messages are sent one after another in the standard stream
+// format (segment table, then segments), never interleaved with each other, but frames of
+// different channels may be interleaved arbitrarily.
+
+enum class FrameType: uint32_t {
+  DATA = 0,
+  // The next `length` bytes of the channel's current message, which is `messageBytes` long in
+  // total. The first DATA frame after a message is complete starts a new one.
+
+  WINDOW = 1,
+  // The receiver has made room for `length` more bytes on the channel.
+
+  CLOSE = 2,
+  // The sender has shut the channel down and will send nothing more on it.
+};
+
+template <typename T>
+void dropFront(kj::Vector<T>& vector, size_t& start) {
+  // Frees the elements of `vector` before `start`, once there are enough of them to be worth
+  // moving the rest down.
+
+  if (start == vector.size()) {
+    vector.clear();
+    start = 0;
+  } else if (start >= 16 && start * 2 >= vector.size()) {
+    kj::Vector<T> rest(vector.size() - start);
+    for (auto i: kj::range(start, vector.size())) {
+      rest.add(kj::mv(vector[i]));
+    }
+    vector = kj::mv(rest);
+    start = 0;
+  }
+}
+
+}  // namespace
+
+struct MultiplexedStream::FrameHeader {
+  _::WireValue<uint32_t> type;
+  _::WireValue<uint32_t> channel;
+  _::WireValue<uint32_t> length;
+  _::WireValue<uint32_t> messageBytes;
+};
+
+MultiplexedStream::MultiplexedStream(
+    kj::AsyncIoStream& stream, rpc::twoparty::Side side,
+    kj::ArrayPtr<const ChannelOptions> channelOptions, ReaderOptions receiveOptions)
+    : stream(stream), side(side), receiveOptions(receiveOptions) {
+  KJ_REQUIRE(channelOptions.size() > 0, "MultiplexedStream needs at least one channel");
+
+  auto builder = kj::heapArrayBuilder<kj::Own<Channel>>(channelOptions.size());
+  for (auto i: kj::indices(channelOptions)) {
+    KJ_REQUIRE(channelOptions[i].windowBytes > 0 && channelOptions[i].windowBytes <= (1u << 31),
+               "channel window size out of range", i, channelOptions[i].windowBytes);
+    builder.add(kj::heap<Channel>(*this, i, channelOptions[i]));
+  }
+  channels = builder.finish();
+
+  readTask = readLoop().eagerlyEvaluate([this](kj::Exception&& exception) {
+    failRead(kj::mv(exception));
+  });
+}
+
+MultiplexedStream::~MultiplexedStream() noexcept(false) {}
+
+MultiplexedStream::Channel& MultiplexedStream::getChannel(uint index) {
+  KJ_REQUIRE(index < channels.size(), "no such channel", index);
+  return *channels[index];
+}
+
+// ---------------------------------------------------------------------------------------
+// Writing
+
+void MultiplexedStream::scheduleWrite() {
+  if (writing || writeError != nullptr) return;
+  writing = true;
+
+  // Wait a turn so that messages sent together go out in one write.
+  writeTask = kj::evalLater([this]() { return writeLoop(); })
+      .eagerlyEvaluate([this](kj::Exception&& exception) {
+    failWrite(kj::mv(exception));
+  });
+}
+
+kj::Promise<void> MultiplexedStream::writeLoop() {
+  // Nothing from the previous write is in flight any more, so finished messages can go.
+  for (auto& channel: channels) {
+    dropFront(channel->outgoing, channel->outgoingStart);
+  }
+
+  struct Frame {
+    FrameType type;
+    Channel* channel;
+    uint32_t length;
+    Channel::OutgoingMessage* message;
+  };
+  kj::Vector<Frame> frames;
+  kj::Vector<Channel*> closing;
+
+  // Window updates go first: they're tiny, and the peer may be waiting for them.
+  for (auto& channel: channels) {
+    if (channel->creditBytes > 0) {
+      frames.add(Frame { FrameType::WINDOW, channel.get(),
+                         static_cast<uint32_t>(channel->creditBytes), nullptr });
+      channel->receivedBytes -= channel->creditBytes;
+      channel->creditBytes = 0;
+    }
+  }
+
+  // Then up to MAX_FRAME_BYTES of messages, always from the highest-priority channel that can
+  // send, so that no message waits behind more than one write's worth of lower-priority data.
+  size_t budget = MAX_FRAME_BYTES;
+  while (budget > 0) {
+    Channel* best = nullptr;
+    uint bestIndex = 0;
+    for (auto i: kj::indices(channels)) {
+      uint index = (nextChannel + i) % channels.size();
+      auto& channel = *channels[index];
+      if (channel.canSend() &&
+          (best == nullptr || channel.options.priority > best->options.priority)) {
+        best = &channel;
+        bestIndex = index;
+      }
+    }
+    if (best == nullptr) break;
+    nextChannel = (bestIndex + 1) % channels.size();
+
+    auto& message = best->outgoing[best->outgoingStart];
+    size_t length = kj::min(kj::min(message.totalBytes - message.sentBytes, best->sendWindow),
+                            budget);
+    frames.add(Frame { FrameType::DATA, best, static_cast<uint32_t>(length), &message });
+    message.sentBytes += length;
+    best->sendWindow -= length;
+    budget -= length;
+    if (message.sentBytes == message.totalBytes) {
+      ++best->outgoingStart;
+    }
+  }
+
+  // A channel is closed once everything sent on it has been written.
+  for (auto& channel: channels) {
+    if (channel->shutdownRequested && !channel->closeSent &&
+        channel->outgoingStart == channel->outgoing.size()) {
+      frames.add(Frame { FrameType::CLOSE, channel.get(), 0, nullptr });
+      channel->closeSent = true;
+      closing.add(channel.get());
+    }
+  }
+
+  if (frames.empty()) {
+    writing = false;
+    return kj::READY_NOW;
+  }
+
+  auto headers = kj::heapArray<FrameHeader>(frames.size());
+  kj::Vector<kj::ArrayPtr<const byte>> pieces(frames.size() * 2);
+  for (auto i: kj::indices(frames)) {
+    auto& frame = frames[i];
+    auto& header = headers[i];
+    header.type.set(static_cast<uint32_t>(frame.type));
+    header.channel.set(frame.channel->id);
+    header.length.set(frame.length);
+    header.messageBytes.set(0);
+    pieces.add(kj::arrayPtr(&header, 1).asBytes());
+
+    if (frame.message != nullptr) {
+      auto message = frame.message;
+      header.messageBytes.set(message->totalBytes);
+
+      // Take the frame's bytes from the message's pieces.
+      size_t remaining = frame.length;
+      while (remaining > 0) {
+        auto piece = message->pieces[message->pieceIndex];
+        size_t n = kj::min(piece.size() - message->pieceOffset, remaining);
+        pieces.add(piece.slice(message->pieceOffset, message->pieceOffset + n));
+        remaining -= n;
+        message->pieceOffset += n;
+        if (message->pieceOffset == piece.size()) {
+          ++message->pieceIndex;
+          message->pieceOffset = 0;
+        }
+      }
+    }
+  }
+
+  auto promise = stream.write(pieces.asPtr());
+  return promise.attach(kj::mv(headers), kj::mv(pieces))
+      .then([this, closing = kj::mv(closing)]() {
+    for (auto channel: closing) {
+      channel->shutdownFulfiller->fulfill();
+    }
+    return writeLoop();
+  });
+}
+
+void MultiplexedStream::failWrite(kj::Exception&& exception) {
+  writing = false;
+  for (auto& channel: channels) {
+    channel->outgoing.clear();
+    channel->outgoingStart = 0;
+    if (channel->shutdownFulfiller.get() != nullptr) {
+      channel->shutdownFulfiller->reject(kj::cp(exception));
+    }
+  }
+  writeError = kj::mv(exception);
+}
+
+class MultiplexedStream::OutgoingMessageImpl final
+    : public OutgoingRpcMessage, public kj::Refcounted {
+public:
+  OutgoingMessageImpl(Channel& channel, uint firstSegmentWordSize)
+      : channel(channel),
+        message(firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS
+                                          : firstSegmentWordSize) {}
+
+  AnyPointer::Builder getBody() override {
+    return message.getRoot<AnyPointer>();
+  }
+
+  void setFds(kj::Array<int> fds) override {
+    // FD passing isn't supported.
+  }
+
+  void send() override {
+    auto& mux = channel.mux;
+    size_t size = message.sizeInWords();
+    if (!_::checkOutgoingMessageSize(size, mux.receiveOptions)) return;
+    KJ_REQUIRE(!channel.shutdownRequested, "already shut down");
+
+    if (mux.writeError != nullptr) {
+      // Leave it to the read side to report the problem.
+      return;
+    }
+
+    auto segments = message.getSegmentsForOutput();
+
+    Channel::OutgoingMessage outgoing;
+    outgoing.message = kj::addRef(*this);
+
+    // Segment table as in writeMessage().
+    outgoing.table = kj::heapArray<_::WireValue<uint32_t>>((segments.size() + 2) & ~size_t(1));
+    outgoing.table[0].set(segments.size() - 1);
+    for (auto i: kj::indices(segments)) {
+      outgoing.table[i + 1].set(segments[i].size());
+    }
+    if (segments.size() % 2 == 0) {
+      // Set padding byte.
+      outgoing.table[segments.size() + 1].set(0);
+    }
+
+    outgoing.pieces = kj::heapArray<kj::ArrayPtr<const byte>>(segments.size() + 1);
+    outgoing.pieces[0] = outgoing.table.asBytes();
+    outgoing.totalBytes = outgoing.pieces[0].size();
+    for (auto i: kj::indices(segments)) {
+      outgoing.pieces[i + 1] = segments[i].asBytes();
+      outgoing.totalBytes += outgoing.pieces[i + 1].size();
+    }
+    KJ_REQUIRE(outgoing.totalBytes <= uint32_t(kj::maxValue), "message too large");
+
+    channel.outgoing.add(kj::mv(outgoing));
+    mux.scheduleWrite();
+  }
+
+  size_t sizeInWords() override {
+    return message.sizeInWords();
+  }
+
+private:
+  Channel& channel;
+  MallocMessageBuilder message;
+};
+
+// ---------------------------------------------------------------------------------------
+// Reading
+
+kj::Promise<void> MultiplexedStream::readLoop() {
+  auto header = kj::heap<FrameHeader>();
+  auto promise = stream.tryRead(header.get(), sizeof(FrameHeader), sizeof(FrameHeader));
+  return promise.then([this, header = kj::mv(header)](size_t n) -> kj::Promise<void> {
+    if (n == 0) {
+      failRead(nullptr);
+      return kj::READY_NOW;
+    }
+    if (n < sizeof(FrameHeader)) {
+      kj::throwRecoverableException(KJ_EXCEPTION(DISCONNECTED, "Premature EOF."));
+      return kj::READY_NOW;
+    }
+
+    uint32_t channelId = header->channel.get();
+    KJ_REQUIRE(channelId < channels.size(), "frame for unknown channel", channelId);
+    auto& channel = *channels[channelId];
+    uint32_t length = header->length.get();
+
+    switch (static_cast<FrameType>(header->type.get())) {
+      case FrameType::DATA:
+        return readData(channel, length, header->messageBytes.get()).then([this]() {
+          return readLoop();
+        });
+
+      case FrameType::WINDOW:
+        KJ_REQUIRE(length <= channel.options.windowBytes - channel.sendWindow,
+                   "peer credited more than the channel's window", channelId, length);
+        channel.sendWindow += length;
+        if (channel.canSend()) {
+          scheduleWrite();
+        }
+        break;
+
+      case FrameType::CLOSE:
+        KJ_REQUIRE(channel.partial == nullptr, "channel closed in the middle of a message");
+        channel.receiveClosed = true;
+        channel.wakeReceiver();
+        break;
+
+      default:
+        KJ_FAIL_REQUIRE("unknown frame type", header->type.get());
+    }
+
+    return readLoop();
+  });
+}
+
+kj::Promise<void> MultiplexedStream::readData(
+    Channel& channel, uint32_t length, uint32_t messageBytes) {
+  KJ_REQUIRE(!channel.receiveClosed, "data received on a closed channel");
+  KJ_REQUIRE(length > 0, "empty data frame");
+  KJ_REQUIRE(length <= channel.options.windowBytes - channel.receivedBytes,
+             "peer exceeded the channel's flow-control window", channel.id, length);
+  channel.receivedBytes += length;
+
+  if (channel.partial == nullptr) {
+    KJ_REQUIRE(messageBytes % sizeof(word) == 0, "message size is not a whole number of words",
+               messageBytes);
+    KJ_REQUIRE(messageBytes / sizeof(word) <= receiveOptions.traversalLimitInWords,
+               "Message is too large.  To increase the limit on the receiving end, see "
+               "capnp::ReaderOptions.", messageBytes);
+    channel.partial = kj::heapArray<word>(messageBytes / sizeof(word));
+    channel.partialBytes = 0;
+  }
+
+  auto buffer = KJ_ASSERT_NONNULL(channel.partial).asBytes();
+  KJ_REQUIRE(messageBytes == buffer.size() && length <= buffer.size() - channel.partialBytes,
+             "data frame doesn't fit the message being received");
+
+  // Read straight into place, so that the message never needs to be reassembled.
+  auto promise = stream.read(buffer.begin() + channel.partialBytes, length);
+  return promise.then([&channel, length]() {
+    channel.partialBytes += length;
+    auto& buffer = KJ_ASSERT_NONNULL(channel.partial);
+    if (channel.partialBytes == buffer.asBytes().size()) {
+      channel.incoming.add(Channel::IncomingMessage { kj::mv(buffer), length });
+      channel.partial = nullptr;
+      channel.wakeReceiver();
+    } else {
+      channel.credit(length);
+    }
+  });
+}
+
+void MultiplexedStream::failRead(kj::Maybe<kj::Exception> error) {
+  for (auto& channel: channels) {
+    KJ_IF_MAYBE(e, error) {
+      channel->receiveError = kj::cp(*e);
+    } else if (channel->partial != nullptr) {
+      channel->receiveError = KJ_EXCEPTION(DISCONNECTED, "Premature EOF.");
+    } else {
+      channel->receiveClosed = true;
+    }
+    channel->wakeReceiver();
+  }
+}
+
+class MultiplexedStream::IncomingMessageImpl final: public IncomingRpcMessage {
+public:
+  IncomingMessageImpl(kj::Array<word> words, ReaderOptions options)
+      : words(kj::mv(words)), message(this->words, options) {}
+
+  AnyPointer::Reader getBody() override {
+    return message.getRoot<AnyPointer>();
+  }
+
+  size_t sizeInWords() override {
+    return words.size();
+  }
+
+private:
+  kj::Array<word> words;
+  FlatArrayMessageReader message;
+};
+
+// ---------------------------------------------------------------------------------------
+// Channel
+
+MultiplexedStream::Channel::Channel(MultiplexedStream& mux, uint id,
+                                    const ChannelOptions& options)
+    : mux(mux), id(id), options(options), connectionState(*this, mux.side),
+      sendWindow(options.windowBytes) {}
+
+kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> MultiplexedStream::Channel::connect(
+    rpc::twoparty::VatId::Reader ref) {
+  return connectionState.connect(ref);
+}
+
+kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> MultiplexedStream::Channel::accept() {
+  return connectionState.accept();
+}
+
+void MultiplexedStream::Channel::credit(size_t bytes) {
+  // Credit is returned in batches of at least half the window, so that a busy channel sends
+  // only a couple of WINDOW frames per window of data. The sender is never stuck waiting for the
+  // rest: if it has run out of window, everything it sent has either been credited or is still
+  // waiting for the RpcSystem to take it.
+  creditBytes += bytes;
+  if (creditBytes >= kj::max(options.windowBytes / 2, size_t(1))) {
+    mux.scheduleWrite();
+  }
+}
+
+void MultiplexedStream::Channel::wakeReceiver() {
+  if (receiveFulfiller.get() != nullptr) {
+    receiveFulfiller->fulfill();
+    receiveFulfiller = nullptr;
+  }
+}
+
+kj::Own<RpcFlowController> MultiplexedStream::Channel::newStream() {
+  return RpcFlowController::newFixedWindowController(options.windowBytes);
+}
+
+rpc::twoparty::VatId::Reader MultiplexedStream::Channel::getPeerVatId() {
+  return connectionState.getPeerVatId();
+}
+
+kj::Own<OutgoingRpcMessage> MultiplexedStream::Channel::newOutgoingMessage(
+    uint firstSegmentWordSize) {
+  return kj::refcounted<OutgoingMessageImpl>(*this, firstSegmentWordSize);
+}
+
+kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>>
+    MultiplexedStream::Channel::receiveIncomingMessage() {
+  if (incomingStart < incoming.size()) {
+    auto message = kj::mv(incoming[incomingStart++]);
+    dropFront(incoming, incomingStart);
+    credit(message.uncreditedBytes);
+    kj::Own<IncomingRpcMessage> result =
+        kj::heap<IncomingMessageImpl>(kj::mv(message.words), mux.receiveOptions);
+    return kj::Maybe<kj::Own<IncomingRpcMessage>>(kj::mv(result));
+  }
+
+  KJ_IF_MAYBE(exception, receiveError) {
+    return kj::cp(*exception);
+  }
+  if (receiveClosed) {
+    return kj::Maybe<kj::Own<IncomingRpcMessage>>(nullptr);
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  receiveFulfiller = kj::mv(paf.fulfiller);
+  return paf.promise.then([this]() {
+    return receiveIncomingMessage();
+  });
+}
+
+kj::Promise<void> MultiplexedStream::Channel::shutdown() {
+  KJ_REQUIRE(!shutdownRequested, "already shut down");
+  shutdownRequested = true;
+
+  KJ_IF_MAYBE(exception, mux.writeError) {
+    return kj::cp(*exception);
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  shutdownFulfiller = kj::mv(paf.fulfiller);
+  mux.scheduleWrite();
+  return kj::mv(paf.promise);
+}
+
+}  // namespace capnp
@@ -0,0 +1,222 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+// Carries several independent two-party RPC connections over a single byte stream.
+//
+// TwoPartyVatNetwork writes each message to the stream whole, in the order sent, so a call sent
+// just after a few megabytes of ByteStream data waits for all of it to go out first. Here, each
+// connection ("channel") has its own queue, and messages are cut into frames which are written
+// in order of channel priority, so a small call on a high-priority channel waits for at most one
+// frame of bulk data. Each channel also has its own flow-control window, so a channel whose
+// receiver has fallen behind stops sending without holding up the others.
+
+#include "rpc.h"
+#include "rpc-twoparty.h"
+#include "endian.h"
+#include <kj/async-io.h>
+#include <kj/vector.h>
+
+CAPNP_BEGIN_HEADER
+
+namespace capnp {
+
+class MultiplexedStream {
+  // Splits a byte stream into a fixed set of channels, each of which is a two-party
+  // `VatNetwork` using the same VatId type as TwoPartyVatNetwork. Run a separate RpcSystem on each
+  // channel, e.g. one for latency-sensitive calls and another for bulk transfers:
+  //
+  //     MultiplexedStream::ChannelOptions options[2];
+  //     options[0].priority = 1;   // control
+  //     options[1].priority = 0;   // bulk
+  //     MultiplexedStream mux(stream, rpc::twoparty::Side::CLIENT, options);
+  //     auto control = makeRpcClient(mux.getChannel(0));
+  //     auto bulk = makeRpcClient(mux.getChannel(1));
+  //
+  // Both ends must be constructed with the same number of channels and the same window for each
+  // channel. Priorities are local: each end decides the order in which it writes its own frames.
+  //
+  // Each message is sent as one or more DATA frames of at most MAX_FRAME_BYTES. Whenever the
+  // stream is ready for more, frames are taken from the highest-priority channel that has data
+  // and send window to spare, round-robin among channels of equal priority. A channel may have at
+  // most its window's worth of bytes sent but not yet credited by the peer. The receiver credits
+  // the bytes of a partly-received message as soon as they arrive, since they go straight into a
+  // buffer allocated for the whole message, and the bytes of a complete message once its
+  // RpcSystem takes it. The window therefore bounds how far received messages can pile up
+  // behind a busy RpcSystem, and it is also used as the window for streaming calls on the channel.
+  //
+  // The underlying stream is always read promptly, whatever the channels are doing; it is the
+  // per-channel windows that provide backpressure.
+  //
+  // Every RpcSystem using a channel must be destroyed before the MultiplexedStream.
+
+public:
+  static constexpr size_t DEFAULT_WINDOW_BYTES = 1 << 20;
+  static constexpr size_t MAX_FRAME_BYTES = 16384;
+
+  struct ChannelOptions {
+    uint priority = 0;
+    // Channels with higher priority have their frames written first.
+
+    size_t windowBytes = DEFAULT_WINDOW_BYTES;
+    // Bytes that may be in flight towards the receiver. Must match the peer's setting.
+  };
+
+  class Channel;
+
+  MultiplexedStream(kj::AsyncIoStream& stream, rpc::twoparty::Side side,
+                    kj::ArrayPtr<const ChannelOptions> channels,
+                    ReaderOptions receiveOptions = ReaderOptions());
+  // Starts reading from `stream` right away. Each end must pass a different `side`.
+
+  KJ_DISALLOW_COPY(MultiplexedStream);
+  ~MultiplexedStream() noexcept(false);
+
+  Channel& getChannel(uint index);
+
+  rpc::twoparty::Side getSide() { return side; }
+
+private:
+  struct FrameHeader;
+  class OutgoingMessageImpl;
+  class IncomingMessageImpl;
+
+  kj::AsyncIoStream& stream;
+  rpc::twoparty::Side side;
+  ReaderOptions receiveOptions;
+  kj::Array<kj::Own<Channel>> channels;
+
+  uint nextChannel = 0;
+  // Where to start looking for a channel to write, so that channels of equal priority take turns.
+
+  bool writing = false;
+  // Whether writeTask is running. It stops when it runs out of frames it's allowed to write.
+
+  kj::Maybe<kj::Exception> writeError;
+  // Set if a write failed, after which everything sent is discarded. As in TwoPartyVatNetwork,
+  // it's left to the read side to report the problem.
+
+  kj::Promise<void> writeTask = nullptr;
+  kj::Promise<void> readTask = nullptr;
+
+  void scheduleWrite();
+  kj::Promise<void> writeLoop();
+  kj::Promise<void> readLoop();
+  kj::Promise<void> readData(Channel& channel, uint32_t length, uint32_t messageBytes);
+  void failRead(kj::Maybe<kj::Exception> error);
+  void failWrite(kj::Exception&& error);
+};
+
+class MultiplexedStream::Channel final: public TwoPartyVatNetworkBase,
+                                        private TwoPartyVatNetworkBase::Connection {
+  // One channel of a MultiplexedStream. Behaves like a TwoPartyVatNetwork whose stream is the
+  // channel.
+
+public:
+  Channel(MultiplexedStream& mux, uint id, const ChannelOptions& options);
+  KJ_DISALLOW_COPY(Channel);
+
+  kj::Promise<void> onDisconnect() { return connectionState.onDisconnect(); }
+  // Returns a promise that resolves when the RpcSystem has dropped the connection, like
+  // TwoPartyVatNetwork::onDisconnect().
+
+  rpc::twoparty::Side getSide() { return mux.side; }
+
+  // implements VatNetwork -----------------------------------------------------
+
+  kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> connect(
+      rpc::twoparty::VatId::Reader ref) override;
+  kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> accept() override;
+
+private:
+  friend class MultiplexedStream;
+
+  struct OutgoingMessage {
+    kj::Own<OutgoingMessageImpl> message;
+    kj::Array<_::WireValue<uint32_t>> table;
+    kj::Array<kj::ArrayPtr<const byte>> pieces;
+    // The message in the standard stream format, as with writeMessage().
+
+    size_t totalBytes;
+    size_t sentBytes = 0;
+    size_t pieceIndex = 0;
+    size_t pieceOffset = 0;
+    // How far we've got in sending `pieces`.
+  };
+
+  struct IncomingMessage {
+    kj::Array<word> words;
+    size_t uncreditedBytes;
+    // Bytes to credit back to the peer when the message is taken.
+  };
+
+  MultiplexedStream& mux;
+  uint id;
+  ChannelOptions options;
+  _::TwoPartyConnectionState connectionState;
+
+  // Sending.
+  kj::Vector<OutgoingMessage> outgoing;
+  size_t outgoingStart = 0;
+  // outgoing[outgoingStart] is the message currently being sent; those before it are done.
+
+  size_t sendWindow;
+  // Bytes we may send before the peer credits us with more.
+
+  bool shutdownRequested = false;
+  bool closeSent = false;
+  kj::Own<kj::PromiseFulfiller<void>> shutdownFulfiller;
+
+  // Receiving.
+  kj::Vector<IncomingMessage> incoming;
+  size_t incomingStart = 0;
+  kj::Maybe<kj::Array<word>> partial;
+  // The message currently being received, if any; `partialBytes` of it have arrived.
+  size_t partialBytes = 0;
+
+  size_t receivedBytes = 0;
+  // Bytes the peer has sent that we haven't yet credited back. Never exceeds the window.
+  size_t creditBytes = 0;
+  // Bytes we're ready to credit back, in the next WINDOW frame.
+
+  bool receiveClosed = false;
+  kj::Maybe<kj::Exception> receiveError;
+  kj::Own<kj::PromiseFulfiller<void>> receiveFulfiller;
+  // Fulfilled when something is added to `incoming`, or the channel is closed or fails.
+
+  bool canSend() {
+    return outgoingStart < outgoing.size() && sendWindow > 0;
+  }
+  void credit(size_t bytes);
+  void wakeReceiver();
+
+  // implements Connection -----------------------------------------------------
+
+  kj::Own<RpcFlowController> newStream() override;
+  rpc::twoparty::VatId::Reader getPeerVatId() override;
+  kj::Own<OutgoingRpcMessage> newOutgoingMessage(uint firstSegmentWordSize) override;
+  kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveIncomingMessage() override;
+  kj::Promise<void> shutdown() override;
+};
+
+}  // namespace capnp
+
+CAPNP_END_HEADER
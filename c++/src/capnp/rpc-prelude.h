@@ -34,6 +34,9 @@ namespace capnp {
 class OutgoingRpcMessage;
 class IncomingRpcMessage;
 class RpcFlowController;
+class RpcCallObserver;
+struct RpcEmbargoStats;
+class RpcCallScheduler;
 
 template <typename SturdyRefHostId>
 class RpcSystem;
@@ -94,6 +97,9 @@ private:
   Capability::Client baseBootstrap(AnyStruct::Reader vatId);
   Capability::Client baseRestore(AnyStruct::Reader vatId, AnyPointer::Reader objectId);
   void baseSetFlowLimit(size_t words);
+  void baseSetCallObserver(kj::Maybe<RpcCallObserver&> observer);
+  RpcEmbargoStats baseGetEmbargoStats();
+  void baseSetCallScheduler(kj::Maybe<RpcCallScheduler&> scheduler);
 
   template <typename>
   friend class capnp::RpcSystem;
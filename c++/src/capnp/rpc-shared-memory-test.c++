@@ -0,0 +1,198 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "rpc-shared-memory.h"
+
+#if __linux__
+
+#include "test-util.h"
+#include <kj/test.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace capnp {
+namespace _ {
+namespace {
+
+kj::AutoCloseFd dupFd(int fd) {
+  int result;
+  KJ_SYSCALL(result = dup(fd));
+  return kj::AutoCloseFd(result);
+}
+
+SharedMemoryVatNetwork::Fds dupFds(const SharedMemoryVatNetwork::Fds& fds) {
+  return { dupFd(fds.memory), dupFd(fds.clientEvent), dupFd(fds.serverEvent) };
+}
+
+ReaderOptions bigMessageOptions() {
+  ReaderOptions options;
+  options.traversalLimitInWords = 32 << 20;
+  return options;
+}
+
+struct TestContext {
+  kj::AsyncIoContext io;
+  SharedMemoryVatNetwork::Fds fds;
+  SharedMemoryVatNetwork serverNetwork;
+  SharedMemoryVatNetwork clientNetwork;
+  RpcSystem<rpc::twoparty::VatId> server;
+  RpcSystem<rpc::twoparty::VatId> client;
+
+  TestContext(Capability::Client bootstrap, size_t bufferBytes,
+              ReaderOptions options = ReaderOptions(),
+              SharedMemoryVatNetwork::PeerTrust trust =
+                  SharedMemoryVatNetwork::PeerTrust::UNTRUSTED)
+      : io(kj::setupAsyncIo()),
+        fds(SharedMemoryVatNetwork::newChannel(bufferBytes)),
+        serverNetwork(io.unixEventPort, dupFds(fds), rpc::twoparty::Side::SERVER, options, trust),
+        clientNetwork(io.unixEventPort, kj::mv(fds), rpc::twoparty::Side::CLIENT, options, trust),
+        server(makeRpcServer(serverNetwork, kj::mv(bootstrap))),
+        client(makeRpcClient(clientNetwork)) {}
+
+  template <typename T>
+  typename T::Client connect() {
+    MallocMessageBuilder vatId;
+    vatId.initRoot<rpc::twoparty::VatId>().setSide(rpc::twoparty::Side::SERVER);
+    return client.bootstrap(vatId.getRoot<rpc::twoparty::VatId>()).castAs<T>();
+  }
+};
+
+KJ_TEST("SharedMemoryVatNetwork basic calls") {
+  int callCount = 0;
+  TestContext context(kj::heap<TestInterfaceImpl>(callCount),
+                      SharedMemoryVatNetwork::DEFAULT_BUFFER_BYTES);
+  auto client = context.connect<test::TestInterface>();
+
+  for (uint i = 0; i < 3; i++) {
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    auto response = request.send().wait(context.io.waitScope);
+    KJ_EXPECT(response.getX() == "foo");
+  }
+
+  KJ_EXPECT(callCount == 3);
+}
+
+void testWrapAround(SharedMemoryVatNetwork::PeerTrust trust) {
+  // Many more calls than fit in the buffer at once, with every response kept around so that a
+  // trusting receiver must stop reading in place and start copying.
+  TestContext context(kj::heap<TestCallOrderImpl>(), 4096, ReaderOptions(), trust);
+  auto client = context.connect<test::TestCallOrder>();
+
+  kj::Vector<RemotePromise<test::TestCallOrder::GetCallSequenceResults>> promises;
+  for (uint i = 0; i < 1000; i++) {
+    auto request = client.getCallSequenceRequest();
+    request.setExpected(i);
+    promises.add(request.send());
+  }
+
+  kj::Vector<Response<test::TestCallOrder::GetCallSequenceResults>> responses;
+  for (auto& promise: promises) {
+    responses.add(promise.wait(context.io.waitScope));
+  }
+  for (auto i: kj::indices(responses)) {
+    KJ_EXPECT(responses[i].getN() == i);
+  }
+}
+
+KJ_TEST("SharedMemoryVatNetwork wraps around a small buffer") {
+  testWrapAround(SharedMemoryVatNetwork::PeerTrust::UNTRUSTED);
+}
+
+KJ_TEST("SharedMemoryVatNetwork wraps around a small buffer, reading in place") {
+  testWrapAround(SharedMemoryVatNetwork::PeerTrust::TRUSTED);
+}
+
+KJ_TEST("SharedMemoryVatNetwork sends large messages in pieces") {
+  int callCount = 0;
+  int handleCount = 0;
+  TestContext context(kj::heap<TestMoreStuffImpl>(callCount, handleCount), 65536,
+                      bigMessageOptions());
+  auto client = context.connect<test::TestMoreStuff>();
+
+  auto response = client.getEnormousStringRequest().send().wait(context.io.waitScope);
+  KJ_EXPECT(response.getStr().size() == 100000000);
+}
+
+KJ_TEST("SharedMemoryVatNetwork disconnects when the peer goes away") {
+  auto io = kj::setupAsyncIo();
+  auto fds = SharedMemoryVatNetwork::newChannel(65536);
+
+  int callCount = 0;
+  SharedMemoryVatNetwork serverNetwork(
+      io.unixEventPort, dupFds(fds), rpc::twoparty::Side::SERVER);
+  auto server = makeRpcServer(serverNetwork, kj::heap<TestInterfaceImpl>(callCount));
+
+  {
+    SharedMemoryVatNetwork clientNetwork(
+        io.unixEventPort, kj::mv(fds), rpc::twoparty::Side::CLIENT);
+    auto rpcClient = makeRpcClient(clientNetwork);
+
+    MallocMessageBuilder vatId;
+    vatId.initRoot<rpc::twoparty::VatId>().setSide(rpc::twoparty::Side::SERVER);
+    auto client = rpcClient.bootstrap(vatId.getRoot<rpc::twoparty::VatId>())
+        .castAs<test::TestInterface>();
+
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    request.send().wait(io.waitScope);
+  }
+
+  serverNetwork.onDisconnect().wait(io.waitScope);
+  KJ_EXPECT(callCount == 1);
+}
+
+KJ_TEST("SharedMemoryVatNetwork won't map a region the peer could resize") {
+  auto io = kj::setupAsyncIo();
+  auto fds = SharedMemoryVatNetwork::newChannel(65536);
+
+  // The region from newChannel() can't be shrunk.
+  KJ_EXPECT(ftruncate(fds.memory, 0) < 0 && errno == EPERM);
+
+  // An unsealed copy of it is rejected.
+  struct stat stats;
+  KJ_SYSCALL(fstat(fds.memory, &stats));
+  auto contents = kj::heapArray<kj::byte>(stats.st_size);
+  ssize_t n;
+  KJ_SYSCALL(n = pread(fds.memory, contents.begin(), contents.size(), 0));
+  KJ_ASSERT(n == contents.size());
+
+  int memfd;
+  KJ_SYSCALL(memfd = memfd_create("capnp-rpc-test", MFD_CLOEXEC));
+  kj::AutoCloseFd unsealed(memfd);
+  KJ_SYSCALL(n = pwrite(unsealed, contents.begin(), contents.size(), 0));
+  KJ_ASSERT(n == contents.size());
+
+  SharedMemoryVatNetwork::Fds unsealedFds = {
+    kj::mv(unsealed), dupFd(fds.clientEvent), dupFd(fds.serverEvent) };
+  KJ_EXPECT_THROW_MESSAGE("was not created by SharedMemoryVatNetwork::newChannel()",
+      SharedMemoryVatNetwork(io.unixEventPort, kj::mv(unsealedFds), rpc::twoparty::Side::SERVER));
+}
+
+}  // namespace
+}  // namespace _
+}  // namespace capnp
+
+#endif  // __linux__
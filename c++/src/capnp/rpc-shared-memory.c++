@@ -0,0 +1,764 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "rpc-shared-memory.h"
+
+#if __linux__
+
+#include "serialize.h"
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace capnp {
+
+namespace {
+
+// Layout of the shared memory region:
+//
+//   RegionHeader, padded to a page
+//   for each direction (client -> server, then server -> client):
+//     Descriptor[slotCount]   queue of messages, written by the sender
+//     uint8_t[slotCount]      which slots are in use: set by the sender, cleared by the receiver
+//     data, padded to a page  slotCount slots of SLOT_WORDS words each
+//
+// Queue positions count descriptors since the start of the connection and only ever increase;
+// a descriptor's index in the queue is its position modulo slotCount. The queue can't overflow in
+// practice since every queued descriptor holds at least one slot, but the sender checks anyway.
+//
+// All shared words are accessed with sequentially-consistent atomics. The "waiting" flags follow
+// the usual pattern: a side that wants to sleep sets its flag and then re-checks for progress,
+// while the side making progress publishes it and then checks the flag, so one of the two always
+// sees the other.
+
+constexpr uint64_t REGION_MAGIC = 0x6d68735f706e6163ull;  // "capn_shm"
+constexpr size_t PAGE_BYTES = 4096;
+constexpr uint SLOT_WORDS = 32;
+constexpr uint64_t MAX_SLOTS = 1u << 24;
+constexpr int REQUIRED_SEALS = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+struct DirectionHeader {
+  alignas(64) uint64_t head;    // Written by the sender: position past the last queued descriptor.
+  uint32_t receiverWaiting;     // Set by the receiver before it sleeps waiting for descriptors.
+  uint32_t closed;              // Set by the sender once it will send no more.
+
+  alignas(64) uint64_t tail;    // Written by the receiver: position past the last one it popped.
+  uint32_t heldSlots;           // Number of slots the receiver is holding for in-place messages.
+  uint32_t senderWaiting;       // Set by the sender before it sleeps waiting for space.
+  uint32_t receiverClosed;      // Set by the receiver once it will receive no more.
+};
+
+struct RegionHeader {
+  uint64_t magic;
+  uint64_t slotCount;
+  DirectionHeader directions[2];
+};
+
+static_assert(sizeof(RegionHeader) <= PAGE_BYTES, "RegionHeader doesn't fit in its page");
+
+enum class DescriptorType: uint32_t {
+  MESSAGE = 1,
+  // A whole message, framed as by writeMessage().
+
+  FRAGMENT = 2,
+  LAST_FRAGMENT = 3,
+  // Consecutive pieces of one message which is too big for any run of free slots. The receiver
+  // concatenates them.
+};
+
+struct Descriptor {
+  DescriptorType type;
+  uint32_t firstSlot;
+  uint32_t words;
+  uint32_t reserved;
+};
+
+inline size_t roundUpToPage(size_t bytes) {
+  return (bytes + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+}
+
+inline uint32_t slotsFor(size_t words) {
+  return (words + SLOT_WORDS - 1) / SLOT_WORDS;
+}
+
+struct Layout {
+  size_t descriptorsOffset[2];
+  size_t flagsOffset[2];
+  size_t dataOffset[2];
+  size_t totalBytes;
+
+  explicit Layout(uint64_t slotCount) {
+    size_t offset = PAGE_BYTES;
+    for (uint i: kj::zeroTo(2)) {
+      descriptorsOffset[i] = offset;
+      offset += slotCount * sizeof(Descriptor);
+      flagsOffset[i] = offset;
+      offset = roundUpToPage(offset + slotCount);
+      dataOffset[i] = offset;
+      offset += slotCount * SLOT_WORDS * sizeof(word);
+    }
+    totalBytes = offset;
+  }
+};
+
+template <typename T>
+inline T load(const T& slot) {
+  return __atomic_load_n(&slot, __ATOMIC_SEQ_CST);
+}
+
+template <typename T>
+inline void store(T& slot, T value) {
+  __atomic_store_n(&slot, value, __ATOMIC_SEQ_CST);
+}
+
+inline Descriptor loadDescriptor(const Descriptor& descriptor) {
+  // Copies a descriptor the peer may be writing to. The fields are checked after copying, so it
+  // doesn't matter if they're torn, as long as each one is read only once.
+  Descriptor result;
+  result.type = static_cast<DescriptorType>(
+      __atomic_load_n(reinterpret_cast<const uint32_t*>(&descriptor.type), __ATOMIC_RELAXED));
+  result.firstSlot = __atomic_load_n(&descriptor.firstSlot, __ATOMIC_RELAXED);
+  result.words = __atomic_load_n(&descriptor.words, __ATOMIC_RELAXED);
+  result.reserved = 0;
+  return result;
+}
+
+inline bool takeFlag(uint32_t& flag) {
+  // Clears `flag`, returning whether it was set. Checks with a plain load first since the flag is
+  // usually clear.
+  return load(flag) != 0 && __atomic_exchange_n(&flag, 0, __ATOMIC_SEQ_CST) != 0;
+}
+
+kj::AutoCloseFd newEventFd() {
+  int fd;
+  KJ_SYSCALL(fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  return kj::AutoCloseFd(fd);
+}
+
+}  // namespace
+
+class SharedMemoryVatNetwork::Channel final: public kj::Refcounted {
+  // The mapped region and the state of both directions as seen from one side. Refcounted because
+  // messages read in place must keep the mapping alive.
+
+public:
+  struct PendingWrite {
+    // A message that is being copied into the buffer, possibly in several pieces. The words
+    // copied are the segment table followed by the segments, exactly as writeMessage() would
+    // write them to a stream.
+
+    kj::Array<word> table;
+    kj::ArrayPtr<const kj::ArrayPtr<const word>> segments;
+
+    uint piece = 0;      // 0 for the table, i + 1 for segments[i].
+    size_t offset = 0;   // Words of the current piece already copied.
+    size_t remaining;    // Words left to copy.
+    bool started = false;
+    bool fragmented = false;
+
+    explicit PendingWrite(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments)
+        : table(kj::heapArray<word>((segments.size() + 2) / 2)), segments(segments) {
+      auto entries = reinterpret_cast<_::WireValue<uint32_t>*>(table.begin());
+      entries[0].set(segments.size() - 1);
+      remaining = table.size();
+      for (auto i: kj::indices(segments)) {
+        entries[i + 1].set(segments[i].size());
+        remaining += segments[i].size();
+      }
+      if (segments.size() % 2 == 0) {
+        // Set padding byte.
+        entries[segments.size() + 1].set(0);
+      }
+    }
+
+    void copyTo(word* dst, size_t count) {
+      remaining -= count;
+      while (count > 0) {
+        auto current = piece == 0 ? table.asPtr().asConst() : segments[piece - 1];
+        size_t n = kj::min(count, current.size() - offset);
+        memcpy(dst, current.begin() + offset, n * sizeof(word));
+        dst += n;
+        count -= n;
+        offset += n;
+        if (offset == current.size()) {
+          ++piece;
+          offset = 0;
+        }
+      }
+    }
+  };
+
+  Channel(kj::UnixEventPort& eventPort, Fds fdsParam, rpc::twoparty::Side side, PeerTrust trust)
+      : readInPlace(trust == PeerTrust::TRUSTED),
+        fds(kj::mv(fdsParam)),
+        waitFd(side == rpc::twoparty::Side::CLIENT ? fds.clientEvent : fds.serverEvent),
+        signalFd(side == rpc::twoparty::Side::CLIENT ? fds.serverEvent : fds.clientEvent),
+        observer(eventPort, waitFd, kj::UnixEventPort::FdObserver::OBSERVE_READ) {
+    // Without these seals, the peer could shrink the memory after we map it, and our next
+    // access past the new end would raise SIGBUS.
+    int seals;
+    KJ_SYSCALL(seals = fcntl(fds.memory, F_GET_SEALS));
+    KJ_REQUIRE((seals & REQUIRED_SEALS) == REQUIRED_SEALS,
+               "shared memory region was not created by SharedMemoryVatNetwork::newChannel()");
+
+    struct stat stats;
+    KJ_SYSCALL(fstat(fds.memory, &stats));
+    KJ_REQUIRE(stats.st_size >= PAGE_BYTES, "shared memory region is too small to be a channel");
+    mappingSize = stats.st_size;
+
+    void* mapped = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fds.memory, 0);
+    if (mapped == MAP_FAILED) {
+      KJ_FAIL_SYSCALL("mmap", errno);
+    }
+    mapping = reinterpret_cast<kj::byte*>(mapped);
+    KJ_ON_SCOPE_FAILURE(munmap(mapping, mappingSize));
+
+    // The peer can write to the header at any time, so read each field once.
+    auto& header = *reinterpret_cast<RegionHeader*>(mapping);
+    uint64_t magic = load(header.magic);
+    uint64_t headerSlotCount = load(header.slotCount);
+    KJ_REQUIRE(magic == REGION_MAGIC && headerSlotCount > 0 && headerSlotCount <= MAX_SLOTS &&
+               Layout(headerSlotCount).totalBytes == mappingSize,
+               "shared memory region was not created by SharedMemoryVatNetwork::newChannel()");
+    slotCount = headerSlotCount;
+
+    Layout layout(slotCount);
+    uint outIndex = side == rpc::twoparty::Side::CLIENT ? 0 : 1;
+    uint inIndex = 1 - outIndex;
+    out = { &header.directions[outIndex],
+            reinterpret_cast<Descriptor*>(mapping + layout.descriptorsOffset[outIndex]),
+            reinterpret_cast<uint8_t*>(mapping + layout.flagsOffset[outIndex]),
+            reinterpret_cast<word*>(mapping + layout.dataOffset[outIndex]) };
+    in = { &header.directions[inIndex],
+           reinterpret_cast<Descriptor*>(mapping + layout.descriptorsOffset[inIndex]),
+           reinterpret_cast<uint8_t*>(mapping + layout.flagsOffset[inIndex]),
+           reinterpret_cast<word*>(mapping + layout.dataOffset[inIndex]) };
+
+    writePos = load(out.header->head);
+    readPos = load(in.header->tail);
+  }
+
+  ~Channel() noexcept(false) {
+    munmap(mapping, mappingSize);
+  }
+
+  size_t getBufferBytes() { return slotCount * SLOT_WORDS * sizeof(word); }
+
+  void closeOutgoing() {
+    // We won't send anything more.
+    store(out.header->closed, 1u);
+    signalPeer();
+  }
+
+  void closeIncoming() {
+    // We won't receive anything more, so a sender waiting for space should give up.
+    store(in.header->receiverClosed, 1u);
+    signalPeer();
+  }
+
+  // -------------------------------------------------------------------------------------------
+  // Sending
+
+  bool tryWrite(PendingWrite& write) {
+    // Copies as much of `write` into the buffer as currently fits. Returns true if it's all been
+    // sent.
+
+    while (write.remaining > 0) {
+      if (load(out.header->receiverClosed)) {
+        kj::throwFatalException(KJ_EXCEPTION(DISCONNECTED, "peer closed the shared memory channel"));
+      }
+
+      uint64_t tail = load(out.header->tail);
+      KJ_REQUIRE(tail <= writePos && writePos - tail <= slotCount,
+                 "peer corrupted the shared memory queue");
+      if (writePos - tail == slotCount) {
+        return false;
+      }
+
+      uint32_t needed = slotsFor(write.remaining);
+      uint32_t count;
+      uint32_t first;
+      if (!write.started && needed <= slotCount / 2) {
+        // Try to send it whole so that the receiver can read it in place, or copy it out in one go.
+        first = allocate(needed, needed, count);
+        if (first == NONE) {
+          if (inUse > load(out.header->heldSlots)) {
+            // The receiver has yet to free some slots. Wait for it.
+            return false;
+          }
+          // Everything in use is being held by the receiver for messages it's still reading, so
+          // waiting may not help. Split up the message to fit the gaps.
+          write.fragmented = true;
+          first = allocate(1, needed, count);
+        }
+      } else {
+        // Too big to be read in place anyway, or already being sent in pieces.
+        write.fragmented = true;
+        first = allocate(1, needed, count);
+      }
+      if (first == NONE) {
+        return false;
+      }
+
+      size_t words = kj::min(write.remaining, size_t(count) * SLOT_WORDS);
+      write.copyTo(out.data + size_t(first) * SLOT_WORDS, words);
+      write.started = true;
+
+      Descriptor descriptor;
+      descriptor.type = !write.fragmented ? DescriptorType::MESSAGE
+                      : write.remaining == 0 ? DescriptorType::LAST_FRAGMENT
+                      : DescriptorType::FRAGMENT;
+      descriptor.firstSlot = first;
+      descriptor.words = words;
+      descriptor.reserved = 0;
+      out.descriptors[writePos % slotCount] = descriptor;
+      store(out.header->head, ++writePos);
+
+      if (takeFlag(out.header->receiverWaiting)) {
+        signalPeer();
+      }
+    }
+
+    return true;
+  }
+
+  kj::Promise<void> write(kj::Own<PendingWrite> write) {
+    // Sends all of `write`, waiting for the receiver to free space as needed.
+
+    if (tryWrite(*write)) {
+      return kj::READY_NOW;
+    }
+
+    store(out.header->senderWaiting, 1u);
+    if (tryWrite(*write)) {
+      store(out.header->senderWaiting, 0u);
+      return kj::READY_NOW;
+    }
+
+    return whenSignaled().then([this, write = kj::mv(write)]() mutable {
+      return this->write(kj::mv(write));
+    });
+  }
+
+  // -------------------------------------------------------------------------------------------
+  // Receiving
+
+  kj::Promise<kj::Maybe<kj::Own<MessageReader>>> read(ReaderOptions options) {
+    bool atEnd = false;
+    KJ_IF_MAYBE(message, tryRead(options, atEnd)) {
+      return kj::Maybe<kj::Own<MessageReader>>(kj::mv(*message));
+    } else if (atEnd) {
+      return kj::Maybe<kj::Own<MessageReader>>(nullptr);
+    }
+
+    store(in.header->receiverWaiting, 1u);
+    KJ_IF_MAYBE(message, tryRead(options, atEnd)) {
+      store(in.header->receiverWaiting, 0u);
+      return kj::Maybe<kj::Own<MessageReader>>(kj::mv(*message));
+    } else if (atEnd) {
+      return kj::Maybe<kj::Own<MessageReader>>(nullptr);
+    }
+
+    return whenSignaled().then([this, options]() {
+      return read(options);
+    });
+  }
+
+private:
+  struct Direction {
+    DirectionHeader* header;
+    Descriptor* descriptors;
+    uint8_t* slotsInUse;
+    word* data;
+  };
+
+  bool readInPlace;
+  // Whether messages may be parsed where they lie in shared memory. See PeerTrust.
+
+  Fds fds;
+  int waitFd;
+  int signalFd;
+  kj::UnixEventPort::FdObserver observer;
+
+  kj::byte* mapping = nullptr;
+  size_t mappingSize = 0;
+  uint32_t slotCount = 0;
+  Direction out;
+  Direction in;
+
+  static constexpr uint32_t NONE = kj::maxValue;
+
+  // Sender state.
+  uint64_t writePos;
+  uint32_t allocCursor = 0;
+  uint32_t inUse = 0;
+  // Slots found in use by the last allocate() that failed.
+
+  // Receiver state.
+  uint64_t readPos;
+  uint32_t heldSlots = 0;
+  kj::Vector<word> fragments;
+
+  // Wakeups.
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> waiters;
+  kj::Maybe<kj::Promise<void>> signalPump;
+  kj::Maybe<kj::Exception> signalError;
+
+  uint32_t allocate(uint32_t minSlots, uint32_t maxSlots, uint32_t& count) {
+    // Finds the first run of at least `minSlots` free slots, starting from where the last
+    // allocation left off, and marks up to `maxSlots` of it in use. Returns the first slot, or
+    // NONE if there's no such run, in which case `inUse` is updated.
+
+    uint32_t pos = allocCursor;
+    uint32_t scanned = 0;
+    uint32_t used = 0;
+    while (scanned < slotCount) {
+      if (pos == slotCount) pos = 0;
+
+      if (load(out.slotsInUse[pos]) != 0) {
+        ++pos;
+        ++scanned;
+        ++used;
+        continue;
+      }
+
+      uint32_t start = pos;
+      uint32_t length = 0;
+      while (pos < slotCount && length < maxSlots && scanned < slotCount &&
+             load(out.slotsInUse[pos]) == 0) {
+        ++pos;
+        ++length;
+        ++scanned;
+      }
+
+      if (length >= minSlots) {
+        for (uint32_t i = start; i < pos; i++) {
+          __atomic_store_n(&out.slotsInUse[i], 1, __ATOMIC_RELAXED);
+        }
+        allocCursor = pos;
+        count = length;
+        return start;
+      }
+    }
+
+    inUse = used;
+    return NONE;
+  }
+
+  kj::Maybe<kj::Own<MessageReader>> tryRead(ReaderOptions options, bool& atEnd) {
+    for (;;) {
+      uint64_t head = load(in.header->head);
+      KJ_REQUIRE(readPos <= head && head - readPos <= slotCount,
+                 "peer corrupted the shared memory queue");
+
+      if (readPos == head) {
+        if (load(in.header->closed) && load(in.header->head) == readPos) {
+          atEnd = true;
+        }
+        return nullptr;
+      }
+
+      Descriptor descriptor = loadDescriptor(in.descriptors[readPos % slotCount]);
+      uint32_t first = descriptor.firstSlot;
+      size_t words = descriptor.words;
+      uint32_t slots = slotsFor(words);
+      KJ_REQUIRE(words > 0 && first < slotCount && slots <= slotCount - first,
+                 "peer sent a malformed shared memory descriptor");
+      auto data = kj::arrayPtr<const word>(in.data + size_t(first) * SLOT_WORDS, words);
+
+      kj::Maybe<kj::Own<MessageReader>> result;
+      switch (descriptor.type) {
+        case DescriptorType::MESSAGE:
+          if (readInPlace && heldSlots + slots <= slotCount / 2) {
+            // Read it in place. The slots are freed when the reader is destroyed.
+            heldSlots += slots;
+            store(in.header->heldSlots, heldSlots);
+            result = kj::heap<FlatArrayMessageReader>(data, options)
+                .attach(kj::defer([self = kj::addRef(*this), first, slots]() mutable {
+              self->releaseHeld(first, slots);
+            }));
+          } else {
+            auto copy = kj::heapArray(data);
+            freeSlots(first, slots);
+            result = kj::heap<FlatArrayMessageReader>(copy, options).attach(kj::mv(copy));
+          }
+          break;
+
+        case DescriptorType::FRAGMENT:
+        case DescriptorType::LAST_FRAGMENT:
+          KJ_REQUIRE(fragments.size() + words <= options.traversalLimitInWords,
+                     "Message is too large. To increase the limit on the receiving end, see "
+                     "capnp::ReaderOptions.");
+          fragments.addAll(data);
+          freeSlots(first, slots);
+          if (descriptor.type == DescriptorType::LAST_FRAGMENT) {
+            auto whole = fragments.releaseAsArray();
+            result = kj::heap<FlatArrayMessageReader>(whole, options).attach(kj::mv(whole));
+          }
+          break;
+
+        default:
+          KJ_FAIL_REQUIRE("peer sent a shared memory descriptor of unknown type",
+                          (uint)descriptor.type);
+      }
+
+      store(in.header->tail, ++readPos);
+      if (takeFlag(in.header->senderWaiting)) {
+        signalPeer();
+      }
+
+      if (result != nullptr) {
+        return kj::mv(result);
+      }
+    }
+  }
+
+  void releaseHeld(uint32_t first, uint32_t count) {
+    // Called when a message read in place is dropped.
+    heldSlots -= count;
+    store(in.header->heldSlots, heldSlots);
+    freeSlots(first, count);
+  }
+
+  void freeSlots(uint32_t first, uint32_t count) {
+    for (uint32_t i = first; i < first + count; i++) {
+      store(in.slotsInUse[i], uint8_t(0));
+    }
+    if (takeFlag(in.header->senderWaiting)) {
+      signalPeer();
+    }
+  }
+
+  // -------------------------------------------------------------------------------------------
+  // Wakeups
+
+  void signalPeer() {
+    uint64_t one = 1;
+    ssize_t n;
+    KJ_SYSCALL(n = ::write(signalFd, &one, sizeof(one)));
+  }
+
+  kj::Promise<void> whenSignaled() {
+    // Resolves the next time the peer signals our eventfd. Both the sending and the receiving
+    // side may be waiting at once, but the FdObserver only accepts one waiter, so a single loop
+    // watches the eventfd and wakes everyone.
+
+    KJ_IF_MAYBE(e, signalError) {
+      return kj::cp(*e);
+    }
+
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    waiters.add(kj::mv(paf.fulfiller));
+    if (signalPump == nullptr) {
+      signalPump = pumpSignals().eagerlyEvaluate([this](kj::Exception&& e) {
+        for (auto& waiter: waiters) {
+          waiter->reject(kj::cp(e));
+        }
+        waiters.clear();
+        signalError = kj::mv(e);
+      });
+    }
+    return kj::mv(paf.promise);
+  }
+
+  kj::Promise<void> pumpSignals() {
+    return observer.whenBecomesReadable().then([this]() {
+      // Reset the eventfd's counter, so that the next signal is a new edge.
+      uint64_t count;
+      ssize_t n;
+      KJ_NONBLOCKING_SYSCALL(n = ::read(waitFd, &count, sizeof(count)));
+
+      auto ready = kj::mv(waiters);
+      for (auto& waiter: ready) {
+        waiter->fulfill();
+      }
+      return pumpSignals();
+    });
+  }
+};
+
+// =======================================================================================
+
+SharedMemoryVatNetwork::Fds SharedMemoryVatNetwork::newChannel(size_t bufferBytes) {
+  uint64_t slotCount = kj::max(slotsFor((bufferBytes + sizeof(word) - 1) / sizeof(word)), 8u);
+  KJ_REQUIRE(slotCount <= MAX_SLOTS, "shared memory buffer is too big", bufferBytes);
+  Layout layout(slotCount);
+
+  int memfd;
+  KJ_SYSCALL(memfd = memfd_create("capnp-rpc", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+  kj::AutoCloseFd memory(memfd);
+  KJ_SYSCALL(ftruncate(memory, layout.totalBytes));
+
+  // The new region is zero-filled, which is a valid initial state apart from the header fields
+  // set here.
+  RegionHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = REGION_MAGIC;
+  header.slotCount = slotCount;
+  ssize_t n;
+  KJ_SYSCALL(n = pwrite(memory, &header, sizeof(header), 0));
+  KJ_ASSERT(n == sizeof(header));
+  KJ_SYSCALL(fcntl(memory, F_ADD_SEALS, REQUIRED_SEALS));
+
+  return { kj::mv(memory), newEventFd(), newEventFd() };
+}
+
+SharedMemoryVatNetwork::SharedMemoryVatNetwork(
+    kj::UnixEventPort& eventPort, Fds fds, rpc::twoparty::Side side, ReaderOptions receiveOptions,
+    PeerTrust trust)
+    : channel(kj::refcounted<Channel>(eventPort, kj::mv(fds), side, trust)),
+      connectionState(*this, side), receiveOptions(receiveOptions),
+      previousWrite(kj::READY_NOW) {}
+
+SharedMemoryVatNetwork::~SharedMemoryVatNetwork() noexcept(false) {
+  // Like closing a socket: the peer sees end-of-stream, and its writes fail.
+  channel->closeOutgoing();
+  channel->closeIncoming();
+}
+
+kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> SharedMemoryVatNetwork::connect(
+    rpc::twoparty::VatId::Reader ref) {
+  return connectionState.connect(ref);
+}
+
+kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> SharedMemoryVatNetwork::accept() {
+  return connectionState.accept();
+}
+
+class SharedMemoryVatNetwork::OutgoingMessageImpl final
+    : public OutgoingRpcMessage, public kj::Refcounted {
+public:
+  OutgoingMessageImpl(SharedMemoryVatNetwork& network, uint firstSegmentWordSize)
+      : network(network),
+        message(firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS
+                                          : firstSegmentWordSize) {}
+
+  AnyPointer::Builder getBody() override {
+    return message.getRoot<AnyPointer>();
+  }
+
+  void setFds(kj::Array<int> fds) override {
+    // FD passing isn't supported.
+  }
+
+  void send() override {
+    size_t size = message.sizeInWords();
+    if (!_::checkOutgoingMessageSize(size, network.receiveOptions)) return;
+
+    auto& previousWrite = KJ_ASSERT_NONNULL(network.previousWrite, "already shut down");
+    auto write = kj::heap<Channel::PendingWrite>(message.getSegmentsForOutput());
+
+    if (network.queuedWrites == 0) {
+      // Nothing is queued ahead of us, so try to copy the message in right away.
+      bool done = false;
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        done = network.channel->tryWrite(*write);
+      })) {
+        // As with a failed socket write, leave it to the read side to report the problem. The
+        // count is never decremented, so all further writes are skipped.
+        ++network.queuedWrites;
+        network.previousWrite = kj::Promise<void>(kj::mv(*exception));
+        return;
+      }
+      if (done) {
+        return;
+      }
+    }
+
+    ++network.queuedWrites;
+    network.previousWrite = previousWrite
+        .then([&network = network, write = kj::mv(write)]() mutable {
+      return network.channel->write(kj::mv(write));
+    }).then([&network = network]() {
+      --network.queuedWrites;
+    }).attach(kj::addRef(*this))
+      .eagerlyEvaluate(nullptr);
+  }
+
+  size_t sizeInWords() override {
+    return message.sizeInWords();
+  }
+
+private:
+  SharedMemoryVatNetwork& network;
+  MallocMessageBuilder message;
+};
+
+class SharedMemoryVatNetwork::IncomingMessageImpl final: public IncomingRpcMessage {
+public:
+  IncomingMessageImpl(kj::Own<MessageReader> message): message(kj::mv(message)) {}
+
+  AnyPointer::Reader getBody() override {
+    return message->getRoot<AnyPointer>();
+  }
+
+  size_t sizeInWords() override {
+    return message->sizeInWords();
+  }
+
+private:
+  kj::Own<MessageReader> message;
+};
+
+kj::Own<RpcFlowController> SharedMemoryVatNetwork::newStream() {
+  return RpcFlowController::newFixedWindowController(channel->getBufferBytes() / 2);
+}
+
+rpc::twoparty::VatId::Reader SharedMemoryVatNetwork::getPeerVatId() {
+  return connectionState.getPeerVatId();
+}
+
+kj::Own<OutgoingRpcMessage> SharedMemoryVatNetwork::newOutgoingMessage(
+    uint firstSegmentWordSize) {
+  return kj::refcounted<OutgoingMessageImpl>(*this, firstSegmentWordSize);
+}
+
+kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>>
+    SharedMemoryVatNetwork::receiveIncomingMessage() {
+  return kj::evalLater([this]() {
+    return channel->read(receiveOptions)
+        .then([](kj::Maybe<kj::Own<MessageReader>>&& message)
+              -> kj::Maybe<kj::Own<IncomingRpcMessage>> {
+      KJ_IF_MAYBE(m, message) {
+        return kj::Own<IncomingRpcMessage>(kj::heap<IncomingMessageImpl>(kj::mv(*m)));
+      } else {
+        return nullptr;
+      }
+    });
+  });
+}
+
+kj::Promise<void> SharedMemoryVatNetwork::shutdown() {
+  kj::Promise<void> result = KJ_ASSERT_NONNULL(previousWrite, "already shut down").then([this]() {
+    channel->closeOutgoing();
+  });
+  previousWrite = nullptr;
+  return kj::mv(result);
+}
+
+}  // namespace capnp
+
+#endif  // __linux__
@@ -0,0 +1,153 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+// A VatNetwork for two processes on the same (Linux) host, which exchanges messages through
+// shared memory rather than through a socket.
+//
+// With TwoPartyVatNetwork over a unix socket, every message is copied into the kernel by the
+// sender and back out by the receiver, and each side makes at least one syscall per batch of
+// messages. Here, the sender copies its message straight into shared memory and the receiver
+// copies it out (or, with a trusted peer, parses it where it lies), with no syscalls at all while
+// both sides are busy. An eventfd per side is used only to wake a peer that has gone to sleep
+// waiting for messages or for buffer space.
+
+#include "rpc.h"
+#include "rpc-twoparty.h"
+
+#if __linux__
+
+#include <kj/async-unix.h>
+
+CAPNP_BEGIN_HEADER
+
+namespace capnp {
+
+class SharedMemoryVatNetwork: public TwoPartyVatNetworkBase,
+                              private TwoPartyVatNetworkBase::Connection {
+  // A two-party `VatNetwork` whose connection is carried over shared memory. It uses the same
+  // VatId type as TwoPartyVatNetwork, so code written against one works with the other.
+  //
+  // One side calls newChannel() and passes the descriptors in the returned `Fds` to the other
+  // (e.g. by fork() or over a unix socket with SCM_RIGHTS). Each side then constructs a
+  // SharedMemoryVatNetwork from its copy of the descriptors.
+  //
+  // Each direction has a buffer of `bufferBytes`, divided into fixed-size slots. The sender copies
+  // each message into a run of free slots and queues a small descriptor for it; the receiver
+  // copies the message out to the heap and frees the slots right away. A message that doesn't
+  // fit in any run of free slots is sent in pieces, which the receiver reassembles in a heap
+  // buffer.
+  //
+  // Destroying the network tells the peer, which sees the connection close. Nothing is said if
+  // the process dies, though: if the peer may crash, watch for that separately (e.g. with a pidfd
+  // or a unix socket) and destroy the network when it happens.
+  //
+  // The peer can write to the shared memory at any time. Copying each message out before parsing
+  // it means that the message we parse is one the peer can no longer change, so it's validated
+  // just like a message read from a socket. See PeerTrust for skipping the copy.
+  //
+  // Only available on Linux.
+
+public:
+  static constexpr size_t DEFAULT_BUFFER_BYTES = 1 << 20;
+
+  struct Fds {
+    kj::AutoCloseFd memory;
+    // memfd holding the buffers for both directions.
+
+    kj::AutoCloseFd clientEvent;
+    kj::AutoCloseFd serverEvent;
+    // eventfds that wake up the client side and the server side, respectively.
+  };
+
+  enum class PeerTrust {
+    UNTRUSTED,
+    // Copy each message out of shared memory before parsing it. The default.
+
+    TRUSTED,
+    // Parse messages in place, freeing their slots when they're dropped, in whatever order that
+    // happens. Messages are still copied out once half of the buffer is held, so that a few
+    // long-lived messages (say, the results of a call that the application keeps around) can't
+    // starve the connection.
+    //
+    // The reader's bounds checks are NOT safe against a peer that writes to a message while we're
+    // reading it: a pointer may be checked and then re-read with a different value, and used to
+    // read outside the mapped region. Only use this when the peer is as trusted as our own
+    // process, e.g. a fork() of it running the same code.
+  };
+
+  static Fds newChannel(size_t bufferBytes = DEFAULT_BUFFER_BYTES);
+  // Creates and initializes a shared memory region holding a buffer of `bufferBytes` for each
+  // direction, along with the eventfds. The memory's size is sealed, so that neither side can
+  // shrink it under the other's mapping.
+
+  SharedMemoryVatNetwork(kj::UnixEventPort& eventPort, Fds fds, rpc::twoparty::Side side,
+                         ReaderOptions receiveOptions = ReaderOptions(),
+                         PeerTrust trust = PeerTrust::UNTRUSTED);
+  // `eventPort` is typically `kj::AsyncIoContext::unixEventPort`. Maps the memory in `fds`, which
+  // must have come from newChannel(); each side must pass a different `side`. `trust` applies to
+  // messages this side receives.
+
+  KJ_DISALLOW_COPY(SharedMemoryVatNetwork);
+  ~SharedMemoryVatNetwork() noexcept(false);
+
+  kj::Promise<void> onDisconnect() { return connectionState.onDisconnect(); }
+  // Returns a promise that resolves when the peer disconnects.
+
+  rpc::twoparty::Side getSide() { return connectionState.getSide(); }
+
+  // implements VatNetwork -----------------------------------------------------
+
+  kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> connect(
+      rpc::twoparty::VatId::Reader ref) override;
+  kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> accept() override;
+
+private:
+  class Channel;
+  class OutgoingMessageImpl;
+  class IncomingMessageImpl;
+
+  kj::Own<Channel> channel;
+  _::TwoPartyConnectionState connectionState;
+  ReaderOptions receiveOptions;
+
+  kj::Maybe<kj::Promise<void>> previousWrite;
+  // Resolves when the previous write completes, as in TwoPartyVatNetwork. Writes that find room
+  // in the buffer and have nothing queued ahead of them complete immediately and never touch this.
+  // Becomes null when shutdown() is called.
+
+  uint queuedWrites = 0;
+  // Number of messages waiting on previousWrite.
+
+  // implements Connection -----------------------------------------------------
+
+  kj::Own<RpcFlowController> newStream() override;
+  rpc::twoparty::VatId::Reader getPeerVatId() override;
+  kj::Own<OutgoingRpcMessage> newOutgoingMessage(uint firstSegmentWordSize) override;
+  kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveIncomingMessage() override;
+  kj::Promise<void> shutdown() override;
+};
+
+}  // namespace capnp
+
+CAPNP_END_HEADER
+
+#endif  // __linux__
@@ -0,0 +1,224 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#ifndef CAPNP_PRIVATE
+#error "This header is only meant to be included by Cap'n Proto's own source code."
+#endif
+
+// Tables of the IDs an RPC connection hands out to its peer.  Used by rpc.c++; they're declared
+// here so that rpc-test can exercise them directly.
+
+#include "common.h"
+#include <kj/debug.h>
+#include <kj/vector.h>
+
+CAPNP_BEGIN_HEADER
+
+namespace capnp {
+namespace _ {  // private
+
+inline uint lowestBit(uint64_t value) {
+  // Index of the lowest set bit.
+  //
+  // Undefined for value = 0.
+#if _MSC_VER && !defined(__clang__)
+  unsigned long i;
+  auto found = _BitScanForward64(&i, value);
+  KJ_DASSERT(found);  // !found means value = 0
+  return i;
+#else
+  return __builtin_ctzll(value);
+#endif
+}
+
+class FreeIdSet {
+  // A set of IDs that always hands out its lowest member first, in (effectively) constant time.
+  //
+  // This is a hierarchical bitmap: level 0 has a bit for every ID, set when the ID is in the set,
+  // and each bit of level N + 1 is set when the corresponding word of level N is non-zero.  The
+  // top level is a single word, so with 64-bit words, six levels cover every 32-bit ID.
+
+public:
+  bool empty() const { return levels.empty() || levels.back()[0] == 0; }
+
+  bool contains(uint id) const {
+    return levels.size() > 0 && id / 64 < levels[0].size() &&
+        (levels[0][id / 64] & (uint64_t(1) << (id % 64)));
+  }
+
+  void add(uint id) {
+    grow(id);
+    for (auto& level: levels) {
+      uint64_t& bits = level[id / 64];
+      bool wasEmpty = bits == 0;
+      bits |= uint64_t(1) << (id % 64);
+      if (!wasEmpty) break;
+      id /= 64;
+    }
+  }
+
+  void remove(uint id) {
+    KJ_DREQUIRE(contains(id));
+    for (auto& level: levels) {
+      uint64_t& bits = level[id / 64];
+      bits &= ~(uint64_t(1) << (id % 64));
+      if (bits != 0) break;
+      id /= 64;
+    }
+  }
+
+  uint takeLowest() {
+    KJ_DREQUIRE(!empty());
+    uint id = 0;
+    for (size_t i = levels.size(); i-- > 0;) {
+      id = id * 64 + lowestBit(levels[i][id]);
+    }
+    remove(id);
+    return id;
+  }
+
+  void shrink(uint limit) {
+    // Releases memory for IDs at or above `limit`, none of which may be in the set.
+
+    size_t words = limit;
+    for (auto& level: levels) {
+      words = (words + 63) / 64;
+      if (words < level.size()) {
+        level.truncate(kj::max(words, size_t(1)));
+        if (level.size() * 4 <= level.capacity()) {
+          level = kj::Vector<uint64_t>(level.releaseAsArray());
+        }
+      }
+    }
+  }
+
+  size_t capacityWords() const {
+    // Words of memory held for the bitmap.
+
+    size_t result = 0;
+    for (auto& level: levels) result += level.capacity();
+    return result;
+  }
+
+private:
+  kj::Vector<kj::Vector<uint64_t>> levels;
+
+  void grow(uint id) {
+    // Make sure there's room for `id`.
+
+    size_t words = size_t(id) / 64 + 1;
+    for (size_t i = 0;; i++) {
+      if (i == levels.size()) {
+        // Adding a level on top. Its one word summarizes the old top, which is also one word.
+        auto& level = levels.add();
+        level.add(i > 0 && levels[i - 1][0] != 0 ? 1 : 0);
+      }
+      auto& level = levels[i];
+      while (level.size() < words) level.add(0);
+      if (words == 1 && i + 1 == levels.size()) break;
+      words = (words + 63) / 64;
+    }
+  }
+};
+
+template <typename Id, typename T>
+class ExportTable {
+  // Table mapping integers to T, where the integers are chosen locally.
+
+public:
+  kj::Maybe<T&> find(Id id) {
+    if (id < slots.size() && slots[id] != nullptr) {
+      return slots[id];
+    } else {
+      return nullptr;
+    }
+  }
+
+  T erase(Id id, T& entry) {
+    // Remove an entry from the table and return it.  We return it so that the caller can be
+    // careful to release it (possibly invoking arbitrary destructors) at a time that makes sense.
+    // `entry` is a reference to the entry being released -- we require this in order to prove
+    // that the caller has already done a find() to check that this entry exists.  We can't check
+    // ourselves because the caller may have nullified the entry in the meantime.
+    KJ_DREQUIRE(&entry == &slots[id]);
+    T toRelease = kj::mv(slots[id]);
+    slots[id] = T();
+
+    if (id + 1 == slots.size()) {
+      // Drop free slots off the end rather than tracking them, so that the table shrinks back
+      // down after a burst.  (We don't release memory here, since that would move the remaining
+      // entries while callers may hold references to them; next() does it.)
+      slots.removeLast();
+      while (!slots.empty() && freeIds.contains(slots.size() - 1)) {
+        freeIds.remove(slots.size() - 1);
+        slots.removeLast();
+      }
+      freeIds.shrink(slots.size());
+    } else {
+      freeIds.add(id);
+    }
+
+    return toRelease;
+  }
+
+  T& next(Id& id) {
+    if (freeIds.empty()) {
+      if (slots.capacity() > MIN_SHRINK_CAPACITY && slots.size() * 4 <= slots.capacity()) {
+        // Mostly empty after a burst.  Like add(), this may move existing entries.
+        kj::Vector<T> newSlots(slots.size() * 2);
+        for (auto& slot: slots) newSlots.add(kj::mv(slot));
+        slots = kj::mv(newSlots);
+      }
+      id = slots.size();
+      return slots.add();
+    } else {
+      id = freeIds.takeLowest();
+      return slots[id];
+    }
+  }
+
+  template <typename Func>
+  void forEach(Func&& func) {
+    for (Id i = 0; i < slots.size(); i++) {
+      if (slots[i] != nullptr) {
+        func(i, slots[i]);
+      }
+    }
+  }
+
+  size_t capacity() const { return slots.capacity(); }
+  size_t freeIdCapacityWords() const { return freeIds.capacityWords(); }
+  // Memory held, as slots and as words of the free ID bitmap.
+
+private:
+  static constexpr size_t MIN_SHRINK_CAPACITY = 64;
+
+  kj::Vector<T> slots;
+  FreeIdSet freeIds;
+  // IDs below slots.size() whose slots are free. The last slot is never free.
+};
+
+}  // namespace _ (private)
+}  // namespace capnp
+
+CAPNP_END_HEADER
@@ -20,13 +20,16 @@
 // THE SOFTWARE.
 
 #define CAPNP_TESTING_CAPNP 1
+#define CAPNP_PRIVATE
 
 #include "rpc.h"
+#include "rpc-tables.h"
 #include "test-util.h"
 #include "schema.h"
 #include "serialize.h"
 #include <kj/debug.h>
 #include <kj/string-tree.h>
+#include <kj/time.h>
 #include <kj/compat/gtest.h>
 #include <capnp/rpc.capnp.h>
 #include <map>
@@ -209,6 +212,7 @@ public:
 
   uint getSentCount() { return sent; }
   uint getReceivedCount() { return received; }
+  uint getMultiSegmentSentCount() { return multiSegmentSent; }
 
   typedef TestNetworkAdapterBase::Connection Connection;
 
@@ -271,6 +275,9 @@ public:
         }
 
         ++connection.network.sent;
+        if (message.getSegmentsForOutput().size() > 1) {
+          ++connection.network.multiSegmentSent;
+        }
 
         // Uncomment to get a debug dump.
 //        kj::String msg = connection.network.network.dumper.dump(
@@ -407,6 +414,7 @@ private:
   kj::StringPtr self;
   uint sent = 0;
   uint received = 0;
+  uint multiSegmentSent = 0;
 
   std::map<const TestNetworkAdapter*, kj::Own<ConnectionImpl>> connections;
   std::queue<kj::Own<kj::PromiseFulfiller<kj::Own<Connection>>>> fulfillerQueue;
@@ -884,7 +892,9 @@ TEST(Rpc, RetainAndRelease) {
       auto capCopy = client.getHeldRequest().send().wait(context.waitScope).getCap();
 
       {
-        // And call it, without any network communications.
+        // And call it, without any network communications.  (First let the deferred `Finish` for
+        // getHeld() go out.)
+        context.waitScope.poll();
         uint oldSentCount = context.clientNetwork.getSentCount();
         auto request = capCopy.fooRequest();
         request.setI(123);
@@ -1456,6 +1466,930 @@ KJ_TEST("loopback bootstrap()") {
   KJ_EXPECT(callCount == 1);
 }
 
+KJ_TEST("Finish and Release are sent at the end of the turn") {
+  TestContext context;
+
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_MORE_STUFF)
+      .castAs<test::TestMoreStuff>();
+
+  {
+    kj::Maybe<Response<test::TestMoreStuff::GetHandleResults>> response =
+        client.getHandleRequest().send().wait(context.waitScope);
+    auto handle = KJ_ASSERT_NONNULL(response).getHandle();
+    context.waitScope.poll();
+    uint oldSentCount = context.clientNetwork.getSentCount();
+
+    // Dropping the response and the handle queues a `Finish` and a `Release`...
+    handle = nullptr;
+    response = nullptr;
+    KJ_EXPECT(context.clientNetwork.getSentCount() == oldSentCount);
+
+    // ...which go out once the turn ends.
+    context.waitScope.poll();
+    KJ_EXPECT(context.clientNetwork.getSentCount() == oldSentCount + 2);
+  }
+
+  // The connection still works, including reusing the finished question's ID.
+  client.getHandleRequest().send().wait(context.waitScope);
+}
+
+KJ_TEST("many simultaneous imports") {
+  // The server imports one capability per call and keeps each call outstanding, so both its
+  // import and answer tables grow to several pages.  Releasing everything empties the tables,
+  // and a second round must work just the same with the IDs reused.
+
+  constexpr uint COUNT = 1000;
+
+  TestContext context;
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_MORE_STUFF)
+      .castAs<test::TestMoreStuff>();
+
+  for (uint round = 0; round < 2; round++) {
+    kj::Vector<kj::Promise<void>> destroyed(COUNT);
+    kj::Vector<RemotePromise<test::TestMoreStuff::NeverReturnResults>> calls(COUNT);
+
+    for (uint i = 0; i < COUNT; i++) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      destroyed.add(kj::mv(paf.promise));
+      auto request = client.neverReturnRequest();
+      request.setCap(kj::heap<TestCapDestructor>(kj::mv(paf.fulfiller)));
+      calls.add(request.send());
+    }
+
+    // A round trip ensures that the server has received every call.
+    KJ_EXPECT(client.getCallSequenceRequest().send().wait(context.waitScope).getN() ==
+              (round + 1) * (COUNT + 1) - 1);
+    for (auto& promise: destroyed) {
+      KJ_EXPECT(!promise.poll(context.waitScope));
+    }
+
+    // Canceling the calls releases every capability the server imported.
+    calls.clear();
+    kj::joinPromises(destroyed.releaseAsArray()).wait(context.waitScope);
+  }
+}
+
+KJ_TEST("question IDs chosen by the peer") {
+  // Our own ExportTable allocates IDs densely, so send raw Bootstrap messages to exercise the
+  // server's answer table with scattered IDs, which mostly don't fit in its pages.
+
+  int callCount = 0;
+  TestContext context(kj::heap<TestInterfaceImpl>(callCount));
+
+  MallocMessageBuilder hostIdMessage(128);
+  auto hostId = hostIdMessage.initRoot<test::TestSturdyRefHostId>();
+  hostId.setHost("server");
+  auto conn = KJ_ASSERT_NONNULL(context.clientNetwork.connect(hostId));
+
+  auto bootstrap = [&](uint32_t id) {
+    auto msg = conn->newOutgoingMessage(16);
+    msg->getBody().initAs<rpc::Message>().initBootstrap().setQuestionId(id);
+    msg->send();
+  };
+  auto finish = [&](uint32_t id) {
+    auto msg = conn->newOutgoingMessage(16);
+    msg->getBody().initAs<rpc::Message>().initFinish().setQuestionId(id);
+    msg->send();
+  };
+  auto expectReturn = [&](uint32_t id) {
+    auto reply = KJ_ASSERT_NONNULL(conn->receiveIncomingMessage().wait(context.waitScope));
+    auto message = reply->getBody().getAs<rpc::Message>();
+    KJ_ASSERT(message.isReturn(), message.which());
+    KJ_EXPECT(message.getReturn().getAnswerId() == id);
+  };
+
+  uint32_t ids[] = { 0, 1, 200, 2, 1000000, 63, 64, 65, 0xffffffffu, 3 };
+  for (auto id: ids) {
+    bootstrap(id);
+    expectReturn(id);
+  }
+
+  // Every ID can be finished and then reused.
+  for (auto id: ids) {
+    finish(id);
+  }
+  for (auto id: ids) {
+    bootstrap(id);
+    expectReturn(id);
+  }
+
+  // An ID that's in use, wherever it's stored, can't be reused until it's finished.
+  bootstrap(1000000);
+  auto reply = KJ_ASSERT_NONNULL(conn->receiveIncomingMessage().wait(context.waitScope));
+  KJ_EXPECT(reply->getBody().getAs<rpc::Message>().isAbort());
+}
+
+class ForwardingPromiseHook final: public ClientHook, public kj::Refcounted {
+  // A promise capability that already forwards calls to `target` before it resolves to `target`,
+  // e.g. like a membrane that only later decides to get out of the way.
+
+public:
+  ForwardingPromiseHook(kj::Own<ClientHook> target, kj::Promise<void> resolved)
+      : target(kj::mv(target)), resolved(resolved.fork()) {}
+
+  Request<AnyPointer, AnyPointer> newCall(
+      uint64_t interfaceId, uint16_t methodId, kj::Maybe<MessageSize> sizeHint) override {
+    return target->newCall(interfaceId, methodId, sizeHint);
+  }
+  VoidPromiseAndPipeline call(uint64_t interfaceId, uint16_t methodId,
+                              kj::Own<CallContextHook>&& context) override {
+    return target->call(interfaceId, methodId, kj::mv(context));
+  }
+  kj::Maybe<ClientHook&> getResolved() override { return nullptr; }
+  kj::Maybe<kj::Promise<kj::Own<ClientHook>>> whenMoreResolved() override {
+    return resolved.addBranch().then([target = target->addRef()]() mutable {
+      return kj::mv(target);
+    });
+  }
+  kj::Own<ClientHook> addRef() override { return kj::addRef(*this); }
+  const void* getBrand() override { return nullptr; }
+  kj::Maybe<int> getFd() override { return nullptr; }
+
+private:
+  kj::Own<ClientHook> target;
+  kj::ForkedPromise<void> resolved;
+};
+
+class PromiseEchoer final: public test::TestMoreStuff::Server {
+  // echo() returns a promise for the given capability which forwards calls right away but only
+  // resolves once `resolved` does.
+
+public:
+  void setResolved(kj::Promise<void> promise) {
+    resolved = promise.fork();
+  }
+
+  kj::Promise<void> echo(EchoContext context) override {
+    auto hook = kj::refcounted<ForwardingPromiseHook>(
+        ClientHook::from(context.getParams().getCap()),
+        KJ_ASSERT_NONNULL(resolved).addBranch());
+    context.getResults().setCap(test::TestCallOrder::Client(kj::mv(hook)));
+    return kj::READY_NOW;
+  }
+
+private:
+  kj::Maybe<kj::ForkedPromise<void>> resolved;
+};
+
+KJ_TEST("embargo is skipped when all calls through the promise have returned") {
+  auto echoerOwn = kj::heap<PromiseEchoer>();
+  auto& echoer = *echoerOwn;
+  TestContext context(kj::mv(echoerOwn));
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  echoer.setResolved(kj::mv(paf.promise));
+
+  MallocMessageBuilder serverHostIdBuilder;
+  auto serverHostId = serverHostIdBuilder.getRoot<test::TestSturdyRefHostId>();
+  serverHostId.setHost("server");
+  auto client = context.rpcClient.bootstrap(serverHostId).castAs<test::TestMoreStuff>();
+
+  auto cap = test::TestCallOrder::Client(kj::heap<TestCallOrderImpl>());
+  auto echoRequest = client.echoRequest();
+  echoRequest.setCap(cap);
+  auto promiseCap = echoRequest.send().wait(context.waitScope).getCap();
+
+  // These go to the server and come back to `cap` through the unresolved promise.
+  KJ_EXPECT(getCallSequence(promiseCap, 0).wait(context.waitScope).getN() == 0);
+  KJ_EXPECT(getCallSequence(promiseCap, 1).wait(context.waitScope).getN() == 1);
+
+  // Resolve the promise back to `cap`. Nothing is in flight, so no embargo is needed.
+  paf.fulfiller->fulfill();
+  context.waitScope.poll();
+
+  auto stats = context.rpcClient.getEmbargoStats();
+  KJ_EXPECT(stats.reflectedResolutions == 1);
+  KJ_EXPECT(stats.embargoes == 0);
+  KJ_EXPECT(stats.embargoesSkipped == 1);
+
+  KJ_EXPECT(getCallSequence(promiseCap, 2).wait(context.waitScope).getN() == 2);
+}
+
+KJ_TEST("embargo stats count embargoes") {
+  TestContext context;
+
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_MORE_STUFF)
+      .castAs<test::TestMoreStuff>();
+
+  {
+    // Nothing called through the pipeline: no embargo.
+    auto cap = test::TestCallOrder::Client(kj::heap<TestCallOrderImpl>());
+    auto echoRequest = client.echoRequest();
+    echoRequest.setCap(cap);
+    auto echo = echoRequest.send();
+    auto pipeline = echo.getCap();
+    echo.wait(context.waitScope);
+    KJ_EXPECT(getCallSequence(pipeline, 0).wait(context.waitScope).getN() == 0);
+  }
+
+  auto stats = context.rpcClient.getEmbargoStats();
+  KJ_EXPECT(stats.reflectedResolutions == 1);
+  KJ_EXPECT(stats.embargoes == 0);
+  KJ_EXPECT(stats.embargoesSkipped == 0);
+
+  {
+    // A pipelined call still in flight when the pipeline resolves: embargo.
+    auto cap = test::TestCallOrder::Client(kj::heap<TestCallOrderImpl>());
+    auto echoRequest = client.echoRequest();
+    echoRequest.setCap(cap);
+    auto echo = echoRequest.send();
+    auto pipeline = echo.getCap();
+    auto call0 = getCallSequence(pipeline, 0);
+    echo.wait(context.waitScope);
+    auto call1 = getCallSequence(pipeline, 1);
+    KJ_EXPECT(call0.wait(context.waitScope).getN() == 0);
+    KJ_EXPECT(call1.wait(context.waitScope).getN() == 1);
+  }
+
+  stats = context.rpcClient.getEmbargoStats();
+  KJ_EXPECT(stats.reflectedResolutions == 2);
+  KJ_EXPECT(stats.embargoes == 1);
+  KJ_EXPECT(stats.embargoesSkipped == 0);
+}
+
+class FakeClock final: public kj::MonotonicClock {
+public:
+  kj::TimePoint now() const override { return time; }
+
+  kj::TimePoint time = kj::origin<kj::TimePoint>();
+};
+
+class FakeOutgoingMessage final: public OutgoingRpcMessage {
+public:
+  FakeOutgoingMessage(size_t words): words(words) {}
+
+  AnyPointer::Builder getBody() override { KJ_UNIMPLEMENTED("fake message has no body"); }
+  void send() override {}
+  size_t sizeInWords() override { return words; }
+
+private:
+  size_t words;
+};
+
+class SimulatedPath {
+  // A path with a given bandwidth and latency, with an unbounded queue in front of it, carrying
+  // messages from an AdaptiveFlowController. Acks arrive in the order messages were sent.
+
+public:
+  SimulatedPath(kj::WaitScope& waitScope, FakeClock& clock, RpcFlowController& controller)
+      : waitScope(waitScope), clock(clock), controller(controller), linkFree(clock.time) {}
+
+  void run(uint messageCount, uint64_t bytesPerSecond, kj::Duration latency) {
+    for (uint i = 0; i < messageCount; i++) {
+      auto start = kj::max(clock.time, linkFree);
+      linkFree = start + MESSAGE_WORDS * sizeof(word) * kj::SECONDS / bytesPerSecond;
+
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      acks.push({ linkFree + latency, kj::mv(paf.fulfiller) });
+      auto promise = controller.send(kj::heap<FakeOutgoingMessage>(MESSAGE_WORDS),
+                                     kj::mv(paf.promise));
+
+      // Deliver acks until the controller lets us send again.
+      while (!promise.poll(waitScope)) {
+        KJ_ASSERT(!acks.empty());
+        clock.time = acks.front().time;
+        acks.front().fulfiller->fulfill();
+        acks.pop();
+      }
+      promise.wait(waitScope);
+    }
+  }
+
+private:
+  static constexpr size_t MESSAGE_WORDS = 1024;
+
+  kj::WaitScope& waitScope;
+  FakeClock& clock;
+  RpcFlowController& controller;
+  kj::TimePoint linkFree;
+
+  struct Ack {
+    kj::TimePoint time;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  };
+  std::queue<Ack> acks;
+};
+
+KJ_TEST("AdaptiveFlowController tracks the bandwidth-delay product") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  FakeClock clock;
+  AdaptiveFlowController::Group group;
+  AdaptiveFlowController controller(clock, group);
+  SimulatedPath path(waitScope, clock, controller);
+
+  // 10MB/s with 50ms of latency: a bandwidth-delay product of 500kB, much more than the initial
+  // window.
+  path.run(3000, 10000000, 50 * kj::MILLISECONDS);
+
+  auto stats = controller.getStats();
+  KJ_EXPECT(!stats.startup);
+  KJ_EXPECT(stats.bandwidth > 9000000 && stats.bandwidth < 11000000, stats.bandwidth);
+  KJ_EXPECT(stats.minRtt >= 50 * kj::MILLISECONDS && stats.minRtt < 55 * kj::MILLISECONDS,
+            stats.minRtt);
+  KJ_EXPECT(stats.window > 800000 && stats.window < 1200000, stats.window);
+
+  // The queue in front of the path stays around one bandwidth-delay product.
+  KJ_EXPECT(stats.smoothedRtt < 150 * kj::MILLISECONDS, stats.smoothedRtt);
+
+  auto groupStats = group.getStats();
+  KJ_ASSERT(groupStats.size() == 1);
+  KJ_EXPECT(groupStats[0].window == stats.window);
+
+  // When the bandwidth drops to a tenth, the window follows once the old samples age out.
+  path.run(3000, 1000000, 50 * kj::MILLISECONDS);
+
+  stats = controller.getStats();
+  KJ_EXPECT(stats.bandwidth > 900000 && stats.bandwidth < 1100000, stats.bandwidth);
+  KJ_EXPECT(stats.window > 80000 && stats.window < 150000, stats.window);
+}
+
+KJ_TEST("AdaptiveFlowController stops counting a message whose ack fails") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  FakeClock clock;
+  AdaptiveFlowController controller(clock);
+
+  auto acked = kj::newPromiseAndFulfiller<void>();
+  auto failed = kj::newPromiseAndFulfiller<void>();
+  controller.send(kj::heap<FakeOutgoingMessage>(16), kj::mv(acked.promise)).wait(waitScope);
+  controller.send(kj::heap<FakeOutgoingMessage>(16), kj::mv(failed.promise)).wait(waitScope);
+  KJ_EXPECT(controller.getStats().inFlight == 2 * 16 * sizeof(word));
+
+  failed.fulfiller->reject(KJ_EXCEPTION(DISCONNECTED, "connection lost"));
+  waitScope.poll();
+  KJ_EXPECT(controller.getStats().inFlight == 16 * sizeof(word));
+
+  acked.fulfiller->fulfill();
+  waitScope.poll();
+  KJ_EXPECT(controller.getStats().inFlight == 0);
+}
+
+class RecordingCallObserver final: public RpcCallObserver {
+public:
+  kj::Vector<kj::String> events;
+  kj::Vector<Call> finished;
+
+  void callSent(const Call& call) override { record("sent", call); }
+  void callReceived(const Call& call) override { record("received", call); }
+  void callReturned(const Call& call) override { record("returned", call); }
+  void callFinished(const Call& call) override {
+    record("finished", call);
+    finished.add(call);
+  }
+
+private:
+  void record(kj::StringPtr event, const Call& call) {
+    events.add(kj::str(event, ' ', call.incoming ? "in" : "out", ' ', call.methodId));
+  }
+};
+
+KJ_TEST("RpcCallObserver sees both ends of a call") {
+  TestContext context;
+  RecordingCallObserver clientObserver;
+  RecordingCallObserver serverObserver;
+  context.rpcClient.setCallObserver(clientObserver);
+  context.rpcServer.setCallObserver(serverObserver);
+
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_INTERFACE)
+      .castAs<test::TestInterface>();
+
+  {
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    auto response = request.send().wait(context.waitScope);
+    KJ_EXPECT(response.getX() == "foo");
+  }
+
+  // Let the Finish message and the server's cleanup go through.
+  context.waitScope.poll();
+
+  KJ_EXPECT(kj::strArray(clientObserver.events, ", ") ==
+            "sent out 0, returned out 0, finished out 0",
+            kj::strArray(clientObserver.events, ", "));
+  KJ_EXPECT(kj::strArray(serverObserver.events, ", ") ==
+            "received in 0, returned in 0, finished in 0",
+            kj::strArray(serverObserver.events, ", "));
+
+  for (auto observer: { &clientObserver, &serverObserver }) {
+    KJ_ASSERT(observer->finished.size() == 1);
+    auto& call = observer->finished[0];
+    KJ_EXPECT(call.interfaceId == typeId<test::TestInterface>());
+    KJ_EXPECT(call.methodId == 0);
+    KJ_EXPECT(call.paramWords > 0);
+    KJ_EXPECT(call.resultWords > 0);
+    auto returnTime = KJ_ASSERT_NONNULL(call.returnTime);
+    KJ_EXPECT(call.startTime <= call.sendTime);
+    KJ_EXPECT(call.sendTime <= returnTime);
+    KJ_EXPECT(returnTime <= call.finishTime);
+  }
+
+  // Once unset, no more events are reported.
+  context.rpcClient.setCallObserver(nullptr);
+  {
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    request.send().wait(context.waitScope);
+  }
+  KJ_EXPECT(clientObserver.events.size() == 3);
+}
+
+KJ_TEST("PriorityCallScheduler admits by priority, then round-robin across connections") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  PriorityCallScheduler::Options options;
+  options.capacity = 1;
+  options.maxQueued = 4;
+  PriorityCallScheduler scheduler([](const RpcCallScheduler::Call& call) {
+    PriorityCallScheduler::Class result;
+    result.priority = call.methodId;
+    return result;
+  }, options);
+
+  int connection1, connection2;
+  auto admit = [&](const void* connection, uint16_t methodId) {
+    return scheduler.admit({ 0, methodId, 0, connection });
+  };
+
+  // There's capacity, so the first call runs right away.
+  auto running = admit(&connection1, 0).wait(waitScope);
+
+  auto a1 = admit(&connection1, 0);
+  auto a2 = admit(&connection1, 0);
+  auto b1 = admit(&connection2, 0);
+  auto urgent = admit(&connection2, 1);
+  KJ_EXPECT(scheduler.getStats().queued == 4);
+
+  // The queue is full.
+  KJ_EXPECT_THROW(OVERLOADED, admit(&connection2, 0).wait(waitScope));
+
+  running = nullptr;
+  KJ_EXPECT(urgent.poll(waitScope));
+  KJ_EXPECT(!a1.poll(waitScope));
+  running = urgent.wait(waitScope);
+
+  running = nullptr;
+  KJ_EXPECT(a1.poll(waitScope));
+  KJ_EXPECT(!b1.poll(waitScope));
+  running = a1.wait(waitScope);
+
+  // connection1 went last time, so connection2 goes next even though a2 arrived first.
+  running = nullptr;
+  KJ_EXPECT(b1.poll(waitScope));
+  KJ_EXPECT(!a2.poll(waitScope));
+  running = b1.wait(waitScope);
+
+  // Canceling a queued call removes it from the queue.
+  a2 = nullptr;
+  KJ_EXPECT(scheduler.getStats().queued == 0);
+
+  running = nullptr;
+  auto stats = scheduler.getStats();
+  KJ_EXPECT(stats.running == 0);
+  KJ_EXPECT(stats.admitted == 4);
+  KJ_EXPECT(stats.rejected == 1);
+}
+
+KJ_TEST("RpcSystem call scheduler defers and rejects calls") {
+  TestContext context;
+
+  PriorityCallScheduler::Options options;
+  options.capacity = 1;
+  PriorityCallScheduler scheduler([](const RpcCallScheduler::Call& call) {
+    if (call.interfaceId == typeId<test::TestMoreStuff>() && call.methodId == 10) {
+      // getNull()
+      KJ_FAIL_REQUIRE("getNull() not allowed");
+    }
+    return PriorityCallScheduler::Class();
+  }, options);
+  context.rpcServer.setCallScheduler(scheduler);
+
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_MORE_STUFF)
+      .castAs<test::TestMoreStuff>();
+
+  KJ_EXPECT_THROW_MESSAGE("getNull() not allowed",
+      client.getNullRequest().send().wait(context.waitScope));
+
+  // neverReturn() takes up all the capacity.
+  auto sendNeverReturn = [&]() {
+    auto request = client.neverReturnRequest();
+    request.setCap(kj::heap<TestInterfaceImpl>(context.restorer.callCount));
+    return request.send();
+  };
+  auto neverReturnPromise = sendNeverReturn();
+  context.waitScope.poll();
+  KJ_EXPECT(scheduler.getStats().running == 1);
+
+  // So this has to wait.
+  auto echo = client.echoRequest();
+  echo.setCap(test::TestCallOrder::Client(kj::heap<TestCallOrderImpl>()));
+  auto echoPromise = echo.send();
+  context.waitScope.poll();
+  KJ_EXPECT(!echoPromise.poll(context.waitScope));
+  KJ_EXPECT(scheduler.getStats().queued == 1);
+
+  // Once the caller gives up on neverReturn(), the echo() gets to run.
+  neverReturnPromise = nullptr;
+  echoPromise.wait(context.waitScope);
+
+  // A call canceled while queued never runs.
+  neverReturnPromise = sendNeverReturn();
+  context.waitScope.poll();
+  {
+    auto promise = client.getCallSequenceRequest().send();
+    context.waitScope.poll();
+    KJ_EXPECT(scheduler.getStats().queued == 1);
+  }
+  context.waitScope.poll();
+  KJ_EXPECT(scheduler.getStats().queued == 0);
+
+  neverReturnPromise = nullptr;
+  context.waitScope.poll();
+  KJ_EXPECT(scheduler.getStats().running == 0);
+
+  context.rpcServer.setCallScheduler(nullptr);
+}
+
+class RecordingInterface final: public test::TestInterface::Server {
+public:
+  explicit RecordingInterface(kj::Vector<kj::String>& log): log(log) {}
+
+  kj::Promise<void> foo(FooContext context) override {
+    log.add(kj::str("other"));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> bar(BarContext context) override {
+    log.add(kj::str("other bar"));
+    return kj::READY_NOW;
+  }
+
+private:
+  kj::Vector<kj::String>& log;
+};
+
+class CallRecorder final: public test::TestMoreStuff::Server {
+  // Records the order in which calls are delivered.
+
+public:
+  CallRecorder(kj::Vector<kj::String>& log, test::TestInterface::Client other)
+      : log(log), other(kj::mv(other)) {}
+
+  kj::Promise<void> neverReturn(NeverReturnContext context) override {
+    context.allowCancellation();
+    return kj::NEVER_DONE;
+  }
+
+  kj::Promise<void> methodWithDefaults(MethodWithDefaultsContext context) override {
+    log.add(kj::str("low"));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> getCallSequence(GetCallSequenceContext context) override {
+    log.add(kj::str("high"));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> getHeld(GetHeldContext context) override {
+    context.getResults().setCap(other);
+    return kj::READY_NOW;
+  }
+
+private:
+  kj::Vector<kj::String>& log;
+  test::TestInterface::Client other;
+};
+
+KJ_TEST("call scheduler only reorders calls to different targets") {
+  kj::Vector<kj::String> log;
+  TestContext context(kj::heap<CallRecorder>(
+      log, test::TestInterface::Client(kj::heap<RecordingInterface>(log))));
+
+  // getCallSequence() (inherited from TestCallOrder) and calls to TestInterface are urgent.
+  PriorityCallScheduler::Options options;
+  options.capacity = 1;
+  PriorityCallScheduler scheduler([](const RpcCallScheduler::Call& call) {
+    PriorityCallScheduler::Class result;
+    if (call.interfaceId == typeId<test::TestInterface>() ||
+        call.interfaceId == typeId<test::TestCallOrder>()) {
+      result.priority = 1;
+    }
+    return result;
+  }, options);
+  context.rpcServer.setCallScheduler(scheduler);
+
+  MallocMessageBuilder serverHostIdBuilder;
+  auto serverHostId = serverHostIdBuilder.getRoot<test::TestSturdyRefHostId>();
+  serverHostId.setHost("server");
+  auto client = context.rpcClient.bootstrap(serverHostId).castAs<test::TestMoreStuff>();
+  auto other = client.getHeldRequest().send().wait(context.waitScope).getCap();
+
+  // neverReturn() takes up all the capacity while the other calls arrive.
+  auto blocker = client.neverReturnRequest().send();
+  context.waitScope.poll();
+  KJ_EXPECT(scheduler.getStats().running == 1);
+
+  auto low = client.methodWithDefaultsRequest().send();
+  auto high = client.getCallSequenceRequest().send();
+  auto otherCall = other.fooRequest().send();
+  context.waitScope.poll();
+
+  // Only the first waiting call to each target has been passed to the scheduler.
+  KJ_EXPECT(scheduler.getStats().queued == 2);
+
+  // The urgent call to the other target goes first, but the urgent call to `client` can't
+  // overtake the call sent before it.
+  blocker = nullptr;
+  low.wait(context.waitScope);
+  high.wait(context.waitScope);
+  otherCall.wait(context.waitScope);
+  KJ_EXPECT(kj::strArray(log, ", ") == "other, low, high", kj::strArray(log, ", "));
+
+  context.rpcServer.setCallScheduler(nullptr);
+}
+
+class GatedCallScheduler final: public RpcCallScheduler {
+  // Holds back calls to TestCallOrder, or those matching `holdBack`, until open() is called.
+
+public:
+  explicit GatedCallScheduler(kj::Function<bool(const Call&)> holdBack = [](const Call& call) {
+        return call.interfaceId == typeId<test::TestCallOrder>();
+      })
+      : holdBack(kj::mv(holdBack)) {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    gate = paf.promise.fork();
+    fulfiller = kj::mv(paf.fulfiller);
+  }
+
+  void open() { fulfiller->fulfill(); }
+
+  kj::Promise<kj::Own<Ticket>> admit(const Call& call) override {
+    if (holdBack(call)) {
+      return gate.addBranch().then([]() { return kj::heap<Ticket>(); });
+    } else {
+      return kj::heap<Ticket>();
+    }
+  }
+
+private:
+  kj::Function<bool(const Call&)> holdBack;
+  kj::ForkedPromise<void> gate = nullptr;
+  kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+};
+
+KJ_TEST("call scheduler keeps a direct call behind one pipelined on the same object") {
+  // The client pipelines a call on getHeld()'s answer, then calls the returned capability
+  // directly. The two calls name the same object differently, but the urgent direct call must
+  // still not overtake the pipelined one that the scheduler is holding back.
+
+  kj::Vector<kj::String> log;
+  TestContext context(kj::heap<CallRecorder>(
+      log, test::TestInterface::Client(kj::heap<RecordingInterface>(log))));
+  GatedCallScheduler scheduler([](const RpcCallScheduler::Call& call) {
+    return call.interfaceId == typeId<test::TestInterface>() && call.methodId == 0;
+  });
+  context.rpcServer.setCallScheduler(scheduler);
+
+  MallocMessageBuilder serverHostIdBuilder;
+  auto serverHostId = serverHostIdBuilder.getRoot<test::TestSturdyRefHostId>();
+  serverHostId.setHost("server");
+  auto client = context.rpcClient.bootstrap(serverHostId).castAs<test::TestMoreStuff>();
+
+  auto held = client.getHeldRequest().send();
+  auto low = held.getCap().fooRequest().send();
+  auto other = held.wait(context.waitScope).getCap();
+  auto high = other.barRequest().send();
+  context.waitScope.poll();
+  KJ_EXPECT(log.size() == 0, kj::strArray(log, ", "));
+
+  scheduler.open();
+  low.wait(context.waitScope);
+  high.wait(context.waitScope);
+  KJ_EXPECT(kj::strArray(log, ", ") == "other, other bar", kj::strArray(log, ", "));
+
+  context.rpcServer.setCallScheduler(nullptr);
+}
+
+KJ_TEST("call scheduler holds back a Disembargo behind queued calls to its target") {
+  // As in the Embargo test, calls made through a promise that turns out to point back to the
+  // caller are embargoed until the Disembargo comes back. The server must not echo it while the
+  // earlier calls are still queued, or the later calls would overtake them.
+
+  TestContext context;
+  GatedCallScheduler scheduler;
+  context.rpcServer.setCallScheduler(scheduler);
+
+  auto client = context.connect(test::TestSturdyRefObjectId::Tag::TEST_MORE_STUFF)
+      .castAs<test::TestMoreStuff>();
+  auto cap = test::TestCallOrder::Client(kj::heap<TestCallOrderImpl>());
+
+  auto echoRequest = client.echoRequest();
+  echoRequest.setCap(cap);
+  auto echo = echoRequest.send();
+  auto pipeline = echo.getCap();
+
+  auto call0 = getCallSequence(pipeline, 0);
+  auto call1 = getCallSequence(pipeline, 1);
+  auto resolved = echo.wait(context.waitScope).getCap();
+  auto call2 = getCallSequence(pipeline, 2);
+
+  context.waitScope.poll();
+  KJ_EXPECT(!call2.poll(context.waitScope));
+
+  scheduler.open();
+  KJ_EXPECT(call0.wait(context.waitScope).getN() == 0);
+  KJ_EXPECT(call1.wait(context.waitScope).getN() == 1);
+  KJ_EXPECT(call2.wait(context.waitScope).getN() == 2);
+
+  context.rpcServer.setCallScheduler(nullptr);
+}
+
+KJ_TEST("call scheduler holds back direct calls behind reflected calls it has queued") {
+  // The server forwards calls made through the promise back to us with a tail call, so our
+  // questions return as soon as the forwarded calls are sent, while those are still queued by
+  // our call scheduler. When the promise then resolves to our own capability, no embargo is
+  // needed, but calls made directly from then on must still wait behind the queued ones.
+
+  auto echoerOwn = kj::heap<PromiseEchoer>();
+  auto& echoer = *echoerOwn;
+  TestContext context(kj::mv(echoerOwn));
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  echoer.setResolved(kj::mv(paf.promise));
+  GatedCallScheduler scheduler;
+  context.rpcClient.setCallScheduler(scheduler);
+
+  MallocMessageBuilder serverHostIdBuilder;
+  auto serverHostId = serverHostIdBuilder.getRoot<test::TestSturdyRefHostId>();
+  serverHostId.setHost("server");
+  auto client = context.rpcClient.bootstrap(serverHostId).castAs<test::TestMoreStuff>();
+
+  auto cap = test::TestCallOrder::Client(kj::heap<TestCallOrderImpl>());
+  auto echoRequest = client.echoRequest();
+  echoRequest.setCap(cap);
+  auto promiseCap = echoRequest.send().wait(context.waitScope).getCap();
+
+  auto call0 = getCallSequence(promiseCap, 0);
+  context.waitScope.poll();
+
+  paf.fulfiller->fulfill();
+  context.waitScope.poll();
+
+  auto stats = context.rpcClient.getEmbargoStats();
+  KJ_EXPECT(stats.reflectedResolutions == 1);
+  KJ_EXPECT(stats.embargoes == 0);
+  KJ_EXPECT(stats.embargoesSkipped == 1);
+
+  auto call1 = getCallSequence(promiseCap, 1);
+  context.waitScope.poll();
+  KJ_EXPECT(!call0.poll(context.waitScope));
+  KJ_EXPECT(!call1.poll(context.waitScope));
+
+  scheduler.open();
+  KJ_EXPECT(call0.wait(context.waitScope).getN() == 0);
+  KJ_EXPECT(call1.wait(context.waitScope).getN() == 1);
+
+  context.rpcClient.setCallScheduler(nullptr);
+}
+
+class TextEchoer final: public test::TestMoreStuff::Server {
+public:
+  kj::Promise<void> methodWithDefaults(MethodWithDefaultsContext context) override {
+    context.getResults().setD(context.getParams().getA());
+    return kj::READY_NOW;
+  }
+};
+
+KJ_TEST("messages are sized from previous calls to the same method") {
+  TestContext context(kj::heap<TextEchoer>());
+
+  MallocMessageBuilder serverHostIdBuilder;
+  auto serverHostId = serverHostIdBuilder.getRoot<test::TestSturdyRefHostId>();
+  serverHostId.setHost("server");
+  auto client = context.rpcClient.bootstrap(serverHostId).castAs<test::TestMoreStuff>();
+
+  // Much bigger than SUGGESTED_FIRST_SEGMENT_WORDS.
+  auto text = kj::str(kj::repeat('x', 10000 * sizeof(word)));
+
+  auto echo = [&]() {
+    auto request = client.methodWithDefaultsRequest();
+    request.setA(text);
+    auto response = request.send().wait(context.waitScope);
+    KJ_EXPECT(response.getD() == text);
+  };
+
+  // Without a size hint, the first call and its results both overflow the default first segment.
+  echo();
+  KJ_EXPECT(context.clientNetwork.getMultiSegmentSentCount() == 1);
+  KJ_EXPECT(context.serverNetwork.getMultiSegmentSentCount() == 1);
+
+  // After that, each message fits in one segment.
+  echo();
+  echo();
+  KJ_EXPECT(context.clientNetwork.getMultiSegmentSentCount() == 1);
+  KJ_EXPECT(context.serverNetwork.getMultiSegmentSentCount() == 1);
+}
+
+KJ_TEST("FreeIdSet hands out its lowest ID across words and levels") {
+  // One level of the bitmap covers IDs below 64, two cover those below 4096, and three those
+  // below 262144.
+  FreeIdSet ids;
+  KJ_EXPECT(ids.empty());
+
+  uint added[] = { 300000, 4096, 64, 4095, 262144, 0, 63, 262143, 65 };
+  for (uint id: added) ids.add(id);
+  for (uint id: added) KJ_EXPECT(ids.contains(id), id);
+  for (uint id: { 1u, 62u, 66u, 4094u, 4097u, 262142u, 262145u, 299999u, 300001u }) {
+    KJ_EXPECT(!ids.contains(id), id);
+  }
+
+  for (uint id: { 0u, 63u, 64u, 65u, 4095u, 4096u, 262143u, 262144u, 300000u }) {
+    KJ_EXPECT(!ids.empty());
+    KJ_EXPECT(ids.takeLowest() == id);
+  }
+  KJ_EXPECT(ids.empty());
+
+  // An ID added below the lowest, in another word or another top-level subtree, comes out first.
+  ids.add(5000);
+  ids.add(4097);
+  KJ_EXPECT(ids.takeLowest() == 4097);
+  ids.add(70);
+  KJ_EXPECT(ids.takeLowest() == 70);
+  ids.add(4096);
+  ids.remove(5000);
+  KJ_EXPECT(ids.takeLowest() == 4096);
+  KJ_EXPECT(ids.empty());
+}
+
+KJ_TEST("ExportTable reuses the lowest freed ID") {
+  ExportTable<uint, kj::Maybe<uint>> table;
+  auto add = [&]() {
+    uint id;
+    auto& slot = table.next(id);
+    slot = id;
+    return id;
+  };
+  auto erase = [&](uint id) {
+    table.erase(id, KJ_ASSERT_NONNULL(table.find(id)));
+  };
+
+  for (uint i = 0; i < 5000; i++) {
+    KJ_ASSERT(add() == i);
+  }
+
+  // Freed out of order, on both sides of the boundaries between words and levels.
+  for (uint id: { 4097u, 63u, 4095u, 64u, 4096u, 0u }) {
+    erase(id);
+    KJ_EXPECT(table.find(id) == nullptr);
+  }
+  for (uint id: { 0u, 63u, 64u, 4095u, 4096u, 4097u, 5000u }) {
+    KJ_EXPECT(add() == id);
+  }
+
+  // Freeing the highest IDs drops them rather than tracking them, so they aren't reused ahead of
+  // lower ones freed earlier.
+  erase(10);
+  erase(5000);
+  erase(4999);
+  KJ_EXPECT(add() == 10);
+  KJ_EXPECT(add() == 4999);
+
+  uint count = 0;
+  table.forEach([&](uint id, kj::Maybe<uint>& entry) {
+    KJ_EXPECT(KJ_ASSERT_NONNULL(entry) == id);
+    ++count;
+  });
+  KJ_EXPECT(count == 5000);
+}
+
+KJ_TEST("ExportTable gives back its memory after a burst") {
+  ExportTable<uint, kj::Maybe<uint>> table;
+  constexpr uint COUNT = 100000;
+
+  for (uint i = 0; i < COUNT; i++) {
+    uint id;
+    table.next(id) = id;
+  }
+  KJ_EXPECT(table.capacity() >= COUNT);
+
+  // Free them lowest first, so that every one but the last is tracked as free, which takes three
+  // levels of bitmap.
+  for (uint i = 0; i + 1 < COUNT; i++) {
+    table.erase(i, KJ_ASSERT_NONNULL(table.find(i)));
+  }
+  KJ_EXPECT(table.freeIdCapacityWords() >= COUNT / 64, table.freeIdCapacityWords());
+
+  table.erase(COUNT - 1, KJ_ASSERT_NONNULL(table.find(COUNT - 1)));
+  KJ_EXPECT(table.freeIdCapacityWords() <= 3, table.freeIdCapacityWords());
+
+  // The slots are released by the next allocation, since erase() can't move live entries.
+  uint id;
+  table.next(id) = 0u;
+  KJ_EXPECT(id == 0);
+  KJ_EXPECT(table.capacity() <= 64, table.capacity());
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
@@ -44,6 +44,7 @@
 #include <kj/windows-sanity.h>
 #else
 #include <sys/socket.h>
+#include <netinet/in.h>
 #endif
 
 // TODO(cleanup): Auto-generate stringification functions for union discriminants.
@@ -161,6 +162,70 @@ TEST(TwoPartyNetwork, Basic) {
   EXPECT_TRUE(barFailed);
 }
 
+KJ_TEST("TwoPartyVatNetwork with segment pool") {
+  auto ioContext = kj::setupAsyncIo();
+  int callCount = 0;
+  int handleCount = 0;
+
+  auto pool = kj::atomicRefcounted<MessageSegmentPool>();
+
+  auto serverThread = runServer(*ioContext.provider, callCount, handleCount);
+  TwoPartyVatNetwork network(*serverThread.pipe, rpc::twoparty::Side::CLIENT);
+  network.useSegmentPool(kj::atomicAddRef(*pool));
+  auto rpcClient = makeRpcClient(network);
+
+  auto client = getPersistentCap(rpcClient, rpc::twoparty::Side::SERVER,
+      test::TestSturdyRefObjectId::Tag::TEST_INTERFACE).castAs<test::TestInterface>();
+
+  for (uint i = 0; i < 10; i++) {
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    KJ_EXPECT(request.send().wait(ioContext.waitScope).getX() == "foo");
+  }
+
+  KJ_EXPECT(callCount == 10);
+
+  // After warming up, every outgoing message reused a pooled segment.
+  auto stats = pool->getStats();
+  KJ_EXPECT(stats.allocations >= 10);
+  KJ_EXPECT(stats.mallocs < 5, stats.mallocs);
+  KJ_EXPECT(stats.frees == 0);
+}
+
+KJ_TEST("TwoPartyVatNetwork with batched writes and read-ahead") {
+  auto ioContext = kj::setupAsyncIo();
+  int callCount = 0;
+  int handleCount = 0;
+
+  auto serverThread = runServer(*ioContext.provider, callCount, handleCount);
+  TwoPartyVatNetwork network(*serverThread.pipe, rpc::twoparty::Side::CLIENT);
+  network.useBatchedWrites();
+  network.useReadAhead();
+  auto rpcClient = makeRpcClient(network);
+
+  auto client = getPersistentCap(rpcClient, rpc::twoparty::Side::SERVER,
+      test::TestSturdyRefObjectId::Tag::TEST_INTERFACE).castAs<test::TestInterface>();
+
+  // Many calls sent in one turn go out together.
+  kj::Vector<kj::Promise<void>> promises;
+  for (uint i = 0; i < 20; i++) {
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    promises.add(request.send().then([](auto response) {
+      KJ_EXPECT(response.getX() == "foo");
+    }));
+  }
+  kj::joinPromises(promises.releaseAsArray()).wait(ioContext.waitScope);
+
+  KJ_EXPECT(callCount == 20);
+
+  auto stats = KJ_ASSERT_NONNULL(network.getBatchedWriter()).getStats();
+  KJ_EXPECT(stats.messages >= 20);
+  KJ_EXPECT(stats.batches < stats.messages, stats.batches, stats.messages);
+}
+
 TEST(TwoPartyNetwork, Pipelining) {
   auto ioContext = kj::setupAsyncIo();
   int callCount = 0;
@@ -439,6 +504,105 @@ TEST(TwoPartyNetwork, BootstrapFactory) {
 
 // =======================================================================================
 
+#if !_WIN32
+KJ_TEST("TwoPartyServerPool spreads accepted connections across threads") {
+  auto ioContext = kj::setupAsyncIo();
+
+  // Each thread's bootstrap counts its own calls, so no locking is needed.
+  int callCounts[3] = {0, 0, 0};
+  uint factoryCalls = 0;
+
+  {
+    TwoPartyServerPool pool(3, [&]() -> Capability::Client {
+      return kj::heap<TestInterfaceImpl>(callCounts[factoryCalls++]);
+    });
+    KJ_EXPECT(factoryCalls == 3);
+
+    kj::Vector<kj::Own<kj::AsyncIoStream>> streams;
+    kj::Vector<kj::Own<TwoPartyClient>> clients;
+    for (uint i = 0; i < 6; i++) {
+      int fds[2];
+      KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+      pool.accept(kj::AutoCloseFd(fds[1]));
+      streams.add(ioContext.lowLevelProvider->wrapSocketFd(kj::AutoCloseFd(fds[0])));
+      clients.add(kj::heap<TwoPartyClient>(*streams.back()));
+    }
+
+    for (auto& client: clients) {
+      auto request = client->bootstrap().castAs<test::TestInterface>().fooRequest();
+      request.setI(123);
+      request.setJ(true);
+      KJ_EXPECT(request.send().wait(ioContext.waitScope).getX() == "foo");
+    }
+  }
+
+  // Destroying the pool joined its threads, so their counts can be read now.
+  for (auto count: callCounts) {
+    KJ_EXPECT(count == 2, count);
+  }
+}
+
+KJ_TEST("TwoPartyServerPool rethrows a bootstrap factory failure") {
+  int callCount = 0;
+  uint factoryCalls = 0;
+
+  // The first thread comes up and must be stopped and joined again when the second one fails.
+  auto exception = kj::runCatchingExceptions([&]() {
+    TwoPartyServerPool pool(3, [&]() -> Capability::Client {
+      if (factoryCalls++ == 1) {
+        KJ_FAIL_ASSERT("no bootstrap for you");
+      }
+      return kj::heap<TestInterfaceImpl>(callCount);
+    });
+  });
+  KJ_IF_MAYBE(e, exception) {
+    KJ_EXPECT(e->getDescription().endsWith("no bootstrap for you"), e->getDescription());
+  } else {
+    KJ_FAIL_EXPECT("TwoPartyServerPool constructor didn't throw");
+  }
+  KJ_EXPECT(factoryCalls == 2);
+}
+
+KJ_TEST("TwoPartyServerPool listens on every thread") {
+  auto ioContext = kj::setupAsyncIo();
+
+  int fd;
+  KJ_SYSCALL(fd = socket(AF_INET, SOCK_STREAM, 0));
+  kj::AutoCloseFd listenFd(fd);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  KJ_SYSCALL(bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)));
+  KJ_SYSCALL(::listen(listenFd, 16));
+  socklen_t addrLen = sizeof(addr);
+  KJ_SYSCALL(getsockname(listenFd, reinterpret_cast<struct sockaddr*>(&addr), &addrLen));
+
+  int callCounts[2] = {0, 0};
+  uint factoryCalls = 0;
+
+  {
+    TwoPartyServerPool pool(2, [&]() -> Capability::Client {
+      return kj::heap<TestInterfaceImpl>(callCounts[factoryCalls++]);
+    });
+    pool.listen(listenFd);
+
+    auto address = ioContext.provider->getNetwork()
+        .parseAddress("127.0.0.1", ntohs(addr.sin_port)).wait(ioContext.waitScope);
+    for (uint i = 0; i < 4; i++) {
+      auto connection = address->connect().wait(ioContext.waitScope);
+      TwoPartyClient client(*connection);
+      auto request = client.bootstrap().castAs<test::TestInterface>().fooRequest();
+      request.setI(123);
+      request.setJ(true);
+      KJ_EXPECT(request.send().wait(ioContext.waitScope).getX() == "foo");
+    }
+  }
+
+  KJ_EXPECT(callCounts[0] + callCounts[1] == 4);
+}
+#endif  // !_WIN32
+
 #if !_WIN32 && !__CYGWIN__  // Windows and Cygwin don't support SCM_RIGHTS.
 KJ_TEST("send FD over RPC") {
   auto io = kj::setupAsyncIo();
@@ -651,6 +815,93 @@ KJ_TEST("Streaming over RPC") {
   }
 }
 
+constexpr size_t BLOB_SIZE = 1 << 20;
+
+class BlobServer final: public test::TestPipeline::Server {
+  // Keeps a slice of the Data sent to testPointers(), and returns a big string from getCap().
+
+public:
+  kj::Array<const byte> slice;
+  bool sliceWasCopied = true;
+  bool outsideWasCopied = false;
+
+  kj::Promise<void> testPointers(TestPointersContext context) override {
+    auto data = context.getParams().getObj().getAs<Data>();
+    slice = context.sliceParamData(data);
+    sliceWasCopied = slice.begin() != data.begin();
+
+    // Bytes that aren't part of the params are copied.
+    auto outside = kj::heapArray<const byte>(16);
+    outsideWasCopied = context.sliceParamData(outside).begin() != outside.begin();
+    context.releaseParams();
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> getCap(GetCapContext context) override {
+    auto s = context.getResults().initS(BLOB_SIZE);
+    memset(s.begin(), 'x', s.size());
+    return kj::READY_NOW;
+  }
+};
+
+KJ_TEST("large Data is sent by reference and received as a slice") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  auto pipe = kj::newTwoWayPipe();
+
+  auto ownServer = kj::heap<BlobServer>();
+  auto& server = *ownServer;
+  test::TestPipeline::Client serverCap(kj::mv(ownServer));
+
+  TwoPartyClient tpClient(*pipe.ends[0]);
+  TwoPartyClient tpServer(*pipe.ends[1], serverCap, rpc::twoparty::Side::SERVER);
+  auto cap = tpClient.bootstrap().castAs<test::TestPipeline>();
+
+  {
+    bool freed = false;
+    auto blob = kj::heapArray<byte>(BLOB_SIZE);
+    for (auto i: kj::indices(blob)) blob[i] = i * 7;
+
+    auto request = cap.testPointersRequest();
+    auto orphanage = Orphanage::getForMessageContaining(
+        test::TestPipeline::TestPointersParams::Builder(request));
+    request.getObj().adopt(orphanage.referenceExternalData(
+        blob.attach(kj::defer([&]() { freed = true; }))));
+    request.send().wait(waitScope);
+    KJ_EXPECT(freed);
+  }
+
+  // The server's slice shares the received message and outlives the call.
+  KJ_EXPECT(!server.sliceWasCopied);
+  KJ_EXPECT(server.outsideWasCopied);
+  KJ_ASSERT(server.slice.size() == BLOB_SIZE);
+  for (auto i: kj::indices(server.slice)) {
+    if (server.slice[i] != byte(i * 7)) {
+      KJ_FAIL_EXPECT("slice corrupted", i);
+      break;
+    }
+  }
+  server.slice = nullptr;
+
+  // Same on the client side for the response.
+  kj::Array<const byte> slice;
+  {
+    auto response = cap.getCapRequest().send().wait(waitScope);
+    auto s = response.getS().asBytes();
+    slice = response.sliceData(s);
+    KJ_EXPECT(slice.begin() == s.begin());
+
+    // Bytes from anywhere else are copied rather than attached to the message.
+    const byte bytes[] = { 1, 2, 3 };
+    Data::Reader outside(bytes, sizeof(bytes));
+    auto copy = response.sliceData(outside);
+    KJ_EXPECT(copy.begin() != outside.begin());
+    KJ_EXPECT(copy.asPtr() == outside);
+  }
+  KJ_ASSERT(slice.size() == BLOB_SIZE);
+  KJ_EXPECT(slice[0] == 'x' && slice[BLOB_SIZE - 1] == 'x');
+}
+
 KJ_TEST("Streaming over RPC then unwrap with CapabilitySet") {
   kj::EventLoop loop;
   kj::WaitScope waitScope(loop);
@@ -28,6 +28,7 @@
 #include "serialize-async.h"
 #include <kj/debug.h>
 #include <kj/io.h>
+#include <kj/mutex.h>
 
 #if _WIN32
 #include <winsock2.h>
@@ -35,14 +36,16 @@
 #include <kj/windows-sanity.h>
 #else
 #include <sys/socket.h>
+#include <unistd.h>
 #endif
 
 namespace capnp {
 
-TwoPartyVatNetwork::TwoPartyVatNetwork(kj::AsyncIoStream& stream, rpc::twoparty::Side side,
-                                       ReaderOptions receiveOptions)
-    : stream(&stream), maxFdsPerMessage(0), side(side), peerVatId(4),
-      receiveOptions(receiveOptions), previousWrite(kj::READY_NOW) {
+namespace _ {  // private
+
+TwoPartyConnectionState::TwoPartyConnectionState(
+    TwoPartyVatNetworkBase::Connection& connection, rpc::twoparty::Side side)
+    : connection(connection), side(side), peerVatId(4) {
   peerVatId.initRoot<rpc::twoparty::VatId>().setSide(
       side == rpc::twoparty::Side::CLIENT ? rpc::twoparty::Side::SERVER
                                           : rpc::twoparty::Side::CLIENT);
@@ -52,25 +55,18 @@ TwoPartyVatNetwork::TwoPartyVatNetwork(kj::AsyncIoStream& stream, rpc::twoparty:
   disconnectFulfiller.fulfiller = kj::mv(paf.fulfiller);
 }
 
-TwoPartyVatNetwork::TwoPartyVatNetwork(kj::AsyncCapabilityStream& stream, uint maxFdsPerMessage,
-                                       rpc::twoparty::Side side, ReaderOptions receiveOptions)
-    : TwoPartyVatNetwork(stream, side, receiveOptions) {
-  this->stream = &stream;
-  this->maxFdsPerMessage = maxFdsPerMessage;
-}
-
-void TwoPartyVatNetwork::FulfillerDisposer::disposeImpl(void* pointer) const {
+void TwoPartyConnectionState::FulfillerDisposer::disposeImpl(void* pointer) const {
   if (--refcount == 0) {
     fulfiller->fulfill();
   }
 }
 
-kj::Own<TwoPartyVatNetworkBase::Connection> TwoPartyVatNetwork::asConnection() {
+kj::Own<TwoPartyVatNetworkBase::Connection> TwoPartyConnectionState::asConnection() {
   ++disconnectFulfiller.refcount;
-  return kj::Own<TwoPartyVatNetworkBase::Connection>(this, disconnectFulfiller);
+  return kj::Own<TwoPartyVatNetworkBase::Connection>(&connection, disconnectFulfiller);
 }
 
-kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> TwoPartyVatNetwork::connect(
+kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> TwoPartyConnectionState::connect(
     rpc::twoparty::VatId::Reader ref) {
   if (ref.getSide() == side) {
     return nullptr;
@@ -79,7 +75,7 @@ kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> TwoPartyVatNetwork::conne
   }
 }
 
-kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> TwoPartyVatNetwork::accept() {
+kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> TwoPartyConnectionState::accept() {
   if (side == rpc::twoparty::Side::SERVER && !accepted) {
     accepted = true;
     return asConnection();
@@ -91,12 +87,50 @@ kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> TwoPartyVatNetwork::acc
   }
 }
 
+rpc::twoparty::VatId::Reader TwoPartyConnectionState::getPeerVatId() {
+  return peerVatId.getRoot<rpc::twoparty::VatId>();
+}
+
+bool checkOutgoingMessageSize(size_t sizeInWords, const ReaderOptions& receiveOptions) {
+  KJ_REQUIRE(sizeInWords < receiveOptions.traversalLimitInWords, sizeInWords,
+             "Trying to send Cap'n Proto message larger than our single-message size limit. The "
+             "other side probably won't accept it (assuming its traversalLimitInWords matches "
+             "ours) and would abort the connection, so I won't send it.") {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace _ (private)
+
+TwoPartyVatNetwork::TwoPartyVatNetwork(kj::AsyncIoStream& stream, rpc::twoparty::Side side,
+                                       ReaderOptions receiveOptions)
+    : stream(&stream), maxFdsPerMessage(0), connectionState(*this, side),
+      receiveOptions(receiveOptions), previousWrite(kj::READY_NOW) {}
+
+TwoPartyVatNetwork::TwoPartyVatNetwork(kj::AsyncCapabilityStream& stream, uint maxFdsPerMessage,
+                                       rpc::twoparty::Side side, ReaderOptions receiveOptions)
+    : TwoPartyVatNetwork(stream, side, receiveOptions) {
+  this->stream = &stream;
+  this->maxFdsPerMessage = maxFdsPerMessage;
+}
+
+kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> TwoPartyVatNetwork::connect(
+    rpc::twoparty::VatId::Reader ref) {
+  return connectionState.connect(ref);
+}
+
+kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> TwoPartyVatNetwork::accept() {
+  return connectionState.accept();
+}
+
 class TwoPartyVatNetwork::OutgoingMessageImpl final
     : public OutgoingRpcMessage, public kj::Refcounted {
 public:
   OutgoingMessageImpl(TwoPartyVatNetwork& network, uint firstSegmentWordSize)
       : network(network),
-        message(firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS : firstSegmentWordSize) {}
+        message(initMessage(firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS
+                                                      : firstSegmentWordSize)) {}
 
   AnyPointer::Builder getBody() override {
     return message.getRoot<AnyPointer>();
@@ -113,15 +147,21 @@ public:
     for (auto& segment: message.getSegmentsForOutput()) {
       size += segment.size();
     }
-    KJ_REQUIRE(size < network.receiveOptions.traversalLimitInWords, size,
-               "Trying to send Cap'n Proto message larger than our single-message size limit. The "
-               "other side probably won't accept it (assuming its traversalLimitInWords matches "
-               "ours) and would abort the connection, so I won't send it.") {
+    if (!_::checkOutgoingMessageSize(size, network.receiveOptions)) return;
+
+    auto& previousWrite = KJ_ASSERT_NONNULL(network.previousWrite, "already shut down");
+
+    KJ_IF_MAYBE(writer, network.batchedWriter) {
+      // The writer queues the message right away so that it can share a write with its
+      // neighbors; we still chain through previousWrite so that shutdown() waits for it.
+      auto promise = writer->get()->writeMessage(message).attach(kj::addRef(*this));
+      network.previousWrite = previousWrite
+          .then([promise = kj::mv(promise)]() mutable { return kj::mv(promise); })
+          .eagerlyEvaluate(nullptr);
       return;
     }
 
-    network.previousWrite = KJ_ASSERT_NONNULL(network.previousWrite, "already shut down")
-        .then([&]() {
+    network.previousWrite = previousWrite.then([&]() {
       // Note that if the write fails, all further writes will be skipped due to the exception.
       // We never actually handle this exception because we assume the read end will fail as well
       // and it's cleaner to handle the failure there.
@@ -147,8 +187,17 @@ public:
 
 private:
   TwoPartyVatNetwork& network;
-  MallocMessageBuilder message;
+  kj::OneOf<MallocMessageBuilder, PooledMessageBuilder> builder;
+  MessageBuilder& message;
   kj::Array<int> fds;
+
+  MessageBuilder& initMessage(uint firstSegmentWordSize) {
+    KJ_IF_MAYBE(pool, network.segmentPool) {
+      return builder.init<PooledMessageBuilder>(firstSegmentWordSize, kj::atomicAddRef(**pool));
+    } else {
+      return builder.init<MallocMessageBuilder>(firstSegmentWordSize);
+    }
+  }
 };
 
 class TwoPartyVatNetwork::IncomingMessageImpl final: public IncomingRpcMessage {
@@ -181,6 +230,9 @@ private:
 };
 
 kj::Own<RpcFlowController> TwoPartyVatNetwork::newStream() {
+  KJ_IF_MAYBE(a, adaptiveFlow) {
+    return kj::heap<AdaptiveFlowController>(a->get()->clock, a->get()->options, a->get()->group);
+  }
   return RpcFlowController::newVariableWindowController(*this);
 }
 
@@ -239,8 +291,51 @@ size_t TwoPartyVatNetwork::getWindow() {
   }
 }
 
+void TwoPartyVatNetwork::useSegmentPool(kj::Own<const MessageSegmentPool> pool) {
+  segmentPool = kj::mv(pool);
+}
+
+void TwoPartyVatNetwork::useBatchedWrites(BatchedMessageWriter::Options options) {
+  KJ_REQUIRE(stream.is<kj::AsyncIoStream*>(), "batched writes don't support FD passing");
+  KJ_REQUIRE(batchedWriter == nullptr, "useBatchedWrites() already called");
+  batchedWriter = kj::heap<BatchedMessageWriter>(*stream.get<kj::AsyncIoStream*>(), options);
+}
+
+kj::Maybe<BatchedMessageWriter&> TwoPartyVatNetwork::getBatchedWriter() {
+  KJ_IF_MAYBE(writer, batchedWriter) {
+    return **writer;
+  } else {
+    return nullptr;
+  }
+}
+
+void TwoPartyVatNetwork::useReadAhead(size_t bufferWords) {
+  KJ_REQUIRE(stream.is<kj::AsyncIoStream*>(), "read-ahead doesn't support FD passing");
+  KJ_REQUIRE(readAhead == nullptr, "useReadAhead() already called");
+  readAhead = kj::heap<ReadAheadMessageStream>(
+      *stream.get<kj::AsyncIoStream*>(), receiveOptions, bufferWords);
+}
+
+void TwoPartyVatNetwork::useAdaptiveFlowControl(
+    AdaptiveFlowController::Options options, const kj::MonotonicClock& clock) {
+  KJ_IF_MAYBE(a, adaptiveFlow) {
+    a->get()->options = options;
+    KJ_REQUIRE(&a->get()->clock == &clock, "can't change the clock used for flow control");
+  } else {
+    adaptiveFlow = kj::heap<AdaptiveFlow>(clock, options);
+  }
+}
+
+kj::Array<AdaptiveFlowController::Stats> TwoPartyVatNetwork::getStreamStats() {
+  KJ_IF_MAYBE(a, adaptiveFlow) {
+    return a->get()->group.getStats();
+  } else {
+    return nullptr;
+  }
+}
+
 rpc::twoparty::VatId::Reader TwoPartyVatNetwork::getPeerVatId() {
-  return peerVatId.getRoot<rpc::twoparty::VatId>();
+  return connectionState.getPeerVatId();
 }
 
 kj::Own<OutgoingRpcMessage> TwoPartyVatNetwork::newOutgoingMessage(uint firstSegmentWordSize) {
@@ -251,8 +346,10 @@ kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> TwoPartyVatNetwork::receiveI
   return kj::evalLater([this]() {
     KJ_SWITCH_ONEOF(stream) {
       KJ_CASE_ONEOF(ioStream, kj::AsyncIoStream*) {
-        return tryReadMessage(*ioStream, receiveOptions)
-            .then([](kj::Maybe<kj::Own<MessageReader>>&& message)
+        auto promise = readAhead == nullptr
+            ? tryReadMessage(*ioStream, receiveOptions)
+            : KJ_ASSERT_NONNULL(readAhead)->tryReadMessage();
+        return promise.then([](kj::Maybe<kj::Own<MessageReader>>&& message)
                   -> kj::Maybe<kj::Own<IncomingRpcMessage>> {
           KJ_IF_MAYBE(m, message) {
             return kj::Own<IncomingRpcMessage>(kj::heap<IncomingMessageImpl>(kj::mv(*m)));
@@ -325,41 +422,38 @@ struct TwoPartyServer::AcceptedConnection {
 };
 
 void TwoPartyServer::accept(kj::Own<kj::AsyncIoStream>&& connection) {
-  auto connectionState = kj::heap<AcceptedConnection>(bootstrapInterface, kj::mv(connection));
-
-  // Run the connection until disconnect.
-  auto promise = connectionState->network.onDisconnect();
-  tasks.add(promise.attach(kj::mv(connectionState)));
+  tasks.add(run(kj::heap<AcceptedConnection>(bootstrapInterface, kj::mv(connection))));
 }
 
 void TwoPartyServer::accept(
     kj::Own<kj::AsyncCapabilityStream>&& connection, uint maxFdsPerMessage) {
-  auto connectionState = kj::heap<AcceptedConnection>(
-      bootstrapInterface, kj::mv(connection), maxFdsPerMessage);
-
-  // Run the connection until disconnect.
-  auto promise = connectionState->network.onDisconnect();
-  tasks.add(promise.attach(kj::mv(connectionState)));
+  tasks.add(run(kj::heap<AcceptedConnection>(
+      bootstrapInterface, kj::mv(connection), maxFdsPerMessage)));
 }
 
 kj::Promise<void> TwoPartyServer::accept(kj::AsyncIoStream& connection) {
-  auto connectionState = kj::heap<AcceptedConnection>(bootstrapInterface,
-      kj::Own<kj::AsyncIoStream>(&connection, kj::NullDisposer::instance));
-
-  // Run the connection until disconnect.
-  auto promise = connectionState->network.onDisconnect();
-  return promise.attach(kj::mv(connectionState));
+  return run(kj::heap<AcceptedConnection>(bootstrapInterface,
+      kj::Own<kj::AsyncIoStream>(&connection, kj::NullDisposer::instance)));
 }
 
 kj::Promise<void> TwoPartyServer::accept(
     kj::AsyncCapabilityStream& connection, uint maxFdsPerMessage) {
-  auto connectionState = kj::heap<AcceptedConnection>(bootstrapInterface,
+  return run(kj::heap<AcceptedConnection>(bootstrapInterface,
       kj::Own<kj::AsyncCapabilityStream>(&connection, kj::NullDisposer::instance),
-      maxFdsPerMessage);
+      maxFdsPerMessage));
+}
+
+kj::Promise<void> TwoPartyServer::run(kj::Own<AcceptedConnection> connection) {
+  KJ_IF_MAYBE(s, callScheduler) {
+    connection->rpcSystem.setCallScheduler(*s);
+  }
 
-  // Run the connection until disconnect.
-  auto promise = connectionState->network.onDisconnect();
-  return promise.attach(kj::mv(connectionState));
+  auto promise = connection->network.onDisconnect();
+  return promise.attach(kj::mv(connection));
+}
+
+void TwoPartyServer::setCallScheduler(kj::Maybe<RpcCallScheduler&> scheduler) {
+  callScheduler = scheduler;
 }
 
 kj::Promise<void> TwoPartyServer::listen(kj::ConnectionReceiver& listener) {
@@ -383,6 +477,133 @@ void TwoPartyServer::taskFailed(kj::Exception&& exception) {
   KJ_LOG(ERROR, exception);
 }
 
+// =======================================================================================
+
+#if !_WIN32
+
+struct TwoPartyServerPool::Worker final: private kj::TaskSet::ErrorHandler {
+  // One thread of the pool. `executor` is set before the constructor of TwoPartyServerPool
+  // returns; the other pointers are only dereferenced on the worker's own thread.
+
+  kj::Own<const kj::Executor> executor;
+  kj::LowLevelAsyncIoProvider* provider = nullptr;
+  TwoPartyServer* server = nullptr;
+  kj::TaskSet* listeners = nullptr;
+  kj::Own<kj::PromiseFulfiller<void>> stopFulfiller;
+
+  kj::Own<kj::Thread> thread;
+  // Declared last so that it's joined before the rest is destroyed.
+
+  struct StartState {
+    bool started = false;
+    kj::Maybe<kj::Exception> error;
+  };
+
+  void run(kj::Function<Capability::Client()>& bootstrapFactory,
+           kj::MutexGuarded<StartState>& start) {
+    kj::Maybe<kj::AsyncIoContext> io;
+    kj::Maybe<TwoPartyServer> serverSpace;
+    kj::Maybe<kj::TaskSet> listenerSpace;
+    kj::Maybe<kj::Promise<void>> stopped;
+
+    auto error = kj::runCatchingExceptions([&]() {
+      auto& context = io.emplace(kj::setupAsyncIo());
+      server = &serverSpace.emplace(bootstrapFactory());
+      listeners = &listenerSpace.emplace(static_cast<kj::TaskSet::ErrorHandler&>(*this));
+      provider = context.lowLevelProvider.get();
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      stopFulfiller = kj::mv(paf.fulfiller);
+      stopped = kj::mv(paf.promise);
+      executor = kj::getCurrentThreadExecutor().addRef();
+    });
+
+    {
+      auto lock = start.lockExclusive();
+      lock->started = true;
+      lock->error = kj::mv(error);
+    }
+
+    KJ_IF_MAYBE(promise, stopped) {
+      promise->wait(KJ_ASSERT_NONNULL(io).waitScope);
+    }
+
+    // Tear down listeners and connections while the event loop still exists.
+    listenerSpace = nullptr;
+    serverSpace = nullptr;
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(ERROR, exception);
+  }
+};
+
+TwoPartyServerPool::TwoPartyServerPool(
+    uint threadCount, kj::Function<Capability::Client()> bootstrapFactory)
+    : bootstrapFactory(kj::mv(bootstrapFactory)) {
+  KJ_REQUIRE(threadCount > 0, "TwoPartyServerPool needs at least one thread");
+
+  workers.reserve(threadCount);
+  for (uint i = 0; i < threadCount; i++) {
+    auto worker = kj::heap<Worker>();
+    kj::MutexGuarded<Worker::StartState> start;
+    auto& ref = *worker;
+    worker->thread = kj::heap<kj::Thread>([this, &ref, &start]() {
+      ref.run(this->bootstrapFactory, start);
+    });
+
+    // Wait for the thread to come up, so that the factory is never called concurrently.
+    kj::Maybe<kj::Exception> error;
+    {
+      auto lock = start.lockExclusive();
+      lock.wait([](const Worker::StartState& state) { return state.started; });
+      error = kj::mv(lock->error);
+    }
+    KJ_IF_MAYBE(e, error) {
+      // This thread has already exited, but the ones started before it are waiting to be
+      // stopped. Once they are, unwinding joins them.
+      stop();
+      kj::throwFatalException(kj::mv(*e));
+    }
+    workers.add(kj::mv(worker));
+  }
+}
+
+TwoPartyServerPool::~TwoPartyServerPool() noexcept(false) {
+  stop();
+  // Destroying `workers` joins the threads.
+}
+
+void TwoPartyServerPool::stop() {
+  for (auto& worker: workers) {
+    worker->executor->executeSync([&]() { worker->stopFulfiller->fulfill(); });
+  }
+}
+
+void TwoPartyServerPool::listen(int socketFd) {
+  for (auto& worker: workers) {
+    int fd;
+    KJ_SYSCALL(fd = dup(socketFd));
+    kj::AutoCloseFd ownFd(fd);
+
+    auto& ref = *worker;
+    ref.executor->executeSync([&]() {
+      auto listener = ref.provider->wrapListenSocketFd(kj::mv(ownFd));
+      ref.listeners->add(ref.server->listen(*listener).attach(kj::mv(listener)));
+    });
+  }
+}
+
+void TwoPartyServerPool::accept(kj::AutoCloseFd connectionFd) {
+  auto& worker = *workers[nextWorker];
+  nextWorker = (nextWorker + 1) % workers.size();
+
+  worker.executor->executeSync([&]() {
+    worker.server->accept(worker.provider->wrapSocketFd(kj::mv(connectionFd)));
+  });
+}
+
+#endif  // !_WIN32
+
 TwoPartyClient::TwoPartyClient(kj::AsyncIoStream& connection)
     : network(connection, rpc::twoparty::Side::CLIENT),
       rpcSystem(makeRpcClient(network)) {}
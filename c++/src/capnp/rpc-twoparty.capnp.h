@@ -45,6 +45,10 @@ struct VatId {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<VatId,  ::capnp::schemas::Side_9fd69ebc87b9719c> sideColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(d20b909fee733a8e, 1, 0)
     #if !CAPNP_LITE
@@ -60,6 +64,10 @@ struct ProvisionId {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<ProvisionId,  ::uint32_t> joinIdColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(b88d09a9c5f39817, 1, 0)
     #if !CAPNP_LITE
@@ -105,6 +113,16 @@ struct JoinKeyPart {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<JoinKeyPart,  ::uint32_t> joinIdColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<JoinKeyPart,  ::uint16_t> partCountColumn() {
+    return { 2, 0 };
+  }
+  static constexpr ::capnp::DataColumn<JoinKeyPart,  ::uint16_t> partNumColumn() {
+    return { 3, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(95b29059097fca83, 1, 0)
     #if !CAPNP_LITE
@@ -120,6 +138,13 @@ struct JoinResult {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<JoinResult,  ::uint32_t> joinIdColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<JoinResult, bool> succeededColumn() {
+    return { 32, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(9d263a3630b7ebee, 1, 1)
     #if !CAPNP_LITE
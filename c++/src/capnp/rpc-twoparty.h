@@ -23,9 +23,11 @@
 
 #include "rpc.h"
 #include "message.h"
+#include "serialize-async.h"
 #include <kj/async-io.h>
 #include <capnp/rpc-twoparty.capnp.h>
 #include <kj/one-of.h>
+#include <kj/vector.h>
 
 CAPNP_BEGIN_HEADER
 
@@ -41,6 +43,67 @@ typedef VatNetwork<rpc::twoparty::VatId, rpc::twoparty::ProvisionId,
     rpc::twoparty::RecipientId, rpc::twoparty::ThirdPartyCapId, rpc::twoparty::JoinResult>
     TwoPartyVatNetworkBase;
 
+namespace _ {  // private
+
+class TwoPartyConnectionState {
+  // Bookkeeping for a two-party VatNetwork that carries exactly one connection and implements
+  // that Connection itself, as TwoPartyVatNetwork, SharedMemoryVatNetwork, and
+  // MultiplexedStream::Channel do. The network forwards connect(), accept() and getPeerVatId()
+  // here.
+
+public:
+  TwoPartyConnectionState(TwoPartyVatNetworkBase::Connection& connection,
+                          rpc::twoparty::Side side);
+  KJ_DISALLOW_COPY(TwoPartyConnectionState);
+
+  rpc::twoparty::Side getSide() { return side; }
+
+  kj::Promise<void> onDisconnect() { return disconnectPromise.addBranch(); }
+  // Resolves when every reference to the connection handed out by connect() or accept() has been
+  // dropped.
+
+  kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> connect(
+      rpc::twoparty::VatId::Reader ref);
+  kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> accept();
+  rpc::twoparty::VatId::Reader getPeerVatId();
+
+private:
+  TwoPartyVatNetworkBase::Connection& connection;
+  rpc::twoparty::Side side;
+  MallocMessageBuilder peerVatId;
+  bool accepted = false;
+
+  kj::Own<kj::PromiseFulfiller<kj::Own<TwoPartyVatNetworkBase::Connection>>> acceptFulfiller;
+  // Fulfiller for the promise returned by accept() on the client side, or the second call on the
+  // server side.  Never fulfilled, because there is only one connection.
+
+  kj::ForkedPromise<void> disconnectPromise = nullptr;
+
+  class FulfillerDisposer: public kj::Disposer {
+    // Hack:  The network is both a VatNetwork and a VatNetwork::Connection.  When the RPC
+    //   system detects (or initiates) a disconnection, it drops its reference to the Connection.
+    //   When all references have been dropped, then we want disconnectPromise to be fulfilled.
+    //   So we hand out Own<Connection>s with this disposer attached, so that we can detect when
+    //   they are dropped.
+
+  public:
+    mutable kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    mutable uint refcount = 0;
+
+    void disposeImpl(void* pointer) const override;
+  };
+  FulfillerDisposer disconnectFulfiller;
+
+  kj::Own<TwoPartyVatNetworkBase::Connection> asConnection();
+  // Returns a reference to `connection` with the disposer set to disconnectFulfiller.
+};
+
+bool checkOutgoingMessageSize(size_t sizeInWords, const ReaderOptions& receiveOptions);
+// Returns true if a message of `sizeInWords` may be sent. Otherwise reports a recoverable error
+// and returns false, since the peer would most likely abort the connection on receiving it.
+
+}  // namespace _ (private)
+
 class TwoPartyVatNetwork: public TwoPartyVatNetworkBase,
                           private TwoPartyVatNetworkBase::Connection,
                           private RpcFlowController::WindowGetter {
@@ -68,10 +131,41 @@ public:
 
   KJ_DISALLOW_COPY(TwoPartyVatNetwork);
 
-  kj::Promise<void> onDisconnect() { return disconnectPromise.addBranch(); }
+  kj::Promise<void> onDisconnect() { return connectionState.onDisconnect(); }
   // Returns a promise that resolves when the peer disconnects.
 
-  rpc::twoparty::Side getSide() { return side; }
+  rpc::twoparty::Side getSide() { return connectionState.getSide(); }
+
+  void useSegmentPool(
+      kj::Own<const MessageSegmentPool> pool = MessageSegmentPool::getForCurrentThread());
+  // Build outgoing messages with PooledMessageBuilder, drawing segments from `pool`, rather than
+  // with MallocMessageBuilder. Useful for connections that send many messages, which otherwise
+  // each pay for a calloc() and free(). Affects messages created after the call.
+
+  void useBatchedWrites(
+      BatchedMessageWriter::Options options = BatchedMessageWriter::Options());
+  // Send outgoing messages through a BatchedMessageWriter, so that messages sent in quick
+  // succession share a write() syscall. Must be called before any messages are sent. Not supported
+  // on streams that pass file descriptors.
+
+  kj::Maybe<BatchedMessageWriter&> getBatchedWriter();
+  // Returns the writer installed by useBatchedWrites(), e.g. to read its stats or to cork it
+  // around a burst of calls. Null if batched writes aren't in use.
+
+  void useReadAhead(size_t bufferWords = ReadAheadMessageStream::DEFAULT_BUFFER_WORDS);
+  // Read incoming messages through a ReadAheadMessageStream, so that messages which arrive
+  // together are picked up with one read() syscall and without copying. Must be called before
+  // any messages are received. Not supported on streams that pass file descriptors.
+
+  void useAdaptiveFlowControl(
+      AdaptiveFlowController::Options options = AdaptiveFlowController::Options(),
+      const kj::MonotonicClock& clock = kj::systemPreciseMonotonicClock());
+  // Use an AdaptiveFlowController for each streaming capability on this connection, instead of a
+  // window the size of the socket's send buffer. Affects streams created after the call.
+
+  kj::Array<AdaptiveFlowController::Stats> getStreamStats();
+  // Returns the current window and estimates of each live stream created while adaptive flow
+  // control was enabled.
 
   // implements VatNetwork -----------------------------------------------------
 
@@ -85,10 +179,21 @@ private:
 
   kj::OneOf<kj::AsyncIoStream*, kj::AsyncCapabilityStream*> stream;
   uint maxFdsPerMessage;
-  rpc::twoparty::Side side;
-  MallocMessageBuilder peerVatId;
+  _::TwoPartyConnectionState connectionState;
   ReaderOptions receiveOptions;
-  bool accepted = false;
+  kj::Maybe<kj::Own<const MessageSegmentPool>> segmentPool;
+  kj::Maybe<kj::Own<BatchedMessageWriter>> batchedWriter;
+  kj::Maybe<kj::Own<ReadAheadMessageStream>> readAhead;
+
+  struct AdaptiveFlow {
+    AdaptiveFlow(const kj::MonotonicClock& clock, AdaptiveFlowController::Options options)
+        : clock(clock), options(options) {}
+
+    const kj::MonotonicClock& clock;
+    AdaptiveFlowController::Options options;
+    AdaptiveFlowController::Group group;
+  };
+  kj::Maybe<kj::Own<AdaptiveFlow>> adaptiveFlow;
 
   bool solSndbufUnimplemented = false;
   // Whether stream.getsockopt(SO_SNDBUF) has been observed to throw UNIMPLEMENTED.
@@ -97,30 +202,6 @@ private:
   // Resolves when the previous write completes.  This effectively serves as the write queue.
   // Becomes null when shutdown() is called.
 
-  kj::Own<kj::PromiseFulfiller<kj::Own<TwoPartyVatNetworkBase::Connection>>> acceptFulfiller;
-  // Fulfiller for the promise returned by acceptConnectionAsRefHost() on the client side, or the
-  // second call on the server side.  Never fulfilled, because there is only one connection.
-
-  kj::ForkedPromise<void> disconnectPromise = nullptr;
-
-  class FulfillerDisposer: public kj::Disposer {
-    // Hack:  TwoPartyVatNetwork is both a VatNetwork and a VatNetwork::Connection.  When the RPC
-    //   system detects (or initiates) a disconnection, it drops its reference to the Connection.
-    //   When all references have been dropped, then we want disconnectPromise to be fulfilled.
-    //   So we hand out Own<Connection>s with this disposer attached, so that we can detect when
-    //   they are dropped.
-
-  public:
-    mutable kj::Own<kj::PromiseFulfiller<void>> fulfiller;
-    mutable uint refcount = 0;
-
-    void disposeImpl(void* pointer) const override;
-  };
-  FulfillerDisposer disconnectFulfiller;
-
-  kj::Own<TwoPartyVatNetworkBase::Connection> asConnection();
-  // Returns a pointer to this with the disposer set to disconnectFulfiller.
-
   // implements Connection -----------------------------------------------------
 
   kj::Own<RpcFlowController> newStream() override;
@@ -171,15 +252,66 @@ public:
   //
   // Only considers clients whose connections TwoPartyServer took ownership of.
 
+  void setCallScheduler(kj::Maybe<RpcCallScheduler&> scheduler);
+  // Schedules incoming calls on connections accepted from now on with `scheduler`, which sees all
+  // of them, so e.g. a PriorityCallScheduler can share capacity fairly between clients. See
+  // RpcSystem::setCallScheduler().
+
 private:
   Capability::Client bootstrapInterface;
+  kj::Maybe<RpcCallScheduler&> callScheduler;
   kj::TaskSet tasks;
 
   struct AcceptedConnection;
 
+  kj::Promise<void> run(kj::Own<AcceptedConnection> connection);
+  // Runs the connection until disconnect.
+
   void taskFailed(kj::Exception&& exception) override;
 };
 
+#if !_WIN32
+class TwoPartyServerPool {
+  // Like TwoPartyServer, but services connections on several threads, each running its own event
+  // loop (set up with kj::setupAsyncIo()), so that a busy server can use more than one core.
+  //
+  // Capabilities belong to a single event loop, so each thread gets its own bootstrap capability
+  // from `bootstrapFactory`. Objects reachable from different threads' bootstrap capabilities must
+  // do their own locking if they share state.
+  //
+  // Not available on Windows.
+
+public:
+  TwoPartyServerPool(uint threadCount, kj::Function<Capability::Client()> bootstrapFactory);
+  // Starts `threadCount` threads. `bootstrapFactory` is called on each new thread, one thread at a
+  // time, before the constructor returns. If it throws, the exception is rethrown here.
+
+  KJ_DISALLOW_COPY(TwoPartyServerPool);
+  ~TwoPartyServerPool() noexcept(false);
+  // Disconnects all clients and stops the threads.
+
+  void listen(int socketFd);
+  // Accepts connections on the listening socket `socketFd` on every thread. Each thread waits on
+  // its own duplicate of the descriptor and the kernel hands each incoming connection to one of
+  // them. The caller keeps ownership of `socketFd`.
+
+  void accept(kj::AutoCloseFd connectionFd);
+  // Services an already-connected socket on the next thread, in round-robin order. Useful when
+  // connections are accepted elsewhere.
+
+  uint getThreadCount() { return workers.size(); }
+
+private:
+  struct Worker;
+
+  kj::Function<Capability::Client()> bootstrapFactory;
+  kj::Vector<kj::Own<Worker>> workers;
+  uint nextWorker = 0;
+
+  void stop();
+};
+#endif  // !_WIN32
+
 class TwoPartyClient {
   // Convenience class which implements a simple client.
 
@@ -19,17 +19,19 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#define CAPNP_PRIVATE
+
 #include "rpc.h"
+#include "rpc-tables.h"
 #include "message.h"
 #include <kj/debug.h>
 #include <kj/vector.h>
 #include <kj/async.h>
 #include <kj/one-of.h>
 #include <kj/function.h>
-#include <functional>  // std::greater
 #include <unordered_map>
 #include <map>
-#include <queue>
+#include <list>
 #include <capnp/rpc.capnp.h>
 #include <kj/io.h>
 #include <kj/map.h>
@@ -71,6 +73,44 @@ uint firstSegmentSize(kj::Maybe<MessageSize> sizeHint, uint additional) {
   }
 }
 
+class SharedIncomingRpcMessage final: public IncomingRpcMessage, public kj::Refcounted {
+  // Wraps a received message so that slices of it (see sliceMessage()) can keep it alive after
+  // its original owner is done with it.
+
+public:
+  SharedIncomingRpcMessage(kj::Own<IncomingRpcMessage>&& inner): inner(kj::mv(inner)) {}
+
+  AnyPointer::Reader getBody() override { return inner->getBody(); }
+  kj::ArrayPtr<kj::AutoCloseFd> getAttachedFds() override { return inner->getAttachedFds(); }
+  size_t sizeInWords() override { return inner->sizeInWords(); }
+
+private:
+  kj::Own<IncomingRpcMessage> inner;
+};
+
+kj::Maybe<kj::Array<const byte>> sliceMessage(kj::Own<IncomingRpcMessage>& message,
+                                               kj::Maybe<SharedIncomingRpcMessage&>& shared,
+                                               kj::ArrayPtr<const byte> data) {
+  // Returns `data`, which should point into `message`, as an array that keeps the message alive.
+  // The first time, this replaces `message` with a SharedIncomingRpcMessage wrapping it, and
+  // records the wrapper in `shared` for next time. Returns null, so that the caller copies
+  // `data`, if it isn't actually part of `message`.
+
+  if (!PointerHelpers<AnyPointer>::getInternalReader(message->getBody()).containsBytes(data)) {
+    return nullptr;
+  }
+
+  KJ_IF_MAYBE(s, shared) {
+    return data.attach(kj::addRef(*s));
+  }
+
+  auto wrapper = kj::refcounted<SharedIncomingRpcMessage>(kj::mv(message));
+  shared = *wrapper;
+  auto result = data.attach(kj::addRef(*wrapper));
+  message = kj::mv(wrapper);
+  return result;
+}
+
 kj::Maybe<kj::Array<PipelineOp>> toPipelineOps(List<rpc::PromisedAnswer::Op>::Reader ops) {
   auto result = kj::heapArrayBuilder<PipelineOp>(ops.size());
   for (auto opReader: ops) {
@@ -154,109 +194,157 @@ uint exceptionSizeHint(const kj::Exception& exception) {
 // =======================================================================================
 
 template <typename Id, typename T>
-class ExportTable {
-  // Table mapping integers to T, where the integers are chosen locally.
+class ImportTable {
+  // Table mapping integers to T, where the integers are chosen remotely.
+  //
+  // A well-behaved peer allocates IDs densely starting from zero (see ExportTable), so entries
+  // are kept in fixed-size pages indexed directly by ID.  Since the peer could instead pick
+  // arbitrary IDs, a new page is only started once the last page is at least half full; any
+  // other ID goes in a hash map.  Entries never move once created, so references returned by
+  // operator[] and find() remain valid until the entry is erased.
+  //
+  // Empty pages at the end of the range are freed, except the first of them, which is kept so
+  // that a peer whose number of outstanding IDs hovers around a page boundary doesn't make us
+  // allocate and free a page on every call.  An empty page with non-empty pages after it is kept
+  // too, since its IDs are the next ones a well-behaved peer will use; so a connection's memory
+  // use for pages is bounded by the highest paged ID it has in use.
 
 public:
+  T& operator[](Id id) {
+    KJ_IF_MAYBE(page, findPage(id)) {
+      return page->add(id % PAGE_SIZE);
+    }
+
+    KJ_IF_MAYBE(entry, sparse.find(id)) {
+      return **entry;
+    }
+
+    if (id / PAGE_SIZE == pages.size() && canAddPage()) {
+      return pages.add(kj::heap<Page>())->add(id % PAGE_SIZE);
+    }
+
+    return *sparse.insert(id, kj::heap<T>()).value;
+  }
+
   kj::Maybe<T&> find(Id id) {
-    if (id < slots.size() && slots[id] != nullptr) {
-      return slots[id];
+    KJ_IF_MAYBE(page, findPage(id)) {
+      return page->find(id % PAGE_SIZE);
+    }
+
+    KJ_IF_MAYBE(entry, sparse.find(id)) {
+      return **entry;
     } else {
       return nullptr;
     }
   }
 
-  T erase(Id id, T& entry) {
+  T erase(Id id) {
     // Remove an entry from the table and return it.  We return it so that the caller can be
     // careful to release it (possibly invoking arbitrary destructors) at a time that makes sense.
-    // `entry` is a reference to the entry being released -- we require this in order to prove
-    // that the caller has already done a find() to check that this entry exists.  We can't check
-    // ourselves because the caller may have nullified the entry in the meantime.
-    KJ_DREQUIRE(&entry == &slots[id]);
-    T toRelease = kj::mv(slots[id]);
-    slots[id] = T();
-    freeIds.push(id);
-    return toRelease;
-  }
-
-  T& next(Id& id) {
-    if (freeIds.empty()) {
-      id = slots.size();
-      return slots.add();
+    KJ_IF_MAYBE(page, findPage(id)) {
+      T toRelease = page->erase(id % PAGE_SIZE);
+      freeEmptyPages();
+      return toRelease;
+    }
+
+    KJ_IF_MAYBE(entry, sparse.find(id)) {
+      T toRelease = kj::mv(**entry);
+      sparse.erase(id);
+      return toRelease;
     } else {
-      id = freeIds.top();
-      freeIds.pop();
-      return slots[id];
+      return T();
     }
   }
 
   template <typename Func>
   void forEach(Func&& func) {
-    for (Id i = 0; i < slots.size(); i++) {
-      if (slots[i] != nullptr) {
-        func(i, slots[i]);
+    for (auto i: kj::indices(pages)) {
+      uint64_t remaining = pages[i]->present;
+      while (remaining != 0) {
+        uint slot = lowestBit(remaining);
+        remaining &= remaining - 1;
+        func(i * PAGE_SIZE + slot, pages[i]->entries[slot]);
       }
     }
+    for (auto& entry: sparse) {
+      func(entry.key, *entry.value);
+    }
   }
 
 private:
-  kj::Vector<T> slots;
-  std::priority_queue<Id, std::vector<Id>, std::greater<Id>> freeIds;
-};
-
-template <typename Id, typename T>
-class ImportTable {
-  // Table mapping integers to T, where the integers are chosen remotely.
-
-public:
-  T& operator[](Id id) {
-    if (id < kj::size(low)) {
-      return low[id];
-    } else {
-      return high[id];
+  static constexpr uint PAGE_SIZE = 64;
+  // Matches the width of `Page::present`, which has one bit per entry.
+
+  struct Page {
+    T entries[PAGE_SIZE];
+    uint64_t present = 0;
+    uint count = 0;
+
+    T& add(uint slot) {
+      uint64_t bit = uint64_t(1) << slot;
+      if (!(present & bit)) {
+        present |= bit;
+        ++count;
+      }
+      return entries[slot];
     }
-  }
 
-  kj::Maybe<T&> find(Id id) {
-    if (id < kj::size(low)) {
-      return low[id];
-    } else {
-      auto iter = high.find(id);
-      if (iter == high.end()) {
-        return nullptr;
+    kj::Maybe<T&> find(uint slot) {
+      if (present & (uint64_t(1) << slot)) {
+        return entries[slot];
       } else {
-        return iter->second;
+        return nullptr;
       }
     }
-  }
 
-  T erase(Id id) {
-    // Remove an entry from the table and return it.  We return it so that the caller can be
-    // careful to release it (possibly invoking arbitrary destructors) at a time that makes sense.
-    if (id < kj::size(low)) {
-      T toRelease = kj::mv(low[id]);
-      low[id] = T();
+    T erase(uint slot) {
+      uint64_t bit = uint64_t(1) << slot;
+      T toRelease = kj::mv(entries[slot]);
+      entries[slot] = T();
+      if (present & bit) {
+        present &= ~bit;
+        --count;
+      }
       return toRelease;
+    }
+  };
+
+  kj::Vector<kj::Own<Page>> pages;
+  // Pages covering IDs [0, pages.size() * PAGE_SIZE).  Heap-allocated individually so that growing
+  // the vector doesn't move entries.
+
+  kj::HashMap<Id, kj::Own<T>> sparse;
+  // Entries whose IDs are not covered by `pages`.
+
+  kj::Maybe<Page&> findPage(Id id) {
+    if (id / PAGE_SIZE < pages.size()) {
+      return *pages[id / PAGE_SIZE];
     } else {
-      T toRelease = kj::mv(high[id]);
-      high.erase(id);
-      return toRelease;
+      return nullptr;
     }
   }
 
-  template <typename Func>
-  void forEach(Func&& func) {
-    for (Id i: kj::indices(low)) {
-      func(i, low[i]);
-    }
-    for (auto& entry: high) {
-      func(entry.first, entry.second);
+  void freeEmptyPages() {
+    while (pages.size() >= 2 && pages.back()->count == 0 && pages[pages.size() - 2]->count == 0) {
+      pages.removeLast();
     }
   }
 
-private:
-  T low[16];
-  std::unordered_map<Id, T> high;
+  bool canAddPage() {
+    // Only start a new page when the previous one is at least half full, so that a peer picking
+    // scattered IDs can't make us allocate a whole page per entry.  The new page also must not
+    // overlap any sparse entries, which must stay where they are.
+    if (!pages.empty() && pages.back()->count < PAGE_SIZE / 2) {
+      return false;
+    }
+    if (sparse.size() > 0) {
+      Id begin = pages.size() * PAGE_SIZE;
+      for (Id id = begin; id < begin + PAGE_SIZE; id++) {
+        if (sparse.find(id) != nullptr) return false;
+      }
+    }
+    return true;
+  }
 };
 
 // =======================================================================================
@@ -273,10 +361,11 @@ public:
                      kj::Maybe<SturdyRefRestorerBase&> restorer,
                      kj::Own<VatNetworkBase::Connection>&& connectionParam,
                      kj::Own<kj::PromiseFulfiller<DisconnectInfo>>&& disconnectFulfiller,
-                     size_t flowLimit)
+                     size_t flowLimit, kj::Maybe<RpcCallObserver&> callObserver,
+                     kj::Maybe<RpcCallScheduler&> callScheduler)
       : bootstrapFactory(bootstrapFactory), gateway(kj::mv(gateway)),
         restorer(restorer), disconnectFulfiller(kj::mv(disconnectFulfiller)), flowLimit(flowLimit),
-        tasks(*this) {
+        callObserver(callObserver), callScheduler(callScheduler), tasks(*this) {
     connection.init<Connected>(kj::mv(connectionParam));
     tasks.add(messageLoop());
   }
@@ -286,6 +375,7 @@ public:
       return newBrokenCap(kj::cp(connection.get<Disconnected>()));
     }
 
+    sendDeferredFinishes();
     QuestionId questionId;
     auto& question = questions.next(questionId);
 
@@ -410,6 +500,18 @@ public:
     maybeUnblockFlow();
   }
 
+  void setCallObserver(kj::Maybe<RpcCallObserver&> observer) {
+    callObserver = observer;
+  }
+
+  const RpcEmbargoStats& getEmbargoStats() {
+    return embargoStats;
+  }
+
+  void setCallScheduler(kj::Maybe<RpcCallScheduler&> scheduler) {
+    callScheduler = scheduler;
+  }
+
 private:
   class RpcClient;
   class ImportClient;
@@ -575,6 +677,55 @@ private:
   // If non-null, we're currently blocking incoming messages waiting for callWordsInFlight to drop
   // below flowLimit. Fulfill this to un-block.
 
+  kj::Maybe<RpcCallObserver&> callObserver;
+  kj::Maybe<RpcCallScheduler&> callScheduler;
+
+  class CallTurn;
+  struct CallTurnQueue {
+    kj::Own<ClientHook> target;
+    // Keeps the key alive.
+
+    bool unresolved;
+    // `target` was a promise when the first call queued here arrived. Calls that arrive once it
+    // has resolved are keyed on what it resolved to, and have to wait behind the ones here.
+
+    std::list<kj::Own<kj::PromiseFulfiller<kj::Own<CallTurn>>>> waiting;
+  };
+  kj::HashMap<ClientHook*, CallTurnQueue> callTurns;
+  uint unresolvedCallTurns = 0;
+  // While a call scheduler is set, incoming calls to each target object take turns to be passed to
+  // it, in the order they arrived, so that the scheduler only ever reorders calls to different
+  // objects. Targets are keyed on the object the call reaches (see resolvedTarget()) rather than on
+  // how the peer named it, since the peer may pipeline on an answer and then switch to the export
+  // it returned. A target has an entry here while some call (or Disembargo) holds its turn; the
+  // list holds those waiting for theirs. See waitForTurn().
+
+  RpcEmbargoStats embargoStats;
+
+  struct MethodKey {
+    uint64_t interfaceId;
+    uint16_t methodId;
+
+    inline bool operator==(const MethodKey& other) const {
+      return interfaceId == other.interfaceId && methodId == other.methodId;
+    }
+    inline uint hashCode() const { return kj::hashCode(interfaceId, methodId); }
+  };
+  kj::HashMap<MethodKey, uint> callSizes;
+  kj::HashMap<MethodKey, uint> returnSizes;
+  // Moving averages of the sizes, in words, of the `Call` and `Return` messages recently sent for
+  // each method. Used to size the first segment of the next message when the application gave no
+  // size hint. See learnedSizeHint().
+
+  struct DeferredFinish {
+    QuestionId questionId;
+    bool releaseResultCaps;
+  };
+  kj::Vector<DeferredFinish> deferredFinishes;
+  kj::HashMap<ImportId, uint> deferredReleases;
+  bool deferredFlushQueued = false;
+  // `Finish` and `Release` messages that haven't been sent yet. See deferFinish().
+
   kj::TaskSet tasks;
 
   // =====================================================================================
@@ -609,6 +760,11 @@ private:
     // that other client -- return a reference to the other client, transitively.  Otherwise,
     // return a new reference to *this.
 
+    virtual void noteCallSent(QuestionId questionId) {}
+    // Called after a call targeting this client (i.e. for which writeTarget() returned null) is
+    // sent as question `questionId`. PromiseClient uses this to tell, when it resolves, whether
+    // any calls sent through it may still be on their way.
+
     virtual void adoptFlowController(kj::Own<RpcFlowController> flowController) {
       // Called when a PromiseClient resolves to another RpcClient. If streaming calls were
       // outstanding on the old client, we'd like to keep using the same FlowController on the new
@@ -675,11 +831,7 @@ private:
 
       auto request = kj::heap<RpcRequest>(
           *connectionState, *connectionState->connection.get<Connected>(),
-          sizeHint, kj::addRef(*this));
-      auto callBuilder = request->getCall();
-
-      callBuilder.setInterfaceId(interfaceId);
-      callBuilder.setMethodId(methodId);
+          interfaceId, methodId, sizeHint, kj::addRef(*this));
 
       auto root = request->getRoot();
       return Request<AnyPointer, AnyPointer>(root, kj::mv(request));
@@ -758,14 +910,9 @@ private:
           }
         }
 
-        // Send a message releasing our remote references.
+        // Release our remote references.
         if (remoteRefcount > 0 && connectionState->connection.is<Connected>()) {
-          auto message = connectionState->connection.get<Connected>()->newOutgoingMessage(
-              messageSizeHint<rpc::Release>());
-          rpc::Release::Builder builder = message->getBody().initAs<rpc::Message>().initRelease();
-          builder.setId(importId);
-          builder.setReferenceCount(remoteRefcount);
-          message->send();
+          connectionState->deferRelease(importId, remoteRefcount);
         }
       });
     }
@@ -920,7 +1067,7 @@ private:
 
     kj::Maybe<kj::Own<ClientHook>> writeTarget(
         rpc::MessageTarget::Builder target) override {
-      receivedCall = true;
+      // Calls written here are tracked in noteCallSent() rather than by setting `receivedCall`.
       return connectionState->writeTarget(*cap, target);
     }
 
@@ -929,6 +1076,22 @@ private:
       return connectionState->getInnermostClient(*cap);
     }
 
+    void noteCallSent(QuestionId questionId) override {
+      if (isResolved()) {
+        // writeTarget() forwarded the call to `cap`.
+        if (cap->getBrand() == connectionState.get()) {
+          kj::downcast<RpcClient>(*cap).noteCallSent(questionId);
+        }
+        return;
+      }
+
+      if (callsSent.size() >= callsSentPruneSize) {
+        pruneCallsSent();
+        callsSentPruneSize = kj::max(callsSentPruneSize, callsSent.size() * 2);
+      }
+      callsSent.add(questionId);
+    }
+
     void adoptFlowController(kj::Own<RpcFlowController> flowController) override {
       if (cap->getBrand() == connectionState.get()) {
         // Pass the flow controller on to our inner cap.
@@ -954,7 +1117,7 @@ private:
             ->newCall(interfaceId, methodId, sizeHint);
       }
 
-      receivedCall = true;
+      // No need to set `receivedCall`: the request targets us, so noteCallSent() will see it.
 
       // IMPORTANT: We must call our superclass's version of newCall(), NOT cap->newCall(), because
       //   the Request object we create needs to check at send() time whether the promise has
@@ -1021,6 +1184,17 @@ private:
     kj::ForkedPromise<kj::Own<ClientHook>> fork;
 
     bool receivedCall = false;
+    // Set if this promise may have been used in a way that requires an embargo should it resolve
+    // to a local capability, other than by requests made with newCall(), which are tracked in
+    // `callsSent`. Passing the promise to the peer, forwarding a call with call(), or taking its
+    // innermost client sets this.
+
+    kj::Vector<QuestionId> callsSent;
+    size_t callsSentPruneSize = 16;
+    // Questions sent to this promise before it resolved. If all of them have already returned
+    // when the promise resolves, then the peer has already delivered them, so no embargo is
+    // needed to keep new calls from overtaking them. The IDs may have been reused by unrelated
+    // questions since, which at worst causes an unnecessary embargo.
 
     enum {
       UNRESOLVED,
@@ -1044,6 +1218,25 @@ private:
       return resolutionType != UNRESOLVED;
     }
 
+    void pruneCallsSent() {
+      // Drop IDs of questions that have returned.
+      size_t n = 0;
+      for (auto id: callsSent) {
+        KJ_IF_MAYBE(question, connectionState->questions.find(id)) {
+          if (question->isAwaitingReturn) {
+            callsSent[n++] = id;
+          }
+        }
+      }
+      callsSent.resize(n);
+    }
+
+    bool mayHaveCallsInFlight() {
+      if (receivedCall) return true;
+      pruneCallsSent();
+      return callsSent.size() > 0;
+    }
+
     kj::Promise<kj::Own<ClientHook>> resolve(kj::Own<ClientHook> replacement) {
       KJ_DASSERT(!isResolved());
 
@@ -1085,6 +1278,7 @@ private:
             // The other capability hasn't resolved yet, so we can safely merge with it and do a
             // single combined disembargo if needed later.
             other->receivedCall = other->receivedCall || receivedCall;
+            other->callsSent.addAll(callsSent);
             resolutionType = MERGED;
           }
         } else {
@@ -1125,8 +1319,13 @@ private:
         }
       }
 
-      if (resolutionType == REFLECTED && receivedCall &&
-          connectionState->connection.is<Connected>()) {
+      bool callsWereSent = callsSent.size() > 0;
+      if (resolutionType == REFLECTED) {
+        ++connectionState->embargoStats.reflectedResolutions;
+      }
+
+      if (resolutionType == REFLECTED && connectionState->connection.is<Connected>() &&
+          mayHaveCallsInFlight()) {
         // The new capability is hosted locally, not on the remote machine.  And, we had made calls
         // to the promise.  We need to make sure those calls echo back to us before we allow new
         // calls to go directly to the local capability, so we need to set a local embargo and send
@@ -1151,9 +1350,21 @@ private:
         auto paf = kj::newPromiseAndFulfiller<void>();
         embargo.fulfiller = kj::mv(paf.fulfiller);
 
-        // Make a promise which resolves to `replacement` as soon as the `Disembargo` comes back.
-        auto embargoPromise = paf.promise.then([replacement = kj::mv(replacement)]() mutable {
-          return kj::mv(replacement);
+        auto& stats = connectionState->embargoStats;
+        ++stats.embargoes;
+        auto startTime = kj::systemPreciseMonotonicClock().now();
+
+        // Make a promise which resolves to `replacement` as soon as the `Disembargo` comes back
+        // and the calls that came back ahead of it have got past the call scheduler, if any.
+        auto embargoPromise = paf.promise.then(
+            [replacement = kj::mv(replacement), state = kj::addRef(*connectionState), startTime]()
+            mutable {
+          state->embargoStats.embargoTime += kj::systemPreciseMonotonicClock().now() - startTime;
+          auto& state2 = *state;
+          return state2.queuedCallsAdmitted(*replacement)
+              .then([replacement = kj::mv(replacement)]() mutable {
+            return kj::mv(replacement);
+          }).attach(kj::mv(state));
         });
 
         // We need to queue up calls in the meantime, so we'll resolve ourselves to a local promise
@@ -1162,6 +1373,21 @@ private:
 
         // Send the `Disembargo`.
         message->send();
+      } else if (resolutionType == REFLECTED) {
+        if (callsWereSent) {
+          // Calls were made through the promise but all of them have returned.
+          ++connectionState->embargoStats.embargoesSkipped;
+        }
+
+        if (connectionState->hasQueuedCalls(*replacement)) {
+          // A returned call may have been forwarded back to us with a tail call, and still be
+          // waiting for the call scheduler. New calls must wait behind it.
+          auto admitted = connectionState->queuedCallsAdmitted(*replacement);
+          replacement = newLocalPromiseClient(admitted.then(
+              [replacement = kj::mv(replacement)]() mutable {
+            return kj::mv(replacement);
+          }));
+        }
       }
 
       cap = replacement->addRef();
@@ -1405,6 +1631,75 @@ private:
     });
   }
 
+  // =====================================================================================
+  // Deferred Finish and Release messages
+
+  void deferFinish(QuestionId questionId, bool releaseResultCaps) {
+    // Queue a `Finish` message to be sent at the end of the turn.  Deferring `Finish` and
+    // `Release` is safe because nothing else we send depends on their having been sent already,
+    // except that a question ID must not be reused before its `Finish` goes out; see
+    // sendDeferredFinishes().  Meanwhile, several `Release`s of the same import merge into one,
+    // and the messages can share a write with other traffic if the network batches writes.
+
+    deferredFinishes.add(DeferredFinish { questionId, releaseResultCaps });
+    queueDeferredFlush();
+  }
+
+  void deferRelease(ImportId importId, uint referenceCount) {
+    // Queue a `Release` message, merging it with any already queued for the same import.
+
+    deferredReleases.upsert(importId, referenceCount, [](uint& existing, uint&& added) {
+      existing += added;
+    });
+    queueDeferredFlush();
+  }
+
+  void sendDeferredFinishes() {
+    // Called before allocating a question ID, which could be one whose `Finish` is still queued.
+
+    if (!deferredFinishes.empty()) {
+      sendDeferred();
+    }
+  }
+
+  void queueDeferredFlush() {
+    if (deferredFlushQueued) return;
+    deferredFlushQueued = true;
+    tasks.add(kj::evalLater([this]() {
+      deferredFlushQueued = false;
+      sendDeferred();
+    }));
+  }
+
+  void sendDeferred() {
+    if (!connection.is<Connected>()) {
+      deferredFinishes.clear();
+      deferredReleases.clear();
+      return;
+    }
+    auto& conn = *connection.get<Connected>();
+
+    // Take the queues first, since sending could run destructors that queue more.
+    auto finishes = kj::mv(deferredFinishes);
+    auto releases = kj::mv(deferredReleases);
+
+    for (auto& finish: finishes) {
+      auto message = conn.newOutgoingMessage(messageSizeHint<rpc::Finish>());
+      auto builder = message->getBody().getAs<rpc::Message>().initFinish();
+      builder.setQuestionId(finish.questionId);
+      builder.setReleaseResultCaps(finish.releaseResultCaps);
+      message->send();
+    }
+
+    for (auto& release: releases) {
+      auto message = conn.newOutgoingMessage(messageSizeHint<rpc::Release>());
+      rpc::Release::Builder builder = message->getBody().initAs<rpc::Message>().initRelease();
+      builder.setId(release.key);
+      builder.setReferenceCount(release.value);
+      message->send();
+    }
+  }
+
   // =====================================================================================
   // Interpreting CapDescriptor
 
@@ -1612,6 +1907,91 @@ private:
     return result.finish();
   }
 
+  // =====================================================================================
+  // Message size learning
+
+  static uint learnedSizeHint(kj::HashMap<MethodKey, uint>& sizes, MethodKey key) {
+    // Returns a first segment size for a new message to or from the given method, or zero (meaning
+    // "use the default") if we haven't sent one yet. Most callers don't pass a size hint to
+    // newCall() or getResults(), and without one a large message spills into extra segments while
+    // a small one wastes most of a default-sized segment. Messages for any given method tend to
+    // be about the same size, so the sizes we've seen so far are a good guess.
+
+    KJ_IF_MAYBE(average, sizes.find(key)) {
+      // Leave some headroom so that a message a bit bigger than average still fits.
+      return *average + *average / 4 + 1;
+    } else {
+      return 0;
+    }
+  }
+
+  static void learnSize(kj::HashMap<MethodKey, uint>& sizes, MethodKey key, size_t words) {
+    // Records that we sent a message of `words` words to or from the given method.
+
+    uint64_t size = kj::min(uint64_t(words), MAX_SIZE_HINT);
+    KJ_IF_MAYBE(average, sizes.find(key)) {
+      // Exponentially-weighted, so that a method whose messages change size over time catches up.
+      *average = (*average * 3 + size) / 4;
+    } else {
+      sizes.insert(key, size);
+    }
+  }
+
+  // =====================================================================================
+  // Call tracing
+
+  typedef kj::Maybe<kj::Own<RpcCallObserver::Call>> CallTrace;
+  // Timing and size of one call, kept by the object tracking that call (QuestionRef or
+  // RpcCallContext) when a call observer is registered. Always null otherwise.
+
+  enum class CallEvent { SENT, RECEIVED, RETURNED, FINISHED };
+
+  CallTrace startCallTrace(bool incoming, uint64_t interfaceId = 0, uint16_t methodId = 0) {
+    KJ_IF_MAYBE(observer, callObserver) {
+      auto now = observer->getClock().now();
+      return kj::heap(RpcCallObserver::Call {
+        interfaceId, methodId, incoming, 0, 0, now, now, nullptr, now
+      });
+    } else {
+      return nullptr;
+    }
+  }
+
+  void traceCall(CallTrace& trace, CallEvent event, size_t words = 0) {
+    // Records `event` in `trace` and reports it to the observer. `words` is the size of the
+    // message received or sent. Does nothing if the call isn't traced or the observer has since
+    // been unset.
+
+    KJ_IF_MAYBE(t, trace) {
+      KJ_IF_MAYBE(observer, callObserver) {
+        auto& call = **t;
+        auto now = observer->getClock().now();
+        switch (event) {
+          case CallEvent::SENT:
+            call.sendTime = now;
+            observer->callSent(call);
+            break;
+          case CallEvent::RECEIVED:
+            call.paramWords = words;
+            observer->callReceived(call);
+            break;
+          case CallEvent::RETURNED:
+            call.resultWords = words;
+            call.returnTime = now;
+            observer->callReturned(call);
+            break;
+          case CallEvent::FINISHED:
+            call.finishTime = now;
+            observer->callFinished(call);
+            break;
+        }
+      }
+      if (event == CallEvent::FINISHED) {
+        trace = nullptr;
+      }
+    }
+  }
+
   // =====================================================================================
   // RequestHook/PipelineHook/ResponseHook implementations
 
@@ -1627,26 +2007,24 @@ private:
 
     ~QuestionRef() {
       unwindDetector.catchExceptionsIfUnwinding([&]() {
+        connectionState->traceCall(trace, CallEvent::FINISHED);
+
         auto& question = KJ_ASSERT_NONNULL(
             connectionState->questions.find(id), "Question ID no longer on table?");
 
         // Send the "Finish" message (if the connection is not already broken).
         if (connectionState->connection.is<Connected>() && !question.skipFinish) {
-          auto message = connectionState->connection.get<Connected>()->newOutgoingMessage(
-              messageSizeHint<rpc::Finish>());
-          auto builder = message->getBody().getAs<rpc::Message>().initFinish();
-          builder.setQuestionId(id);
           // If we're still awaiting a return, then this request is being canceled, and we're going
           // to ignore any capabilities in the return message, so set releaseResultCaps true. If we
           // already received the return, then we've already built local proxies for the caps and
           // will send Release messages when those are destroyed.
-          builder.setReleaseResultCaps(question.isAwaitingReturn);
-          message->send();
+          connectionState->deferFinish(id, question.isAwaitingReturn);
         }
 
         // Check if the question has returned and, if so, remove it from the table.
-        // Remove question ID from the table.  Must do this *after* sending `Finish` to ensure that
-        // the ID is not re-allocated before the `Finish` message can be sent.
+        // Remove question ID from the table.  Must do this *after* queuing `Finish`; the ID won't
+        // be re-allocated before the `Finish` message is sent, since allocating a question ID
+        // first sends any queued `Finish`es.
         if (question.isAwaitingReturn) {
           // Still waiting for return, so just remove the QuestionRef pointer from the table.
           question.selfRef = nullptr;
@@ -1671,6 +2049,9 @@ private:
       fulfiller->reject(kj::mv(exception));
     }
 
+    CallTrace trace;
+    // Moved here from the RpcRequest when the call is sent.
+
   private:
     kj::Own<RpcConnectionState> connectionState;
     QuestionId id;
@@ -1681,14 +2062,20 @@ private:
   class RpcRequest final: public RequestHook {
   public:
     RpcRequest(RpcConnectionState& connectionState, VatNetworkBase::Connection& connection,
+               uint64_t interfaceId, uint16_t methodId,
                kj::Maybe<MessageSize> sizeHint, kj::Own<RpcClient>&& target)
         : connectionState(kj::addRef(connectionState)),
           target(kj::mv(target)),
-          message(connection.newOutgoingMessage(
-              firstSegmentSize(sizeHint, messageSizeHint<rpc::Call>() +
+          message(connection.newOutgoingMessage(sizeHint == nullptr
+              ? learnedSizeHint(connectionState.callSizes, { interfaceId, methodId })
+              : firstSegmentSize(sizeHint, messageSizeHint<rpc::Call>() +
                   sizeInWords<rpc::Payload>() + MESSAGE_TARGET_SIZE_HINT))),
           callBuilder(message->getBody().getAs<rpc::Message>().initCall()),
-          paramsBuilder(capTable.imbue(callBuilder.getParams().getContent())) {}
+          paramsBuilder(capTable.imbue(callBuilder.getParams().getContent())),
+          trace(connectionState.startCallTrace(false)) {
+      callBuilder.setInterfaceId(interfaceId);
+      callBuilder.setMethodId(methodId);
+    }
 
     inline AnyPointer::Builder getRoot() {
       return paramsBuilder;
@@ -1805,6 +2192,7 @@ private:
     BuilderCapabilityTable capTable;
     rpc::Call::Builder callBuilder;
     AnyPointer::Builder paramsBuilder;
+    CallTrace trace;
 
     struct SendInternalResult {
       kj::Own<QuestionRef> questionRef;
@@ -1828,6 +2216,7 @@ private:
       message->setFds(fds.releaseAsArray());
 
       // Init the question table.  Do this after writing descriptors to avoid interference.
+      connectionState->sendDeferredFinishes();
       QuestionId questionId;
       auto& question = connectionState->questions.next(questionId);
       question.isAwaitingReturn = true;
@@ -1842,6 +2231,19 @@ private:
       question.selfRef = *result.questionRef;
       result.promise = paf.promise.attach(kj::addRef(*result.questionRef));
 
+      target->noteCallSent(questionId);
+      learnSize(connectionState->callSizes,
+                { callBuilder.getInterfaceId(), callBuilder.getMethodId() },
+                message->sizeInWords());
+
+      KJ_IF_MAYBE(t, trace) {
+        auto& call = **t;
+        call.interfaceId = callBuilder.getInterfaceId();
+        call.methodId = callBuilder.getMethodId();
+        call.paramWords = message->sizeInWords();
+        result.questionRef->trace = kj::mv(trace);
+      }
+
       return { kj::mv(result), questionId, question };
     }
 
@@ -1863,6 +2265,8 @@ private:
         result.question.isAwaitingReturn = false;
         result.question.skipFinish = true;
         result.questionRef->reject(kj::mv(*exception));
+      } else {
+        connectionState->traceCall(result.questionRef->trace, CallEvent::SENT);
       }
 
       // Send and return.
@@ -1898,6 +2302,8 @@ private:
         return kj::mv(*exception);
       }
 
+      connectionState->traceCall(setup.questionRef->trace, CallEvent::SENT);
+
       return kj::mv(flowPromise);
     }
   };
@@ -2039,9 +2445,16 @@ private:
       return kj::addRef(*this);
     }
 
+    kj::Maybe<kj::Array<const byte>> sliceData(kj::ArrayPtr<const byte> data) override {
+      // Share just the message, not the whole response, so that holding a slice doesn't delay
+      // the `Finish` message.
+      return sliceMessage(message, sharedMessage, data);
+    }
+
   private:
     kj::Own<RpcConnectionState> connectionState;
     kj::Own<IncomingRpcMessage> message;
+    kj::Maybe<SharedIncomingRpcMessage&> sharedMessage;
     ReaderCapabilityTable capTable;
     AnyPointer::Reader reader;
     kj::Own<QuestionRef> questionRef;
@@ -2097,6 +2510,10 @@ private:
       }
     }
 
+    size_t sizeInWords() {
+      return message->sizeInWords();
+    }
+
   private:
     RpcConnectionState& connectionState;
     kj::Own<OutgoingRpcMessage> message;
@@ -2145,8 +2562,10 @@ private:
           params(paramsCapTable.imbue(params)),
           returnMessage(nullptr),
           redirectResults(redirectResults),
-          cancelFulfiller(kj::mv(cancelFulfiller)) {
+          cancelFulfiller(kj::mv(cancelFulfiller)),
+          trace(connectionState.startCallTrace(true, interfaceId, methodId)) {
       connectionState.callWordsInFlight += requestSize;
+      connectionState.traceCall(trace, CallEvent::RECEIVED, requestSize);
     }
 
     ~RpcCallContext() noexcept(false) {
@@ -2175,11 +2594,14 @@ private:
             }
 
             message->send();
+            connectionState->traceCall(trace, CallEvent::RETURNED, message->sizeInWords());
           }
 
           cleanupAnswerTable(nullptr, shouldFreePipeline);
         });
       }
+
+      connectionState->traceCall(trace, CallEvent::FINISHED);
     }
 
     kj::Own<RpcResponse> consumeRedirectedResponse() {
@@ -2208,16 +2630,20 @@ private:
         returnMessage.setAnswerId(answerId);
         returnMessage.setReleaseParamCaps(false);
 
+        auto& responseImpl = kj::downcast<RpcServerResponseImpl>(*KJ_ASSERT_NONNULL(response));
         kj::Maybe<kj::Array<ExportId>> exports;
         KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
           // Debug info incase send() fails due to overside message.
           KJ_CONTEXT("returning from RPC call", interfaceId, methodId);
-          exports = kj::downcast<RpcServerResponseImpl>(*KJ_ASSERT_NONNULL(response)).send();
+          exports = responseImpl.send();
         })) {
           responseSent = false;
           sendErrorReturn(kj::mv(*exception));
           return;
         }
+        learnSize(connectionState->returnSizes, { interfaceId, methodId },
+                  responseImpl.sizeInWords());
+        connectionState->traceCall(trace, CallEvent::RETURNED, responseImpl.sizeInWords());
 
         KJ_IF_MAYBE(e, exports) {
           // Caps were returned, so we can't free the pipeline yet.
@@ -2241,6 +2667,7 @@ private:
           fromException(exception, builder.initException());
 
           message->send();
+          connectionState->traceCall(trace, CallEvent::RETURNED, message->sizeInWords());
         }
 
         // Do not allow releasing the pipeline because we want pipelined calls to propagate the
@@ -2261,6 +2688,7 @@ private:
         builder.setResultsSentElsewhere();
 
         message->send();
+        connectionState->traceCall(trace, CallEvent::RETURNED, message->sizeInWords());
 
         cleanupAnswerTable(nullptr, false);
       }
@@ -2276,6 +2704,14 @@ private:
       bool previouslyAllowedButNotRequested = cancellationFlags == CANCEL_ALLOWED;
       cancellationFlags |= CANCEL_REQUESTED;
 
+      if (!redirectResults) {
+        KJ_IF_MAYBE(f, queueCancelFulfiller) {
+          // The call hasn't been delivered yet, so it's always safe to cancel it.
+          f->get()->reject(KJ_EXCEPTION(FAILED, "call canceled while waiting to be scheduled"));
+          queueCancelFulfiller = nullptr;
+        }
+      }
+
       if (previouslyAllowedButNotRequested) {
         // We just set CANCEL_REQUESTED, and CANCEL_ALLOWED was already set previously.  Initiate
         // the cancellation.
@@ -2291,6 +2727,11 @@ private:
     }
     void releaseParams() override {
       request = nullptr;
+      sharedRequest = nullptr;
+    }
+    kj::Maybe<kj::Array<const byte>> sliceParamData(kj::ArrayPtr<const byte> data) override {
+      auto& r = KJ_REQUIRE_NONNULL(request, "Can't call sliceParamData() after releaseParams().");
+      return sliceMessage(r, sharedRequest, data);
     }
     AnyPointer::Builder getResults(kj::Maybe<MessageSize> sizeHint) override {
       KJ_IF_MAYBE(r, response) {
@@ -2302,8 +2743,10 @@ private:
           response = kj::refcounted<LocallyRedirectedRpcResponse>(sizeHint);
         } else {
           auto message = connectionState->connection.get<Connected>()->newOutgoingMessage(
-              firstSegmentSize(sizeHint, messageSizeHint<rpc::Return>() +
-                               sizeInWords<rpc::Payload>()));
+              sizeHint == nullptr
+                  ? learnedSizeHint(connectionState->returnSizes, { interfaceId, methodId })
+                  : firstSegmentSize(sizeHint, messageSizeHint<rpc::Return>() +
+                                     sizeInWords<rpc::Payload>()));
           returnMessage = message->getBody().initAs<rpc::Message>().initReturn();
           response = kj::heap<RpcServerResponseImpl>(
               *connectionState, kj::mv(message), returnMessage.getResults());
@@ -2341,6 +2784,7 @@ private:
               builder.setTakeFromOtherQuestion(tailInfo->questionId);
 
               message->send();
+              connectionState->traceCall(trace, CallEvent::RETURNED, message->sizeInWords());
             }
 
             // There are no caps in our return message, but of course the tail results could have
@@ -2383,6 +2827,17 @@ private:
       return kj::addRef(*this);
     }
 
+    kj::Promise<kj::Own<RpcCallScheduler::Ticket>> onCanceledWhileQueued() {
+      // Returns a promise that rejects if the caller cancels before startQueued() is called.
+      auto paf = kj::newPromiseAndFulfiller<kj::Own<RpcCallScheduler::Ticket>>();
+      queueCancelFulfiller = kj::mv(paf.fulfiller);
+      return kj::mv(paf.promise);
+    }
+
+    void startQueued() {
+      queueCancelFulfiller = nullptr;
+    }
+
   private:
     kj::Own<RpcConnectionState> connectionState;
     AnswerId answerId;
@@ -2395,6 +2850,7 @@ private:
 
     size_t requestSize;  // for flow limit purposes
     kj::Maybe<kj::Own<IncomingRpcMessage>> request;
+    kj::Maybe<SharedIncomingRpcMessage&> sharedRequest;  // see sliceMessage()
     ReaderCapabilityTable paramsCapTable;
     AnyPointer::Reader params;
 
@@ -2421,6 +2877,12 @@ private:
     // exclusive-joined with the outermost promise waiting on the call return, so fulfilling it
     // cancels that promise.
 
+    kj::Maybe<kj::Own<kj::PromiseFulfiller<kj::Own<RpcCallScheduler::Ticket>>>>
+        queueCancelFulfiller;
+    // Non-null while the call waits for the call scheduler. Rejected on cancellation.
+
+    CallTrace trace;
+
     kj::UnwindDetector unwindDetector;
 
     // -----------------------------------------------------
@@ -2731,6 +3193,7 @@ private:
     auto cancelPaf = kj::newPromiseAndFulfiller<void>();
 
     AnswerId answerId = call.getQuestionId();
+    size_t paramWords = message->sizeInWords();
 
     auto context = kj::refcounted<RpcCallContext>(
         *this, answerId, kj::mv(message), kj::mv(capTableArray), payload.getContent(),
@@ -2750,8 +3213,8 @@ private:
       answer.callContext = *context;
     }
 
-    auto promiseAndPipeline = startCall(
-        call.getInterfaceId(), call.getMethodId(), kj::mv(capability), context->addRef());
+    auto promiseAndPipeline = admitCall(
+        call.getInterfaceId(), call.getMethodId(), paramWords, kj::mv(capability), *context);
 
     // Things may have changed -- in particular if startCall() immediately called
     // context->directTailCall().
@@ -2797,6 +3260,156 @@ private:
     }
   }
 
+  class CallTurn {
+    // Held by the incoming call (or Disembargo) whose turn it is to be admitted for its target.
+    // Destroying it passes the turn on.
+
+  public:
+    CallTurn(RpcConnectionState& state, ClientHook* key): state(kj::addRef(state)), key(key) {}
+    KJ_DISALLOW_COPY(CallTurn);
+    ~CallTurn() noexcept(false) {
+      state->passTurn(key);
+    }
+
+  private:
+    kj::Own<RpcConnectionState> state;
+    ClientHook* key;
+  };
+
+  static ClientHook& resolvedTarget(ClientHook& cap) {
+    // The object calls to `cap` reach, as far as is known so far.
+    ClientHook* ptr = &cap;
+    for (;;) {
+      KJ_IF_MAYBE(inner, ptr->getResolved()) {
+        ptr = inner;
+      } else {
+        return *ptr;
+      }
+    }
+  }
+
+  kj::Promise<kj::Own<CallTurn>> waitForTurn(ClientHook& target) {
+    KJ_IF_MAYBE(queue, callTurns.find(&target)) {
+      auto paf = kj::newPromiseAndFulfiller<kj::Own<CallTurn>>();
+      queue->waiting.push_back(kj::mv(paf.fulfiller));
+      return kj::mv(paf.promise);
+    } else {
+      bool unresolved = target.whenMoreResolved() != nullptr;
+      if (unresolved) ++unresolvedCallTurns;
+      callTurns.insert(&target, { target.addRef(), unresolved, {} });
+      return kj::heap<CallTurn>(*this, &target);
+    }
+  }
+
+  void passTurn(ClientHook* key) {
+    auto& queue = KJ_ASSERT_NONNULL(callTurns.find(key));
+    while (!queue.waiting.empty()) {
+      auto fulfiller = kj::mv(queue.waiting.front());
+      queue.waiting.pop_front();
+      if (fulfiller->isWaiting()) {
+        // The turn is created up front so that it's passed on even if the waiter is canceled
+        // before it sees it.
+        fulfiller->fulfill(kj::heap<CallTurn>(*this, key));
+        return;
+      }
+    }
+    if (queue.unresolved) --unresolvedCallTurns;
+    callTurns.erase(key);
+  }
+
+  kj::Vector<ClientHook*> promisesQueuedFor(ClientHook& target) {
+    // Keys of the queues of calls to promises that have since resolved to `target`.
+    kj::Vector<ClientHook*> result;
+    if (unresolvedCallTurns > 0) {
+      for (auto& entry: callTurns) {
+        if (entry.value.unresolved && entry.key != &target &&
+            &resolvedTarget(*entry.value.target) == &target) {
+          result.add(entry.key);
+        }
+      }
+    }
+    return result;
+  }
+
+  kj::Promise<void> promisedCallsAdmitted(ClientHook& target) {
+    // Resolves once the calls that arrived so far for promises that have since resolved to
+    // `target` have all been admitted.
+    auto keys = promisesQueuedFor(target);
+    if (keys.empty()) return kj::READY_NOW;
+    auto promises = KJ_MAP(key, keys) {
+      return waitForTurn(*key).ignoreResult();
+    };
+    return kj::joinPromises(kj::mv(promises));
+  }
+
+  bool hasQueuedCalls(ClientHook& cap) {
+    // Whether calls the peer made to `cap` are waiting for their turn to be passed to the call
+    // scheduler, or for the scheduler to admit them.
+    auto& target = resolvedTarget(cap);
+    return callTurns.find(&target) != nullptr || !promisesQueuedFor(target).empty();
+  }
+
+  kj::Promise<void> queuedCallsAdmitted(ClientHook& cap) {
+    // Resolves once every call to `cap` that has arrived so far has been admitted and started,
+    // so that calls made to `cap` directly from now on can't overtake them. Used when a promise
+    // we imported resolves back to `cap`, where the embargo only ensures that the calls made
+    // through the promise have arrived back here, and for a Disembargo.
+    auto& target = resolvedTarget(cap);
+    auto promised = promisedCallsAdmitted(target);
+    if (callTurns.find(&target) != nullptr) {
+      return kj::joinPromises(kj::arr(waitForTurn(target).ignoreResult(), kj::mv(promised)));
+    }
+    return kj::mv(promised);
+  }
+
+  ClientHook::VoidPromiseAndPipeline admitCall(
+      uint64_t interfaceId, uint16_t methodId, size_t paramWords,
+      kj::Own<ClientHook>&& capability, RpcCallContext& context) {
+    // Calls startCall(), after waiting for the call scheduler if there is one. Calls to the same
+    // object are passed to the scheduler one at a time, each once the one before it has started,
+    // so that they're delivered in the order they were sent (E-order) however the scheduler
+    // ranks them.
+
+    KJ_IF_MAYBE(scheduler, callScheduler) {
+      RpcCallScheduler::Call info { interfaceId, methodId, paramWords, this };
+      auto& target = resolvedTarget(*capability);
+
+      // Calls that were pipelined on a promise that has since resolved to `target` came first,
+      // even though they're queued under the promise.
+      auto promisedCalls = promisedCallsAdmitted(target);
+
+      auto admission = waitForTurn(target)
+          .then([&scheduler = *scheduler, info, promisedCalls = kj::mv(promisedCalls)]
+                (kj::Own<CallTurn>&& turn) mutable {
+        // The turn is released as soon as the call is admitted, just before it starts.
+        return promisedCalls.then([&scheduler, info]() {
+          return scheduler.admit(info);
+        }).attach(kj::mv(turn));
+      }).exclusiveJoin(context.onCanceledWhileQueued());
+
+      auto vpapPromises = admission.then(
+          [this, interfaceId, methodId, capability = kj::mv(capability),
+           context = kj::addRef(context)](kj::Own<RpcCallScheduler::Ticket>&& ticket) mutable {
+        context->startQueued();
+
+        // If the target was a promise that has resolved meanwhile, call what it resolved to, as
+        // later calls keyed on that will: going through the promise takes extra turns, which
+        // would let them overtake this one.
+        capability = resolvedTarget(*capability).addRef();
+
+        auto vpap = startCall(interfaceId, methodId, kj::mv(capability), kj::mv(context));
+        return kj::tuple(vpap.promise.attach(kj::mv(ticket)), kj::mv(vpap.pipeline));
+      }).split();
+
+      return {
+        kj::mv(kj::get<0>(vpapPromises)),
+        newLocalPromisePipeline(kj::mv(kj::get<1>(vpapPromises))),
+      };
+    } else {
+      return startCall(interfaceId, methodId, kj::mv(capability), context.addRef());
+    }
+  }
+
   ClientHook::VoidPromiseAndPipeline startCall(
       uint64_t interfaceId, uint64_t methodId,
       kj::Own<ClientHook>&& capability, kj::Own<CallContextHook>&& context) {
@@ -2912,6 +3525,8 @@ private:
       }
 
       KJ_IF_MAYBE(questionRef, question->selfRef) {
+        traceCall(questionRef->trace, CallEvent::RETURNED, message->sizeInWords());
+
         switch (ret.which()) {
           case rpc::Return::RESULTS: {
             KJ_REQUIRE(!question->isTailCall,
@@ -3153,9 +3768,16 @@ private:
 
         EmbargoId embargoId = context.getSenderLoopback();
 
+        // Calls to the same target that arrived before this may still be waiting for the call
+        // scheduler. The peer will lift its embargo when it sees the echo, so they have to be on
+        // their way first.
+        auto earlierCallsAdmitted = queuedCallsAdmitted(*target);
+
         // We need to insert an evalLast() here to make sure that any pending calls towards this
         // cap have had time to find their way through the event loop.
-        tasks.add(canceler.wrap(kj::evalLast(kj::mvCapture(
+        tasks.add(canceler.wrap(earlierCallsAdmitted.then([]() {
+          return kj::evalLast([]() {});
+        }).then(kj::mvCapture(
             target, [this,embargoId](kj::Own<ClientHook>&& target) {
           if (!connection.is<Connected>()) {
             return;
@@ -3278,6 +3900,30 @@ public:
     }
   }
 
+  void setCallObserver(kj::Maybe<RpcCallObserver&> observer) {
+    callObserver = observer;
+
+    for (auto& conn: connections) {
+      conn.second->setCallObserver(observer);
+    }
+  }
+
+  void setCallScheduler(kj::Maybe<RpcCallScheduler&> scheduler) {
+    callScheduler = scheduler;
+
+    for (auto& conn: connections) {
+      conn.second->setCallScheduler(scheduler);
+    }
+  }
+
+  RpcEmbargoStats getEmbargoStats() {
+    RpcEmbargoStats result = disconnectedEmbargoStats;
+    for (auto& conn: connections) {
+      addEmbargoStats(result, conn.second->getEmbargoStats());
+    }
+    return result;
+  }
+
 private:
   VatNetworkBase& network;
   kj::Maybe<Capability::Client> bootstrapInterface;
@@ -3285,6 +3931,9 @@ private:
   kj::Maybe<RealmGateway<>::Client> gateway;
   kj::Maybe<SturdyRefRestorerBase&> restorer;
   size_t flowLimit = kj::maxValue;
+  kj::Maybe<RpcCallObserver&> callObserver;
+  kj::Maybe<RpcCallScheduler&> callScheduler;
+  RpcEmbargoStats disconnectedEmbargoStats;
   kj::TaskSet tasks;
 
   typedef std::unordered_map<VatNetworkBase::Connection*, kj::Own<RpcConnectionState>>
@@ -3300,12 +3949,16 @@ private:
       auto onDisconnect = kj::newPromiseAndFulfiller<RpcConnectionState::DisconnectInfo>();
       tasks.add(onDisconnect.promise
           .then([this,connectionPtr](RpcConnectionState::DisconnectInfo info) {
+        auto iter = connections.find(connectionPtr);
+        if (iter != connections.end()) {
+          addEmbargoStats(disconnectedEmbargoStats, iter->second->getEmbargoStats());
+        }
         connections.erase(connectionPtr);
         tasks.add(kj::mv(info.shutdownPromise));
       }));
       auto newState = kj::refcounted<RpcConnectionState>(
           bootstrapFactory, gateway, restorer, kj::mv(connection),
-          kj::mv(onDisconnect.fulfiller), flowLimit);
+          kj::mv(onDisconnect.fulfiller), flowLimit, callObserver, callScheduler);
       RpcConnectionState& result = *newState;
       connections.insert(std::make_pair(connectionPtr, kj::mv(newState)));
       return result;
@@ -3314,6 +3967,13 @@ private:
     }
   }
 
+  static void addEmbargoStats(RpcEmbargoStats& total, const RpcEmbargoStats& stats) {
+    total.reflectedResolutions += stats.reflectedResolutions;
+    total.embargoes += stats.embargoes;
+    total.embargoesSkipped += stats.embargoesSkipped;
+    total.embargoTime += stats.embargoTime;
+  }
+
   kj::Promise<void> acceptLoop() {
     auto receive = network.baseAccept().then(
         [this](kj::Own<VatNetworkBase::Connection>&& connection) {
@@ -3372,6 +4032,18 @@ void RpcSystemBase::baseSetFlowLimit(size_t words) {
   return impl->setFlowLimit(words);
 }
 
+void RpcSystemBase::baseSetCallObserver(kj::Maybe<RpcCallObserver&> observer) {
+  impl->setCallObserver(observer);
+}
+
+RpcEmbargoStats RpcSystemBase::baseGetEmbargoStats() {
+  return impl->getEmbargoStats();
+}
+
+void RpcSystemBase::baseSetCallScheduler(kj::Maybe<RpcCallScheduler&> scheduler) {
+  impl->setCallScheduler(scheduler);
+}
+
 }  // namespace _ (private)
 
 // =======================================================================================
@@ -3515,4 +4187,341 @@ kj::Own<RpcFlowController> RpcFlowController::newVariableWindowController(Window
   return kj::heap<WindowFlowController>(getter);
 }
 
+// =======================================================================================
+
+AdaptiveFlowController::Group::~Group() noexcept(false) {
+  for (auto member: members) {
+    member->group = nullptr;
+  }
+}
+
+kj::Array<AdaptiveFlowController::Stats> AdaptiveFlowController::Group::getStats() {
+  return KJ_MAP(member, members) { return member->getStats(); };
+}
+
+AdaptiveFlowController::AdaptiveFlowController(
+    const kj::MonotonicClock& clock, kj::Maybe<Group&> group)
+    : AdaptiveFlowController(clock, Options(), group) {}
+
+AdaptiveFlowController::AdaptiveFlowController(
+    const kj::MonotonicClock& clock, Options options, kj::Maybe<Group&> group)
+    : clock(clock), options(options), group(group),
+      inner(newVariableWindowController(*this)),
+      window(kj::max(options.minWindow, kj::min(options.initialWindow, options.maxWindow))),
+      deliveredTime(clock.now()),
+      bandwidthSamples(kj::heapArray<BandwidthSample>(kj::max(options.bandwidthRounds, 1u))),
+      minRttTime(deliveredTime) {
+  for (auto& sample: bandwidthSamples) {
+    sample = { 0, 0 };
+  }
+  KJ_IF_MAYBE(g, group) {
+    g->members.add(this);
+  }
+}
+
+AdaptiveFlowController::~AdaptiveFlowController() noexcept(false) {
+  // Drop the acks `inner` is still waiting for while `inFlight` is still around to be updated.
+  inner = nullptr;
+
+  KJ_IF_MAYBE(g, group) {
+    auto& members = g->members;
+    for (auto i: kj::indices(members)) {
+      if (members[i] == this) {
+        members[i] = members.back();
+        members.removeLast();
+        break;
+      }
+    }
+  }
+}
+
+AdaptiveFlowController::Stats AdaptiveFlowController::getStats() {
+  return {
+    window, inFlight,
+    minRtt.orDefault(0 * kj::NANOSECONDS), smoothedRtt,
+    getBandwidth(), delivered, startup
+  };
+}
+
+kj::Promise<void> AdaptiveFlowController::send(
+    kj::Own<OutgoingRpcMessage> message, kj::Promise<void> ack) {
+  size_t size = message->sizeInWords() * sizeof(capnp::word);
+
+  // If this message doesn't fill the window, the sender is the bottleneck rather than the path,
+  // so the rate measured from its ack says little about the path's bandwidth.
+  bool appLimited = inFlight + size < window;
+
+  Sent sent { size, sendCount++, clock.now(), delivered, deliveredTime, appLimited };
+  inFlight += sent.size;
+  auto measured = ack.then([this, sent]() { onAck(sent); })
+      .attach(kj::defer([this, size]() {
+    // Whether the ack arrived, failed, or was canceled, the message is no longer in flight.
+    inFlight -= size;
+  }));
+
+  // The window is updated in onAck() before `inner` sees the ack, so it releases blocked sends
+  // based on the new window.
+  return inner->send(kj::mv(message), kj::mv(measured));
+}
+
+kj::Promise<void> AdaptiveFlowController::waitAllAcked() {
+  return inner->waitAllAcked();
+}
+
+void AdaptiveFlowController::onAck(const Sent& sent) {
+  auto now = clock.now();
+  delivered += sent.size;
+  deliveredTime = now;
+
+  kj::Duration rtt = now - sent.time;
+  KJ_IF_MAYBE(m, minRtt) {
+    if (probingRtt) {
+      if (sent.sequence >= probeStart) {
+        // This message was sent after the window shrank, behind at most a short queue.
+        *m = rtt;
+        minRttTime = now;
+        probingRtt = false;
+      }
+    } else if (rtt <= *m) {
+      *m = rtt;
+      minRttTime = now;
+    } else if (now - minRttTime > options.minRttExpiry) {
+      // The minimum is stale, but RTTs measured now may include a queue we built ourselves. Shrink
+      // the window to let any queue drain, and take the next message's RTT as the new minimum.
+      probingRtt = true;
+      probeStart = sendCount;
+    }
+    smoothedRtt = smoothedRtt + (rtt - smoothedRtt) / 8;
+  } else {
+    minRtt = rtt;
+    minRttTime = now;
+    smoothedRtt = rtt;
+  }
+
+  bool newRound = false;
+  if (sent.delivered >= roundEndDelivered) {
+    ++round;
+    roundEndDelivered = delivered;
+    newRound = true;
+  }
+
+  kj::Duration interval = now - sent.deliveredTime;
+  if (interval > 0 * kj::NANOSECONDS) {
+    uint64_t rate = double(delivered - sent.delivered) * (kj::SECONDS / kj::NANOSECONDS) /
+                    (interval / kj::NANOSECONDS);
+    if (!sent.appLimited || rate > getBandwidth()) {
+      auto& sample = bandwidthSamples[round % bandwidthSamples.size()];
+      if (sample.round != round) {
+        sample = { round, rate };
+      } else {
+        sample.bytesPerSecond = kj::max(sample.bytesPerSecond, rate);
+      }
+    }
+  }
+
+  uint64_t bandwidth = getBandwidth();
+  double bdp = double(bandwidth) * (KJ_ASSERT_NONNULL(minRtt) / kj::NANOSECONDS) /
+               (kj::SECONDS / kj::NANOSECONDS);
+
+  if (startup && newRound && !sent.appLimited) {
+    if (bandwidth >= startupBandwidth + startupBandwidth / 4) {
+      startupBandwidth = bandwidth;
+      startupFlatRounds = 0;
+    } else if (++startupFlatRounds >= 3) {
+      startup = false;
+    }
+  }
+
+  double newWindow;
+  if (probingRtt) {
+    newWindow = options.minWindow;
+  } else if (startup) {
+    // Grow by what was acknowledged, but not so far past the bandwidth-delay product measured so
+    // far that a queue builds up while we wait for the bandwidth to stop growing.
+    newWindow = double(window) + sent.size;
+    if (bandwidth > 0) {
+      newWindow = kj::min(newWindow, kj::max(double(options.initialWindow), bdp * STARTUP_GAIN));
+    }
+  } else {
+    newWindow = bdp * options.windowGain;
+  }
+  window = kj::max(double(options.minWindow), kj::min(double(options.maxWindow), newWindow));
+}
+
+uint64_t AdaptiveFlowController::getBandwidth() {
+  uint64_t result = 0;
+  for (auto& sample: bandwidthSamples) {
+    if (sample.round + bandwidthSamples.size() > round) {
+      result = kj::max(result, sample.bytesPerSecond);
+    }
+  }
+  return result;
+}
+
+// =======================================================================================
+
+struct PriorityCallScheduler::Queues {
+  struct ConnectionQueue {
+    std::list<Waiter*> waiters;
+    std::list<const void*>::iterator turn;
+    // This connection's position in Level::turns.
+  };
+
+  struct Level {
+    std::list<const void*> turns;
+    // Connections with waiting calls, in the order they will be served.
+
+    std::unordered_map<const void*, ConnectionQueue> connections;
+  };
+
+  std::map<int, Level, std::greater<int>> levels;
+  // Highest priority first.
+};
+
+class PriorityCallScheduler::CostTicket final: public RpcCallScheduler::Ticket {
+  // Holds a running call's cost until the call completes.
+
+public:
+  CostTicket(PriorityCallScheduler& scheduler, uint cost): scheduler(scheduler), cost(cost) {
+    scheduler.running += cost;
+    ++scheduler.admitted;
+  }
+  KJ_DISALLOW_COPY(CostTicket);
+  ~CostTicket() noexcept(false) {
+    scheduler.running -= cost;
+    scheduler.pump();
+  }
+
+private:
+  PriorityCallScheduler& scheduler;
+  uint cost;
+};
+
+class PriorityCallScheduler::Waiter {
+  // Adapter for a queued call's admission promise. Dropping the promise removes the call from
+  // its queue.
+
+public:
+  Waiter(kj::PromiseFulfiller<kj::Own<Ticket>>& fulfiller, PriorityCallScheduler& scheduler,
+         int priority, const void* connection, uint cost)
+      : fulfiller(fulfiller), scheduler(scheduler),
+        priority(priority), connection(connection), cost(cost) {
+    auto& level = scheduler.queues->levels[priority];
+    auto insertResult = level.connections.insert(
+        std::make_pair(connection, Queues::ConnectionQueue()));
+    auto& queue = insertResult.first->second;
+    if (insertResult.second) {
+      queue.turn = level.turns.insert(level.turns.end(), connection);
+    }
+    position = queue.waiters.insert(queue.waiters.end(), this);
+    ++scheduler.queued;
+  }
+
+  ~Waiter() noexcept(false) {
+    if (isQueued) dequeue();
+  }
+
+  void admit() {
+    // Removes the call from its queue and lets it run.
+
+    auto& level = scheduler.queues->levels.find(priority)->second;
+    auto& queue = level.connections.find(connection)->second;
+    if (queue.waiters.size() > 1) {
+      // Send the connection to the back of the line.
+      level.turns.splice(level.turns.end(), level.turns, queue.turn);
+    }
+
+    dequeue();
+    fulfiller.fulfill(kj::heap<CostTicket>(scheduler, cost));
+  }
+
+  uint getCost() { return cost; }
+
+private:
+  kj::PromiseFulfiller<kj::Own<Ticket>>& fulfiller;
+  PriorityCallScheduler& scheduler;
+  int priority;
+  const void* connection;
+  uint cost;
+  std::list<Waiter*>::iterator position;
+  bool isQueued = true;
+
+  void dequeue() {
+    auto& levels = scheduler.queues->levels;
+    auto levelIter = levels.find(priority);
+    auto& level = levelIter->second;
+    auto queueIter = level.connections.find(connection);
+    auto& queue = queueIter->second;
+
+    queue.waiters.erase(position);
+    if (queue.waiters.empty()) {
+      level.turns.erase(queue.turn);
+      level.connections.erase(queueIter);
+      if (level.connections.empty()) {
+        levels.erase(levelIter);
+      }
+    }
+
+    isQueued = false;
+    --scheduler.queued;
+  }
+};
+
+PriorityCallScheduler::PriorityCallScheduler(Classifier classify)
+    : PriorityCallScheduler(kj::mv(classify), Options()) {}
+
+PriorityCallScheduler::PriorityCallScheduler(Classifier classify, Options options)
+    : classify(kj::mv(classify)), options(options), queues(kj::heap<Queues>()) {}
+
+PriorityCallScheduler::~PriorityCallScheduler() noexcept(false) {
+  KJ_REQUIRE(running == 0 && queued == 0,
+      "PriorityCallScheduler destroyed while calls are using it") {
+    break;
+  }
+}
+
+PriorityCallScheduler::Stats PriorityCallScheduler::getStats() {
+  return { running, queued, admitted, rejected };
+}
+
+kj::Promise<kj::Own<RpcCallScheduler::Ticket>> PriorityCallScheduler::admit(const Call& call) {
+  Class callClass;
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    callClass = classify(call);
+  })) {
+    ++rejected;
+    return kj::mv(*exception);
+  }
+
+  if (queued == 0 && fits(callClass.cost)) {
+    return kj::Own<Ticket>(kj::heap<CostTicket>(*this, callClass.cost));
+  }
+
+  if (queued >= options.maxQueued) {
+    ++rejected;
+    return KJ_EXCEPTION(OVERLOADED, "server is overloaded; too many calls queued",
+                        call.interfaceId, call.methodId);
+  }
+
+  return kj::newAdaptedPromise<kj::Own<Ticket>, Waiter>(
+      *this, callClass.priority, call.connection, callClass.cost);
+}
+
+bool PriorityCallScheduler::fits(uint cost) {
+  return running == 0 || running + cost <= options.capacity;
+}
+
+void PriorityCallScheduler::pump() {
+  while (!queues->levels.empty()) {
+    auto& level = queues->levels.begin()->second;
+    auto& queue = level.connections.find(level.turns.front())->second;
+    Waiter& next = *queue.waiters.front();
+
+    // Don't let cheaper calls behind `next` overtake it, or an expensive call could wait forever.
+    if (!fits(next.getCost())) break;
+
+    next.admit();
+  }
+}
+
 }  // namespace capnp
@@ -89,6 +89,10 @@ struct Bootstrap {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<Bootstrap,  ::uint32_t> questionIdColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(e94ccf8031176ec4, 1, 1)
     #if !CAPNP_LITE
@@ -105,6 +109,19 @@ struct Call {
   class Pipeline;
   struct SendResultsTo;
 
+  static constexpr ::capnp::DataColumn<Call,  ::uint32_t> questionIdColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Call,  ::uint64_t> interfaceIdColumn() {
+    return { 1, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Call,  ::uint16_t> methodIdColumn() {
+    return { 2, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Call, bool> allowThirdPartyTailCallColumn() {
+    return { 128, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(836a53ce789d4cd4, 3, 3)
     #if !CAPNP_LITE
@@ -148,6 +165,13 @@ struct Return {
     ACCEPT_FROM_THIRD_PARTY,
   };
 
+  static constexpr ::capnp::DataColumn<Return,  ::uint32_t> answerIdColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Return, bool> releaseParamCapsColumn() {
+    return { 32, true };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(9e19b28d3db3573a, 2, 1)
     #if !CAPNP_LITE
@@ -163,6 +187,13 @@ struct Finish {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<Finish,  ::uint32_t> questionIdColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Finish, bool> releaseResultCapsColumn() {
+    return { 32, true };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(d37d2eb2c2f80e63, 1, 0)
     #if !CAPNP_LITE
@@ -182,6 +213,10 @@ struct Resolve {
     EXCEPTION,
   };
 
+  static constexpr ::capnp::DataColumn<Resolve,  ::uint32_t> promiseIdColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(bbc29655fa89086e, 1, 1)
     #if !CAPNP_LITE
@@ -197,6 +232,13 @@ struct Release {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<Release,  ::uint32_t> idColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Release,  ::uint32_t> referenceCountColumn() {
+    return { 1, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(ad1a6c0d7dd07497, 1, 0)
     #if !CAPNP_LITE
@@ -249,6 +291,10 @@ struct Provide {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<Provide,  ::uint32_t> questionIdColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(9c6a046bfbc1ac5a, 1, 2)
     #if !CAPNP_LITE
@@ -264,6 +310,13 @@ struct Accept {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<Accept,  ::uint32_t> questionIdColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Accept, bool> embargoColumn() {
+    return { 32, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(d4c9b56290554016, 1, 1)
     #if !CAPNP_LITE
@@ -279,6 +332,10 @@ struct Join {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<Join,  ::uint32_t> questionIdColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(fbe1980490e001af, 1, 2)
     #if !CAPNP_LITE
@@ -336,6 +393,10 @@ struct CapDescriptor {
     THIRD_PARTY_HOSTED,
   };
 
+  static constexpr ::capnp::DataColumn<CapDescriptor,  ::uint8_t> attachedFdColumn() {
+    return { 2, 255u };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(8523ddc40b86b8b0, 1, 1)
     #if !CAPNP_LITE
@@ -352,6 +413,10 @@ struct PromisedAnswer {
   class Pipeline;
   struct Op;
 
+  static constexpr ::capnp::DataColumn<PromisedAnswer,  ::uint32_t> questionIdColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(d800b1d6cd6f1ca0, 1, 1)
     #if !CAPNP_LITE
@@ -386,6 +451,10 @@ struct ThirdPartyCapDescriptor {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<ThirdPartyCapDescriptor,  ::uint32_t> vineIdColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(d37007fde1f0027d, 1, 1)
     #if !CAPNP_LITE
@@ -403,6 +472,16 @@ struct Exception {
   typedef ::capnp::schemas::Type_b28c96e23f4cbd58 Type;
 
 
+  static constexpr ::capnp::DataColumn<Exception, bool> obsoleteIsCallersFaultColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Exception,  ::uint16_t> obsoleteDurabilityColumn() {
+    return { 1, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Exception,  ::capnp::schemas::Type_b28c96e23f4cbd58> typeColumn() {
+    return { 2, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(d625b7063acf691a, 1, 1)
     #if !CAPNP_LITE
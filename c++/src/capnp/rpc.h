@@ -23,6 +23,8 @@
 
 #include "capability.h"
 #include "rpc-prelude.h"
+#include <kj/time.h>
+#include <kj/function.h>
 
 CAPNP_BEGIN_HEADER
 
@@ -141,6 +143,21 @@ public:
   // order to prevent a grain from inundating the system with in-flight calls. In practice, the
   // main time this happens is when a grain is pushing a large file download and doesn't implement
   // proper cooperative flow control.
+
+  void setCallObserver(kj::Maybe<RpcCallObserver&> observer);
+  // Reports every call made or received on this RpcSystem's connections to `observer`, which must
+  // outlive the RpcSystem or be unset first with `setCallObserver(nullptr)`. Applies to calls
+  // started after this is called. See RpcCallObserver.
+
+  RpcEmbargoStats getEmbargoStats();
+  // Returns counts of embargoes on all connections so far, including disconnected ones.
+
+  void setCallScheduler(kj::Maybe<RpcCallScheduler&> scheduler);
+  // Makes each incoming call wait for `scheduler` to admit it before it is delivered to its target.
+  // `scheduler` may be shared by several RpcSystems (e.g. all of a TwoPartyServer's connections)
+  // and must outlive them. Applies to calls received after this is called. Unlike setFlowLimit(),
+  // this doesn't stop reading messages, so returns and cheap calls keep flowing while expensive
+  // calls wait.
 };
 
 template <typename VatId, typename ProvisionId, typename RecipientId,
@@ -393,6 +410,343 @@ public:
   // The window size used by the default implementation of Connection::newStream().
 };
 
+class AdaptiveFlowController final: public RpcFlowController,
+                                    private RpcFlowController::WindowGetter {
+  // A flow controller which sizes its window from measurements of the stream itself, in the
+  // style of BBR: it tracks the round-trip time of each message (from send() until its `ack`)
+  // and the rate at which bytes are acknowledged, and sets the window to a small multiple of
+  // the resulting bandwidth-delay product. A fixed window either underfills a long fat pipe or
+  // lets a queue build up in front of a slow one; this one tries to keep just enough in flight
+  // to saturate the path.
+  //
+  // The stream starts out like TCP slow start, growing the window by the bytes acknowledged
+  // (doubling it per round trip) until the measured bandwidth stops increasing. After that, the
+  // window follows `windowGain` times the recent maximum bandwidth times the recent minimum RTT.
+  // Because the window is based on the minimum RTT, a queue growing somewhere along the path
+  // doesn't inflate it, as it would for a window based on the average.
+  //
+  // Keep in mind that `ack` includes the time the receiver took to process the message, so a
+  // slow receiver reads as a slow link, which is what we want for backpressure.
+
+public:
+  struct Options {
+    size_t initialWindow = DEFAULT_WINDOW_SIZE;
+    // Window used until there are measurements.
+
+    size_t minWindow = 16384;
+    size_t maxWindow = 64u << 20;
+    // Bounds on the window.
+
+    uint windowGain = 2;
+    // The window is this many times the estimated bandwidth-delay product. It must be more than 1
+    // to keep the pipe full while acks are on their way back.
+
+    uint bandwidthRounds = 10;
+    // The bandwidth estimate is the highest delivery rate seen in this many round trips.
+
+    kj::Duration minRttExpiry = 10 * kj::SECONDS;
+    // The RTT estimate is the lowest RTT seen in this long. It is then re-measured, so that the
+    // estimate follows a path whose latency has gone up.
+  };
+
+  struct Stats {
+    size_t window;
+    // Current window, in bytes.
+
+    size_t inFlight;
+    // Bytes sent but not yet acknowledged.
+
+    kj::Duration minRtt;
+    kj::Duration smoothedRtt;
+    // Minimum and exponentially-smoothed round-trip times. Zero until the first ack.
+
+    uint64_t bandwidth;
+    // Estimated delivery rate, in bytes per second.
+
+    uint64_t bytesAcked;
+    // Total bytes acknowledged over the life of the stream.
+
+    bool startup;
+    // Whether the window is still growing exponentially.
+  };
+
+  class Group {
+    // A set of controllers whose stats can be listed together, e.g. all streams on a connection.
+    // Controllers join a group on construction and leave it on destruction; either may be
+    // destroyed first.
+
+  public:
+    Group() = default;
+    KJ_DISALLOW_COPY(Group);
+    ~Group() noexcept(false);
+
+    kj::Array<Stats> getStats();
+    // Returns the stats of every controller currently in the group.
+
+  private:
+    kj::Vector<AdaptiveFlowController*> members;
+    friend class AdaptiveFlowController;
+  };
+
+  explicit AdaptiveFlowController(const kj::MonotonicClock& clock,
+                                  kj::Maybe<Group&> group = nullptr);
+  AdaptiveFlowController(const kj::MonotonicClock& clock, Options options,
+                         kj::Maybe<Group&> group = nullptr);
+  // `clock` is used to time acks; typically kj::systemPreciseMonotonicClock().
+
+  KJ_DISALLOW_COPY(AdaptiveFlowController);
+  ~AdaptiveFlowController() noexcept(false);
+
+  Stats getStats();
+
+  kj::Promise<void> send(kj::Own<OutgoingRpcMessage> message, kj::Promise<void> ack) override;
+  kj::Promise<void> waitAllAcked() override;
+
+private:
+  const kj::MonotonicClock& clock;
+  Options options;
+  kj::Maybe<Group&> group;
+  kj::Own<RpcFlowController> inner;
+  // A variable-window controller that does the actual throttling, using getWindow() below.
+
+  size_t window;
+  size_t inFlight = 0;
+  uint64_t delivered = 0;
+  kj::TimePoint deliveredTime;
+  // Bytes acknowledged so far and when the last ack arrived. Each send() records these so that
+  // its ack can compute the delivery rate over the interval in between.
+
+  uint64_t round = 0;
+  uint64_t roundEndDelivered = 0;
+  // A round trip ends when a message sent after the previous round ended is acknowledged.
+
+  struct BandwidthSample {
+    uint64_t round;
+    uint64_t bytesPerSecond;
+  };
+  kj::Array<BandwidthSample> bandwidthSamples;
+  // Highest delivery rate per round, indexed by round modulo bandwidthRounds.
+
+  kj::Maybe<kj::Duration> minRtt;
+  kj::TimePoint minRttTime;
+  kj::Duration smoothedRtt = 0 * kj::NANOSECONDS;
+
+  uint64_t sendCount = 0;
+  bool probingRtt = false;
+  uint64_t probeStart = 0;
+  // When the minimum RTT expires, the window shrinks to minWindow until a message sent at or
+  // after send number `probeStart` is acknowledged, and that message's RTT is the new minimum.
+
+  bool startup = true;
+  uint64_t startupBandwidth = 0;
+  uint startupFlatRounds = 0;
+  // Startup ends after three rounds in which the bandwidth didn't grow by a quarter.
+
+  static constexpr double STARTUP_GAIN = 3;
+
+  struct Sent {
+    size_t size;
+    uint64_t sequence;
+    kj::TimePoint time;
+    uint64_t delivered;
+    kj::TimePoint deliveredTime;
+    bool appLimited;
+  };
+
+  void onAck(const Sent& sent);
+  uint64_t getBandwidth();
+
+  size_t getWindow() override { return window; }
+};
+
+struct RpcEmbargoStats {
+  // How often promises imported from a peer resolved to a capability hosted by this vat, and how
+  // often that cost an embargo. When such a promise resolves, calls made through it may still be
+  // on their way back to us via the peer, so new calls must wait for a `Disembargo` to echo
+  // through the peer -- one round trip -- to stay ordered behind them. The embargo is skipped if
+  // no calls were sent through the promise, or if all of them have already returned.
+
+  uint64_t reflectedResolutions = 0;
+  // Promises that resolved to a capability hosted by this vat.
+
+  uint64_t embargoes = 0;
+  // Of those, how many were embargoed.
+
+  uint64_t embargoesSkipped = 0;
+  // Of those, how many had calls sent through them but weren't embargoed because all of the calls
+  // had returned. (Promises with no calls at all are counted only in `reflectedResolutions`.)
+
+  kj::Duration embargoTime = 0 * kj::NANOSECONDS;
+  // Total time from sending each `Disembargo` until it came back.
+};
+
+class RpcCallObserver {
+  // Receives an event at each stage of every call passing through an RpcSystem, with the timing
+  // and size of the call so far, e.g. to maintain per-method latency histograms. Register one
+  // with RpcSystem::setCallObserver().
+  //
+  // The callbacks are made synchronously on the RpcSystem's thread, in the middle of sending and
+  // receiving messages, so they should be cheap -- bump a counter, record a histogram sample --
+  // and must not make calls or otherwise re-enter the RpcSystem. With no observer set, the RPC
+  // code paths pay only a null check and no clock reads.
+
+public:
+  virtual ~RpcCallObserver() noexcept(false) = default;
+
+  struct Call {
+    uint64_t interfaceId;
+    uint16_t methodId;
+
+    bool incoming;
+    // True if the peer called us, false if we called the peer.
+
+    size_t paramWords;
+    // Size of the `Call` message, in words.
+
+    size_t resultWords;
+    // Size of the `Return` message, in words. Zero until the return.
+
+    kj::TimePoint startTime;
+    // Outgoing: when the request was created, before its params were filled in.
+    // Incoming: when the `Call` message was received.
+
+    kj::TimePoint sendTime;
+    // Outgoing: when the `Call` message was handed to the connection.
+    // Incoming: same as `startTime`.
+
+    kj::Maybe<kj::TimePoint> returnTime;
+    // Outgoing: when the `Return` message was received.
+    // Incoming: when the `Return` message was sent.
+    // Null until the return, and remains null for outgoing calls that are canceled first.
+
+    kj::TimePoint finishTime;
+    // Outgoing: when the caller dropped the call, sending `Finish`.
+    // Incoming: when the call completed and the server released the call context.
+    // Only meaningful in callFinished().
+  };
+
+  virtual void callSent(const Call& call) {}
+  // An outgoing call's `Call` message has been sent.
+
+  virtual void callReceived(const Call& call) {}
+  // An incoming call's `Call` message has been received and is about to be delivered.
+
+  virtual void callReturned(const Call& call) {}
+  // The `Return` message was received (outgoing) or sent (incoming).
+
+  virtual void callFinished(const Call& call) {}
+  // The call is complete and this is its last event.
+
+  virtual const kj::MonotonicClock& getClock() { return kj::systemPreciseMonotonicClock(); }
+  // The clock used for the timestamps in `Call`.
+};
+
+class RpcCallScheduler {
+  // Decides when incoming calls are delivered to their targets, e.g. to bound the work in
+  // progress, to run cheap or important calls ahead of others, or to shed load. Register one with
+  // RpcSystem::setCallScheduler() or TwoPartyServer::setCallScheduler().
+  //
+  // Calls must reach each capability in the order they were sent (E-order), so the RpcSystem
+  // passes calls with the same target on a connection to admit() one at a time, each once the
+  // one before it has been admitted, refused or canceled. A scheduler can therefore only reorder
+  // calls to different targets; holding a call back also holds back every later call to the same
+  // target. Disembargo messages wait their turn in the same way, so that an embargo is never
+  // lifted while calls that it protects are still queued here.
+
+public:
+  struct Call {
+    uint64_t interfaceId;
+    uint16_t methodId;
+
+    size_t paramWords;
+    // Size of the `Call` message, in words.
+
+    const void* connection;
+    // Identifies the connection the call arrived on, e.g. to queue each connection separately.
+    // Only meaningful while the connection is open.
+  };
+
+  class Ticket {
+  public:
+    virtual ~Ticket() noexcept(false) = default;
+  };
+
+  virtual kj::Promise<kj::Own<Ticket>> admit(const Call& call) = 0;
+  // Returns a promise which resolves when the call may be delivered. Reject it (or throw) to
+  // refuse the call; the exception is returned to the caller. The ticket is held until the call
+  // completes, so its destructor can release whatever capacity the call was using.
+  //
+  // If the caller cancels the call while it waits, the returned promise is dropped.
+};
+
+class PriorityCallScheduler final: public RpcCallScheduler {
+  // An RpcCallScheduler which lets calls run as long as their total cost stays within a capacity,
+  // and queues the rest. Queued calls are admitted highest priority first; within a priority,
+  // connections take turns, so a client flooding the server with calls doesn't starve others.
+  // (A call never overtakes an earlier call to the same target, though; see RpcCallScheduler.)
+  // When too many calls are queued, new ones are refused with an OVERLOADED exception, bounding
+  // how long an admitted call can have waited.
+
+public:
+  struct Class {
+    int priority = 0;
+    // Calls with a higher priority are admitted first.
+
+    uint cost = 1;
+    // Units of capacity the call holds while running. A call costing more than the whole capacity
+    // is admitted when nothing else is running.
+  };
+
+  typedef kj::Function<Class(const Call& call)> Classifier;
+  // Assigns a class to each call, typically by interface and method ID. Throw (e.g. an
+  // OVERLOADED exception) to refuse the call outright.
+
+  struct Options {
+    uint capacity = 64;
+    // Total cost of calls allowed to run at once.
+
+    size_t maxQueued = 1024;
+    // Calls arriving when this many are already waiting are refused.
+  };
+
+  struct Stats {
+    uint running;
+    // Cost of the calls currently running.
+
+    size_t queued;
+    // Number of calls waiting.
+
+    uint64_t admitted;
+    uint64_t rejected;
+    // Totals since construction.
+  };
+
+  explicit PriorityCallScheduler(Classifier classify);
+  PriorityCallScheduler(Classifier classify, Options options);
+  KJ_DISALLOW_COPY(PriorityCallScheduler);
+  ~PriorityCallScheduler() noexcept(false);
+
+  Stats getStats();
+
+  kj::Promise<kj::Own<Ticket>> admit(const Call& call) override;
+
+private:
+  class Waiter;
+  class CostTicket;
+  struct Queues;
+
+  Classifier classify;
+  Options options;
+  kj::Own<Queues> queues;
+  uint running = 0;
+  size_t queued = 0;
+  uint64_t admitted = 0;
+  uint64_t rejected = 0;
+
+  bool fits(uint cost);
+  void pump();
+};
+
 template <typename VatId, typename ProvisionId, typename RecipientId,
           typename ThirdPartyCapId, typename JoinResult>
 class VatNetwork: public _::VatNetworkBase {
@@ -602,6 +956,21 @@ inline void RpcSystem<VatId>::setFlowLimit(size_t words) {
   baseSetFlowLimit(words);
 }
 
+template <typename VatId>
+inline void RpcSystem<VatId>::setCallObserver(kj::Maybe<RpcCallObserver&> observer) {
+  baseSetCallObserver(observer);
+}
+
+template <typename VatId>
+inline RpcEmbargoStats RpcSystem<VatId>::getEmbargoStats() {
+  return baseGetEmbargoStats();
+}
+
+template <typename VatId>
+inline void RpcSystem<VatId>::setCallScheduler(kj::Maybe<RpcCallScheduler&> scheduler) {
+  baseSetCallScheduler(scheduler);
+}
+
 template <typename VatId, typename ProvisionId, typename RecipientId,
           typename ThirdPartyCapId, typename JoinResult>
 RpcSystem<VatId> makeRpcServer(
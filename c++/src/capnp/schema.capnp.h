@@ -94,6 +94,19 @@ struct Node {
   struct Const;
   struct Annotation;
 
+  static constexpr ::capnp::DataColumn<Node,  ::uint64_t> idColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Node,  ::uint32_t> displayNamePrefixLengthColumn() {
+    return { 2, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Node,  ::uint64_t> scopeIdColumn() {
+    return { 2, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Node, bool> isGenericColumn() {
+    return { 288, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(e682ab4cf923a417, 5, 6)
     #if !CAPNP_LITE
@@ -124,6 +137,10 @@ struct Node::NestedNode {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<NestedNode,  ::uint64_t> idColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(debf55bbfa0fc242, 1, 1)
     #if !CAPNP_LITE
@@ -140,6 +157,10 @@ struct Node::SourceInfo {
   class Pipeline;
   struct Member;
 
+  static constexpr ::capnp::DataColumn<SourceInfo,  ::uint64_t> idColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(f38e1de3041357ae, 1, 2)
     #if !CAPNP_LITE
@@ -253,6 +274,13 @@ struct Field {
   struct Group;
   struct Ordinal;
 
+  static constexpr ::capnp::DataColumn<Field,  ::uint16_t> codeOrderColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Field,  ::uint16_t> discriminantValueColumn() {
+    return { 1, 65535u };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(9aad50a41f4af45f, 3, 4)
     #if !CAPNP_LITE
@@ -317,6 +345,10 @@ struct Enumerant {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<Enumerant,  ::uint16_t> codeOrderColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(978a7cebdc549a4d, 1, 2)
     #if !CAPNP_LITE
@@ -332,6 +364,10 @@ struct Superclass {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<Superclass,  ::uint64_t> idColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(a9962a9ed0a4d7f8, 1, 1)
     #if !CAPNP_LITE
@@ -347,6 +383,16 @@ struct Method {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<Method,  ::uint16_t> codeOrderColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Method,  ::uint64_t> paramStructTypeColumn() {
+    return { 1, 0 };
+  }
+  static constexpr ::capnp::DataColumn<Method,  ::uint64_t> resultStructTypeColumn() {
+    return { 2, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(9500cce23b334d80, 3, 5)
     #if !CAPNP_LITE
@@ -558,6 +604,10 @@ struct Brand::Scope {
     INHERIT,
   };
 
+  static constexpr ::capnp::DataColumn<Scope,  ::uint64_t> scopeIdColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(abd73485a9636bc9, 2, 1)
     #if !CAPNP_LITE
@@ -628,6 +678,10 @@ struct Annotation {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<Annotation,  ::uint64_t> idColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(f1c8950dab257542, 1, 2)
     #if !CAPNP_LITE
@@ -645,6 +699,16 @@ struct CapnpVersion {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<CapnpVersion,  ::uint16_t> majorColumn() {
+    return { 0, 0 };
+  }
+  static constexpr ::capnp::DataColumn<CapnpVersion,  ::uint8_t> minorColumn() {
+    return { 2, 0 };
+  }
+  static constexpr ::capnp::DataColumn<CapnpVersion,  ::uint8_t> microColumn() {
+    return { 3, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(d85d305b7d839963, 1, 0)
     #if !CAPNP_LITE
@@ -677,6 +741,10 @@ struct CodeGeneratorRequest::RequestedFile {
   class Pipeline;
   struct Import;
 
+  static constexpr ::capnp::DataColumn<RequestedFile,  ::uint64_t> idColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(cfea0eb02e810062, 1, 2)
     #if !CAPNP_LITE
@@ -692,6 +760,10 @@ struct CodeGeneratorRequest::RequestedFile::Import {
   class Builder;
   class Pipeline;
 
+  static constexpr ::capnp::DataColumn<Import,  ::uint64_t> idColumn() {
+    return { 0, 0 };
+  }
+
   struct _capnpPrivate {
     CAPNP_DECLARE_STRUCT_HEADER(ae504193122357e5, 1, 1)
     #if !CAPNP_LITE
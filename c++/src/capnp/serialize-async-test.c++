@@ -346,6 +346,413 @@ TEST(SerializeAsyncTest, WriteAsyncEvenSegmentCount) {
   writeMessage(*output, message).wait(ioContext.waitScope);
 }
 
+class RecordingOutputStream final: public kj::AsyncOutputStream {
+  // Records everything written to it, and how many write calls it took. Writes can be held
+  // pending or made to fail.
+
+public:
+  kj::Vector<byte> data;
+  uint writeCount = 0;
+  size_t lastPieceCount = 0;
+  bool blockWrites = false;
+  bool failWrites = false;
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> blocked;
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    kj::ArrayPtr<const byte> piece(reinterpret_cast<const byte*>(buffer), size);
+    return write(kj::arrayPtr(&piece, 1));
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    ++writeCount;
+    lastPieceCount = pieces.size();
+    if (failWrites) {
+      return KJ_EXCEPTION(DISCONNECTED, "test write failure");
+    }
+    for (auto piece: pieces) {
+      data.addAll(piece);
+    }
+    if (blockWrites) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      blocked.add(kj::mv(paf.fulfiller));
+      return kj::mv(paf.promise);
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> whenWriteDisconnected() override { return kj::NEVER_DONE; }
+
+  kj::Vector<kj::Own<MessageReader>> readAll() {
+    KJ_ASSERT(data.size() % sizeof(word) == 0);
+    copy = kj::heapArray<word>(data.size() / sizeof(word));
+    memcpy(copy.begin(), data.begin(), data.size());
+
+    kj::Vector<kj::Own<MessageReader>> result;
+    kj::ArrayPtr<const word> remaining = copy;
+    while (remaining.size() > 0) {
+      auto reader = kj::heap<FlatArrayMessageReader>(remaining);
+      remaining = kj::arrayPtr(reader->getEnd(), remaining.end());
+      result.add(kj::mv(reader));
+    }
+    return result;
+  }
+
+private:
+  kj::Array<word> copy;
+};
+
+KJ_TEST("BatchedMessageWriter coalesces messages written in one turn") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  RecordingOutputStream output;
+  BatchedMessageWriter writer(output);
+
+  kj::Vector<kj::Promise<void>> promises;
+  for (uint i = 0; i < 10; i++) {
+    MallocMessageBuilder message;
+    message.initRoot<TestAllTypes>().setUInt32Field(i);
+    // The message is small, so it's copied and can be destroyed right away.
+    promises.add(writer.writeMessage(message));
+  }
+
+  // Includes a segment large enough to be passed by reference.
+  TestMessageBuilder big(3);
+  for (auto element: big.initRoot<TestAllTypes>().initStructList(16)) {
+    initTestMessage(element);
+  }
+  promises.add(writer.writeMessage(big));
+
+  KJ_EXPECT(output.writeCount == 0);
+  KJ_EXPECT(writer.getQueuedBytes() > 0);
+  kj::joinPromises(promises.releaseAsArray()).wait(waitScope);
+  KJ_EXPECT(writer.getQueuedBytes() == 0);
+
+  KJ_EXPECT(output.writeCount == 1);
+  KJ_EXPECT(output.lastPieceCount == 2);  // copied prefix plus the big segment
+
+  auto messages = output.readAll();
+  KJ_ASSERT(messages.size() == 11);
+  for (uint i = 0; i < 10; i++) {
+    KJ_EXPECT(messages[i]->getRoot<TestAllTypes>().getUInt32Field() == i);
+  }
+  auto list = messages[10]->getRoot<TestAllTypes>().getStructList();
+  KJ_ASSERT(list.size() == 16);
+  checkTestMessage(list[15]);
+}
+
+KJ_TEST("BatchedMessageWriter queues behind a write in progress") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  RecordingOutputStream output;
+  output.blockWrites = true;
+  BatchedMessageWriter writer(output);
+
+  MallocMessageBuilder message;
+  auto root = message.initRoot<TestAllTypes>();
+
+  auto promise1 = writer.writeMessage(message);
+  waitScope.poll();
+  KJ_EXPECT(output.writeCount == 1);
+  KJ_EXPECT(!promise1.poll(waitScope));
+
+  root.setUInt32Field(2);
+  auto promise2 = writer.writeMessage(message);
+  root.setUInt32Field(3);
+  auto promise3 = writer.writeMessage(message);
+  waitScope.poll();
+  KJ_EXPECT(output.writeCount == 1);
+
+  output.blocked[0]->fulfill();
+  promise1.wait(waitScope);
+  waitScope.poll();
+  KJ_EXPECT(output.writeCount == 2);
+
+  output.blocked[1]->fulfill();
+  promise2.wait(waitScope);
+  promise3.wait(waitScope);
+
+  auto messages = output.readAll();
+  KJ_ASSERT(messages.size() == 3);
+  KJ_EXPECT(messages[2]->getRoot<TestAllTypes>().getUInt32Field() == 3);
+}
+
+KJ_TEST("BatchedMessageWriter cork and flush policy") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  MallocMessageBuilder message;
+  message.initRoot<TestAllTypes>().setUInt32Field(123);
+
+  {
+    RecordingOutputStream output;
+    BatchedMessageWriter writer(output);
+
+    writer.cork();
+    auto promise1 = writer.writeMessage(message);
+    auto promise2 = writer.writeMessage(message);
+    waitScope.poll();
+    KJ_EXPECT(output.writeCount == 0);
+
+    writer.uncork();
+    promise1.wait(waitScope);
+    promise2.wait(waitScope);
+    KJ_EXPECT(output.writeCount == 1);
+  }
+
+  {
+    RecordingOutputStream output;
+    BatchedMessageWriter::Options options;
+    options.flushPolicy = BatchedMessageWriter::FlushPolicy::EXPLICIT;
+    options.flushThreshold = 1024;
+    BatchedMessageWriter writer(output, options);
+
+    auto promise1 = writer.writeMessage(message);
+    waitScope.poll();
+    KJ_EXPECT(output.writeCount == 0);
+    writer.flush().wait(waitScope);
+    KJ_EXPECT(promise1.poll(waitScope));
+    KJ_EXPECT(output.writeCount == 1);
+
+    // Reaching the threshold flushes without being asked.
+    while (writer.getQueuedBytes() < options.flushThreshold) {
+      writer.writeMessage(message).detach([](kj::Exception&&) {});
+    }
+    waitScope.poll();
+    KJ_EXPECT(output.writeCount == 2);
+    KJ_EXPECT(writer.getQueuedBytes() == 0);
+  }
+
+  {
+    RecordingOutputStream output;
+    BatchedMessageWriter::Options options;
+    options.flushPolicy = BatchedMessageWriter::FlushPolicy::WHEN_IDLE;
+    BatchedMessageWriter writer(output, options);
+
+    auto promise1 = writer.writeMessage(message);
+    auto later = kj::evalLater([&]() { return writer.writeMessage(message); });
+    promise1.wait(waitScope);
+    later.wait(waitScope);
+    KJ_EXPECT(output.writeCount == 1);
+  }
+}
+
+KJ_TEST("BatchedMessageWriter message limit, delay, and stats") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  MallocMessageBuilder message;
+  message.initRoot<TestAllTypes>().setUInt32Field(123);
+
+  {
+    RecordingOutputStream output;
+    BatchedMessageWriter::Options options;
+    options.maxMessages = 4;
+    BatchedMessageWriter writer(output, options);
+
+    kj::Vector<kj::Promise<void>> promises;
+    for (uint i = 0; i < 10; i++) {
+      MallocMessageBuilder numbered;
+      numbered.initRoot<TestAllTypes>().setUInt32Field(i);
+      promises.add(writer.writeMessage(numbered));
+    }
+    kj::joinPromises(promises.releaseAsArray()).wait(waitScope);
+
+    // Two full batches, then the remainder at the end of the turn, in order.
+    KJ_EXPECT(output.writeCount == 3);
+    auto messages = output.readAll();
+    KJ_ASSERT(messages.size() == 10);
+    for (uint i = 0; i < 10; i++) {
+      KJ_EXPECT(messages[i]->getRoot<TestAllTypes>().getUInt32Field() == i);
+    }
+    auto stats = writer.getStats();
+    KJ_EXPECT(stats.messages == 10);
+    KJ_EXPECT(stats.batches == 3);
+    KJ_EXPECT(stats.bytes == output.data.size());
+    KJ_EXPECT(stats.thresholdFlushes == 2);
+    KJ_EXPECT(stats.delayFlushes == 0);
+  }
+
+  {
+    RecordingOutputStream output;
+    kj::TimerImpl timer(kj::origin<kj::TimePoint>());
+    BatchedMessageWriter::Options options;
+    options.flushPolicy = BatchedMessageWriter::FlushPolicy::EXPLICIT;
+    options.timer = timer;
+    options.maxDelay = 5 * kj::MILLISECONDS;
+    BatchedMessageWriter writer(output, options);
+
+    auto promise1 = writer.writeMessage(message);
+    timer.advanceTo(timer.now() + 3 * kj::MILLISECONDS);
+    auto promise2 = writer.writeMessage(message);
+    waitScope.poll();
+    KJ_EXPECT(output.writeCount == 0);
+
+    // The deadline counts from the first message in the batch.
+    timer.advanceTo(timer.now() + 2 * kj::MILLISECONDS);
+    promise1.wait(waitScope);
+    promise2.wait(waitScope);
+    KJ_EXPECT(output.writeCount == 1);
+
+    // A batch written before its deadline doesn't flush the next one early.
+    auto promise3 = writer.writeMessage(message);
+    writer.flush().wait(waitScope);
+    auto promise4 = writer.writeMessage(message);
+    timer.advanceTo(timer.now() + 4 * kj::MILLISECONDS);
+    waitScope.poll();
+    KJ_EXPECT(output.writeCount == 2);
+    timer.advanceTo(timer.now() + 1 * kj::MILLISECONDS);
+    promise4.wait(waitScope);
+    KJ_EXPECT(output.writeCount == 3);
+
+    auto stats = writer.getStats();
+    KJ_EXPECT(stats.batches == 3);
+    KJ_EXPECT(stats.delayFlushes == 2);
+    KJ_EXPECT(stats.thresholdFlushes == 0);
+  }
+}
+
+KJ_TEST("BatchedMessageWriter reports write errors") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  RecordingOutputStream output;
+  output.failWrites = true;
+  BatchedMessageWriter writer(output);
+
+  MallocMessageBuilder message;
+  message.initRoot<TestAllTypes>();
+
+  auto promise1 = writer.writeMessage(message);
+  auto promise2 = writer.writeMessage(message);
+  KJ_EXPECT_THROW_MESSAGE("test write failure", promise1.wait(waitScope));
+  KJ_EXPECT_THROW_MESSAGE("test write failure", promise2.wait(waitScope));
+  KJ_EXPECT_THROW_MESSAGE("test write failure", writer.writeMessage(message).wait(waitScope));
+  KJ_EXPECT(output.writeCount == 1);
+}
+
+class ChunkedInputStream final: public kj::AsyncInputStream {
+  // Serves `data` in pieces of at most `chunkSize` bytes, as if each piece arrived separately, and
+  // counts the reads.
+
+public:
+  ChunkedInputStream(kj::ArrayPtr<const byte> data, size_t chunkSize)
+      : data(data), chunkSize(chunkSize) {}
+
+  uint readCount = 0;
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    ++readCount;
+    byte* out = reinterpret_cast<byte*>(buffer);
+    size_t n = 0;
+    do {
+      size_t amount = kj::min(kj::min(chunkSize, maxBytes - n), data.size());
+      memcpy(out + n, data.begin(), amount);
+      data = data.slice(amount, data.size());
+      n += amount;
+    } while (n < minBytes && data.size() > 0);
+    return n;
+  }
+
+private:
+  kj::ArrayPtr<const byte> data;
+  size_t chunkSize;
+};
+
+kj::Array<byte> writeTestStream(uint count) {
+  // Writes `count` messages of assorted sizes and segment counts.
+  kj::VectorOutputStream output;
+  for (uint i = 0; i < count; i++) {
+    MallocMessageBuilder builder(i % 3 == 0 ? 8 : 1024, AllocationStrategy::FIXED_SIZE);
+    auto root = builder.initRoot<TestAllTypes>();
+    root.setUInt32Field(i);
+    if (i % 5 == 0) {
+      initTestMessage(root.initStructField());
+    }
+    writeMessage(output, builder);
+  }
+  return kj::heapArray(output.getArray());
+}
+
+KJ_TEST("ReadAheadMessageStream reads many messages per read") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto data = writeTestStream(20);
+  ChunkedInputStream input(data, data.size());
+  ReadAheadMessageStream stream(input);
+
+  for (uint i = 0; i < 20; i++) {
+    auto reader = stream.readMessage().wait(waitScope);
+    auto root = reader->getRoot<TestAllTypes>();
+    KJ_EXPECT(root.getUInt32Field() == i);
+    if (i % 5 == 0) {
+      checkTestMessage(root.getStructField());
+    }
+  }
+  KJ_EXPECT(stream.tryReadMessage().wait(waitScope) == nullptr);
+
+  // One read picked up everything, and one more saw EOF.
+  KJ_EXPECT(input.readCount == 2, input.readCount);
+  KJ_EXPECT(stream.getStats().messages == 20);
+}
+
+KJ_TEST("ReadAheadMessageStream handles small buffers and fragmented input") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto data = writeTestStream(30);
+  for (size_t chunkSize: {1, 7, 64, 1000}) {
+    ChunkedInputStream input(data, chunkSize);
+    ReadAheadMessageStream stream(input, ReaderOptions(), 16);
+
+    // Keep every other reader alive so that some buffers are still in use when the stream wants
+    // to recycle them.
+    kj::Vector<kj::Own<MessageReader>> kept;
+    for (uint i = 0; i < 30; i++) {
+      auto reader = stream.readMessage().wait(waitScope);
+      KJ_EXPECT(reader->getRoot<TestAllTypes>().getUInt32Field() == i);
+      if (i % 2 == 0) kept.add(kj::mv(reader));
+    }
+    KJ_EXPECT(stream.tryReadMessage().wait(waitScope) == nullptr);
+
+    for (auto i: kj::indices(kept)) {
+      auto root = kept[i]->getRoot<TestAllTypes>();
+      KJ_EXPECT(root.getUInt32Field() == i * 2);
+      if (i * 2 % 5 == 0) {
+        checkTestMessage(root.getStructField());
+      }
+    }
+  }
+}
+
+KJ_TEST("ReadAheadMessageStream errors") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto data = writeTestStream(2);
+
+  {
+    // Truncated in the middle of the second message.
+    ChunkedInputStream input(data.slice(0, data.size() - 8), 100);
+    ReadAheadMessageStream stream(input);
+    stream.readMessage().wait(waitScope);
+    KJ_EXPECT_THROW_MESSAGE("Premature EOF", stream.tryReadMessage().wait(waitScope));
+  }
+
+  {
+    ChunkedInputStream input(data, 100);
+    ReaderOptions options;
+    options.traversalLimitInWords = 4;
+    ReadAheadMessageStream stream(input, options);
+    KJ_EXPECT_THROW_MESSAGE("Message is too large", stream.readMessage().wait(waitScope));
+  }
+
+  {
+    ChunkedInputStream input(nullptr, 100);
+    ReadAheadMessageStream stream(input);
+    KJ_EXPECT_THROW_MESSAGE("Premature EOF", stream.readMessage().wait(waitScope));
+  }
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
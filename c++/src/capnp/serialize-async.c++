@@ -232,6 +232,167 @@ kj::Promise<kj::Maybe<MessageReaderAndFds>> tryReadMessage(
 
 // =======================================================================================
 
+class ReadAheadMessageStream::Buffer final: public kj::AtomicRefcounted {
+public:
+  explicit Buffer(size_t words): words(kj::heapArray<word>(words)) {}
+
+  kj::Array<word> words;
+
+  byte* bytes() { return words.asBytes().begin(); }
+  size_t size() { return words.size() * sizeof(word); }
+};
+
+class ReadAheadMessageStream::Reader final: public MessageReader {
+public:
+  Reader(ReaderOptions options, kj::Own<const Buffer> buffer,
+         const _::WireValue<uint32_t>* table, uint segmentCount, const word* data)
+      : MessageReader(options), buffer(kj::mv(buffer)), table(table),
+        segmentCount(segmentCount), data(data) {}
+
+  kj::ArrayPtr<const word> getSegment(uint id) override {
+    if (id >= segmentCount) return nullptr;
+
+    // Each segment is requested at most once and messages rarely have more than a few, so we
+    // just walk the table rather than allocating an array of segment starts.
+    const word* start = data;
+    for (uint i = 0; i < id; i++) {
+      start += table[i + 1].get();
+    }
+    return kj::arrayPtr(start, table[id + 1].get());
+  }
+
+private:
+  kj::Own<const Buffer> buffer;
+  const _::WireValue<uint32_t>* table;
+  uint segmentCount;
+  const word* data;
+};
+
+constexpr size_t ReadAheadMessageStream::DEFAULT_BUFFER_WORDS;
+
+ReadAheadMessageStream::ReadAheadMessageStream(
+    kj::AsyncInputStream& input, ReaderOptions options, size_t bufferWords)
+    : input(input), options(options), bufferWords(kj::max(bufferWords, size_t(1))),
+      buffer(kj::atomicRefcounted<Buffer>(this->bufferWords)) {
+  ++stats.bufferAllocations;
+}
+
+ReadAheadMessageStream::~ReadAheadMessageStream() noexcept(false) {}
+
+kj::Promise<kj::Own<MessageReader>> ReadAheadMessageStream::readMessage() {
+  return tryReadMessage().then([](kj::Maybe<kj::Own<MessageReader>>&& result)
+                                -> kj::Own<MessageReader> {
+    KJ_IF_MAYBE(reader, result) {
+      return kj::mv(*reader);
+    } else {
+      kj::throwFatalException(KJ_EXCEPTION(DISCONNECTED, "Premature EOF."));
+    }
+  });
+}
+
+kj::Promise<kj::Maybe<kj::Own<MessageReader>>> ReadAheadMessageStream::tryReadMessage() {
+  size_t neededBytes;
+  KJ_IF_MAYBE(reader, tryParse(neededBytes)) {
+    return kj::Maybe<kj::Own<MessageReader>>(kj::mv(*reader));
+  }
+
+  makeSpace(neededBytes);
+
+  ++stats.reads;
+  size_t minBytes = readPos + neededBytes - writePos;
+  return input.tryRead(buffer->bytes() + writePos, minBytes, buffer->size() - writePos)
+      .then([this, minBytes](size_t n) -> kj::Promise<kj::Maybe<kj::Own<MessageReader>>> {
+    writePos += n;
+    if (n < minBytes) {
+      if (writePos == readPos) {
+        return kj::Maybe<kj::Own<MessageReader>>(nullptr);
+      } else {
+        return KJ_EXCEPTION(DISCONNECTED, "Premature EOF.");
+      }
+    }
+    return tryReadMessage();
+  });
+}
+
+kj::Maybe<kj::Own<MessageReader>> ReadAheadMessageStream::tryParse(size_t& neededBytes) {
+  // Parses the message at readPos if it has been read completely. Otherwise, sets `neededBytes`
+  // to the number of bytes starting at readPos that must be present to make progress.
+
+  size_t available = writePos - readPos;
+  const byte* start = buffer->bytes() + readPos;
+  auto table = reinterpret_cast<const _::WireValue<uint32_t>*>(start);
+
+  if (available < sizeof(word)) {
+    neededBytes = sizeof(word);
+    return nullptr;
+  }
+
+  // Reject messages with too many segments for security reasons.
+  uint64_t segmentCount = uint64_t(table[0].get()) + 1;
+  KJ_REQUIRE(segmentCount < 512, "Message has too many segments.");
+
+  size_t tableWords = (segmentCount + 2) / 2;
+  if (available < tableWords * sizeof(word)) {
+    neededBytes = tableWords * sizeof(word);
+    return nullptr;
+  }
+
+  uint64_t totalWords = 0;
+  for (uint i = 0; i < segmentCount; i++) {
+    totalWords += table[i + 1].get();
+  }
+
+  // Don't accept a message which the receiver couldn't possibly traverse without hitting the
+  // traversal limit, as otherwise a malicious peer could make us allocate a huge buffer.
+  KJ_REQUIRE(totalWords <= options.traversalLimitInWords,
+             "Message is too large.  To increase the limit on the receiving end, see "
+             "capnp::ReaderOptions.");
+
+  size_t messageBytes = (tableWords + totalWords) * sizeof(word);
+  if (available < messageBytes) {
+    neededBytes = messageBytes;
+    return nullptr;
+  }
+
+  readPos += messageBytes;
+  ++stats.messages;
+  return kj::Own<MessageReader>(kj::heap<Reader>(
+      options, kj::atomicAddRef(*buffer), table, segmentCount,
+      reinterpret_cast<const word*>(start) + tableWords));
+}
+
+void ReadAheadMessageStream::makeSpace(size_t neededBytes) {
+  // Ensures that the buffer has room for `neededBytes` starting at readPos.
+
+  size_t leftover = writePos - readPos;
+  bool shared = buffer->isShared();
+
+  if (leftover == 0 && !shared) {
+    // Nobody is using the buffer, so start over at the beginning for free.
+    readPos = writePos = 0;
+  }
+
+  if (readPos + neededBytes <= buffer->size()) {
+    return;
+  }
+
+  size_t neededWords = (neededBytes + sizeof(word) - 1) / sizeof(word);
+  if (shared || buffer->words.size() < neededWords) {
+    auto newBuffer = kj::atomicRefcounted<Buffer>(kj::max(bufferWords, neededWords));
+    memcpy(newBuffer->bytes(), buffer->bytes() + readPos, leftover);
+    buffer = kj::mv(newBuffer);
+    ++stats.bufferAllocations;
+  } else {
+    memmove(buffer->bytes(), buffer->bytes() + readPos, leftover);
+  }
+
+  stats.bytesMoved += leftover;
+  readPos = 0;
+  writePos = leftover;
+}
+
+// =======================================================================================
+
 namespace {
 
 struct WriteArrays {
@@ -292,4 +453,212 @@ kj::Promise<void> writeMessage(kj::AsyncCapabilityStream& output, kj::ArrayPtr<c
   });
 }
 
+// =======================================================================================
+
+BatchedMessageWriter::BatchedMessageWriter(kj::AsyncOutputStream& output, Options options)
+    : output(output), options(options), writeQueue(kj::Promise<void>(kj::READY_NOW).fork()) {}
+
+BatchedMessageWriter::BatchedMessageWriter(kj::AsyncOutputStream& output)
+    : BatchedMessageWriter(output, Options()) {}
+
+BatchedMessageWriter::~BatchedMessageWriter() noexcept(false) {}
+
+kj::Promise<void> BatchedMessageWriter::writeMessage(
+    kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  KJ_REQUIRE(segments.size() > 0, "Tried to serialize uninitialized message.");
+  KJ_IF_MAYBE(e, error) {
+    return kj::cp(*e);
+  }
+
+  if (batch.get() == nullptr) {
+    batch = kj::heap<Batch>();
+    batch->buffer = kj::mv(spareBuffer);
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    batch->fulfiller = kj::mv(paf.fulfiller);
+    batch->done = paf.promise.fork();
+    KJ_IF_MAYBE(timer, options.timer) {
+      batch->deadline = timer->afterDelay(options.maxDelay).then([this]() {
+        ++stats.delayFlushes;
+        forceFlush = true;
+        queueFlush(true);
+      }).eagerlyEvaluate(nullptr);
+    }
+  }
+  auto& buffer = batch->buffer;
+
+  // Segment table, in the same format as writeMessageImpl() produces.
+  size_t tableWords = (segments.size() + 2) / 2;
+  size_t tableStart = buffer.size();
+  buffer.resize(tableStart + tableWords);
+  auto table = reinterpret_cast<_::WireValue<uint32_t>*>(buffer.begin() + tableStart);
+  table[0].set(segments.size() - 1);
+  for (uint i = 0; i < segments.size(); i++) {
+    table[i + 1].set(segments[i].size());
+  }
+  if (segments.size() % 2 == 0) {
+    // Set padding byte.
+    table[segments.size() + 1].set(0);
+  }
+  appendBuffered(tableStart, tableWords);
+  batch->byteCount += tableWords * sizeof(word);
+
+  for (auto segment: segments) {
+    size_t bytes = segment.size() * sizeof(word);
+    if (bytes <= options.copyThreshold) {
+      size_t start = buffer.size();
+      buffer.addAll(segment);
+      appendBuffered(start, segment.size());
+    } else {
+      batch->pieces.add(Piece { segment.asBytes().begin(), 0, bytes });
+    }
+    batch->byteCount += bytes;
+  }
+
+  ++batch->messageCount;
+  ++stats.messages;
+  auto result = batch->done.addBranch();
+
+  if (batch->byteCount >= options.flushThreshold ||
+      (options.maxMessages > 0 && batch->messageCount >= options.maxMessages)) {
+    // Close the batch so that later messages start a new one, and write it as soon as the writes
+    // before it complete.
+    ++stats.thresholdFlushes;
+    batch->deadline = nullptr;
+    full.add(kj::mv(batch));
+    queueFlush(true);
+  } else if (corkCount == 0 && options.flushPolicy != FlushPolicy::EXPLICIT) {
+    queueFlush(false);
+  }
+
+  return result;
+}
+
+kj::Promise<void> BatchedMessageWriter::flush() {
+  KJ_IF_MAYBE(e, error) {
+    return kj::cp(*e);
+  }
+
+  if (batch.get() == nullptr) {
+    // Nothing queued, but wait for any write in progress.
+    return writeQueue.addBranch();
+  }
+
+  forceFlush = true;
+  auto result = batch->done.addBranch();
+  queueFlush(true);
+  return result;
+}
+
+size_t BatchedMessageWriter::getQueuedBytes() {
+  size_t result = batch.get() == nullptr ? 0 : batch->byteCount;
+  for (auto i: kj::range(fullHead, full.size())) {
+    result += full[i]->byteCount;
+  }
+  return result;
+}
+
+void BatchedMessageWriter::cork() {
+  ++corkCount;
+}
+
+void BatchedMessageWriter::uncork() {
+  KJ_REQUIRE(corkCount > 0, "uncork() without cork()");
+  if (--corkCount == 0 && batch.get() != nullptr &&
+      options.flushPolicy != FlushPolicy::EXPLICIT) {
+    queueFlush(false);
+  }
+}
+
+void BatchedMessageWriter::appendBuffered(size_t offset, size_t size) {
+  // Adds a piece covering the given range of the batch buffer (in words), merging it with the
+  // previous piece if they're contiguous.
+
+  offset *= sizeof(word);
+  size *= sizeof(word);
+  if (!batch->pieces.empty()) {
+    auto& last = batch->pieces.back();
+    if (last.external == nullptr && last.offset + last.size == offset) {
+      last.size += size;
+      return;
+    }
+  }
+  batch->pieces.add(Piece { nullptr, offset, size });
+}
+
+void BatchedMessageWriter::queueFlush(bool force) {
+  // A forced flush queues a step even if an unforced one is already waiting on the flush policy;
+  // whichever step runs first writes the batch and the other finds nothing to do.
+  if (flushQueued && !force) return;
+  flushQueued = true;
+
+  writeQueue = writeQueue.addBranch().then([this]() -> kj::Promise<void> {
+    // The previous write has completed. Unless asked to write immediately, give more messages a
+    // chance to join the batch.
+    if (!forceFlush && fullHead == full.size()) {
+      switch (options.flushPolicy) {
+        case FlushPolicy::END_OF_TURN:
+          return kj::evalLater([this]() { return writeBatch(); });
+        case FlushPolicy::WHEN_IDLE:
+          return kj::evalLast([this]() { return writeBatch(); });
+        case FlushPolicy::EXPLICIT:
+          break;
+      }
+    }
+    return writeBatch();
+  }).fork();
+}
+
+kj::Promise<void> BatchedMessageWriter::writeBatch() {
+  flushQueued = false;
+  kj::Own<Batch> current;
+  if (fullHead < full.size()) {
+    // Full batches go first, since they were queued before the current one.
+    current = kj::mv(full[fullHead++]);
+    if (fullHead == full.size()) {
+      full.clear();
+      fullHead = 0;
+    }
+
+    // The step that would have written the current batch may have been used up by this one.
+    if (batch.get() != nullptr &&
+        (forceFlush || (corkCount == 0 && options.flushPolicy != FlushPolicy::EXPLICIT))) {
+      queueFlush(forceFlush);
+    }
+  } else {
+    if (batch.get() == nullptr || (corkCount > 0 && !forceFlush)) {
+      return kj::READY_NOW;
+    }
+    forceFlush = false;
+    current = kj::mv(batch);
+  }
+
+  current->deadline = nullptr;
+  KJ_IF_MAYBE(e, error) {
+    current->fulfiller->reject(kj::cp(*e));
+    return kj::READY_NOW;
+  }
+  ++stats.batches;
+  stats.bytes += current->byteCount;
+
+  auto bufferBytes = current->buffer.asPtr().asBytes();
+  current->iov = KJ_MAP(piece, current->pieces) -> kj::ArrayPtr<const byte> {
+    if (piece.external == nullptr) {
+      return bufferBytes.slice(piece.offset, piece.offset + piece.size);
+    } else {
+      return kj::arrayPtr(piece.external, piece.size);
+    }
+  };
+
+  auto& ref = *current;
+  return kj::evalNow([&]() { return output.write(ref.iov); })
+      .then([this, &ref]() {
+    ref.fulfiller->fulfill();
+    spareBuffer = kj::mv(ref.buffer);
+    spareBuffer.clear();
+  }, [this, &ref](kj::Exception&& exception) {
+    ref.fulfiller->reject(kj::cp(exception));
+    error = kj::mv(exception);
+  }).attach(kj::mv(current));
+}
+
 }  // namespace capnp
@@ -42,6 +42,70 @@ kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadMessage(
     kj::ArrayPtr<word> scratchSpace = nullptr);
 // Like `readMessage` but returns null on EOF.
 
+class ReadAheadMessageStream {
+  // Reads a sequence of messages from a stream, like calling readMessage() repeatedly, but reads
+  // in large chunks rather than issuing separate reads for each message's segment table and
+  // content. When the peer sends messages back-to-back, one read typically picks up several of
+  // them, and the following calls to readMessage() complete without any I/O at all.
+  //
+  // Messages are not copied out of the read buffer: each MessageReader returned holds a reference
+  // to the buffer it points into. Once the buffer is full, the stream moves on to a new one, and
+  // the old buffer is freed when the last reader pointing into it is destroyed. If no readers
+  // are still using the buffer, it is reused instead. Note that this means that holding on to one
+  // small message keeps its whole buffer allocated.
+
+public:
+  static constexpr size_t DEFAULT_BUFFER_WORDS = 8192;
+
+  explicit ReadAheadMessageStream(kj::AsyncInputStream& input,
+                                  ReaderOptions options = ReaderOptions(),
+                                  size_t bufferWords = DEFAULT_BUFFER_WORDS);
+  // `bufferWords` is the size of each buffer. Messages bigger than this get a buffer of their own.
+  // `input` must outlive this object.
+
+  KJ_DISALLOW_COPY(ReadAheadMessageStream);
+  ~ReadAheadMessageStream() noexcept(false);
+
+  kj::Promise<kj::Own<MessageReader>> readMessage();
+  kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadMessage();
+  // Read the next message. tryReadMessage() returns null on a clean EOF. Only one read may be in
+  // progress at a time. The returned readers may outlive the stream.
+
+  size_t getBufferedBytes() { return writePos - readPos; }
+  // Bytes that have been read from the stream but not yet returned as messages.
+
+  struct Stats {
+    uint64_t reads = 0;
+    // Calls to the underlying stream's tryRead().
+
+    uint64_t messages = 0;
+    uint64_t bufferAllocations = 0;
+
+    uint64_t bytesMoved = 0;
+    // Bytes of partial messages copied when moving to a new or recycled buffer.
+  };
+
+  const Stats& getStats() { return stats; }
+
+private:
+  class Buffer;
+  class Reader;
+
+  kj::AsyncInputStream& input;
+  ReaderOptions options;
+  size_t bufferWords;
+
+  kj::Own<Buffer> buffer;
+  size_t readPos = 0;
+  size_t writePos = 0;
+  // Byte offsets into `buffer` of the next unparsed message and the end of the data read so far.
+
+  Stats stats;
+
+  kj::Maybe<kj::Own<MessageReader>> tryParse(size_t& neededBytes);
+  void makeSpace(size_t neededBytes);
+};
+
 kj::Promise<void> writeMessage(kj::AsyncOutputStream& output,
                                kj::ArrayPtr<const kj::ArrayPtr<const word>> segments)
     KJ_WARN_UNUSED_RESULT;
@@ -49,6 +113,145 @@ kj::Promise<void> writeMessage(kj::AsyncOutputStream& output, MessageBuilder& bu
     KJ_WARN_UNUSED_RESULT;
 // Write asynchronously.  The parameters must remain valid until the returned promise resolves.
 
+class BatchedMessageWriter {
+  // Writes messages to a stream like writeMessage() does, but queues them first so that many
+  // messages can go out in a single write (i.e. one writev() syscall) instead of one write each.
+  // Segments smaller than `Options::copyThreshold` are copied into a contiguous buffer along with
+  // the segment tables; larger segments are written directly from the caller's memory.
+  //
+  // Messages are always written in the order in which they were queued. While a batch is being
+  // written, new messages accumulate into the next batch, which is written as soon as the
+  // previous one completes.
+
+public:
+  enum class FlushPolicy {
+    END_OF_TURN,
+    // Write the batch once the code currently running on the event loop yields (using
+    // kj::evalLater()). Messages queued during the same turn share a write.
+
+    WHEN_IDLE,
+    // Write the batch once the event loop has nothing else to do (using kj::evalLast()). This
+    // batches more aggressively at the expense of latency.
+
+    EXPLICIT
+    // Only write when flush() is called or when `Options::flushThreshold` is reached.
+  };
+
+  struct Options {
+    FlushPolicy flushPolicy = FlushPolicy::END_OF_TURN;
+
+    size_t copyThreshold = 4096;
+    // Segments of up to this many bytes are copied into the batch buffer.
+
+    size_t flushThreshold = 1u << 20;
+    // Once a batch holds this many bytes, it is written regardless of the policy or cork, and
+    // later messages start a new batch.
+
+    uint maxMessages = 0;
+    // Likewise, the most messages a batch may hold. Zero means no limit.
+
+    kj::Maybe<kj::Timer&> timer;
+    kj::Duration maxDelay = 0 * kj::SECONDS;
+    // If `timer` is set, a batch is written no later than `maxDelay` after its first message was
+    // queued, regardless of the policy or cork. This bounds the latency added by WHEN_IDLE, which
+    // can wait indefinitely on a busy event loop, and by EXPLICIT.
+  };
+
+  struct Stats {
+    uint64_t messages = 0;
+    // Messages queued.
+
+    uint64_t batches = 0;
+    uint64_t bytes = 0;
+    // Writes issued to the stream, and their total size. `messages / batches` is the average
+    // number of messages sharing a write.
+
+    uint64_t thresholdFlushes = 0;
+    // Batches written early because they reached `flushThreshold` or `maxMessages`.
+
+    uint64_t delayFlushes = 0;
+    // Batches written early because they waited `maxDelay`.
+  };
+
+  explicit BatchedMessageWriter(kj::AsyncOutputStream& output, Options options);
+  explicit BatchedMessageWriter(kj::AsyncOutputStream& output);
+  KJ_DISALLOW_COPY(BatchedMessageWriter);
+  ~BatchedMessageWriter() noexcept(false);
+  // Destroying the writer cancels any writes in progress.
+
+  kj::Promise<void> writeMessage(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments)
+      KJ_WARN_UNUSED_RESULT;
+  kj::Promise<void> writeMessage(MessageBuilder& builder) KJ_WARN_UNUSED_RESULT;
+  // Queue a message. The returned promise resolves when the batch containing the message has been
+  // written. Segments that were not copied are read during the write, so as with writeMessage(),
+  // the message must remain valid until the promise resolves.
+  //
+  // If any write fails, the error is reported to every message in the batch and all later
+  // messages.
+
+  kj::Promise<void> flush() KJ_WARN_UNUSED_RESULT;
+  // Write all queued messages as soon as the writes before them complete, even if corked.
+  // Resolves when they have been written.
+
+  void cork();
+  void uncork();
+  // While corked, messages are only written by flush() or when the flush threshold is reached.
+  // cork() calls nest. uncork() of the last cork() schedules a write per the flush policy.
+
+  size_t getQueuedBytes();
+  // Bytes waiting to be written, not counting any write in progress.
+
+  Stats getStats() { return stats; }
+
+private:
+  struct Piece {
+    const byte* external;
+    // Points at the caller's segment, or null if the piece is part of `buffer`.
+
+    size_t offset;
+    size_t size;
+  };
+
+  struct Batch {
+    kj::Vector<word> buffer;
+    kj::Vector<Piece> pieces;
+    kj::Array<kj::ArrayPtr<const byte>> iov;
+    size_t byteCount = 0;
+    uint messageCount = 0;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    kj::ForkedPromise<void> done = nullptr;
+    kj::Promise<void> deadline = nullptr;
+    // Forces a flush after `Options::maxDelay`, if a timer was given.
+  };
+
+  kj::AsyncOutputStream& output;
+  Options options;
+  uint corkCount = 0;
+  bool flushQueued = false;
+  bool forceFlush = false;
+  Stats stats;
+
+  kj::Own<Batch> batch;
+  // Messages not yet handed to the stream. Null if none.
+
+  kj::Vector<kj::Own<Batch>> full;
+  size_t fullHead = 0;
+  // Batches that reached `flushThreshold` or `maxMessages`, waiting for earlier writes to complete.
+  // They are written in order starting at `fullHead`, before `batch`.
+
+  kj::Vector<word> spareBuffer;
+  // Buffer of the last completed batch, kept to avoid reallocating it.
+
+  kj::Maybe<kj::Exception> error;
+
+  kj::ForkedPromise<void> writeQueue;
+  // Chain of pending writes. Never rejects; errors are recorded in `error` instead.
+
+  void appendBuffered(size_t offset, size_t size);
+  void queueFlush(bool force);
+  kj::Promise<void> writeBatch();
+};
+
 // -----------------------------------------------------------------------------
 // Versions that support FD passing.
 
@@ -86,6 +289,9 @@ inline kj::Promise<void> writeMessage(
     kj::AsyncCapabilityStream& output, kj::ArrayPtr<const int> fds, MessageBuilder& builder) {
   return writeMessage(output, fds, builder.getSegmentsForOutput());
 }
+inline kj::Promise<void> BatchedMessageWriter::writeMessage(MessageBuilder& builder) {
+  return writeMessage(builder.getSegmentsForOutput());
+}
 
 }  // namespace capnp
 
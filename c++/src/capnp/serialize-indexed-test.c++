@@ -0,0 +1,139 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "serialize-indexed.h"
+#include <kj/filesystem.h>
+#include <kj/test.h>
+#include "test-util.h"
+
+namespace capnp {
+namespace _ {  // private
+namespace {
+
+kj::Array<const byte> writeTestFile(uint count, bool checksums) {
+  kj::VectorOutputStream output;
+  IndexedMessageWriter writer(output, checksums);
+
+  for (uint i = 0; i < count; i++) {
+    MallocMessageBuilder builder;
+    auto root = builder.initRoot<TestAllTypes>();
+    if (i % 7 == 0) {
+      initTestMessage(root);
+    }
+    root.setUInt32Field(i);
+    root.setTextField(kj::str("message #", i));
+    KJ_EXPECT(writer.add(builder) == i);
+  }
+
+  writer.finish();
+
+  // Copy into a word-aligned buffer.
+  auto words = kj::heapArray<word>(output.getArray().size() / sizeof(word));
+  memcpy(words.begin(), output.getArray().begin(), words.asBytes().size());
+  KJ_ASSERT(words.asBytes().size() == output.getArray().size());
+  kj::ArrayPtr<const byte> bytes = words.asBytes();
+  return bytes.attach(kj::mv(words));
+}
+
+void checkMessage(IndexedMessageFile& file, uint i) {
+  auto reader = file.getMessage(i);
+  auto root = reader->getRoot<TestAllTypes>();
+  KJ_EXPECT(root.getUInt32Field() == i);
+  KJ_EXPECT(root.getTextField() == kj::str("message #", i));
+  if (i % 7 == 0) {
+    KJ_EXPECT(root.getInt64Field() == -123456789012345ll);
+  }
+}
+
+KJ_TEST("indexed message file random access") {
+  for (bool checksums: {false, true}) {
+    IndexedMessageFile file(writeTestFile(100, checksums));
+    KJ_ASSERT(file.size() == 100);
+    KJ_EXPECT(file.hasChecksums() == checksums);
+
+    // Visit in a scattered order.
+    for (uint i = 0; i < 100; i++) {
+      checkMessage(file, (i * 37) % 100);
+    }
+
+    KJ_EXPECT_THROW_MESSAGE("out of range", file.getMessageData(100));
+  }
+}
+
+KJ_TEST("indexed message file is also a plain message stream") {
+  auto bytes = writeTestFile(10, true);
+  auto words = kj::arrayPtr(reinterpret_cast<const word*>(bytes.begin()),
+                            bytes.size() / sizeof(word));
+
+  for (uint i = 0; i < 10; i++) {
+    FlatArrayMessageReader reader(words);
+    KJ_EXPECT(reader.getRoot<TestAllTypes>().getUInt32Field() == i);
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+  }
+}
+
+KJ_TEST("indexed message file via mmap") {
+  auto file = kj::newInMemoryFile(kj::nullClock());
+  file->writeAll(writeTestFile(50, true));
+
+  IndexedMessageFile indexed(*file);
+  KJ_ASSERT(indexed.size() == 50);
+  checkMessage(indexed, 49);
+  checkMessage(indexed, 0);
+  checkMessage(indexed, 21);
+}
+
+KJ_TEST("indexed message file detects corruption") {
+  auto bytes = writeTestFile(10, true);
+  auto words = kj::arrayPtr(reinterpret_cast<const word*>(bytes.begin()),
+                            bytes.size() / sizeof(word));
+
+  {
+    IndexedMessageFile file(kj::mv(bytes));  // `words` still points at the same memory
+    auto data = file.getMessageData(3);
+
+    // Flip a bit in the middle of message 3.
+    auto copy = kj::heapArray<word>(words.size());
+    memcpy(copy.begin(), words.begin(), words.asBytes().size());
+    size_t pos = data.begin() - words.begin() + data.size() / 2;
+    reinterpret_cast<byte*>(copy.begin() + pos)[0] ^= 1;
+    kj::ArrayPtr<const byte> corrupt = copy.asBytes();
+
+    IndexedMessageFile corruptFile(corrupt.attach(kj::mv(copy)));
+    checkMessage(corruptFile, 2);
+    KJ_EXPECT_THROW_MESSAGE("checksum mismatch", corruptFile.getMessageData(3));
+  }
+
+  {
+    // Unfinished file has no footer.
+    kj::VectorOutputStream output;
+    IndexedMessageWriter writer(output);
+    MallocMessageBuilder builder;
+    builder.initRoot<TestAllTypes>();
+    writer.add(builder);
+    KJ_EXPECT_THROW_MESSAGE("not an indexed message file",
+        IndexedMessageFile(kj::heapArray<byte>(output.getArray())));
+  }
+}
+
+}  // namespace
+}  // namespace _ (private)
+}  // namespace capnp
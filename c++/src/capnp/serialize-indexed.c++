@@ -0,0 +1,236 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "serialize-indexed.h"
+#include <kj/debug.h>
+#include <kj/filesystem.h>
+
+namespace capnp {
+
+namespace {
+
+constexpr uint FOOTER_WORDS = 4;
+constexpr uint64_t FLAG_CHECKSUMS = 1;
+
+}  // namespace
+
+namespace _ {  // private
+
+void MessageChecksum::update(kj::ArrayPtr<const word> words) {
+  // Each step mixes one word into the state with a multiply and a rotate, using the constants from
+  // MurmurHash3's 64-bit finalizer. Words are read as little-endian so that the checksum doesn't
+  // depend on the host's byte order.
+
+  uint64_t h = state;
+  auto values = reinterpret_cast<const WireValue<uint64_t>*>(words.begin());
+  for (size_t i = 0; i < words.size(); i++) {
+    h ^= values[i].get() * 0x87c37b91114253d5ull;
+    h = (h << 31) | (h >> 33);
+    h *= 0x4cf5ad432745937full;
+  }
+  state = h;
+  wordCount += words.size();
+}
+
+uint64_t MessageChecksum::finish() const {
+  uint64_t h = state ^ wordCount;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+uint64_t computeMessageChecksum(kj::ArrayPtr<const word> words) {
+  MessageChecksum checksum;
+  checksum.update(words);
+  return checksum.finish();
+}
+
+}  // namespace _ (private)
+
+// =======================================================================================
+
+class IndexedMessageWriter::CountingStream final: public kj::OutputStream {
+  // Forwards to the real output while counting bytes and, optionally, computing the checksum.
+  // writeMessage() only ever writes whole words.
+
+public:
+  CountingStream(kj::OutputStream& inner, bool checksum): inner(inner), checksum(checksum) {}
+
+  void write(const void* buffer, size_t size) override {
+    inner.write(buffer, size);
+    count(kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size));
+  }
+
+  void write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    inner.write(pieces);
+    for (auto piece: pieces) {
+      count(piece);
+    }
+  }
+
+  uint64_t getByteCount() const { return byteCount; }
+  uint64_t getChecksum() const { return hasher.finish(); }
+
+private:
+  kj::OutputStream& inner;
+  bool checksum;
+  uint64_t byteCount = 0;
+  _::MessageChecksum hasher;
+
+  void count(kj::ArrayPtr<const byte> bytes) {
+    KJ_ASSERT(bytes.size() % sizeof(word) == 0, "writeMessage() wrote partial word?");
+    byteCount += bytes.size();
+    if (checksum) {
+      hasher.update(kj::arrayPtr(reinterpret_cast<const word*>(bytes.begin()),
+                                 bytes.size() / sizeof(word)));
+    }
+  }
+};
+
+IndexedMessageWriter::IndexedMessageWriter(kj::OutputStream& output, bool checksums)
+    : output(output), checksums(checksums) {}
+
+IndexedMessageWriter::~IndexedMessageWriter() noexcept(false) {}
+
+uint64_t IndexedMessageWriter::add(MessageBuilder& builder) {
+  return add(builder.getSegmentsForOutput());
+}
+
+uint64_t IndexedMessageWriter::add(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  KJ_REQUIRE(!finished, "can't add messages after finish()");
+
+  CountingStream counter(output, checksums);
+  writeMessage(counter, segments);
+
+  uint64_t result = entries.size() / 2;
+  entries.add(offset);
+  entries.add(counter.getByteCount() / sizeof(word));
+  if (checksums) {
+    checksumList.add(counter.getChecksum());
+  }
+  offset += counter.getByteCount();
+  return result;
+}
+
+void IndexedMessageWriter::finish() {
+  KJ_REQUIRE(!finished, "finish() called twice");
+  finished = true;
+
+  uint64_t indexOffset = offset;
+  uint64_t count = entries.size() / 2;
+
+  auto trailer = kj::heapArray<_::WireValue<uint64_t>>(
+      entries.size() + checksumList.size() + FOOTER_WORDS);
+  auto pos = trailer.begin();
+  for (auto value: entries) {
+    (pos++)->set(value);
+  }
+  for (auto value: checksumList) {
+    (pos++)->set(value);
+  }
+  (pos++)->set(INDEXED_MESSAGE_MAGIC);
+  (pos++)->set(count);
+  (pos++)->set(indexOffset);
+  (pos++)->set(checksums ? FLAG_CHECKSUMS : 0);
+  KJ_DASSERT(pos == trailer.end());
+
+  output.write(trailer.begin(), trailer.size() * sizeof(trailer[0]));
+  offset += trailer.size() * sizeof(trailer[0]);
+}
+
+// =======================================================================================
+
+IndexedMessageFile::IndexedMessageFile(
+    const kj::ReadableFile& file, bool verifyChecksums, MmapAdvice advice)
+    : mapping(file.mmap(0, file.stat().size)),
+      verifyChecksums(verifyChecksums) {
+  _::adviseMapping(mapping, advice);
+  init();
+}
+
+IndexedMessageFile::IndexedMessageFile(kj::Array<const byte> bytes, bool verifyChecksums)
+    : mapping(kj::mv(bytes)), verifyChecksums(verifyChecksums) {
+  init();
+}
+
+IndexedMessageFile::~IndexedMessageFile() noexcept(false) {}
+
+void IndexedMessageFile::init() {
+  KJ_REQUIRE(reinterpret_cast<uintptr_t>(mapping.begin()) % sizeof(word) == 0,
+             "indexed message file must be word-aligned in memory");
+  KJ_REQUIRE(mapping.size() % sizeof(word) == 0, "indexed message file size not word-aligned");
+  words = kj::arrayPtr(reinterpret_cast<const word*>(mapping.begin()),
+                       mapping.size() / sizeof(word));
+
+  KJ_REQUIRE(words.size() >= FOOTER_WORDS, "file too small to be an indexed message file");
+  auto footer = reinterpret_cast<const _::WireValue<uint64_t>*>(words.end() - FOOTER_WORDS);
+  KJ_REQUIRE(footer[0].get() == INDEXED_MESSAGE_MAGIC,
+             "not an indexed message file, or file was not finished");
+
+  count = footer[1].get();
+  uint64_t indexOffset = footer[2].get();
+  uint64_t flags = footer[3].get();
+
+  uint64_t indexWords = (flags & FLAG_CHECKSUMS) ? 3 : 2;
+  uint64_t available = words.size() - FOOTER_WORDS;
+  KJ_REQUIRE(indexOffset % sizeof(word) == 0 && indexOffset / sizeof(word) <= available &&
+             count <= (available - indexOffset / sizeof(word)) / indexWords,
+             "indexed message file footer is corrupt", count, indexOffset);
+
+  index = reinterpret_cast<const _::WireValue<uint64_t>*>(
+      words.begin() + indexOffset / sizeof(word));
+  checksums = (flags & FLAG_CHECKSUMS) ? index + count * 2 : nullptr;
+  KJ_REQUIRE(reinterpret_cast<const word*>(index + count * indexWords) ==
+             words.end() - FOOTER_WORDS,
+             "indexed message file footer is corrupt", count, indexOffset);
+}
+
+kj::ArrayPtr<const word> IndexedMessageFile::getMessageData(uint64_t i) const {
+  KJ_REQUIRE(i < count, "message index out of range", i, count);
+
+  uint64_t offset = index[i * 2].get();
+  uint64_t size = index[i * 2 + 1].get();
+
+  // Messages must lie entirely before the index.
+  uint64_t limit = reinterpret_cast<const word*>(index) - words.begin();
+  KJ_REQUIRE(offset % sizeof(word) == 0 && offset / sizeof(word) <= limit &&
+             size <= limit - offset / sizeof(word),
+             "indexed message file index entry is corrupt", i, offset, size);
+
+  auto result = words.slice(offset / sizeof(word), offset / sizeof(word) + size);
+
+  if (verifyChecksums && checksums != nullptr) {
+    KJ_REQUIRE(_::computeMessageChecksum(result) == checksums[i].get(),
+               "indexed message file checksum mismatch; message is corrupt", i);
+  }
+
+  return result;
+}
+
+kj::Own<FlatArrayMessageReader> IndexedMessageFile::getMessage(
+    uint64_t i, ReaderOptions options) const {
+  return kj::heap<FlatArrayMessageReader>(getMessageData(i), options);
+}
+
+}  // namespace capnp
@@ -0,0 +1,156 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// This file implements a seekable container for many messages. A file written by
+// IndexedMessageWriter looks like:
+//
+// * Each message, in the standard format of serialize.h, one after another. Hence the file
+//   starts out looking exactly like a stream written with writeMessage(), and a reader that knows
+//   nothing about the index can still read the messages sequentially, as long as it stops after
+//   the last one. It has to learn the message count some other way: if it reads on, it will try
+//   to parse the index and footer as a message, and fail or return garbage.
+// * The index: for each message, two 64-bit little-endian words: the byte offset of the message
+//   within the file, and its size in words.
+// * If checksums are enabled, one 64-bit word per message: the checksum of the message's words,
+//   as computed by `_::computeMessageChecksum()`.
+// * The footer, four 64-bit words: the magic number INDEXED_MESSAGE_MAGIC, the message count, the
+//   byte offset of the index, and a flags word (bit 0 = checksums present).
+//
+// Since the footer is at a fixed position relative to the end of the file, a reader can locate
+// message N with a single lookup, without parsing any of the messages before it.
+
+#pragma once
+
+#include "serialize.h"
+#include "endian.h"
+#include <kj/vector.h>
+
+CAPNP_BEGIN_HEADER
+
+namespace capnp {
+
+constexpr uint64_t INDEXED_MESSAGE_MAGIC = 0x315844494e504143ull;
+// "CAPNIDX1" read as a little-endian 64-bit integer.
+
+class IndexedMessageWriter {
+  // Writes an indexed message file. Messages are written to the output stream as they are added;
+  // the index is accumulated in memory and written by finish().
+
+public:
+  explicit IndexedMessageWriter(kj::OutputStream& output, bool checksums = true);
+  // If `checksums` is true, a checksum of each message is stored in the index, and
+  // IndexedMessageFile will verify it before handing out the message.
+  //
+  // The offsets in the index count bytes written through this writer, so `output` must be at
+  // the start of the file: an indexed message file can't be appended to other data.
+
+  KJ_DISALLOW_COPY(IndexedMessageWriter);
+  ~IndexedMessageWriter() noexcept(false);
+
+  uint64_t add(MessageBuilder& builder);
+  uint64_t add(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments);
+  // Append a message. Returns its index.
+
+  void finish();
+  // Write the index and footer. No more messages may be added after this. If finish() is never
+  // called, the result is a plain stream of messages which IndexedMessageFile will reject but
+  // which can still be read sequentially.
+
+private:
+  class CountingStream;
+
+  kj::OutputStream& output;
+  bool checksums;
+  bool finished = false;
+  uint64_t offset = 0;
+  kj::Vector<uint64_t> entries;
+  // Flattened (offset, size) pairs, in the order they'll be written.
+  kj::Vector<uint64_t> checksumList;
+};
+
+class IndexedMessageFile {
+  // Provides random access to the messages in a file written by IndexedMessageWriter. The file is
+  // mapped into memory once; looking up a message costs O(1) and does not copy it.
+
+public:
+  explicit IndexedMessageFile(const kj::ReadableFile& file, bool verifyChecksums = true,
+                              MmapAdvice advice = MmapAdvice::RANDOM);
+  // Maps `file` and reads the footer. The file object need not outlive this object.
+  //
+  // If `verifyChecksums` is true and the file has checksums, each message's checksum is verified
+  // when it is retrieved. This requires reading the whole message, so you may wish to disable it
+  // when you'll only be looking at a small part of a large message.
+
+  explicit IndexedMessageFile(kj::Array<const byte> bytes, bool verifyChecksums = true);
+  // Reads an already-loaded file. `bytes` must be word-aligned.
+
+  KJ_DISALLOW_COPY(IndexedMessageFile);
+  ~IndexedMessageFile() noexcept(false);
+
+  uint64_t size() const { return count; }
+  // Number of messages in the file.
+
+  bool hasChecksums() const { return checksums != nullptr; }
+
+  kj::ArrayPtr<const word> getMessageData(uint64_t index) const;
+  // Returns the serialized message at the given index, suitable for passing to
+  // FlatArrayMessageReader. The result points into the mapping.
+
+  kj::Own<FlatArrayMessageReader> getMessage(
+      uint64_t index, ReaderOptions options = ReaderOptions()) const;
+  // Returns a reader for the message at the given index. The reader points into the mapping, so
+  // must not outlive this object.
+
+private:
+  kj::Array<const byte> mapping;
+  kj::ArrayPtr<const word> words;
+  uint64_t count;
+  const _::WireValue<uint64_t>* index;
+  const _::WireValue<uint64_t>* checksums;
+  bool verifyChecksums;
+
+  void init();
+};
+
+namespace _ {  // private
+
+class MessageChecksum {
+  // Computes the checksum stored in the index of an indexed message file, incrementally. This is a
+  // fast non-cryptographic 64-bit hash which processes one word at a time; it detects corruption,
+  // not tampering.
+
+public:
+  void update(kj::ArrayPtr<const word> words);
+  uint64_t finish() const;
+
+private:
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+  uint64_t wordCount = 0;
+};
+
+uint64_t computeMessageChecksum(kj::ArrayPtr<const word> words);
+// Shortcut for a MessageChecksum over a single array.
+
+}  // namespace _ (private)
+
+}  // namespace capnp
+
+CAPNP_END_HEADER
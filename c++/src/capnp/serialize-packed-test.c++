@@ -86,7 +86,13 @@ private:
   std::string::size_type readPos;
 };
 
-void expectPacksTo(kj::ArrayPtr<const byte> unpackedUnaligned, kj::ArrayPtr<const byte> packed) {
+const PackingKernel ALL_KERNELS[] = {
+  PackingKernel::SCALAR, PackingKernel::SSSE3, PackingKernel::NEON
+};
+
+void expectPacksTo(kj::ArrayPtr<const byte> unpackedUnaligned, kj::ArrayPtr<const byte> packed,
+                   PackingKernel kernel) {
+  KJ_CONTEXT((uint)kernel);
   TestPipe pipe;
 
   auto unpackedSizeInWords = computeUnpackedSizeInWords(packed);
@@ -104,7 +110,7 @@ void expectPacksTo(kj::ArrayPtr<const byte> unpackedUnaligned, kj::ArrayPtr<cons
 
   {
     kj::BufferedOutputStreamWrapper bufferedOut(pipe);
-    PackedOutputStream packedOut(bufferedOut);
+    PackedOutputStream packedOut(bufferedOut, kernel);
     packedOut.write(unpacked.begin(), unpacked.size());
   }
 
@@ -120,7 +126,7 @@ void expectPacksTo(kj::ArrayPtr<const byte> unpackedUnaligned, kj::ArrayPtr<cons
   kj::Array<byte> roundTrip = kj::heapArray<byte>(unpacked.size());
 
   {
-    PackedInputStream packedIn(pipe);
+    PackedInputStream packedIn(pipe, kernel);
     packedIn.InputStream::read(roundTrip.begin(), roundTrip.size());
     EXPECT_TRUE(pipe.allRead());
   }
@@ -135,7 +141,7 @@ void expectPacksTo(kj::ArrayPtr<const byte> unpackedUnaligned, kj::ArrayPtr<cons
     pipe.resetRead(blockSize);
 
     {
-      PackedInputStream packedIn(pipe);
+      PackedInputStream packedIn(pipe, kernel);
       packedIn.InputStream::read(roundTrip.begin(), roundTrip.size());
       EXPECT_TRUE(pipe.allRead());
     }
@@ -174,14 +180,14 @@ void expectPacksTo(kj::ArrayPtr<const byte> unpackedUnaligned, kj::ArrayPtr<cons
 
   {
     kj::BufferedOutputStreamWrapper bufferedOut(pipe);
-    PackedOutputStream packedOut(bufferedOut);
+    PackedOutputStream packedOut(bufferedOut, kernel);
     for (uint i = 0; i < 5; i++) {
       packedOut.write(unpacked.begin(), unpacked.size());
     }
   }
 
   for (uint i = 0; i < 5; i++) {
-    PackedInputStream packedIn(pipe);
+    PackedInputStream packedIn(pipe, kernel);
     packedIn.InputStream::read(&*roundTrip.begin(), roundTrip.size());
 
     if (memcmp(roundTrip.begin(), unpacked.begin(), unpacked.size()) != 0) {
@@ -193,6 +199,14 @@ void expectPacksTo(kj::ArrayPtr<const byte> unpackedUnaligned, kj::ArrayPtr<cons
   EXPECT_TRUE(pipe.allRead());
 }
 
+void expectPacksTo(kj::ArrayPtr<const byte> unpacked, kj::ArrayPtr<const byte> packed) {
+  for (auto kernel: ALL_KERNELS) {
+    if (isPackingKernelSupported(kernel)) {
+      expectPacksTo(unpacked, packed, kernel);
+    }
+  }
+}
+
 #ifdef __CDT_PARSER__
 // CDT doesn't seem to understand these initializer lists.
 #define expectPacksTo(...)
@@ -219,6 +233,70 @@ TEST(Packed, SimplePacking) {
       {0xed,8,100,6,1,1,2, 0,2, 0xd4,1,2,3,1});
 }
 
+kj::Array<word> makeMixedWords(size_t count, uint seed) {
+  // Generates words with a mix of zero-byte densities, including runs of all-zero and
+  // all-nonzero words, to exercise both the vectorized and the run-length code paths.
+
+  auto result = kj::heapArray<word>(count);
+  memset(result.begin(), 0, count * sizeof(word));
+  byte* bytes = reinterpret_cast<byte*>(result.begin());
+
+  uint32_t state = seed;
+  auto next = [&]() {
+    state = state * 1103515245u + 12345u;
+    return state >> 16;
+  };
+
+  for (size_t i = 0; i < count; i++) {
+    uint kind = next() % 8;
+    for (uint j = 0; j < 8; j++) {
+      uint value = next() & 0xff;
+      switch (kind) {
+        case 0: value = 0; break;                    // all-zero
+        case 1: value |= 1; break;                   // all-nonzero
+        case 2: if (j % 2 == 0) value = 0; break;    // half zero
+        default: if (next() % 3 == 0) value = 0; break;
+      }
+      bytes[i * 8 + j] = value;
+    }
+  }
+
+  return result;
+}
+
+TEST(Packed, KernelsAgree) {
+  for (uint seed = 0; seed < 16; seed++) {
+    auto words = makeMixedWords(seed * 97 + 3, seed);
+    kj::ArrayPtr<const byte> unpacked = words.asBytes();
+
+    TestPipe expected;
+    {
+      kj::BufferedOutputStreamWrapper bufferedOut(expected);
+      PackedOutputStream packedOut(bufferedOut, PackingKernel::SCALAR);
+      packedOut.write(unpacked.begin(), unpacked.size());
+    }
+
+    for (auto kernel: ALL_KERNELS) {
+      if (isPackingKernelSupported(kernel)) {
+        KJ_CONTEXT(seed, (uint)kernel);
+
+        // Use a tiny output buffer so that the kernels frequently run into the end of it.
+        TestPipe pipe;
+        {
+          byte buffer[64];
+          kj::BufferedOutputStreamWrapper bufferedOut(pipe, kj::arrayPtr(buffer, sizeof(buffer)));
+          PackedOutputStream packedOut(bufferedOut, kernel);
+          packedOut.write(unpacked.begin(), unpacked.size());
+        }
+        EXPECT_TRUE(pipe.getData() == expected.getData());
+
+        // Check that the input survives a round trip through the result.
+        expectPacksTo(unpacked, pipe.getArray(), kernel);
+      }
+    }
+  }
+}
+
 // =======================================================================================
 
 class TestMessageBuilder: public MallocMessageBuilder {
@@ -24,11 +24,242 @@
 #include "layout.h"
 #include <vector>
 
+#if !defined(CAPNP_NO_PACKED_SIMD) && (defined(__GNUC__) || defined(__clang__))
+#if defined(__x86_64__) || defined(__i386__)
+#define CAPNP_PACKED_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define CAPNP_PACKED_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
+
 namespace capnp {
 
 namespace _ {  // private
 
-PackedInputStream::PackedInputStream(kj::BufferedInputStream& inner): inner(inner) {}
+// =======================================================================================
+// Vectorized kernels
+//
+// Each kernel provides a `pack` and an `unpack` function which handle runs of "ordinary" words,
+// i.e. words whose tag is neither 0x00 nor 0xff. They stop as soon as they see a word with a
+// special tag, or when they run out of input or output space, leaving the rest to the scalar
+// code in PackedInputStream / PackedOutputStream, which handles run-length encoding and buffer
+// boundaries. Hence, all kernels produce exactly the same bytes as the scalar code.
+
+namespace {
+
+typedef void PackFunc(const uint8_t* __restrict__& in, const uint8_t* inEnd,
+    uint8_t* __restrict__& out, uint8_t* outEnd);
+// Packs words from `in` to `out`, advancing both. Stops before any word with tag 0x00 or 0xff,
+// at `inEnd`, or when fewer than 10 bytes remain before `outEnd`.
+
+typedef void UnpackFunc(const uint8_t* __restrict__& in, const uint8_t* inEnd,
+    uint8_t* __restrict__& out, uint8_t* outEnd);
+// Unpacks words from `in` to `out`, advancing both. Stops before any tag 0x00 or 0xff, when
+// fewer than 10 bytes remain before `inEnd`, or at `outEnd`.
+
+struct KernelFuncs {
+  PackFunc* pack;
+  UnpackFunc* unpack;
+};
+
+#if CAPNP_PACKED_X86 || CAPNP_PACKED_NEON
+
+struct ShuffleTables {
+  // Byte shuffle controls indexed by tag. An index with the high bit set produces a zero byte,
+  // both for pshufb and (being out-of-range) for vtbl.
+
+  uint8_t compact[256][8];
+  // Moves the bytes selected by the tag to the front, in order.
+
+  uint8_t expand[256][8];
+  // The inverse of `compact`: spreads the first popcount(tag) bytes to the positions selected by
+  // the tag, zeroing the rest.
+
+  uint8_t popCount[256];
+
+  constexpr ShuffleTables(): compact(), expand(), popCount() {
+    for (uint tag = 0; tag < 256; tag++) {
+      uint8_t count = 0;
+      for (uint i = 0; i < 8; i++) {
+        compact[tag][i] = 0x80;
+        if (tag & (1u << i)) {
+          compact[tag][count] = i;
+          expand[tag][i] = count++;
+        } else {
+          expand[tag][i] = 0x80;
+        }
+      }
+      popCount[tag] = count;
+    }
+  }
+};
+
+constexpr ShuffleTables SHUFFLE_TABLES;
+
+inline bool isSpecialTag(uint tag) {
+  return tag == 0 || tag == 0xffu;
+}
+
+#endif  // CAPNP_PACKED_X86 || CAPNP_PACKED_NEON
+
+#if CAPNP_PACKED_X86
+
+__attribute__((target("ssse3")))
+inline uint8_t* packWordSsse3(const uint8_t* in, uint8_t* out, uint tag) {
+  // Writes the tag followed by the word's non-zero bytes. Stores 9 bytes regardless of how many
+  // are significant; the caller guarantees there's room.
+
+  __m128i data = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in));
+  __m128i control = _mm_loadl_epi64(
+      reinterpret_cast<const __m128i*>(SHUFFLE_TABLES.compact[tag]));
+  *out++ = tag;
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(data, control));
+  return out + SHUFFLE_TABLES.popCount[tag];
+}
+
+__attribute__((target("ssse3")))
+void packSsse3(const uint8_t* __restrict__& inRef, const uint8_t* inEnd,
+    uint8_t* __restrict__& outRef, uint8_t* outEnd) {
+  const uint8_t* __restrict__ in = inRef;
+  uint8_t* __restrict__ out = outRef;
+  const __m128i zero = _mm_setzero_si128();
+
+  while (in < inEnd && outEnd - out >= 10) {
+    __m128i data = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in));
+    uint tag = ~_mm_movemask_epi8(_mm_cmpeq_epi8(data, zero)) & 0xffu;
+    if (isSpecialTag(tag)) break;
+    out = packWordSsse3(in, out, tag);
+    in += sizeof(word);
+  }
+
+  inRef = in;
+  outRef = out;
+}
+
+__attribute__((target("ssse3")))
+void unpackSsse3(const uint8_t* __restrict__& inRef, const uint8_t* inEnd,
+    uint8_t* __restrict__& outRef, uint8_t* outEnd) {
+  const uint8_t* __restrict__ in = inRef;
+  uint8_t* __restrict__ out = outRef;
+
+  // We always load 8 bytes after the tag, so we need at least 9 bytes of input. Requiring 10
+  // matches the scalar fast path, which also needs a byte for a possible run count.
+  while (inEnd - in >= 10 && out < outEnd) {
+    uint tag = *in;
+    if (isSpecialTag(tag)) break;
+    __m128i data = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + 1));
+    __m128i control = _mm_loadl_epi64(
+        reinterpret_cast<const __m128i*>(SHUFFLE_TABLES.expand[tag]));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(data, control));
+    in += 1 + SHUFFLE_TABLES.popCount[tag];
+    out += sizeof(word);
+  }
+
+  inRef = in;
+  outRef = out;
+}
+
+#endif  // CAPNP_PACKED_X86
+
+#if CAPNP_PACKED_NEON
+
+void packNeon(const uint8_t* __restrict__& inRef, const uint8_t* inEnd,
+    uint8_t* __restrict__& outRef, uint8_t* outEnd) {
+  static const uint8_t BIT_WEIGHTS[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+  const uint8x8_t weights = vld1_u8(BIT_WEIGHTS);
+
+  const uint8_t* __restrict__ in = inRef;
+  uint8_t* __restrict__ out = outRef;
+
+  while (in < inEnd && outEnd - out >= 10) {
+    uint8x8_t data = vld1_u8(in);
+    uint tag = vaddv_u8(vand_u8(vtst_u8(data, data), weights));
+    if (isSpecialTag(tag)) break;
+    *out++ = tag;
+    vst1_u8(out, vtbl1_u8(data, vld1_u8(SHUFFLE_TABLES.compact[tag])));
+    out += SHUFFLE_TABLES.popCount[tag];
+    in += sizeof(word);
+  }
+
+  inRef = in;
+  outRef = out;
+}
+
+void unpackNeon(const uint8_t* __restrict__& inRef, const uint8_t* inEnd,
+    uint8_t* __restrict__& outRef, uint8_t* outEnd) {
+  const uint8_t* __restrict__ in = inRef;
+  uint8_t* __restrict__ out = outRef;
+
+  while (inEnd - in >= 10 && out < outEnd) {
+    uint tag = *in;
+    if (isSpecialTag(tag)) break;
+    vst1_u8(out, vtbl1_u8(vld1_u8(in + 1), vld1_u8(SHUFFLE_TABLES.expand[tag])));
+    in += 1 + SHUFFLE_TABLES.popCount[tag];
+    out += sizeof(word);
+  }
+
+  inRef = in;
+  outRef = out;
+}
+
+#endif  // CAPNP_PACKED_NEON
+
+PackingKernel detectBestPackingKernel() {
+#if CAPNP_PACKED_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) return PackingKernel::SSSE3;
+#elif CAPNP_PACKED_NEON
+  return PackingKernel::NEON;
+#endif
+  return PackingKernel::SCALAR;
+}
+
+KernelFuncs getKernelFuncs(PackingKernel kernel) {
+  switch (kernel) {
+    case PackingKernel::SCALAR:
+      return { nullptr, nullptr };
+#if CAPNP_PACKED_X86
+    case PackingKernel::SSSE3:
+      return { &packSsse3, &unpackSsse3 };
+#endif
+#if CAPNP_PACKED_NEON
+    case PackingKernel::NEON:
+      return { &packNeon, &unpackNeon };
+#endif
+    default:
+      break;
+  }
+  KJ_FAIL_REQUIRE("packing kernel not available in this build", (uint)kernel);
+  return { nullptr, nullptr };
+}
+
+}  // namespace
+
+PackingKernel getBestPackingKernel() {
+  static const PackingKernel result = detectBestPackingKernel();
+  return result;
+}
+
+bool isPackingKernelSupported(PackingKernel kernel) {
+  switch (kernel) {
+    case PackingKernel::SCALAR:
+      return true;
+    case PackingKernel::SSSE3:
+    case PackingKernel::NEON:
+      return getBestPackingKernel() == kernel;
+  }
+  return false;
+}
+
+// =======================================================================================
+
+PackedInputStream::PackedInputStream(kj::BufferedInputStream& inner, PackingKernel kernel)
+    : inner(inner), kernel(kernel) {
+  KJ_REQUIRE(isPackingKernelSupported(kernel), "packing kernel not supported on this CPU",
+             (uint)kernel);
+}
 PackedInputStream::~PackedInputStream() noexcept(false) {}
 
 size_t PackedInputStream::tryRead(void* dst, size_t minBytes, size_t maxBytes) {
@@ -48,6 +279,7 @@ size_t PackedInputStream::tryRead(void* dst, size_t minBytes, size_t maxBytes) {
     return 0;
   }
   const uint8_t* __restrict__ in = reinterpret_cast<const uint8_t*>(buffer.begin());
+  UnpackFunc* unpackOrdinaryWords = getKernelFuncs(kernel).unpack;
 
 #define REFRESH_BUFFER() \
   inner.skip(buffer.size()); \
@@ -98,6 +330,16 @@ size_t PackedInputStream::tryRead(void* dst, size_t minBytes, size_t maxBytes) {
         REFRESH_BUFFER();
       }
     } else {
+      if (unpackOrdinaryWords != nullptr) {
+        unpackOrdinaryWords(in, BUFFER_END, out, outEnd);
+        if (out == outEnd) {
+          inner.skip(in - reinterpret_cast<const uint8_t*>(buffer.begin()));
+          return maxBytes;
+        } else if (BUFFER_REMAINING < 10) {
+          continue;
+        }
+      }
+
       tag = *in++;
 
 #define HANDLE_BYTE(n) \
@@ -298,8 +540,11 @@ void PackedInputStream::skip(size_t bytes) {
 
 // -------------------------------------------------------------------
 
-PackedOutputStream::PackedOutputStream(kj::BufferedOutputStream& inner)
-    : inner(inner) {}
+PackedOutputStream::PackedOutputStream(kj::BufferedOutputStream& inner, PackingKernel kernel)
+    : inner(inner), kernel(kernel) {
+  KJ_REQUIRE(isPackingKernelSupported(kernel), "packing kernel not supported on this CPU",
+             (uint)kernel);
+}
 PackedOutputStream::~PackedOutputStream() noexcept(false) {}
 
 void PackedOutputStream::write(const void* src, size_t size) {
@@ -310,8 +555,14 @@ void PackedOutputStream::write(const void* src, size_t size) {
 
   const uint8_t* __restrict__ in = reinterpret_cast<const uint8_t*>(src);
   const uint8_t* const inEnd = reinterpret_cast<const uint8_t*>(src) + size;
+  PackFunc* packOrdinaryWords = getKernelFuncs(kernel).pack;
 
   while (in < inEnd) {
+    if (packOrdinaryWords != nullptr) {
+      packOrdinaryWords(in, inEnd, out, reinterpret_cast<uint8_t*>(buffer.end()));
+      if (in == inEnd) break;
+    }
+
     if (reinterpret_cast<uint8_t*>(buffer.end()) - out < 10) {
       // Oops, we're out of space.  We need at least 10 bytes for the fast path, since we don't
       // bounds-check on every byte.
@@ -29,12 +29,35 @@ namespace capnp {
 
 namespace _ {  // private
 
+enum class PackingKernel: uint8_t {
+  // Implementation of the inner loops of PackedInputStream and PackedOutputStream. All kernels
+  // produce bit-identical output; they differ only in speed.
+
+  SCALAR,
+  // Portable implementation which handles one byte at a time.
+
+  SSSE3,
+  // x86: Computes tags using a compare-to-zero plus movemask, and compacts / expands bytes using
+  // pshufb with precomputed shuffle tables.
+
+  NEON
+  // ARM64: The SSSE3 algorithm, using vtbl for shuffles.
+};
+
+PackingKernel getBestPackingKernel();
+// Returns the fastest kernel supported by the CPU we're running on. This is detected once, at
+// first call.
+
+bool isPackingKernelSupported(PackingKernel kernel);
+// Returns true if `kernel` was compiled in and can run on this CPU.
+
 class PackedInputStream: public kj::InputStream {
   // An input stream that unpacks packed data with a picky constraint:  The caller must read data
   // in the exact same size and sequence as the data was written to PackedOutputStream.
 
 public:
-  explicit PackedInputStream(kj::BufferedInputStream& inner);
+  explicit PackedInputStream(kj::BufferedInputStream& inner,
+                             PackingKernel kernel = getBestPackingKernel());
   KJ_DISALLOW_COPY(PackedInputStream);
   ~PackedInputStream() noexcept(false);
 
@@ -44,12 +67,14 @@ public:
 
 private:
   kj::BufferedInputStream& inner;
+  PackingKernel kernel;
 };
 
 class PackedOutputStream: public kj::OutputStream {
   // An output stream that packs data. Buffers passed to `write()` must be word-aligned.
 public:
-  explicit PackedOutputStream(kj::BufferedOutputStream& inner);
+  explicit PackedOutputStream(kj::BufferedOutputStream& inner,
+                              PackingKernel kernel = getBestPackingKernel());
   KJ_DISALLOW_COPY(PackedOutputStream);
   ~PackedOutputStream() noexcept(false);
 
@@ -58,6 +83,7 @@ public:
 
 private:
   kj::BufferedOutputStream& inner;
+  PackingKernel kernel;
 };
 
 }  // namespace _ (private)
@@ -27,6 +27,7 @@
 #include <kj/debug.h>
 #include <kj/compat/gtest.h>
 #include <kj/miniposix.h>
+#include <kj/filesystem.h>
 #include <string>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -438,6 +439,54 @@ TEST(Serialize, FileDescriptors) {
   }
 }
 
+#if !_WIN32  // newDiskReadableFile() takes a HANDLE on Windows.
+TEST(Serialize, MmapFile) {
+#if __ANDROID__
+  char filename[] = "capnproto-serialize-test-XXXXXX";
+#else
+  char filename[] = "/tmp/capnproto-serialize-test-XXXXXX";
+#endif
+  kj::AutoCloseFd tmpfile(mkstemp(filename));
+  ASSERT_GE(tmpfile.get(), 0);
+  EXPECT_EQ(0, unlink(filename));
+
+  {
+    TestMessageBuilder builder(7);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    writeMessageToFd(tmpfile.get(), builder);
+  }
+
+  {
+    TestMessageBuilder builder(1);
+    builder.initRoot<TestAllTypes>().setTextField("second message in file");
+    writeMessageToFd(tmpfile.get(), builder);
+  }
+
+  auto file = kj::newDiskReadableFile(kj::mv(tmpfile));
+  uint64_t fileSize = file->stat().size;
+
+  for (auto advice: {MmapAdvice::NORMAL, MmapAdvice::SEQUENTIAL,
+                     MmapAdvice::RANDOM, MmapAdvice::WILL_NEED}) {
+    uint64_t secondOffset;
+
+    {
+      MmapMessageReader reader(*file, ReaderOptions(), advice);
+      checkTestMessage(reader.getRoot<TestAllTypes>());
+      secondOffset = reader.getEndOffset();
+    }
+
+    {
+      MmapMessageReader reader(*file, secondOffset, ReaderOptions(), advice);
+      EXPECT_EQ("second message in file", reader.getRoot<TestAllTypes>().getTextField());
+      EXPECT_EQ(fileSize, reader.getEndOffset());
+    }
+  }
+
+  EXPECT_ANY_THROW(MmapMessageReader(*file, 4));
+  EXPECT_ANY_THROW(MmapMessageReader(*file, fileSize + 8));
+}
+#endif  // !_WIN32
+
 TEST(Serialize, RejectTooManySegments) {
   kj::Array<word> data = kj::heapArray<word>(8192);
   WireValue<uint32_t>* table = reinterpret_cast<WireValue<uint32_t>*>(data.begin());
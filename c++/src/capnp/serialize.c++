@@ -22,8 +22,14 @@
 #include "serialize.h"
 #include "layout.h"
 #include <kj/debug.h>
+#include <kj/filesystem.h>
 #include <exception>
 
+#if !_WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace capnp {
 
 FlatArrayMessageReader::FlatArrayMessageReader(
@@ -108,6 +114,69 @@ kj::ArrayPtr<const word> FlatArrayMessageReader::getSegment(uint id) {
   }
 }
 
+// -------------------------------------------------------------------
+
+namespace _ {  // private
+
+void adviseMapping(kj::ArrayPtr<const byte> bytes, MmapAdvice advice) {
+#if !_WIN32
+  int flag;
+  switch (advice) {
+    case MmapAdvice::NORMAL: return;
+    case MmapAdvice::SEQUENTIAL: flag = MADV_SEQUENTIAL; break;
+    case MmapAdvice::RANDOM: flag = MADV_RANDOM; break;
+    case MmapAdvice::WILL_NEED: flag = MADV_WILLNEED; break;
+    default: return;
+  }
+
+  if (bytes.size() == 0) return;
+
+  // madvise() requires a page-aligned start address. mmap() mappings always begin on a page
+  // boundary, so rounding down stays within the mapping.
+  static const uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = reinterpret_cast<uintptr_t>(bytes.begin());
+  uintptr_t alignedBegin = begin & ~(pageSize - 1);
+
+  // Ignore errors: this is only a hint, and it's legal for ReadableFile::mmap() to have returned
+  // a heap buffer rather than a real mapping.
+  (void)madvise(reinterpret_cast<void*>(alignedBegin), bytes.size() + (begin - alignedBegin), flag);
+#endif
+}
+
+FileMapping::FileMapping(const kj::ReadableFile& file, uint64_t offset, MmapAdvice advice)
+    : offset(offset) {
+  KJ_REQUIRE(offset % sizeof(word) == 0, "message offset in file must be word-aligned", offset);
+
+  uint64_t size = file.stat().size;
+  KJ_REQUIRE(offset <= size, "message offset is past end of file", offset, size);
+
+  // Round down to whole words. A trailing partial word can't be part of a valid message anyway.
+  mapping = file.mmap(offset, (size - offset) / sizeof(word) * sizeof(word));
+  adviseMapping(mapping, advice);
+}
+
+kj::ArrayPtr<const word> FileMapping::getWords() const {
+  return kj::arrayPtr(reinterpret_cast<const word*>(mapping.begin()),
+                      mapping.size() / sizeof(word));
+}
+
+}  // namespace _ (private)
+
+MmapMessageReader::MmapMessageReader(
+    const kj::ReadableFile& file, ReaderOptions options, MmapAdvice advice)
+    : MmapMessageReader(file, 0, options, advice) {}
+
+MmapMessageReader::MmapMessageReader(
+    const kj::ReadableFile& file, uint64_t offset, ReaderOptions options, MmapAdvice advice)
+    : FileMapping(file, offset, advice),
+      FlatArrayMessageReader(getWords(), options) {}
+
+MmapMessageReader::~MmapMessageReader() noexcept(false) {}
+
+uint64_t MmapMessageReader::getEndOffset() const {
+  return offset + (getEnd() - getWords().begin()) * sizeof(word);
+}
+
 kj::ArrayPtr<const word> initMessageBuilderFromFlatArrayCopy(
     kj::ArrayPtr<const word> array, MessageBuilder& target, ReaderOptions options) {
   FlatArrayMessageReader reader(array, options);
@@ -45,6 +45,10 @@
 
 CAPNP_BEGIN_HEADER
 
+namespace kj {
+  class ReadableFile;
+}
+
 namespace capnp {
 
 class FlatArrayMessageReader: public MessageReader {
@@ -70,6 +74,72 @@ private:
   const word* end;
 };
 
+enum class MmapAdvice {
+  // Hint passed to the OS (via madvise(), where available) describing how a memory-mapped message
+  // is going to be accessed. Purely advisory; has no effect on correctness.
+
+  NORMAL,
+  // No special treatment.
+
+  SEQUENTIAL,
+  // Pages will be accessed in order, e.g. a full scan. The OS may read ahead aggressively and
+  // drop pages soon after they've been accessed.
+
+  RANDOM,
+  // Pages will be accessed in no particular order, e.g. point lookups. The OS should not bother
+  // reading ahead.
+
+  WILL_NEED
+  // The whole message will be needed soon; start prefetching it in the background now.
+};
+
+namespace _ {  // private
+
+void adviseMapping(kj::ArrayPtr<const byte> bytes, MmapAdvice advice);
+// Passes `advice` to madvise() for the pages spanned by `bytes`, which should have been returned
+// by kj::ReadableFile::mmap(). Errors are ignored.
+
+class FileMapping {
+  // Holds the mapping for MmapMessageReader. Separate base class so that it is initialized before
+  // FlatArrayMessageReader.
+
+protected:
+  FileMapping(const kj::ReadableFile& file, uint64_t offset, MmapAdvice advice);
+
+  kj::ArrayPtr<const word> getWords() const;
+
+  kj::Array<const byte> mapping;
+  uint64_t offset;
+};
+
+}  // namespace _ (private)
+
+class MmapMessageReader: private _::FileMapping, public FlatArrayMessageReader {
+  // A FlatArrayMessageReader which reads a message directly out of a memory-mapped file, without
+  // copying. The segment table is parsed in place and the segments point straight into the
+  // mapping, so construction takes constant time regardless of the message size and only the
+  // pages actually visited by the application are ever read from disk.
+  //
+  // Note that the mapping may or may not reflect changes made to the file after the reader is
+  // constructed. Truncating the file while it is mapped may cause accesses to raise SIGBUS.
+
+public:
+  MmapMessageReader(const kj::ReadableFile& file, ReaderOptions options = ReaderOptions(),
+                    MmapAdvice advice = MmapAdvice::NORMAL);
+  MmapMessageReader(const kj::ReadableFile& file, uint64_t offset,
+                    ReaderOptions options = ReaderOptions(),
+                    MmapAdvice advice = MmapAdvice::NORMAL);
+  // Map the message which starts at the given byte offset of the file (default: the beginning).
+  // `offset` must be a multiple of 8. The file is not owned; however, the mapping remains valid
+  // even if the file object is destroyed.
+  KJ_DISALLOW_COPY(MmapMessageReader);
+  ~MmapMessageReader() noexcept(false);
+
+  uint64_t getEndOffset() const;
+  // Get the file offset just past the end of this message. If the file contains multiple
+  // concatenated messages, this is where the next one starts.
+};
+
 kj::ArrayPtr<const word> initMessageBuilderFromFlatArrayCopy(
     kj::ArrayPtr<const word> array, MessageBuilder& target,
     ReaderOptions options = ReaderOptions());
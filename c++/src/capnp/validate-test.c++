@@ -0,0 +1,157 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "validate.h"
+#include "serialize.h"
+#include <kj/test.h>
+#include "test-util.h"
+
+namespace capnp {
+namespace _ {  // private
+namespace {
+
+uint pointerSlot(kj::StringPtr fieldName) {
+  return Schema::from<TestAllTypes>().getFieldByName(fieldName).getProto().getSlot().getOffset();
+}
+
+KJ_TEST("validateMessage() accepts a valid message") {
+  MallocMessageBuilder builder;
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  auto words = messageToFlatArray(builder);
+
+  FlatArrayMessageReader reader(words);
+  KJ_EXPECT(!reader.isValidated());
+  validateMessage<TestAllTypes>(reader);
+  KJ_EXPECT(reader.isValidated());
+  checkTestMessage(reader.getRoot<TestAllTypes>());
+}
+
+KJ_TEST("validateMessage() follows far pointers") {
+  MallocMessageBuilder builder(1, AllocationStrategy::FIXED_SIZE);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  KJ_ASSERT(builder.getSegmentsForOutput().size() > 1);
+
+  SegmentArrayMessageReader reader(builder.getSegmentsForOutput());
+  validateMessage<TestAllTypes>(reader);
+  checkTestMessage(reader.getRoot<TestAllTypes>());
+}
+
+KJ_TEST("validated messages can be read repeatedly without hitting the traversal limit") {
+  MallocMessageBuilder builder;
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  auto words = messageToFlatArray(builder);
+
+  ReaderOptions options;
+  options.traversalLimitInWords = words.size() * 4;
+
+  {
+    FlatArrayMessageReader reader(words, options);
+    KJ_EXPECT_THROW_MESSAGE("traversal limit", {
+      for (uint i = 0; i < 10; i++) {
+        checkTestMessage(reader.getRoot<TestAllTypes>());
+      }
+    });
+  }
+
+  {
+    FlatArrayMessageReader reader(words, options);
+    validateMessage<TestAllTypes>(reader);
+    for (uint i = 0; i < 10; i++) {
+      checkTestMessage(reader.getRoot<TestAllTypes>());
+    }
+  }
+}
+
+KJ_TEST("validateMessage() rejects out-of-bounds pointers") {
+  AlignedData<2> segment = {{
+    // Struct pointer, body immediately follows, one data word, one pointer (which don't fit)
+    0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00,
+
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  }};
+  kj::ArrayPtr<const word> segments[1] = {kj::arrayPtr(segment.words, 2)};
+  SegmentArrayMessageReader reader(kj::arrayPtr(segments, 1));
+
+  KJ_EXPECT_THROW_MESSAGE("out-of-bounds", validateMessage<TestAllTypes>(reader));
+  KJ_EXPECT(!reader.isValidated());
+}
+
+KJ_TEST("validateMessage() checks pointers the schema doesn't know about") {
+  AlignedData<3> segment = {{
+    // Struct pointer, body immediately follows, no data, two pointers
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00,
+
+    // Null pointer
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+
+    // Struct pointer pointing way past the end of the segment
+    0x90, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+  }};
+  kj::ArrayPtr<const word> segments[1] = {kj::arrayPtr(segment.words, 3)};
+  SegmentArrayMessageReader reader(kj::arrayPtr(segments, 1));
+
+  KJ_EXPECT_THROW_MESSAGE("out-of-bounds", validateMessage<test::TestEmptyStruct>(reader));
+}
+
+KJ_TEST("validateMessage() checks types against the schema") {
+  {
+    MallocMessageBuilder builder;
+    auto root = builder.getRoot<AnyPointer>().initAsAnyStruct(
+        Schema::from<TestAllTypes>().getProto().getStruct().getDataWordCount(),
+        Schema::from<TestAllTypes>().getProto().getStruct().getPointerCount());
+    root.getPointerSection()[pointerSlot("structField")].initAs<List<uint32_t>>(3);
+
+    SegmentArrayMessageReader reader(builder.getSegmentsForOutput());
+    KJ_EXPECT_THROW_MESSAGE("list pointer where non-list pointer was expected",
+        validateMessage<TestAllTypes>(reader));
+  }
+
+  {
+    MallocMessageBuilder builder;
+    auto root = builder.getRoot<AnyPointer>().initAsAnyStruct(
+        Schema::from<TestAllTypes>().getProto().getStruct().getDataWordCount(),
+        Schema::from<TestAllTypes>().getProto().getStruct().getPointerCount());
+    auto text = root.getPointerSection()[pointerSlot("textField")].initAs<List<uint8_t>>(3);
+    text.set(0, 'f');
+    text.set(1, 'o');
+    text.set(2, 'o');
+
+    SegmentArrayMessageReader reader(builder.getSegmentsForOutput());
+    KJ_EXPECT_THROW_MESSAGE("not NUL-terminated", validateMessage<TestAllTypes>(reader));
+  }
+
+  {
+    // Lists of structs are checked against the element type.
+    MallocMessageBuilder builder;
+    auto list = builder.initRoot<TestAllTypes>().initStructList(2);
+    AnyStruct::Builder(list[1]).getPointerSection()[pointerSlot("textField")]
+        .initAs<List<uint32_t>>(1);
+
+    SegmentArrayMessageReader reader(builder.getSegmentsForOutput());
+    KJ_EXPECT_THROW_MESSAGE("non-text pointer where text was expected",
+        validateMessage<TestAllTypes>(reader));
+  }
+}
+
+}  // namespace
+}  // namespace _ (private)
+}  // namespace capnp
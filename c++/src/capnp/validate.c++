@@ -0,0 +1,230 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "validate.h"
+#include "any.h"
+#include <kj/debug.h>
+
+#define CAPNP_PRIVATE
+#include "arena.h"
+
+namespace capnp {
+
+namespace {
+
+class Validator {
+  // Iterative walk over a message. Every pointer is read through the regular checked accessors,
+  // which do the actual bounds checking and charge the traversal and nesting limits; the walk
+  // itself only makes sure that every reachable pointer gets read once, and adds type checks
+  // where the schema is known.
+
+public:
+  void validate(AnyPointer::Reader root, StructSchema schema) {
+    stack.add(Item { root, Type(schema) });
+
+    while (!stack.empty()) {
+      Item item = stack.back();
+      stack.removeLast();
+      visitPointer(item.pointer, item.type);
+    }
+  }
+
+private:
+  struct Item {
+    AnyPointer::Reader pointer;
+    kj::Maybe<Type> type;
+    // Null if the pointer's type is unknown, in which case it is only checked structurally.
+  };
+
+  kj::Vector<Item> stack;
+  kj::Vector<bool> covered;
+
+  static bool isPointerType(Type type) {
+    switch (type.which()) {
+      case schema::Type::TEXT:
+      case schema::Type::DATA:
+      case schema::Type::LIST:
+      case schema::Type::STRUCT:
+      case schema::Type::INTERFACE:
+      case schema::Type::ANY_POINTER:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  static kj::Maybe<Type> knownType(Type type) {
+    // AnyPointer (including generic parameters) tells us nothing.
+    if (type.isAnyPointer()) return nullptr;
+    return type;
+  }
+
+  void visitPointer(AnyPointer::Reader pointer, kj::Maybe<Type> maybeType) {
+    switch (pointer.getPointerType()) {
+      case PointerType::NULL_:
+        return;
+
+      case PointerType::STRUCT:
+        KJ_IF_MAYBE(type, maybeType) {
+          KJ_REQUIRE(type->isStruct(),
+              "Message contains struct pointer where non-struct pointer was expected.");
+          visitStruct(pointer.getAs<AnyStruct>(), type->asStruct());
+        } else {
+          visitStruct(pointer.getAs<AnyStruct>(), nullptr);
+        }
+        return;
+
+      case PointerType::LIST:
+        visitList(pointer.getAs<AnyList>(), maybeType);
+        return;
+
+      case PointerType::CAPABILITY:
+        KJ_IF_MAYBE(type, maybeType) {
+          KJ_REQUIRE(type->isInterface(),
+              "Message contains capability pointer where non-capability pointer was expected.");
+        }
+        return;
+    }
+    KJ_UNREACHABLE;
+  }
+
+  void visitList(AnyList::Reader list, kj::Maybe<Type> maybeType) {
+    ElementSize elementSize = list.getElementSize();
+    kj::Maybe<Type> elementType;
+
+    KJ_IF_MAYBE(type, maybeType) {
+      switch (type->which()) {
+        case schema::Type::TEXT: {
+          KJ_REQUIRE(elementSize == ElementSize::BYTE,
+              "Message contains non-text pointer where text was expected.");
+          auto bytes = list.getRawBytes();
+          KJ_REQUIRE(bytes.size() > 0, "Message contains text that is not NUL-terminated.");
+          KJ_REQUIRE(bytes.back() == 0, "Message contains text that is not NUL-terminated.");
+          return;
+        }
+        case schema::Type::DATA:
+          KJ_REQUIRE(elementSize == ElementSize::BYTE,
+              "Message contains non-data pointer where data was expected.");
+          return;
+        case schema::Type::LIST:
+          elementType = type->asList().getElementType();
+          break;
+        default:
+          KJ_FAIL_REQUIRE("Message contains list pointer where non-list pointer was expected.");
+      }
+    }
+
+    switch (elementSize) {
+      case ElementSize::POINTER: {
+        kj::Maybe<Type> pointerType;
+        KJ_IF_MAYBE(t, elementType) {
+          // A list of structs may legitimately be encoded as a list of pointers if the structs
+          // have only one pointer field, in which case we don't know the field's type here.
+          if (isPointerType(*t) && !t->isStruct()) pointerType = knownType(*t);
+        }
+        for (auto element: list.as<List<AnyPointer>>()) {
+          stack.add(Item { element, pointerType });
+        }
+        return;
+      }
+
+      case ElementSize::INLINE_COMPOSITE: {
+        kj::Maybe<StructSchema> structType;
+        KJ_IF_MAYBE(t, elementType) {
+          if (t->isStruct()) structType = t->asStruct();
+        }
+        for (auto element: list.as<List<AnyStruct>>()) {
+          visitStruct(element, structType);
+        }
+        return;
+      }
+
+      default:
+        // No pointers.
+        return;
+    }
+  }
+
+  void visitStruct(AnyStruct::Reader value, kj::Maybe<StructSchema> maybeSchema) {
+    auto pointers = value.getPointerSection();
+
+    covered.resize(pointers.size());
+    for (auto& c: covered) c = false;
+
+    KJ_IF_MAYBE(schema, maybeSchema) {
+      addFields(value, *schema, pointers);
+    }
+
+    for (uint i = 0; i < pointers.size(); i++) {
+      if (!covered[i]) stack.add(Item { pointers[i], nullptr });
+    }
+  }
+
+  void addFields(AnyStruct::Reader value, StructSchema schema,
+                 List<AnyPointer>::Reader pointers) {
+    for (auto field: schema.getNonUnionFields()) {
+      addField(value, field, pointers);
+    }
+
+    auto structProto = schema.getProto().getStruct();
+    if (structProto.getDiscriminantCount() > 0) {
+      // Only the active union member is typed; the others share its slots.
+      auto data = value.getDataSection();
+      size_t offset = structProto.getDiscriminantOffset() * sizeof(uint16_t);
+      uint16_t discriminant = offset + sizeof(uint16_t) <= data.size()
+          ? data[offset] | (data[offset + 1] << 8) : 0;
+      KJ_IF_MAYBE(field, schema.getFieldByDiscriminant(discriminant)) {
+        addField(value, *field, pointers);
+      }
+    }
+  }
+
+  void addField(AnyStruct::Reader value, StructSchema::Field field,
+                List<AnyPointer>::Reader pointers) {
+    auto proto = field.getProto();
+    if (proto.isGroup()) {
+      addFields(value, field.getType().asStruct(), pointers);
+      return;
+    }
+
+    Type type = field.getType();
+    if (!isPointerType(type)) return;
+
+    uint index = proto.getSlot().getOffset();
+    if (index < pointers.size() && !covered[index]) {
+      covered[index] = true;
+      stack.add(Item { pointers[index], knownType(type) });
+    }
+  }
+};
+
+}  // namespace
+
+void validateMessage(MessageReader& message, StructSchema schema) {
+  auto root = message.getRoot<AnyPointer>();
+  Validator().validate(root, schema);
+
+  message.validated = true;
+  message.arena()->markValidated();
+}
+
+}  // namespace capnp
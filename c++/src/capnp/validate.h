@@ -0,0 +1,58 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+
+#include "schema.h"
+#include "message.h"
+
+CAPNP_BEGIN_HEADER
+
+namespace capnp {
+
+void validateMessage(MessageReader& message, StructSchema schema);
+// Walks the whole message reachable from the root, treating the root as a struct of type
+// `schema`, and throws if anything is out-of-bounds, exceeds the reader's traversal or nesting
+// limits, or does not match the schema (e.g. a list where a struct is expected, or Text that is
+// not NUL-terminated). Pointers in fields the schema doesn't know about (e.g. added by a newer
+// version of the schema, or inactive union members) are checked structurally.
+//
+// On success, the message is marked validated: readers obtained from it afterwards skip the
+// per-pointer bounds checks and no longer charge the traversal limit, so a message can be read
+// in full any number of times. This is meant for messages that will be scanned heavily after
+// being received; for messages where only a few fields are read, it just adds a pass.
+//
+// Caveats:
+// * Validate before sharing the MessageReader with other threads.
+// * A failed validation has still consumed traversal limit budget, so the message may be
+//   unreadable afterwards even if the parts you want are fine.
+// * The schema only affects error reporting, not safety: reading the message later as a
+//   different type is no less safe than reading any other message.
+
+template <typename RootType>
+inline void validateMessage(MessageReader& message) {
+  validateMessage(message, Schema::from<RootType>());
+}
+
+}  // namespace capnp
+
+CAPNP_END_HEADER